@@ -0,0 +1,370 @@
+#include "audio.h"
+
+#include "utils.h"
+
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+	#include <emmintrin.h>
+#endif
+
+#define MULAW_BIAS 0x84
+#define MULAW_CLIP 32635
+#define ADPCM_MAX_STEP_INDEX 88
+
+static const int8_t ADPCM_INDEX_TABLE[16] = {-1, -1, -1, -1, 2, 4, 6, 8, -1, -1, -1, -1, 2, 4, 6, 8};
+
+static const int16_t ADPCM_STEP_TABLE[ADPCM_MAX_STEP_INDEX + 1] = {
+    7,     8,     9,     10,    11,    12,    13,    14,    16,    17,    19,    21,    23,    25,    28,
+    31,    34,    37,    41,    45,    50,    55,    60,    66,    73,    80,    88,    97,    107,   118,
+    130,   143,   157,   173,   190,   209,   230,   253,   279,   307,   337,   371,   408,   449,   494,
+    544,   598,   658,   724,   796,   876,   963,   1060,  1166,  1282,  1411,  1552,  1707,  1878,  2066,
+    2272,  2499,  2749,  3024,  3327,  3660,  4026,  4428,  4871,  5358,  5894,  6484,  7132,  7845,  8630,
+    9493,  10442, 11487, 12635, 13899, 15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767};
+
+/*
+ * Codecs in order of preference when negotiating.
+ */
+static const AudioCodec CODEC_PREFERENCE[] = {AudioCodecADPCM, AudioCodecMuLaw, AudioCodecPCM};
+
+static inline uint8_t mulaw_encode_sample(int16_t sample);
+static inline int16_t mulaw_decode_sample(uint8_t code);
+static inline uint8_t adpcm_encode_sample(AdpcmState *state, int16_t sample);
+static inline int16_t adpcm_decode_sample(AdpcmState *state, uint8_t nibble);
+
+const char *audio_codec_to_string(const AudioCodec codec) {
+	switch (codec) {
+		case AudioCodecPCM:
+			return "PCM";
+
+		case AudioCodecMuLaw:
+			return "u-law";
+
+		case AudioCodecADPCM:
+			return "IMA-ADPCM";
+
+		default:
+			return "unknown";
+	}
+}
+
+/*
+ * Mean energy of a block of samples in dB (0 dB is a signal of amplitude 1).
+ */
+float audio_energy_db(const int16_t *pcm, size_t num_samples) {
+	int64_t energy = 0;
+
+	for (size_t i = 0; i < num_samples; i++) {
+		energy += (int32_t)pcm[i] * pcm[i];
+	}
+
+	return 10.0f * log10f((float)energy / (num_samples > 0 ? num_samples : 1) + 1.0f);
+}
+
+/*
+ * Pick the best codec both ends support. PCM is always available as a fallback.
+ */
+AudioCodec audio_codec_negotiate(const AudioCodecMask offered) {
+	AudioCodecMask common = offered & AUDIO_CODECS_SUPPORTED;
+
+	for (size_t i = 0; i < sizeof CODEC_PREFERENCE / sizeof *CODEC_PREFERENCE; i++) {
+		if (common & AUDIO_CODEC_MASK(CODEC_PREFERENCE[i])) {
+			return CODEC_PREFERENCE[i];
+		}
+	}
+
+	return AudioCodecPCM;
+}
+
+size_t audio_encoded_size(const AudioCodec codec, const size_t num_samples) {
+	switch (codec) {
+		case AudioCodecMuLaw:
+			return num_samples;
+
+		case AudioCodecADPCM:
+			return ADPCM_HEADER_SIZE + (num_samples + 1) / 2;
+
+		case AudioCodecPCM:
+		default:
+			return num_samples * sizeof(int16_t);
+	}
+}
+
+/*
+ * Encode num_samples of PCM into out, which must hold audio_encoded_size() bytes.
+ * Returns the number of bytes written.
+ */
+size_t audio_encode(const AudioCodec codec, AdpcmState *state, const int16_t *pcm, size_t num_samples, uint8_t *out) {
+	switch (codec) {
+		case AudioCodecMuLaw:
+			mulaw_encode(pcm, num_samples, out);
+
+			break;
+
+		case AudioCodecADPCM:
+			adpcm_encode(state, pcm, num_samples, out);
+
+			break;
+
+		case AudioCodecPCM:
+		default:
+			memcpy(out, pcm, num_samples * sizeof *pcm);
+	}
+
+	return audio_encoded_size(codec, num_samples);
+}
+
+/*
+ * Decode size bytes into num_samples of PCM. Returns the number of samples
+ * decoded or -1 if the encoded data is too short.
+ */
+ssize_t audio_decode(const AudioCodec codec, const uint8_t *data, size_t size, int16_t *pcm, size_t num_samples) {
+	if (size < audio_encoded_size(codec, num_samples)) {
+		return -1;
+	}
+
+	switch (codec) {
+		case AudioCodecMuLaw:
+			mulaw_decode(data, num_samples, pcm);
+
+			break;
+
+		case AudioCodecADPCM:
+			adpcm_decode(data, num_samples, pcm);
+
+			break;
+
+		case AudioCodecPCM:
+			memcpy(pcm, data, num_samples * sizeof *pcm);
+
+			break;
+
+		default:
+			return -1;
+	}
+
+	return num_samples;
+}
+
+static inline uint8_t mulaw_encode_sample(int16_t sample) {
+	int value = sample;
+	int sign = (value >> 8) & 0x80;
+
+	if (value < 0) {
+		value = -value;
+	}
+
+	if (value > MULAW_CLIP) {
+		value = MULAW_CLIP;
+	}
+
+	value += MULAW_BIAS;
+
+	int exponent = 31 - __builtin_clz(value) - 7;
+	int mantissa = (value >> (exponent + 3)) & 0x0F;
+
+	return ~(sign | (exponent << 4) | mantissa);
+}
+
+static inline int16_t mulaw_decode_sample(uint8_t code) {
+	code = ~code;
+
+	int value = (((code & 0x0F) << 3) + MULAW_BIAS) << ((code & 0x70) >> 4);
+
+	return (code & 0x80) ? MULAW_BIAS - value : value - MULAW_BIAS;
+}
+
+/*
+ * G.711 u-law, eight samples per SSE2 iteration. Per-lane variable shifts are
+ * done as multiplies by a power of two built up from the exponent masks.
+ */
+void mulaw_encode(const int16_t *pcm, size_t num_samples, uint8_t *out) {
+	size_t i = 0;
+
+#if defined(__SSE2__)
+	const __m128i clip_low = _mm_set1_epi16(-MULAW_CLIP);
+	const __m128i clip_high = _mm_set1_epi16(MULAW_CLIP);
+	const __m128i bias = _mm_set1_epi16(MULAW_BIAS);
+	const __m128i sign_bit = _mm_set1_epi16(0x80);
+	const __m128i low_nibble = _mm_set1_epi16(0x0F);
+	const __m128i low_byte = _mm_set1_epi16(0xFF);
+
+	for (; i + 8 <= num_samples; i += 8) {
+		__m128i value = _mm_max_epi16(_mm_loadu_si128((const __m128i *)(pcm + i)), clip_low);
+		__m128i negative = _mm_srai_epi16(value, 15);
+		__m128i sign = _mm_and_si128(negative, sign_bit);
+
+		value = _mm_sub_epi16(_mm_xor_si128(value, negative), negative);
+		value = _mm_add_epi16(_mm_min_epi16(value, clip_high), bias);
+
+		__m128i exponent = _mm_setzero_si128();
+		__m128i scale = _mm_set1_epi16(1 << 7);
+
+		for (int threshold = 1 << 8; threshold <= 1 << 14; threshold <<= 1) {
+			__m128i above = _mm_cmpgt_epi16(value, _mm_set1_epi16(threshold - 1));
+
+			exponent = _mm_sub_epi16(exponent, above);
+			scale = _mm_sub_epi16(scale, _mm_and_si128(above, _mm_srli_epi16(scale, 1)));
+		}
+
+		__m128i mantissa = _mm_and_si128(_mm_srli_epi16(_mm_mullo_epi16(value, scale), 10), low_nibble);
+		__m128i code = _mm_or_si128(_mm_or_si128(sign, _mm_slli_epi16(exponent, 4)), mantissa);
+
+		code = _mm_andnot_si128(code, low_byte);
+		_mm_storel_epi64((__m128i *)(out + i), _mm_packus_epi16(code, code));
+	}
+#endif
+
+	for (; i < num_samples; i++) {
+		out[i] = mulaw_encode_sample(pcm[i]);
+	}
+}
+
+void mulaw_decode(const uint8_t *data, size_t num_samples, int16_t *pcm) {
+	size_t i = 0;
+
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i one = _mm_set1_epi16(1);
+	const __m128i bias = _mm_set1_epi16(MULAW_BIAS);
+	const __m128i low_byte = _mm_set1_epi16(0xFF);
+
+	for (; i + 8 <= num_samples; i += 8) {
+		__m128i code = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(data + i)), zero);
+
+		code = _mm_xor_si128(code, low_byte);
+
+		__m128i exponent = _mm_srli_epi16(code, 4);
+		__m128i scale = _mm_add_epi16(one, _mm_and_si128(exponent, one));
+
+		scale = _mm_mullo_epi16(
+		    scale, _mm_add_epi16(one, _mm_mullo_epi16(_mm_and_si128(_mm_srli_epi16(exponent, 1), one), _mm_set1_epi16(3))));
+		scale = _mm_mullo_epi16(
+		    scale, _mm_add_epi16(one, _mm_mullo_epi16(_mm_and_si128(_mm_srli_epi16(exponent, 2), one), _mm_set1_epi16(15))));
+
+		__m128i value = _mm_add_epi16(_mm_slli_epi16(_mm_and_si128(code, _mm_set1_epi16(0x0F)), 3), bias);
+
+		value = _mm_sub_epi16(_mm_mullo_epi16(value, scale), bias);
+
+		__m128i negative = _mm_cmpeq_epi16(_mm_and_si128(code, _mm_set1_epi16(0x80)), _mm_set1_epi16(0x80));
+
+		value = _mm_sub_epi16(_mm_xor_si128(value, negative), negative);
+		_mm_storeu_si128((__m128i *)(pcm + i), value);
+	}
+#endif
+
+	for (; i < num_samples; i++) {
+		pcm[i] = mulaw_decode_sample(data[i]);
+	}
+}
+
+static inline uint8_t adpcm_encode_sample(AdpcmState *state, int16_t sample) {
+	int step = ADPCM_STEP_TABLE[state->step_index];
+	int diff = sample - state->predictor;
+	uint8_t nibble = 0;
+
+	if (diff < 0) {
+		nibble = 8;
+		diff = -diff;
+	}
+
+	int delta = step >> 3;
+
+	if (diff >= step) {
+		nibble |= 4;
+		diff -= step;
+		delta += step;
+	}
+
+	step >>= 1;
+
+	if (diff >= step) {
+		nibble |= 2;
+		diff -= step;
+		delta += step;
+	}
+
+	step >>= 1;
+
+	if (diff >= step) {
+		nibble |= 1;
+		delta += step;
+	}
+
+	int predictor = state->predictor + ((nibble & 8) ? -delta : delta);
+	int index = state->step_index + ADPCM_INDEX_TABLE[nibble];
+
+	state->predictor = predictor > INT16_MAX ? INT16_MAX : predictor < INT16_MIN ? INT16_MIN : predictor;
+	state->step_index = index < 0 ? 0 : index > ADPCM_MAX_STEP_INDEX ? ADPCM_MAX_STEP_INDEX : index;
+
+	return nibble;
+}
+
+static inline int16_t adpcm_decode_sample(AdpcmState *state, uint8_t nibble) {
+	int step = ADPCM_STEP_TABLE[state->step_index];
+	int delta = step >> 3;
+
+	if (nibble & 4) {
+		delta += step;
+	}
+
+	if (nibble & 2) {
+		delta += step >> 1;
+	}
+
+	if (nibble & 1) {
+		delta += step >> 2;
+	}
+
+	int predictor = state->predictor + ((nibble & 8) ? -delta : delta);
+	int index = state->step_index + ADPCM_INDEX_TABLE[nibble];
+
+	state->predictor = predictor > INT16_MAX ? INT16_MAX : predictor < INT16_MIN ? INT16_MIN : predictor;
+	state->step_index = index < 0 ? 0 : index > ADPCM_MAX_STEP_INDEX ? ADPCM_MAX_STEP_INDEX : index;
+
+	return state->predictor;
+}
+
+/*
+ * IMA-ADPCM, 4 bits per sample. Each sample's prediction depends on the one
+ * before it, so this is inherently serial and left scalar.
+ */
+void adpcm_encode(AdpcmState *state, const int16_t *pcm, size_t num_samples, uint8_t *out) {
+	char *pos = mempcpy(out, &state->predictor, sizeof state->predictor);
+	pos = mempcpy(pos, &state->step_index, sizeof state->step_index);
+	*pos = 0;
+
+	uint8_t *nibbles = out + ADPCM_HEADER_SIZE;
+
+	for (size_t i = 0; i + 1 < num_samples; i += 2) {
+		uint8_t low = adpcm_encode_sample(state, pcm[i]);
+		uint8_t high = adpcm_encode_sample(state, pcm[i + 1]);
+
+		nibbles[i / 2] = low | (high << 4);
+	}
+
+	if (num_samples % 2 != 0) {
+		nibbles[num_samples / 2] = adpcm_encode_sample(state, pcm[num_samples - 1]);
+	}
+}
+
+void adpcm_decode(const uint8_t *data, size_t num_samples, int16_t *pcm) {
+	AdpcmState state = {0};
+
+	memcpy(&state.predictor, data, sizeof state.predictor);
+	memcpy(&state.step_index, data + sizeof state.predictor, sizeof state.step_index);
+
+	if (state.step_index > ADPCM_MAX_STEP_INDEX) {
+		state.step_index = ADPCM_MAX_STEP_INDEX;
+	}
+
+	const uint8_t *nibbles = data + ADPCM_HEADER_SIZE;
+
+	for (size_t i = 0; i < num_samples; i++) {
+		uint8_t byte = nibbles[i / 2];
+
+		pcm[i] = adpcm_decode_sample(&state, (i % 2 == 0) ? byte & 0x0F : byte >> 4);
+	}
+}
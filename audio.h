@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define AUDIO_SAMPLE_RATE 16000
+#define AUDIO_FRAME_MS 20
+#define AUDIO_FRAME_SAMPLES (AUDIO_SAMPLE_RATE * AUDIO_FRAME_MS / 1000)
+
+/*
+ * Energy of a full scale signal in dB, used to convert levels to and from -dBov.
+ */
+#define AUDIO_FULL_SCALE_DB 90.31f
+
+/*
+ * Size of the per-frame IMA-ADPCM header (initial predictor and step index).
+ */
+#define ADPCM_HEADER_SIZE 4
+
+typedef enum
+{
+	AudioCodecPCM,
+	AudioCodecMuLaw,
+	AudioCodecADPCM
+} _AudioCodec;
+
+typedef uint8_t AudioCodec;
+
+/*
+ * Bit mask of codecs, one bit per AudioCodec, used when negotiating.
+ */
+typedef uint8_t AudioCodecMask;
+
+#define AUDIO_CODEC_MASK(codec) ((AudioCodecMask)(1 << (codec)))
+#define AUDIO_CODECS_SUPPORTED \
+	(AUDIO_CODEC_MASK(AudioCodecPCM) | AUDIO_CODEC_MASK(AudioCodecMuLaw) | AUDIO_CODEC_MASK(AudioCodecADPCM))
+
+/*
+ * IMA-ADPCM encoder state carried from one frame to the next. Every encoded
+ * frame starts with a copy of this state so frames decode independently.
+ */
+typedef struct {
+	int16_t predictor;
+	uint8_t step_index;
+} AdpcmState;
+
+const char *audio_codec_to_string(const AudioCodec codec);
+float audio_energy_db(const int16_t *pcm, size_t num_samples);
+AudioCodec audio_codec_negotiate(const AudioCodecMask offered);
+size_t audio_encoded_size(const AudioCodec codec, const size_t num_samples);
+size_t audio_encode(const AudioCodec codec, AdpcmState *state, const int16_t *pcm, size_t num_samples, uint8_t *out);
+ssize_t audio_decode(const AudioCodec codec, const uint8_t *data, size_t size, int16_t *pcm, size_t num_samples);
+
+void mulaw_encode(const int16_t *pcm, size_t num_samples, uint8_t *out);
+void mulaw_decode(const uint8_t *data, size_t num_samples, int16_t *pcm);
+void adpcm_encode(AdpcmState *state, const int16_t *pcm, size_t num_samples, uint8_t *out);
+void adpcm_decode(const uint8_t *data, size_t num_samples, int16_t *pcm);
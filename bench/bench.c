@@ -0,0 +1,28 @@
+#include "bench.h"
+
+#include <stdio.h>
+#include <time.h>
+
+/*
+ * Seconds on the monotonic clock.
+ */
+double bench_now(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/*
+ * Names are the benchmarks' own and never need escaping.
+ */
+void bench_report(const char *suite, const char *name, const char *metric, double value, const char *unit) {
+	printf("{\"suite\":\"%s\",\"name\":\"%s\",\"metric\":\"%s\",\"value\":%.6g,\"unit\":\"%s\"}\n",
+	       suite,
+	       name,
+	       metric,
+	       value,
+	       unit);
+	fflush(stdout);
+}
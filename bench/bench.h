@@ -0,0 +1,13 @@
+#pragma once
+
+/*
+ * Every benchmark reports through bench_report, one JSON object per line on
+ * stdout, so runs can be kept and compared between releases:
+ *
+ *   {"suite":"packets","name":"join_room.encode","metric":"time","value":3.2,"unit":"ns/op"}
+ *
+ * Anything else a benchmark has to say goes to stderr.
+ */
+
+double bench_now(void);
+void bench_report(const char *suite, const char *name, const char *metric, double value, const char *unit);
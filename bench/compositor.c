@@ -0,0 +1,180 @@
+#include "bench.h"
+#include "client.h"
+#include "compositor.h"
+#include "utils.h"
+#include "video.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * Rendering eight participants' video into the space a 200 by 60 terminal
+ * leaves beside the chat pane, with a new frame from every participant for
+ * every render. Frames are a flat background with a shaded disc moving over
+ * it, so decoding sees long runs as well as short ones. Output goes to
+ * /dev/null, so it is the compositor that is timed and not a terminal.
+ *
+ * It is rendered with the calling thread alone and with three workers besides,
+ * as on a four-core laptop. With the workers it has to manage at least 15
+ * frames a second.
+ */
+
+#define TERMINAL_COLS 200
+#define TERMINAL_ROWS 60
+#define NUM_TILES 8
+#define FRAME_WIDTH 320
+#define FRAME_HEIGHT 240
+#define DISTINCT_FRAMES 30
+#define RENDERS 300
+#define MIN_FPS 15
+#define LAPTOP_WORKERS 3
+
+static const unsigned int workers[] = {0, LAPTOP_WORKERS};
+
+typedef struct {
+	uint8_t *data;
+	uint32_t size;
+} Encoded;
+
+static Encoded frames[NUM_TILES][DISTINCT_FRAMES];
+
+static void make_frames(void) {
+	uint8_t *rgb = malloc(FRAME_WIDTH * FRAME_HEIGHT * 3);
+
+	for (int tile = 0; tile < NUM_TILES; tile++) {
+		for (int i = 0; i < DISTINCT_FRAMES; i++) {
+			int centre_x = FRAME_WIDTH / 4 + (FRAME_WIDTH / 2) * i / DISTINCT_FRAMES;
+			int centre_y = FRAME_HEIGHT / 2;
+			int radius = FRAME_HEIGHT / 3;
+
+			for (int y = 0; y < FRAME_HEIGHT; y++) {
+				for (int x = 0; x < FRAME_WIDTH; x++) {
+					uint8_t *pixel = &rgb[(y * FRAME_WIDTH + x) * 3];
+					int dx = x - centre_x;
+					int dy = y - centre_y;
+
+					if (dx * dx + dy * dy < radius * radius) {
+						pixel[0] = 255 - (dx * dx + dy * dy) * 128 / (radius * radius);
+						pixel[1] = 160 + dy / 2;
+						pixel[2] = 120 + dx / 4;
+					} else {
+						pixel[0] = 30 * tile;
+						pixel[1] = 60;
+						pixel[2] = 90;
+					}
+				}
+			}
+
+			frames[tile][i].data = malloc(video_max_encoded_size(FRAME_WIDTH * FRAME_HEIGHT));
+			frames[tile][i].size = video_encode(rgb, FRAME_WIDTH * FRAME_HEIGHT, frames[tile][i].data);
+		}
+	}
+
+	free(rgb);
+}
+
+/*
+ * A frame as it would arrive from the network, which the compositor takes.
+ */
+static VideoFrame *copy_frame(int tile, int index) {
+	const Encoded *encoded = &frames[tile][index % DISTINCT_FRAMES];
+	VideoFrame *frame = malloc(sizeof *frame);
+
+	*frame = (VideoFrame){.source = tile,
+	                      .seq = index,
+	                      .timestamp = index * 33,
+	                      .width = FRAME_WIDTH,
+	                      .height = FRAME_HEIGHT,
+	                      .size = encoded->size,
+	                      .data = malloc(encoded->size)};
+	memcpy(frame->data, encoded->data, encoded->size);
+
+	return frame;
+}
+
+/*
+ * Returns the frames rendered a second, or -1 if not every render drew every
+ * tile.
+ */
+static double bench_workers(unsigned int num_workers, int fd) {
+	Compositor compositor;
+	char name[64];
+	int drawn = 0;
+	uint64_t bytes = 0;
+
+	if (compositor_init(&compositor, num_workers) < 0) {
+		return -1;
+	}
+
+	compositor_set_area(&compositor, 0, 0, TERMINAL_COLS - CHAT_BOX_WIDTH - 1, TERMINAL_ROWS - 2);
+
+	double start = bench_now();
+
+	for (int i = 0; i < RENDERS; i++) {
+		for (int tile = 0; tile < NUM_TILES; tile++) {
+			compositor_push_frame(&compositor, copy_frame(tile, i));
+		}
+
+		drawn += compositor_render(&compositor, fd) == NUM_TILES;
+		bytes += compositor.out_size;
+	}
+
+	double elapsed = bench_now() - start;
+	CompositorStats stats = compositor_stats(&compositor);
+
+	compositor_destroy(&compositor);
+
+	snprintf(name, sizeof name, "%u.workers", num_workers);
+	bench_report("compositor", name, "time", elapsed * 1e3 / RENDERS, "ms/render");
+	bench_report("compositor", name, "rate", RENDERS / elapsed, "fps");
+	bench_report("compositor", name, "output", (double)bytes / RENDERS / 1024, "KiB/render");
+
+	if (drawn < RENDERS || stats.frames_dropped > 0) {
+		fprintf(stderr,
+		        "only %d of %d renders drew every tile and %llu frames were dropped\n",
+		        drawn,
+		        RENDERS,
+		        (unsigned long long)stats.frames_dropped);
+
+		return -1;
+	}
+
+	return RENDERS / elapsed;
+}
+
+int main() {
+	int fd = open("/dev/null", O_WRONLY);
+	int failed = 0;
+
+	if (fd < 0) {
+		perror("failed to open /dev/null");
+
+		return EXIT_FAILURE;
+	}
+
+	make_frames();
+
+	for (size_t i = 0; i < sizeof workers / sizeof *workers; i++) {
+		double fps = bench_workers(workers[i], fd);
+
+		if (fps < 0) {
+			failed = TRUE;
+		} else if (workers[i] == LAPTOP_WORKERS && fps < MIN_FPS) {
+			fprintf(stderr, "eight tiles rendered at %.1f fps, below %d\n", fps, MIN_FPS);
+			failed = TRUE;
+		}
+	}
+
+	for (int tile = 0; tile < NUM_TILES; tile++) {
+		for (int i = 0; i < DISTINCT_FRAMES; i++) {
+			free(frames[tile][i].data);
+		}
+	}
+
+	close(fd);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,108 @@
+#include "bench.h"
+#include "config.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Parsing the server's configuration file, from a small one like most
+ * servers run with to one with as many rooms as anyone is likely to set up,
+ * and the string helpers it leans on.
+ */
+
+#define PARSE_ITERATIONS 20000
+#define LARGE_PARSE_ITERATIONS 200
+#define LARGE_ROOMS 1000
+#define STRING_ITERATIONS 1000000
+
+static volatile uint64_t sink;
+
+/*
+ * A configuration file with num_rooms rooms, written the way people write
+ * them by hand: comments, blank lines and space around the =.
+ */
+static char *make_config(int num_rooms, size_t *size) {
+	char *text = NULL;
+	FILE *file = open_memstream(&text, size);
+
+	if (file == NULL) {
+		perror("failed to generate configuration");
+
+		exit(EXIT_FAILURE);
+	}
+
+	fprintf(file, "# Generated for benchmarking\n\nchat_history = 1048576\nchat_log = chat\n\n[rooms]\n");
+
+	for (int i = 0; i < num_rooms; i++) {
+		fprintf(file, "  room%d = Somewhere to talk about topic number %d  \n", i, i);
+	}
+
+	fclose(file);
+
+	return text;
+}
+
+static void bench_parse(const char *name, int num_rooms, size_t iterations) {
+	size_t size = 0;
+	char *text = make_config(num_rooms, &size);
+	double start = bench_now();
+
+	for (size_t i = 0; i < iterations; i++) {
+		FILE *file = fmemopen(text, size, "r");
+		Config *config = file != NULL ? config_parse(file, "/home/bench") : NULL;
+
+		if (config == NULL || config->num_rooms != num_rooms) {
+			fprintf(stderr, "failed to parse configuration\n");
+
+			exit(EXIT_FAILURE);
+		}
+
+		sink += config->chat_history;
+		config_free(config);
+		fclose(file);
+	}
+
+	double elapsed = bench_now() - start;
+
+	free(text);
+
+	bench_report("config", name, "time", elapsed * 1e6 / iterations, "us/parse");
+	bench_report("config", name, "throughput", (double)size * iterations / elapsed / 1e6, "MB/s");
+}
+
+static void bench_join_path(void) {
+	double start = bench_now();
+
+	for (size_t i = 0; i < STRING_ITERATIONS; i++) {
+		char *path = join_path("/home/bench/", "/.config/", APP_NAME, APP_NAME ".config", NULL);
+
+		sink += path[0];
+		free(path);
+	}
+
+	bench_report("config", "join_path", "time", (bench_now() - start) * 1e9 / STRING_ITERATIONS, "ns/op");
+}
+
+static void bench_strip_whitespace(void) {
+	double start = bench_now();
+
+	for (size_t i = 0; i < STRING_ITERATIONS; i++) {
+		char *stripped = strip_whitespace("   lobby = General chat for everyone  \n");
+
+		sink += stripped[0];
+		free(stripped);
+	}
+
+	bench_report("config", "strip_whitespace", "time", (bench_now() - start) * 1e9 / STRING_ITERATIONS, "ns/op");
+}
+
+int main() {
+	bench_parse("parse.small", 2, PARSE_ITERATIONS);
+	bench_parse("parse.large", LARGE_ROOMS, LARGE_PARSE_ITERATIONS);
+	bench_join_path();
+	bench_strip_whitespace();
+
+	return 0;
+}
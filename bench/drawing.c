@@ -0,0 +1,140 @@
+#include "bench.h"
+#include "client.h"
+#include "drawing.h"
+
+#include <fcntl.h>
+#include <locale.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+/*
+ * What it costs to put the client's screen together: single lines drawn with
+ * draw_line, and a full redraw of the chat screen at a few terminal sizes.
+ * Output goes to /dev/null, so this is the cost of formatting and writing it
+ * rather than of any terminal drawing it.
+ */
+
+#define LINE_ITERATIONS 100000
+#define SCREEN_ITERATIONS 2000
+
+typedef struct {
+	const char *name;
+	int cols;
+	int rows;
+} Screen;
+
+static const Screen screens[] = {
+	{"screen.80x24", 80, 24},
+	{"screen.200x60", 200, 60},
+	{"screen.400x120", 400, 120},
+};
+
+static int stdout_fd = -1;
+
+/*
+ * Send stdout to /dev/null for the timed part of a benchmark, and back again
+ * to report it.
+ */
+static void mute(void) {
+	int null_fd = open("/dev/null", O_WRONLY);
+
+	if (null_fd < 0 || dup2(null_fd, STDOUT_FILENO) < 0) {
+		perror("failed to redirect output");
+
+		exit(EXIT_FAILURE);
+	}
+
+	close(null_fd);
+}
+
+static void unmute(void) {
+	fflush(stdout);
+	dup2(stdout_fd, STDOUT_FILENO);
+}
+
+static void bench_line(const char *name, LineType type, int length) {
+	mute();
+
+	double start = bench_now();
+
+	for (size_t i = 0; i < LINE_ITERATIONS; i++) {
+		draw_line(0, 0, type, length, type == LineTypeHorizontal ? CHAR_HORIZONTAL_LINE : CHAR_VERTICAL_LINE);
+	}
+
+	fflush(stdout);
+
+	double elapsed = bench_now() - start;
+
+	unmute();
+	bench_report("drawing", name, "time", elapsed * 1e9 / LINE_ITERATIONS, "ns/line");
+}
+
+/*
+ * Everything the chat screen draws when it is set up: the borders between the
+ * video, participant and chat panes, a full chat log and the input line.
+ */
+static void draw_screen(const Screen *screen, const char *text) {
+	int chat_col = screen->cols - CHAT_BOX_WIDTH;
+
+	printf("\033[2J\033[H");
+	draw_line(chat_col, 0, LineTypeVertical, screen->rows - 1, CHAR_VERTICAL_LINE);
+	draw_line(chat_col + 1, 0, LineTypeHorizontal, CHAT_BOX_WIDTH - 1, CHAR_HORIZONTAL_LINE);
+	draw_line(chat_col + 1, 9, LineTypeHorizontal, CHAT_BOX_WIDTH - 1, CHAR_HORIZONTAL_LINE);
+	draw_line(0, screen->rows - 2, LineTypeHorizontal, screen->cols, CHAR_HORIZONTAL_LINE);
+
+	for (int row = 10; row < screen->rows - 2; row++) {
+		printf("\033[%d;%dH%.*s\033[K", row + 1, chat_col + 2, CHAT_BOX_WIDTH - 2, text);
+	}
+
+	printf("\033[%dH> %.*s\033[K", screen->rows, screen->cols - 2, text);
+	fflush(stdout);
+}
+
+static void bench_screen(const Screen *screen) {
+	char text[512];
+
+	memset(text, 'x', sizeof text - 1);
+	text[sizeof text - 1] = '\0';
+
+	mute();
+
+	double start = bench_now();
+
+	for (size_t i = 0; i < SCREEN_ITERATIONS; i++) {
+		draw_screen(screen, text);
+	}
+
+	double elapsed = bench_now() - start;
+
+	unmute();
+	bench_report("drawing", screen->name, "time", elapsed * 1e6 / SCREEN_ITERATIONS, "us/frame");
+}
+
+int main() {
+	draw_init();
+
+	// Box drawing characters need a UTF-8 locale, which the environment may not set.
+	if (MB_CUR_MAX == 1) {
+		setlocale(LC_CTYPE, "C.UTF-8");
+	}
+
+	if ((stdout_fd = dup(STDOUT_FILENO)) < 0) {
+		perror("failed to duplicate output");
+
+		return EXIT_FAILURE;
+	}
+
+	bench_line("line.horizontal.80", LineTypeHorizontal, 80);
+	bench_line("line.vertical.24", LineTypeVertical, 24);
+	bench_line("line.horizontal.400", LineTypeHorizontal, 400);
+
+	for (size_t i = 0; i < sizeof screens / sizeof *screens; i++) {
+		bench_screen(&screens[i]);
+	}
+
+	close(stdout_fd);
+
+	return 0;
+}
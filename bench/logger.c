@@ -0,0 +1,130 @@
+#include "bench.h"
+#include "utils.h"
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/*
+ * What logging costs the thread doing it: a message below the log level, one
+ * copied into the thread's ring while there is room, and one logged into a
+ * ring the logger cannot keep up with, which is dropped. Writing a message
+ * out as logging used to, formatted and written on the spot, is there to
+ * compare with, as is what the logger's thread spends formatting one.
+ * Messages go to /dev/null.
+ */
+
+#define ITERATIONS 1000000
+#define BURST 250
+
+static volatile uint64_t sink;
+
+static void report(const char *name, size_t iterations, double elapsed) {
+	bench_report("logger", name, "time", elapsed * 1e9 / iterations, "ns/op");
+}
+
+static void bench_disabled(void) {
+	log_set_level(LogLevelError);
+
+	double start = bench_now();
+
+	for (size_t i = 0; i < ITERATIONS; i++) {
+		log_infof("frame %zu took %d us", i, 42);
+	}
+
+	report("disabled", ITERATIONS, bench_now() - start);
+	log_set_level(LogLevelInfo);
+}
+
+/*
+ * Messages are logged in bursts small enough to stay below the ring's
+ * high-water mark, and the ring is emptied between them, so none are dropped
+ * and the logger's thread is not hurried. Formatting them is what the
+ * logger's thread would have done, timed on its own.
+ */
+static void bench_queued(void) {
+	const char *peer = "client 10.0.0.1:49152 in room lobby";
+	double queue_int = 0;
+	double queue_string = 0;
+	double format = 0;
+
+	for (size_t i = 0; i < ITERATIONS; i += BURST) {
+		double start = bench_now();
+
+		for (size_t j = i; j < i + BURST; j++) {
+			log_infof("frame %zu took %d us", j, 42);
+		}
+
+		queue_int += bench_now() - start;
+		start = bench_now();
+		log_flush();
+		format += bench_now() - start;
+		start = bench_now();
+
+		for (size_t j = i; j < i + BURST; j++) {
+			log_infof("%s sent %" PRIu64 " bytes", peer, (uint64_t)j);
+		}
+
+		queue_string += bench_now() - start;
+		start = bench_now();
+		log_flush();
+		format += bench_now() - start;
+	}
+
+	report("queued.int", ITERATIONS, queue_int);
+	report("queued.string", ITERATIONS, queue_string);
+	report("format", 2 * ITERATIONS, format);
+}
+
+static void bench_flooded(void) {
+	uint64_t dropped = log_dropped();
+	double start = bench_now();
+
+	for (size_t i = 0; i < ITERATIONS; i++) {
+		log_infof("frame %zu took %d us", i, 42);
+	}
+
+	report("flooded", ITERATIONS, bench_now() - start);
+	log_flush();
+	bench_report("logger", "flooded", "dropped", 100.0 * (log_dropped() - dropped) / ITERATIONS, "%");
+}
+
+/*
+ * Logging as it was before messages went through a ring.
+ */
+static void bench_synchronous(void) {
+	double start = bench_now();
+
+	for (size_t i = 0; i < ITERATIONS; i++) {
+		char *message = NULL;
+
+		if (asprintf(&message, "frame %zu took %d us", i, 42) >= 0) {
+			fprintf(stderr, "%s: %s:%s:%d: %s\n", "INFO", __FILE__, __func__, __LINE__, message);
+			sink += message[0];
+			free(message);
+		}
+	}
+
+	report("synchronous", ITERATIONS, bench_now() - start);
+}
+
+int main() {
+	int null_fd = open("/dev/null", O_WRONLY);
+
+	if (null_fd < 0 || dup2(null_fd, STDERR_FILENO) < 0) {
+		perror("failed to redirect log output");
+
+		return EXIT_FAILURE;
+	}
+
+	close(null_fd);
+
+	bench_disabled();
+	bench_queued();
+	bench_flooded();
+	bench_synchronous();
+
+	return 0;
+}
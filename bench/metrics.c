@@ -0,0 +1,105 @@
+#include "bench.h"
+#include "metrics.h"
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * What recording a metric costs on the paths that do it, from one thread and
+ * from several recording at once, which per-thread shards should make no
+ * slower: the time per record is for all of them together.
+ */
+
+#define ITERATIONS 10000000
+#define MAX_THREADS 8
+
+typedef enum
+{
+	RecordCount,
+	RecordPacket,
+	RecordHistogram
+} Record;
+
+typedef struct {
+	Record record;
+	pthread_barrier_t *start;
+} Recorder;
+
+static Room rooms[] = {{.name = "lobby", .desc = ""}, {.name = "dev", .desc = ""}};
+static Config config = {.num_rooms = 2, .rooms = rooms};
+
+static void *run(void *arg) {
+	Recorder *recorder = arg;
+
+	pthread_barrier_wait(recorder->start);
+
+	for (size_t i = 0; i < ITERATIONS; i++) {
+		switch (recorder->record) {
+			case RecordCount:
+				metrics_count(MetricInboxPushed, 1);
+
+				break;
+
+			case RecordPacket:
+				metrics_packet_in(PacketTypeAudioFrame, 660);
+
+				break;
+
+			case RecordHistogram:
+				metrics_observe_room(1, MetricRoomMediaFanout, i & 0xffff);
+
+				break;
+		}
+	}
+
+	return NULL;
+}
+
+static void bench(const char *name, Record record, int num_threads) {
+	pthread_t threads[MAX_THREADS];
+	Recorder recorders[MAX_THREADS];
+	pthread_barrier_t start;
+	char full_name[32];
+
+	pthread_barrier_init(&start, NULL, num_threads + 1);
+
+	for (int i = 0; i < num_threads; i++) {
+		recorders[i] = (Recorder){.record = record, .start = &start};
+
+		if (pthread_create(&threads[i], NULL, run, &recorders[i]) != 0) {
+			fprintf(stderr, "failed to start recorder\n");
+
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	pthread_barrier_wait(&start);
+
+	double begin = bench_now();
+
+	for (int i = 0; i < num_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	double elapsed = bench_now() - begin;
+
+	pthread_barrier_destroy(&start);
+
+	snprintf(full_name, sizeof full_name, "%s.%d", name, num_threads);
+	bench_report("metrics", full_name, "time", elapsed * 1e9 / ITERATIONS / num_threads, "ns/op");
+}
+
+int main() {
+	if (metrics_init(&config) < 0) {
+		return EXIT_FAILURE;
+	}
+
+	for (int threads = 1; threads <= MAX_THREADS; threads *= 2) {
+		bench("count", RecordCount, threads);
+		bench("packet", RecordPacket, threads);
+		bench("histogram", RecordHistogram, threads);
+	}
+
+	return 0;
+}
@@ -0,0 +1,158 @@
+#include "bench.h"
+#include "mpsc.h"
+#include "utils.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Throughput of a room inbox with 1 to 64 threads pushing into it and one
+ * draining it, against the same bounded ring behind a mutex.
+ */
+
+#define ITEMS (1 << 22)
+#define CAPACITY 1024
+#define MAX_PRODUCERS 64
+
+typedef struct {
+	pthread_mutex_t lock;
+	void *items[CAPACITY];
+	size_t head;
+	size_t tail;
+} LockedQueue;
+
+typedef struct {
+	int locked;
+	size_t count;
+	pthread_barrier_t *start;
+} Producer;
+
+static MpscQueue queue;
+static LockedQueue locked_queue;
+
+static int locked_push(void *item) {
+	int ret = -1;
+
+	pthread_mutex_lock(&locked_queue.lock);
+
+	if (locked_queue.tail - locked_queue.head < CAPACITY) {
+		locked_queue.items[locked_queue.tail++ % CAPACITY] = item;
+		ret = 0;
+	}
+
+	pthread_mutex_unlock(&locked_queue.lock);
+
+	return ret;
+}
+
+static void *locked_pop(void) {
+	void *item = NULL;
+
+	pthread_mutex_lock(&locked_queue.lock);
+
+	if (locked_queue.head != locked_queue.tail) {
+		item = locked_queue.items[locked_queue.head++ % CAPACITY];
+	}
+
+	pthread_mutex_unlock(&locked_queue.lock);
+
+	return item;
+}
+
+/*
+ * Items are never NULL, so a pop can tell them from an empty queue.
+ */
+static void *produce(void *arg) {
+	Producer *producer = arg;
+
+	pthread_barrier_wait(producer->start);
+
+	for (size_t i = 1; i <= producer->count; i++) {
+		while ((producer->locked ? locked_push((void *)i) : mpsc_queue_push(&queue, (void *)i)) < 0) {
+			sched_yield();
+		}
+	}
+
+	return NULL;
+}
+
+static void bench(int locked, int num_producers) {
+	pthread_t threads[MAX_PRODUCERS];
+	Producer producers[MAX_PRODUCERS];
+	pthread_barrier_t start;
+	size_t per_producer = ITEMS / num_producers;
+	size_t total = per_producer * num_producers;
+	uint64_t sum = 0;
+
+	pthread_barrier_init(&start, NULL, num_producers + 1);
+
+	for (int i = 0; i < num_producers; i++) {
+		producers[i] = (Producer){.locked = locked, .count = per_producer, .start = &start};
+
+		if (pthread_create(&threads[i], NULL, produce, &producers[i]) != 0) {
+			fprintf(stderr, "failed to start producer\n");
+
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	pthread_barrier_wait(&start);
+
+	double begin = bench_now();
+
+	for (size_t received = 0; received < total;) {
+		void *item = locked ? locked_pop() : mpsc_queue_pop(&queue);
+
+		if (item == NULL) {
+			sched_yield();
+
+			continue;
+		}
+
+		sum += (uintptr_t)item;
+		received++;
+	}
+
+	double elapsed = bench_now() - begin;
+
+	for (int i = 0; i < num_producers; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	pthread_barrier_destroy(&start);
+
+	if (sum != (uint64_t)num_producers * per_producer * (per_producer + 1) / 2) {
+		fprintf(stderr, "%s queue lost items with %d producers\n", locked ? "locked" : "mpsc", num_producers);
+
+		exit(EXIT_FAILURE);
+	}
+
+	char name[32];
+
+	snprintf(name, sizeof name, "%s.%d", locked ? "mutex" : "mpsc", num_producers);
+
+	bench_report("mpsc", name, "time", elapsed * 1e9 / total, "ns/item");
+	bench_report("mpsc", name, "throughput", total / elapsed / 1e6, "Mitems/s");
+}
+
+int main() {
+	if (mpsc_queue_init(&queue, CAPACITY) < 0) {
+		fprintf(stderr, "failed to allocate queue\n");
+
+		return EXIT_FAILURE;
+	}
+
+	pthread_mutex_init(&locked_queue.lock, NULL);
+
+	for (int producers = 1; producers <= MAX_PRODUCERS; producers *= 2) {
+		bench(FALSE, producers);
+		bench(TRUE, producers);
+	}
+
+	mpsc_queue_free(&queue);
+
+	return 0;
+}
@@ -0,0 +1,204 @@
+#include "bench.h"
+#include "histogram.h"
+#include "packets.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/*
+ * send_packet and recv_packet over a loopback TCP connection: how many
+ * packets of each size one thread can push to another, and the round trip
+ * of a small packet sent back and forth, as the server and client see it.
+ */
+
+#define THROUGHPUT_BYTES (256 * 1024 * 1024)
+#define MAX_THROUGHPUT_PACKETS 1000000
+#define ROUND_TRIPS 50000
+#define ROUND_TRIP_SIZE 64
+
+typedef struct {
+	int socket_fd;
+	size_t count;
+	Serialised packet;
+} Peer;
+
+static uint8_t payload[65536];
+
+static void fail(const char *message) {
+	perror(message);
+
+	exit(EXIT_FAILURE);
+}
+
+/*
+ * A connected pair of sockets, through a listener on an ephemeral port.
+ */
+static void connect_pair(int *client_fd, int *server_fd) {
+	struct sockaddr_in addr = {.sin_family = AF_INET, .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+	socklen_t addr_size = sizeof addr;
+	int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+
+	if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof addr) < 0 || listen(listen_fd, 1) < 0 ||
+	    getsockname(listen_fd, (struct sockaddr *)&addr, &addr_size) < 0) {
+		fail("failed to listen");
+	}
+
+	if ((*client_fd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+	    connect(*client_fd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+		fail("failed to connect");
+	}
+
+	if ((*server_fd = accept(listen_fd, NULL, NULL)) < 0) {
+		fail("failed to accept");
+	}
+
+	close(listen_fd);
+}
+
+static Serialised make_packet(uint32_t size) {
+	ChatRecord record = {.id = 1, .timestamp = 1700000000000, .size = size, .data = payload};
+	Serialised packet = {.size = chat_record_packet_size(&record)};
+
+	packet.data = malloc(packet.size);
+
+	if (packet.data == NULL) {
+		fail("failed to allocate packet");
+	}
+
+	serialise_chat_record_into(&record, packet.data, packet.size);
+
+	return packet;
+}
+
+static void *send_all(void *arg) {
+	Peer *peer = arg;
+
+	for (size_t i = 0; i < peer->count; i++) {
+		if (send_packet(peer->socket_fd, &peer->packet, NULL) <= 0) {
+			fail("failed to send packet");
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Send back whatever arrives until the other end hangs up.
+ */
+static void *echo(void *arg) {
+	Peer *peer = arg;
+	Serialised packet;
+
+	while (recv_packet(peer->socket_fd, &packet, NULL) > 0) {
+		if (send_packet(peer->socket_fd, &packet, NULL) <= 0) {
+			fail("failed to echo packet");
+		}
+
+		free(packet.data);
+	}
+
+	return NULL;
+}
+
+static void bench_throughput(uint32_t size) {
+	int client_fd, server_fd;
+	pthread_t thread;
+	Peer sender = {.packet = make_packet(size)};
+
+	sender.count = THROUGHPUT_BYTES / sender.packet.size;
+
+	if (sender.count > MAX_THROUGHPUT_PACKETS) {
+		sender.count = MAX_THROUGHPUT_PACKETS;
+	}
+
+	connect_pair(&client_fd, &server_fd);
+	sender.socket_fd = client_fd;
+
+	double start = bench_now();
+
+	if (pthread_create(&thread, NULL, send_all, &sender) != 0) {
+		fail("failed to start sender");
+	}
+
+	for (size_t i = 0; i < sender.count; i++) {
+		Serialised packet;
+
+		if (recv_packet(server_fd, &packet, NULL) <= 0 || packet.size != sender.packet.size) {
+			fail("failed to receive packet");
+		}
+
+		free(packet.data);
+	}
+
+	double elapsed = bench_now() - start;
+	char name[32];
+
+	pthread_join(thread, NULL);
+	close(client_fd);
+	close(server_fd);
+	free(sender.packet.data);
+
+	snprintf(name, sizeof name, "throughput.%u", size);
+	bench_report("network", name, "time", elapsed * 1e9 / sender.count, "ns/packet");
+	bench_report("network", name, "throughput", (double)sender.packet.size * sender.count / elapsed / 1e6, "MB/s");
+}
+
+static void bench_round_trip(void) {
+	int client_fd, server_fd;
+	pthread_t thread;
+	Histogram histogram = {0};
+	Peer echoer;
+	Serialised packet = make_packet(ROUND_TRIP_SIZE);
+
+	connect_pair(&client_fd, &server_fd);
+	echoer = (Peer){.socket_fd = server_fd};
+
+	if (pthread_create(&thread, NULL, echo, &echoer) != 0) {
+		fail("failed to start echo");
+	}
+
+	double start = bench_now();
+
+	for (size_t i = 0; i < ROUND_TRIPS; i++) {
+		double sent = bench_now();
+		Serialised reply;
+
+		if (send_packet(client_fd, &packet, NULL) <= 0 || recv_packet(client_fd, &reply, NULL) <= 0) {
+			fail("failed to exchange packet");
+		}
+
+		histogram_record(&histogram, (uint64_t)((bench_now() - sent) * 1e9));
+		free(reply.data);
+	}
+
+	double elapsed = bench_now() - start;
+
+	shutdown(client_fd, SHUT_WR);
+	pthread_join(thread, NULL);
+	close(client_fd);
+	close(server_fd);
+	free(packet.data);
+
+	bench_report("network", "round_trip", "mean", elapsed * 1e9 / ROUND_TRIPS, "ns");
+	bench_report("network", "round_trip", "p50", histogram_percentile(&histogram, 50), "ns");
+	bench_report("network", "round_trip", "p99", histogram_percentile(&histogram, 99), "ns");
+	bench_report("network", "round_trip", "p999", histogram_percentile(&histogram, 99.9), "ns");
+}
+
+int main() {
+	memset(payload, 0x5a, sizeof payload);
+
+	for (uint32_t size = 64; size <= sizeof payload; size *= 16) {
+		bench_throughput(size);
+	}
+
+	bench_round_trip();
+
+	return 0;
+}
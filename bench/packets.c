@@ -0,0 +1,220 @@
+#include "bench.h"
+#include "config.h"
+#include "packets.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Encode and decode throughput of each packet type, through the caller-buffer
+ * encoders and zero-copy decoders used on the media path, and the allocating
+ * ones used for config and chat.
+ */
+
+#define ITERATIONS 1000000
+#define CONFIG_ITERATIONS 100000
+#define CONFIG_ROOMS 16
+
+static uint8_t buffer[PACKET_HEADER_SIZE + 65536];
+static uint8_t payload[65536];
+static volatile uint64_t sink;
+
+static void report(const char *name, const char *direction, uint32_t size, size_t iterations, double elapsed) {
+	char full_name[64];
+
+	snprintf(full_name, sizeof full_name, "%s.%s", name, direction);
+
+	bench_report("packets", full_name, "time", elapsed * 1e9 / iterations, "ns/op");
+	bench_report("packets", full_name, "throughput", (double)size * iterations / elapsed / 1e6, "MB/s");
+	bench_report("packets", full_name, "size", size, "B");
+}
+
+#define BENCH_VALUE(name, type, value_type)                               \
+	static void bench_##name(void) {                                      \
+		value_type value = 1;                                             \
+		uint32_t size = 0;                                                \
+		double start = bench_now();                                       \
+                                                                          \
+		for (size_t i = 0; i < ITERATIONS; i++) {                         \
+			size = serialise_##name##_into(value, buffer, sizeof buffer); \
+			sink += buffer[size - 1];                                     \
+		}                                                                 \
+                                                                          \
+		report(#name, "encode", size, ITERATIONS, bench_now() - start);   \
+                                                                          \
+		Serialised serialised = {.size = size, .data = buffer};           \
+                                                                          \
+		start = bench_now();                                              \
+                                                                          \
+		for (size_t i = 0; i < ITERATIONS; i++) {                         \
+			unserialise_##name(&serialised, &value);                      \
+			sink += value;                                                \
+		}                                                                 \
+                                                                          \
+		report(#name, "decode", size, ITERATIONS, bench_now() - start);   \
+	}
+PACKET_VALUE_TABLE(BENCH_VALUE)
+#undef BENCH_VALUE
+
+#define BENCH_STRUCT(name, type, struct_type, fields, tail)                \
+	static void bench_##name(const struct_type *packet) {                  \
+		struct_type decoded = {0};                                         \
+		uint32_t size = 0;                                                 \
+		double start = bench_now();                                        \
+                                                                           \
+		for (size_t i = 0; i < ITERATIONS; i++) {                          \
+			size = serialise_##name##_into(packet, buffer, sizeof buffer); \
+			sink += buffer[size - 1];                                      \
+		}                                                                  \
+                                                                           \
+		report(#name, "encode", size, ITERATIONS, bench_now() - start);    \
+                                                                           \
+		Serialised serialised = {.size = size, .data = buffer};            \
+                                                                           \
+		start = bench_now();                                               \
+                                                                           \
+		for (size_t i = 0; i < ITERATIONS; i++) {                          \
+			if (unserialise_##name(&serialised, &decoded) < 0) {           \
+				fprintf(stderr, "failed to decode %s\n", #name);           \
+                                                                           \
+				exit(EXIT_FAILURE);                                        \
+			}                                                              \
+                                                                           \
+			sink += *(uint8_t *)&decoded;                                  \
+		}                                                                  \
+                                                                           \
+		report(#name, "decode", size, ITERATIONS, bench_now() - start);    \
+	}
+PACKET_STRUCT_TABLE(BENCH_STRUCT)
+#undef BENCH_STRUCT
+
+static void free_serialised(Serialised *serialised) {
+	free(serialised->data);
+	free(serialised);
+}
+
+static void bench_config(void) {
+	Room rooms[CONFIG_ROOMS];
+	char names[CONFIG_ROOMS][16];
+
+	for (int i = 0; i < CONFIG_ROOMS; i++) {
+		snprintf(names[i], sizeof names[i], "room%d", i);
+		rooms[i] = (Room){.name = names[i], .desc = "A room to talk about benchmarks in"};
+	}
+
+	Config config = {.num_rooms = CONFIG_ROOMS, .rooms = rooms};
+	Serialised *serialised = NULL;
+	uint32_t size = 0;
+	double start = bench_now();
+
+	for (size_t i = 0; i < CONFIG_ITERATIONS; i++) {
+		serialised = serialise_config(&config);
+		size = serialised->size;
+		sink += ((uint8_t *)serialised->data)[size - 1];
+		free_serialised(serialised);
+	}
+
+	report("config", "encode", size, CONFIG_ITERATIONS, bench_now() - start);
+
+	serialised = serialise_config(&config);
+	start = bench_now();
+
+	for (size_t i = 0; i < CONFIG_ITERATIONS; i++) {
+		Config *decoded = unserialise_config(serialised);
+
+		if (decoded == NULL) {
+			fprintf(stderr, "failed to decode config\n");
+
+			exit(EXIT_FAILURE);
+		}
+
+		sink += decoded->num_rooms;
+		config_free(decoded);
+	}
+
+	report("config", "decode", size, CONFIG_ITERATIONS, bench_now() - start);
+	free_serialised(serialised);
+}
+
+static void bench_chat_message(size_t length) {
+	char message[length + 1];
+	const ChatMessage *decoded = NULL;
+	Serialised *serialised = NULL;
+	uint32_t size = 0;
+
+	memset(message, 'x', length);
+	message[length] = '\0';
+
+	double start = bench_now();
+
+	for (size_t i = 0; i < ITERATIONS; i++) {
+		serialised = serialise_chat_message(message);
+		size = serialised->size;
+		sink += ((uint8_t *)serialised->data)[size - 2];
+		free_serialised(serialised);
+	}
+
+	report("chat_message", "encode", size, ITERATIONS, bench_now() - start);
+
+	serialised = serialise_chat_message(message);
+	start = bench_now();
+
+	for (size_t i = 0; i < ITERATIONS; i++) {
+		if (unserialise_chat_message(serialised, &decoded) < 0) {
+			fprintf(stderr, "failed to decode chat_message\n");
+
+			exit(EXIT_FAILURE);
+		}
+
+		sink += decoded[0];
+	}
+
+	report("chat_message", "decode", size, ITERATIONS, bench_now() - start);
+	free_serialised(serialised);
+}
+
+static void bench_leave_room(void) {
+	uint32_t size = 0;
+	double start = bench_now();
+
+	for (size_t i = 0; i < ITERATIONS; i++) {
+		Serialised *serialised = serialise_leave_room();
+
+		size = serialised->size;
+		sink += ((uint8_t *)serialised->data)[0];
+		free_serialised(serialised);
+	}
+
+	report("leave_room", "encode", size, ITERATIONS, bench_now() - start);
+}
+
+int main() {
+	memset(payload, 0x5a, sizeof payload);
+
+	bench_join_room();
+	bench_heartbeat(&(HeartbeatProbe){.kind = HeartbeatPing, .timestamp = 1700000000000000000});
+	bench_audio_codecs();
+	bench_active_speaker();
+
+	AudioFrame audio = {.seq = 1, .codec = AudioCodecPCM, .num_samples = AUDIO_FRAME_SAMPLES, .data = payload};
+
+	audio.size = AUDIO_FRAME_SAMPLES * sizeof(int16_t);
+	bench_audio_frame(&audio);
+
+	bench_comfort_noise(&(ComfortNoise){.seq = 1, .level = 60});
+
+	VideoFrame video = {.seq = 1, .width = 64, .height = 48, .size = 64 * 48 * 3, .data = payload};
+
+	bench_video_frame(&video);
+	bench_media_channel(&(MediaChannel){.port = 5000, .ssrc_base = 0x12345670});
+	bench_chat_record(&(ChatRecord){.id = 1, .timestamp = 1700000000000, .size = 64, .data = payload});
+	bench_chat_history(&(ChatHistoryRequest){.before = 1000, .count = 50});
+	bench_chat_search(&(ChatSearchRequest){.count = 20, .size = 8, .data = payload});
+	bench_chat_search_results(&(ChatSearchResults){.count = 20, .size = 20 * 64, .data = payload});
+	bench_config();
+	bench_chat_message(64);
+	bench_leave_room();
+
+	return 0;
+}
@@ -0,0 +1,331 @@
+#include "bench.h"
+#include "mpsc.h"
+#include "packets.h"
+#include "scheduler.h"
+#include "utils.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/*
+ * Chat fan-out in as many busy rooms as there are CPUs, all at once, as the
+ * server does it: members' reader threads push into the room's inbox, the
+ * owner stamps each batch and queues it for every member, and each member's
+ * writer thread sends it over a socket. Run with each room's threads pinned to
+ * a CPU of its own, as pin_rooms does, and with them left to the kernel.
+ *
+ * Readers push as fast as the inbox takes messages, so what is measured is
+ * how many deliveries the rooms manage between them. The threads reading the
+ * other end of the sockets stand in for the clients and are never pinned.
+ */
+
+#define NUM_MEMBERS 8
+#define MESSAGES_PER_MEMBER 5000
+#define INBOX_SIZE 256
+#define INBOX_BATCH 64
+#define MESSAGE_SIZE 64
+#define CPU_NONE -1
+
+typedef struct BusyRoom BusyRoom;
+
+typedef struct {
+	BusyRoom *room;
+	int server_fd;
+	int client_fd;
+	Scheduler scheduler;
+	pthread_t reader;
+	pthread_t client;
+	uint64_t received;
+} Member;
+
+struct BusyRoom {
+	int cpu;
+	MpscQueue inbox;
+	sem_t inbox_ready;
+	sem_t inbox_space;
+	atomic_int stop;
+	pthread_t owner;
+	uint64_t next_id;
+	Member members[NUM_MEMBERS];
+};
+
+static uint8_t text[MESSAGE_SIZE];
+
+static void fail(const char *message) {
+	perror(message);
+
+	exit(EXIT_FAILURE);
+}
+
+static void pin(pthread_t thread, int cpu) {
+	cpu_set_t cpus;
+
+	if (cpu == CPU_NONE) {
+		return;
+	}
+
+	CPU_ZERO(&cpus);
+	CPU_SET(cpu, &cpus);
+
+	if (pthread_setaffinity_np(thread, sizeof cpus, &cpus) != 0) {
+		fail("failed to pin thread");
+	}
+}
+
+/*
+ * A member's reader thread. Messages are numbered, which is all the owner
+ * needs of them.
+ */
+static void *read_messages(void *arg) {
+	Member *member = arg;
+	BusyRoom *room = member->room;
+
+	pin(pthread_self(), room->cpu);
+
+	for (size_t i = 0; i < MESSAGES_PER_MEMBER; i++) {
+		uint64_t *sent = malloc(sizeof *sent);
+
+		*sent = i;
+
+		while (sem_wait(&room->inbox_space) < 0) {
+		}
+
+		mpsc_queue_push(&room->inbox, sent);
+		sem_post(&room->inbox_ready);
+	}
+
+	return NULL;
+}
+
+static void *own_room(void *arg) {
+	BusyRoom *room = arg;
+
+	pin(pthread_self(), room->cpu);
+
+	while (TRUE) {
+		while (sem_wait(&room->inbox_ready) < 0) {
+		}
+
+		Serialised *records[INBOX_BATCH];
+		struct iovec spans[INBOX_BATCH];
+		uint64_t *sent = NULL;
+		int count = 0;
+
+		while (count < INBOX_BATCH && (sent = mpsc_queue_pop(&room->inbox)) != NULL) {
+			ChatRecord record = {.id = ++room->next_id, .timestamp = *sent, .size = sizeof text, .data = text};
+
+			records[count] = serialise_chat_record(&record);
+			spans[count] = (struct iovec){.iov_base = records[count]->data, .iov_len = records[count]->size};
+			count++;
+
+			free(sent);
+			sem_post(&room->inbox_space);
+		}
+
+		if (count == 0) {
+			if (atomic_load(&room->stop)) {
+				break;
+			}
+
+			continue;
+		}
+
+		for (size_t i = 0; i < NUM_MEMBERS; i++) {
+			if (scheduler_sendv(&room->members[i].scheduler, spans, count) < 0) {
+				fail("failed to queue chat");
+			}
+		}
+
+		for (int i = 0; i < count; i++) {
+			free(records[i]->data);
+			free(records[i]);
+		}
+	}
+
+	return NULL;
+}
+
+static void receive_records(Member *member, const Serialised *packets) {
+	Serialised serialised;
+
+	for (uint32_t offset = 0; next_packet(packets->data, packets->size, &offset, &serialised) == 0;) {
+		ChatRecord record;
+
+		if (unserialise_chat_record(&serialised, &record) == 0) {
+			member->received++;
+		}
+	}
+}
+
+/*
+ * A client, taking everything sent to the member whether fragmented or not.
+ */
+static void *receive_chat(void *arg) {
+	Member *member = arg;
+	Reassembly reassembly = {0};
+
+	while (member->received < (uint64_t)NUM_MEMBERS * MESSAGES_PER_MEMBER) {
+		PacketType packet_type = 0;
+		Serialised packet = {0};
+		int ret = 0;
+
+		if (recv(member->client_fd, &packet_type, sizeof packet_type, MSG_PEEK) <= 0) {
+			fail("failed to receive chat");
+		}
+
+		if (packet_type == PacketTypeFragment) {
+			ret = scheduler_recv_fragment(&reassembly, member->client_fd, NULL, &packet);
+		} else {
+			ret = recv_packet(member->client_fd, &packet, NULL);
+		}
+
+		if (ret < 0) {
+			fail("failed to receive chat");
+		}
+
+		if (ret > 0) {
+			receive_records(member, &packet);
+		}
+
+		free(packet.data);
+	}
+
+	reassembly_free(&reassembly);
+
+	return NULL;
+}
+
+static void start_room(BusyRoom *room, int cpu) {
+	memset(room, 0, sizeof *room);
+
+	room->cpu = cpu;
+
+	if (mpsc_queue_init(&room->inbox, INBOX_SIZE) < 0 || sem_init(&room->inbox_ready, 0, 0) < 0 ||
+	    sem_init(&room->inbox_space, 0, INBOX_SIZE) < 0) {
+		fail("failed to set up room inbox");
+	}
+
+	for (size_t i = 0; i < NUM_MEMBERS; i++) {
+		Member *member = &room->members[i];
+		int fds[2];
+
+		if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+			fail("failed to create socket pair");
+		}
+
+		member->room = room;
+		member->server_fd = fds[0];
+		member->client_fd = fds[1];
+
+		if (scheduler_start(&member->scheduler, member->server_fd, NULL) < 0 ||
+		    pthread_create(&member->client, NULL, receive_chat, member) != 0) {
+			fail("failed to start member");
+		}
+
+		pin(member->scheduler.thread, cpu);
+	}
+
+	if (pthread_create(&room->owner, NULL, own_room, room) != 0) {
+		fail("failed to start room owner");
+	}
+}
+
+/*
+ * Wait for every member to have had every message, and take the room down.
+ * Returns how many deliveries there were.
+ */
+static uint64_t stop_room(BusyRoom *room) {
+	uint64_t received = 0;
+
+	for (size_t i = 0; i < NUM_MEMBERS; i++) {
+		pthread_join(room->members[i].reader, NULL);
+	}
+
+	atomic_store(&room->stop, TRUE);
+	sem_post(&room->inbox_ready);
+	pthread_join(room->owner, NULL);
+
+	for (size_t i = 0; i < NUM_MEMBERS; i++) {
+		Member *member = &room->members[i];
+
+		pthread_join(member->client, NULL);
+		scheduler_stop(&member->scheduler);
+		close(member->server_fd);
+		close(member->client_fd);
+
+		received += member->received;
+	}
+
+	sem_destroy(&room->inbox_space);
+	sem_destroy(&room->inbox_ready);
+	mpsc_queue_free(&room->inbox);
+
+	return received;
+}
+
+/*
+ * With pinned set, rooms are dealt the CPUs in turn as the server does it.
+ */
+static void bench_rooms(const cpu_set_t *cpus, int num_rooms, int pinned) {
+	BusyRoom *rooms = calloc(num_rooms, sizeof *rooms);
+	uint64_t received = 0;
+	int cpu = 0;
+
+	for (int i = 0; i < num_rooms; i++) {
+		while (pinned && !CPU_ISSET(cpu, cpus)) {
+			cpu++;
+		}
+
+		start_room(&rooms[i], pinned ? cpu++ : CPU_NONE);
+	}
+
+	double start = bench_now();
+
+	for (int i = 0; i < num_rooms; i++) {
+		for (size_t j = 0; j < NUM_MEMBERS; j++) {
+			if (pthread_create(&rooms[i].members[j].reader, NULL, read_messages, &rooms[i].members[j]) != 0) {
+				fail("failed to start member reader");
+			}
+		}
+	}
+
+	for (int i = 0; i < num_rooms; i++) {
+		received += stop_room(&rooms[i]);
+	}
+
+	double elapsed = bench_now() - start;
+	const char *name = pinned ? "pinned" : "unpinned";
+
+	bench_report("rooms", name, "rooms", num_rooms, "rooms");
+	bench_report("rooms", name, "time", elapsed * 1e9 / received, "ns/delivery");
+	bench_report("rooms", name, "throughput", received / elapsed / 1e6, "Mdeliveries/s");
+
+	free(rooms);
+}
+
+int main() {
+	cpu_set_t cpus;
+
+	if (sched_getaffinity(0, sizeof cpus, &cpus) < 0) {
+		fail("failed to get CPUs");
+	}
+
+	int num_rooms = CPU_COUNT(&cpus);
+
+	memset(text, 'a', sizeof text);
+
+	if (num_rooms < 2) {
+		fprintf(stderr, "only one CPU, so pinned and unpinned rooms run the same\n");
+	}
+
+	bench_rooms(&cpus, num_rooms, FALSE);
+	bench_rooms(&cpus, num_rooms, TRUE);
+
+	return EXIT_SUCCESS;
+}
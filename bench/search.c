@@ -0,0 +1,261 @@
+#include "bench.h"
+#include "chatlog.h"
+#include "search.h"
+#include "utils.h"
+
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Searching a room's chat once a million messages have been said in it.
+ * Messages are a handful of made-up words each, the most common words far
+ * more common than the rest, as in real chat. A few marker words go into a
+ * known number of messages, so what a search finds can be checked.
+ *
+ * Messages are logged and indexed as the room's owner does it, into a log in
+ * a directory of its own that is removed afterwards. Each kind of query has
+ * to take under a millisecond on average. A room without a log, where only
+ * the index's recent messages can be searched, is tried on its own.
+ */
+
+#define NUM_MESSAGES 1000000
+#define VOCABULARY 4000
+#define MAX_WORDS 14
+#define WORD_SIZE 16
+#define WRITE_BATCH 10000
+#define QUERY_REPEATS 200
+#define MAX_QUERY_MS 1.0
+
+#define RARE_WORD "marmalade"
+#define RARE_EVERY 100000
+#define UNCOMMON_WORD "kettle"
+#define UNCOMMON_EVERY 1000
+#define UNLOGGED_MESSAGES 5000
+
+typedef struct {
+	const char *name;
+	const char *text;
+	uint64_t before;
+	int expected;
+} Query;
+
+static char words[VOCABULARY][WORD_SIZE];
+static uint32_t random_state = 12345;
+
+static uint32_t next_random(void) {
+	random_state = random_state * 1103515245 + 12345;
+
+	return random_state >> 8;
+}
+
+static void make_words(void) {
+	static const char *const syllables[] = {"ba", "ko", "ri", "ten", "mu", "sel", "da", "vo", "ni", "pra", "lu", "ges"};
+	const size_t num_syllables = sizeof syllables / sizeof *syllables;
+
+	for (size_t i = 0; i < VOCABULARY; i++) {
+		size_t value = i;
+		char *word = words[i];
+
+		// Every word is spelled differently, as its index written in syllables.
+		do {
+			word = stpcpy(word, syllables[value % num_syllables]);
+			value /= num_syllables;
+		} while (value > 0);
+	}
+}
+
+/*
+ * Word i is picked about (i+1)^(-2/3) times as often as the first, so a few
+ * words make up much of what is said.
+ */
+static const char *pick_word(void) {
+	double u = (double)next_random() / (1 << 24);
+
+	return words[(size_t)(VOCABULARY * u * u * u)];
+}
+
+static size_t make_message(uint64_t number, char *text) {
+	size_t num_words = 4 + next_random() % (MAX_WORDS - 4);
+	char *pos = text;
+
+	for (size_t i = 0; i < num_words; i++) {
+		pos = stpcpy(pos, i > 0 ? " " : "");
+
+		if (i == 1 && number % RARE_EVERY == 0) {
+			pos = stpcpy(pos, RARE_WORD);
+		} else if (i == 2 && number % UNCOMMON_EVERY == 0) {
+			pos = stpcpy(pos, UNCOMMON_WORD);
+		} else {
+			pos = stpcpy(pos, pick_word());
+		}
+	}
+
+	return pos - text;
+}
+
+/*
+ * Wait for the log's writer to catch up, as messages it is too far behind on
+ * are not kept. A log without a directory has no writer.
+ */
+static void wait_for_writer(ChatLog *log) {
+	while (log->dir != NULL) {
+		pthread_mutex_lock(&log->lock);
+
+		int behind = log->written_id < log->next_id;
+
+		pthread_mutex_unlock(&log->lock);
+
+		if (!behind) {
+			break;
+		}
+
+		nanosleep(&(struct timespec){.tv_nsec = 1000000}, NULL);
+	}
+}
+
+static double fill(ChatLog *log, SearchIndex *index, uint64_t num_messages) {
+	char text[MAX_WORDS * (WORD_SIZE + 1)];
+	double indexing = 0;
+
+	for (uint64_t i = 1; i <= num_messages; i++) {
+		Serialised *serialised = chat_log_append(log, text, make_message(i, text));
+		double start = bench_now();
+
+		search_index_add(index, serialised);
+		indexing += bench_now() - start;
+
+		free(serialised->data);
+		free(serialised);
+
+		if (i % WRITE_BATCH == 0) {
+			wait_for_writer(log);
+		}
+	}
+
+	wait_for_writer(log);
+
+	return indexing;
+}
+
+/*
+ * Returns -1 if a query took too long or did not find what it should have.
+ * A query expecting -1 may find any number.
+ */
+static int bench_query(SearchIndex *index, ChatLog *log, const Query *query) {
+	ChatSearchRequest request = {.before = query->before,
+	                             .count = SEARCH_MAX_RESULTS,
+	                             .size = strlen(query->text),
+	                             .data = (uint8_t *)query->text};
+	ChatSearchResults results = {0};
+	double total = 0;
+	double longest = 0;
+	int ret = 0;
+
+	for (size_t i = 0; i < QUERY_REPEATS; i++) {
+		double start = bench_now();
+		Serialised *serialised = search_index_query(index, log, &request);
+		double elapsed = bench_now() - start;
+
+		total += elapsed;
+		longest = elapsed > longest ? elapsed : longest;
+
+		if (unserialise_chat_search_results(serialised, &results) < 0) {
+			results.count = 0;
+		}
+
+		free(serialised->data);
+		free(serialised);
+	}
+
+	double mean_ms = total * 1e3 / QUERY_REPEATS;
+
+	bench_report("search", query->name, "time", mean_ms * 1e3, "us/query");
+	bench_report("search", query->name, "longest", longest * 1e6, "us");
+	bench_report("search", query->name, "found", results.count, "messages");
+
+	if (query->expected >= 0 && results.count != query->expected) {
+		fprintf(stderr, "search for \"%s\" found %u messages, not %d\n", query->text, results.count, query->expected);
+		ret = -1;
+	}
+
+	if (mean_ms >= MAX_QUERY_MS) {
+		fprintf(stderr, "search for \"%s\" took %.3f ms\n", query->text, mean_ms);
+		ret = -1;
+	}
+
+	return ret;
+}
+
+static void remove_log(const char *dir) {
+	DIR *entries = opendir(dir);
+	char path[PATH_MAX];
+
+	if (entries != NULL) {
+		for (struct dirent *entry = readdir(entries); entry != NULL; entry = readdir(entries)) {
+			if (entry->d_name[0] != '.') {
+				snprintf(path, sizeof path, "%s/%s", dir, entry->d_name);
+				unlink(path);
+			}
+		}
+
+		closedir(entries);
+	}
+
+	rmdir(dir);
+}
+
+int main() {
+	char dir[] = "/tmp/" APP_NAME "-search-XXXXXX";
+	ChatLog log;
+	SearchIndex index;
+	int failed = 0;
+
+	if (mkdtemp(dir) == NULL || chat_log_open(&log, dir) < 0) {
+		perror("failed to create chat log");
+
+		return EXIT_FAILURE;
+	}
+
+	search_index_init(&index);
+	make_words();
+
+	double indexing = fill(&log, &index, NUM_MESSAGES);
+
+	bench_report("search", "index", "time", indexing * 1e9 / NUM_MESSAGES, "ns/message");
+	bench_report("search", "index", "memory", (double)index.memory / NUM_MESSAGES, "bytes/message");
+
+	// A phrase's trigrams can all be in a message without the phrase, so candidates are checked against their text.
+	const Query queries[] = {
+	    {.name = "rare", .text = RARE_WORD, .expected = NUM_MESSAGES / RARE_EVERY},
+	    {.name = "uncommon", .text = "KETTLE", .expected = SEARCH_MAX_RESULTS},
+	    {.name = "common", .text = "ten", .expected = SEARCH_MAX_RESULTS},
+	    {.name = "paged", .text = UNCOMMON_WORD, .before = NUM_MESSAGES / 2, .expected = SEARCH_MAX_RESULTS},
+	    {.name = "phrase", .text = "ten sel", .expected = -1},
+	    {.name = "short", .text = "ba", .expected = SEARCH_MAX_RESULTS},
+	    {.name = "short.absent", .text = "zq", .expected = 0},
+	};
+
+	for (size_t i = 0; i < sizeof queries / sizeof *queries; i++) {
+		failed |= bench_query(&index, &log, &queries[i]) < 0;
+	}
+
+	search_index_free(&index);
+	chat_log_close(&log);
+	remove_log(dir);
+
+	const Query unlogged = {.name = "unlogged", .text = UNCOMMON_WORD, .expected = UNLOGGED_MESSAGES / UNCOMMON_EVERY};
+
+	chat_log_open(&log, NULL);
+	search_index_init(&index);
+	fill(&log, &index, UNLOGGED_MESSAGES);
+	failed |= bench_query(&index, &log, &unlogged) < 0;
+	search_index_free(&index);
+	chat_log_close(&log);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,179 @@
+#include "audio.h"
+#include "bench.h"
+#include "utils.h"
+#include "vad.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/*
+ * What DTX saves on one participant's audio over a simulated meeting, where
+ * they talk a quarter of the time. Talk spurts of a few seconds are voiced
+ * speech, rising and falling with each syllable, broken up by fricatives,
+ * which are quieter noise with many zero crossings. Between spurts there is
+ * only room noise.
+ *
+ * Every frame sent is a packet the server fans out to each other member, so
+ * the packets sent matter as much as the bytes. Both have to come to less
+ * than half of sending every frame, without losing speech frames on the way.
+ */
+
+#define MEETING_FRAMES (10 * 60 * 1000 / AUDIO_FRAME_MS)
+#define TALK_SHARE 0.25
+#define MEAN_SPURT_FRAMES 150
+#define MAX_SENT_SHARE 0.5
+#define MAX_MISSED_SHARE 0.01
+
+#define SPEECH_AMPLITUDE 3000.0
+#define FRICATIVE_AMPLITUDE 600.0
+#define ROOM_NOISE_AMPLITUDE 30.0
+
+static const AudioCodec codecs[] = {AudioCodecPCM, AudioCodecMuLaw, AudioCodecADPCM};
+
+typedef struct {
+	int16_t pcm[MEETING_FRAMES][AUDIO_FRAME_SAMPLES];
+	uint8_t talking[MEETING_FRAMES];
+} Meeting;
+
+static uint32_t random_state = 12345;
+
+static double uniform(void) {
+	random_state = random_state * 1103515245 + 12345;
+
+	return (double)(random_state >> 8) / (1 << 24);
+}
+
+static double noise(void) {
+	return 2 * uniform() - 1;
+}
+
+/*
+ * Spurts and the silences between them have exponentially distributed
+ * lengths, with means set for the share of talk time.
+ */
+static size_t spurt_length(double mean) {
+	return 1 + (size_t)(-mean * log(1 - uniform()));
+}
+
+static void make_meeting(Meeting *meeting) {
+	double mean_silence = MEAN_SPURT_FRAMES * (1 - TALK_SHARE) / TALK_SHARE;
+	double pitch = 120;
+	size_t frame = 0;
+	int talking = FALSE;
+
+	while (frame < MEETING_FRAMES) {
+		size_t end = frame + spurt_length(talking ? MEAN_SPURT_FRAMES : mean_silence);
+
+		for (; frame < end && frame < MEETING_FRAMES; frame++) {
+			// A fricative now and then, a few frames long.
+			int fricative = talking && frame % 17 < 3;
+
+			meeting->talking[frame] = talking;
+
+			for (size_t i = 0; i < AUDIO_FRAME_SAMPLES; i++) {
+				double t = (double)(frame * AUDIO_FRAME_SAMPLES + i) / AUDIO_SAMPLE_RATE;
+				double sample = ROOM_NOISE_AMPLITUDE * noise();
+
+				if (fricative) {
+					sample += FRICATIVE_AMPLITUDE * noise();
+				} else if (talking) {
+					double syllable = 0.3 + 0.7 * fabs(sin(2 * M_PI * 2 * t));
+
+					for (int harmonic = 1; harmonic <= 4; harmonic++) {
+						sample += SPEECH_AMPLITUDE * syllable / harmonic * sin(2 * M_PI * pitch * harmonic * t);
+					}
+				}
+
+				meeting->pcm[frame][i] = (int16_t)sample;
+			}
+		}
+
+		talking = !talking;
+		pitch = 100 + 100 * uniform();
+	}
+}
+
+/*
+ * Returns -1 if DTX saved less than it should have, or lost speech.
+ */
+static int bench_codec(const Meeting *meeting, AudioCodec codec) {
+	AudioSender sender;
+	AudioFrame speech = {.codec = codec,
+	                     .num_samples = AUDIO_FRAME_SAMPLES,
+	                     .size = audio_encoded_size(codec, AUDIO_FRAME_SAMPLES)};
+	uint32_t speech_size = audio_frame_packet_size(&speech);
+	uint64_t sent_bytes = 0;
+	uint64_t sent_packets = 0;
+	uint64_t talking = 0;
+	uint64_t missed = 0;
+	char name[64];
+
+	audio_sender_init(&sender, codec);
+
+	double start = bench_now();
+
+	for (size_t frame = 0; frame < MEETING_FRAMES; frame++) {
+		uint32_t size = audio_sender_process(&sender, meeting->pcm[frame], AUDIO_FRAME_SAMPLES);
+
+		sent_bytes += size;
+		sent_packets += size > 0;
+		talking += meeting->talking[frame];
+		missed += meeting->talking[frame] && size != speech_size;
+	}
+
+	double elapsed = bench_now() - start;
+
+	// Every frame sent as speech is the same size for a given codec.
+	double bytes_share = (double)sent_bytes / ((uint64_t)MEETING_FRAMES * speech_size);
+	double packets_share = (double)sent_packets / MEETING_FRAMES;
+	double missed_share = (double)missed / talking;
+
+	snprintf(name, sizeof name, "%s", audio_codec_to_string(codec));
+	bench_report("vad", name, "time", elapsed * 1e9 / MEETING_FRAMES, "ns/frame");
+	bench_report("vad", name, "bytes", 100 * bytes_share, "% of always sending");
+	bench_report("vad", name, "packets", 100 * packets_share, "% of always sending");
+	bench_report("vad", name, "missed", 100 * missed_share, "% of speech frames");
+
+	if (bytes_share >= MAX_SENT_SHARE || packets_share >= MAX_SENT_SHARE || missed_share > MAX_MISSED_SHARE) {
+		fprintf(stderr,
+		        "%s with DTX sent %.1f%% of bytes and %.1f%% of packets and missed %.2f%% of speech\n",
+		        audio_codec_to_string(codec),
+		        100 * bytes_share,
+		        100 * packets_share,
+		        100 * missed_share);
+
+		return -1;
+	}
+
+	return 0;
+}
+
+int main() {
+	Meeting *meeting = malloc(sizeof *meeting);
+	int failed = 0;
+
+	if (meeting == NULL) {
+		perror("failed to allocate meeting");
+
+		return EXIT_FAILURE;
+	}
+
+	make_meeting(meeting);
+
+	uint64_t talking = 0;
+
+	for (size_t frame = 0; frame < MEETING_FRAMES; frame++) {
+		talking += meeting->talking[frame];
+	}
+
+	bench_report("vad", "meeting", "talking", 100.0 * talking / MEETING_FRAMES, "% of frames");
+
+	for (size_t i = 0; i < sizeof codecs / sizeof *codecs; i++) {
+		failed |= bench_codec(meeting, codecs[i]) < 0;
+	}
+
+	free(meeting);
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
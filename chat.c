@@ -0,0 +1,107 @@
+#include "chat.h"
+
+#include "utils.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static void evict_oldest(ChatHistory *history);
+
+/*
+ * The arena itself is only allocated with the first message.
+ */
+void chat_history_init(ChatHistory *history, uint32_t capacity) {
+	memset(history, 0, sizeof *history);
+
+	history->capacity = capacity;
+}
+
+void chat_history_free(ChatHistory *history) {
+	freep(history->arena);
+
+	chat_history_init(history, history->capacity);
+}
+
+/*
+ * Add a chat message packet, evicting as many of the oldest as it takes to
+ * make room. Returns -1 if it is larger than the whole history.
+ */
+int chat_history_append(ChatHistory *history, const Serialised *serialised) {
+	uint32_t size = serialised->size;
+
+	if (size > history->capacity) {
+		return -1;
+	}
+
+	if (history->arena == NULL && (history->arena = malloc(history->capacity)) == NULL) {
+		return -1;
+	}
+
+	while (TRUE) {
+		if (history->wrap == 0) {
+			// Live data is [head, tail): go after it, or wrap round in front of it.
+			if (history->tail + size <= history->capacity) {
+				break;
+			}
+
+			if (size <= history->head) {
+				history->wrap = history->tail;
+				history->tail = 0;
+
+				break;
+			}
+		} else if (history->tail + size <= history->head) {
+			// Live data is [head, wrap) then [0, tail).
+			break;
+		}
+
+		evict_oldest(history);
+	}
+
+	memcpy(history->arena + history->tail, serialised->data, size);
+
+	history->tail += size;
+	history->used += size;
+	history->count++;
+
+	return 0;
+}
+
+/*
+ * Fill spans with the history, oldest first, and return how many are used.
+ */
+int chat_history_spans(const ChatHistory *history, struct iovec spans[2]) {
+	if (history->count == 0) {
+		return 0;
+	}
+
+	if (history->wrap == 0) {
+		spans[0] = (struct iovec){.iov_base = history->arena + history->head, .iov_len = history->tail - history->head};
+
+		return 1;
+	}
+
+	spans[0] = (struct iovec){.iov_base = history->arena + history->head, .iov_len = history->wrap - history->head};
+	spans[1] = (struct iovec){.iov_base = history->arena, .iov_len = history->tail};
+
+	return 2;
+}
+
+static void evict_oldest(ChatHistory *history) {
+	uint32_t size = 0;
+
+	memcpy(&size, history->arena + history->head + sizeof(PacketType), sizeof size);
+
+	history->head += size;
+	history->used -= size;
+	history->count--;
+
+	if (history->count == 0) {
+		history->head = 0;
+		history->tail = 0;
+		history->wrap = 0;
+	} else if (history->head == history->wrap) {
+		history->head = 0;
+		history->wrap = 0;
+	}
+}
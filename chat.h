@@ -0,0 +1,34 @@
+#pragma once
+
+#include "packets.h"
+
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * Default memory each room may use for its chat history, overridden by
+ * chat_history in the configuration file. 0 keeps no history.
+ */
+#define CHAT_HISTORY_DEFAULT_BYTES 65536
+
+/*
+ * Recent chat messages of a room, kept as their serialised packets back to
+ * back in one arena so replaying them is a copy of at most two spans. The
+ * arena is used as a ring: once full, the oldest messages make way for new
+ * ones. When a packet does not fit before the end of the arena it goes at the
+ * start, and wrap marks where the older data stops.
+ */
+typedef struct {
+	uint8_t *arena;
+	uint32_t capacity;
+	uint32_t head;
+	uint32_t tail;
+	uint32_t wrap;
+	uint32_t used;
+	uint32_t count;
+} ChatHistory;
+
+void chat_history_init(ChatHistory *history, uint32_t capacity);
+void chat_history_free(ChatHistory *history);
+int chat_history_append(ChatHistory *history, const Serialised *serialised);
+int chat_history_spans(const ChatHistory *history, struct iovec spans[2]);
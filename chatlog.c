@@ -0,0 +1,686 @@
+#include "chatlog.h"
+
+#include "utils.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CHAT_LOG_INDEX_SIZE (sizeof(ChatLogIndexEntry) * CHAT_LOG_INDEX_ENTRIES)
+
+/*
+ * Message headers are read through a buffer the size of the index interval,
+ * so scanning from an index entry to a message is usually one read.
+ */
+typedef struct {
+	uint32_t offset;
+	uint32_t size;
+	uint8_t data[CHAT_LOG_INDEX_INTERVAL];
+} ReadBuffer;
+
+static void *writer_handler(void *arg);
+static void write_batch(ChatLog *log, const uint8_t *batch, uint32_t size);
+static int write_run(ChatLogSegment *segment, const uint8_t *data, uint32_t size);
+static int open_segment(const ChatLog *log, uint64_t base_id, ChatLogSegment *segment);
+static void close_segment(ChatLogSegment *segment);
+static void recover_segment(ChatLog *log, ChatLogSegment *segment);
+static void index_record(ChatLogSegment *segment, uint32_t offset, const ChatRecord *record);
+static void parse_record(const uint8_t *data, uint32_t *size, ChatRecord *record);
+static int read_record(const ChatLogSegment *segment, ReadBuffer *buffer, uint32_t offset, uint32_t *size,
+                       ChatRecord *record);
+static uint32_t seek(const ChatLogSegment *segment, uint64_t id, uint64_t timestamp);
+static int compare_segments(const void *a, const void *b);
+static uint64_t now_ms();
+
+/*
+ * Open the log in dir, creating it if need be, and start its writer. A NULL
+ * dir gives a log that only stamps messages. The last segment is checked on
+ * the way, dropping a message torn by a crash and indexing any written after
+ * its index was last updated.
+ */
+int chat_log_open(ChatLog *log, const char *dir) {
+	memset(log, 0, sizeof *log);
+
+	pthread_mutex_init(&log->lock, NULL);
+	pthread_cond_init(&log->pending_ready, NULL);
+
+	log->next_id = 1;
+	log->written_id = 1;
+
+	if (dir == NULL) {
+		return 0;
+	}
+
+	if (make_dirs(dir) < 0) {
+		log_errorf(ERROR_OS, "failed to create chat log directory %s", dir);
+
+		return -1;
+	}
+
+	DIR *entries = opendir(dir);
+
+	if (entries == NULL) {
+		log_errorf(ERROR_OS, "failed to open chat log directory %s", dir);
+
+		return -1;
+	}
+
+	log->dir = strdup(dir);
+
+	struct dirent *entry = NULL;
+
+	while ((entry = readdir(entries)) != NULL) {
+		char *end = NULL;
+		uint64_t base_id = strtoull(entry->d_name, &end, 10);
+
+		if (end != entry->d_name && strcmp(end, CHAT_LOG_SEGMENT_SUFFIX) == 0) {
+			log->segments = realloc(log->segments, sizeof *log->segments * (log->num_segments + 1));
+			log->segments[log->num_segments++] = (ChatLogSegment){.base_id = base_id, .fd = -1};
+		}
+	}
+
+	closedir(entries);
+
+	if (log->num_segments > 0) {
+		qsort(log->segments, log->num_segments, sizeof *log->segments, compare_segments);
+	}
+
+	for (size_t i = 0; i < log->num_segments; i++) {
+		if (open_segment(log, log->segments[i].base_id, &log->segments[i]) < 0) {
+			chat_log_close(log);
+
+			return -1;
+		}
+	}
+
+	if (log->num_segments == 0) {
+		log->segments = malloc(sizeof *log->segments);
+
+		if (open_segment(log, log->next_id, &log->segments[0]) < 0) {
+			chat_log_close(log);
+
+			return -1;
+		}
+
+		log->num_segments = 1;
+	} else {
+		recover_segment(log, &log->segments[log->num_segments - 1]);
+	}
+
+	log->written_id = log->next_id;
+
+	if (pthread_create(&log->thread, NULL, writer_handler, log) != 0) {
+		log_error(ERROR_THREAD, "failed to start chat log writer thread");
+
+		chat_log_close(log);
+
+		return -1;
+	}
+
+	log->running = TRUE;
+
+	return 0;
+}
+
+/*
+ * Stop the writer once everything pending is written, and close the log.
+ */
+void chat_log_close(ChatLog *log) {
+	if (log->running) {
+		pthread_mutex_lock(&log->lock);
+		log->stop = TRUE;
+		pthread_cond_signal(&log->pending_ready);
+		pthread_mutex_unlock(&log->lock);
+
+		if (pthread_join(log->thread, NULL) != 0) {
+			log_error(ERROR_THREAD, "failed to join chat log writer thread");
+		}
+
+		log->running = FALSE;
+
+		log_infof("chat log %s: %" PRIu64 " messages written in %" PRIu64 " syncs",
+		          log->dir,
+		          log->records,
+		          log->commits);
+	}
+
+	for (size_t i = 0; i < log->num_segments; i++) {
+		close_segment(&log->segments[i]);
+	}
+
+	freep(log->segments);
+	freep(log->pending);
+	freep(log->dir);
+	log->num_segments = 0;
+
+	pthread_cond_destroy(&log->pending_ready);
+	pthread_mutex_destroy(&log->lock);
+}
+
+/*
+ * Stamp a message with the next id and the time, and queue it to be written.
+ * Returns its ChatRecord packet, which the caller frees.
+ */
+Serialised *chat_log_append(ChatLog *log, const char *text, uint32_t size) {
+	uint64_t now = now_ms();
+
+	pthread_mutex_lock(&log->lock);
+
+	// Times never go backwards within a log, so they can be searched like ids.
+	ChatRecord record = {.id = log->next_id++,
+	                     .timestamp = now > log->last_timestamp ? now : log->last_timestamp,
+	                     .size = size,
+	                     .data = (uint8_t *)text};
+	Serialised *serialised = serialise_chat_record(&record);
+
+	log->last_timestamp = record.timestamp;
+
+	if (!log->running) {
+		// Not persisted.
+	} else if (log->pending_size + serialised->size > CHAT_LOG_MAX_PENDING) {
+		log_errorf(ERROR_OS, "chat log writer is behind, not persisting message %" PRIu64, record.id);
+	} else {
+		if (log->pending_size + serialised->size > log->pending_capacity) {
+			log->pending_capacity = log->pending_capacity * 2 > log->pending_size + serialised->size
+			                            ? log->pending_capacity * 2
+			                            : log->pending_size + serialised->size;
+			log->pending = realloc(log->pending, log->pending_capacity);
+		}
+
+		memcpy(log->pending + log->pending_size, serialised->data, serialised->size);
+
+		log->pending_size += serialised->size;
+
+		pthread_cond_signal(&log->pending_ready);
+	}
+
+	pthread_mutex_unlock(&log->lock);
+
+	return serialised;
+}
+
+/*
+ * Read up to count of the written messages before id before (0 for the
+ * newest) that arrived at or after since, oldest first, into records as
+ * ChatRecord packets back to back, which the caller frees. Returns their
+ * total size, 0 if there are none, or -1 on error.
+ */
+int chat_log_read(ChatLog *log, uint64_t before, uint64_t since, uint32_t count, Serialised *records) {
+	*records = (Serialised){0};
+
+	// Written data never changes, so search a copy of the segments without holding up appends.
+	pthread_mutex_lock(&log->lock);
+
+	uint64_t end_id = before == 0 || before > log->written_id ? log->written_id : before;
+	size_t num_segments = log->num_segments;
+	ChatLogSegment *segments = num_segments > 0 ? malloc(sizeof *segments * num_segments) : NULL;
+
+	if (segments != NULL) {
+		memcpy(segments, log->segments, sizeof *segments * num_segments);
+	}
+
+	pthread_mutex_unlock(&log->lock);
+
+	uint64_t first_id = end_id > count ? end_id - count : 0;
+	size_t first = 0;
+
+	// The last segment starting at or before first_id, then the last whose first message is older than since.
+	for (size_t low = 0, high = num_segments; low < high;) {
+		size_t mid = low + (high - low) / 2;
+
+		if (segments[mid].base_id <= first_id) {
+			first = mid;
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+
+	for (size_t low = first, high = num_segments; since > 0 && low < high;) {
+		size_t mid = low + (high - low) / 2;
+
+		if (segments[mid].num_entries > 0 && segments[mid].index[0].timestamp < since) {
+			first = mid;
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+
+	int ret = 0;
+
+	for (size_t i = first; i < num_segments && segments[i].base_id < end_id; i++) {
+		uint32_t start = seek(&segments[i], first_id, since);
+		uint32_t end = seek(&segments[i], end_id, 0);
+
+		if (start >= end) {
+			continue;
+		}
+
+		if ((uint64_t)records->size + end - start > INT32_MAX) {
+			break;
+		}
+
+		records->data = realloc(records->data, records->size + end - start);
+
+		for (uint32_t done = 0; done < end - start;) {
+			ssize_t n = pread(segments[i].fd, (uint8_t *)records->data + records->size + done, end - start - done,
+			                  start + done);
+
+			if (n <= 0) {
+				if (n < 0 && errno == EINTR) {
+					continue;
+				}
+
+				log_errorf(ERROR_OS, "failed to read chat log segment %020" PRIu64, segments[i].base_id);
+
+				ret = -1;
+
+				break;
+			}
+
+			done += n;
+		}
+
+		if (ret < 0) {
+			break;
+		}
+
+		records->size += end - start;
+	}
+
+	freep(segments);
+
+	if (ret < 0) {
+		freep(records->data);
+		records->size = 0;
+
+		return -1;
+	}
+
+	return records->size;
+}
+
+static void *writer_handler(void *arg) {
+	ChatLog *log = (ChatLog *)arg;
+	uint8_t *batch = NULL;
+	uint32_t batch_capacity = 0;
+
+	pthread_mutex_lock(&log->lock);
+
+	while (log->pending_size > 0 || !log->stop) {
+		if (log->pending_size == 0) {
+			pthread_cond_wait(&log->pending_ready, &log->lock);
+
+			continue;
+		}
+
+		// Swap buffers, so appends carry on into the other one while this batch is written.
+		uint8_t *data = log->pending;
+		uint32_t size = log->pending_size;
+		uint32_t capacity = log->pending_capacity;
+
+		log->pending = batch;
+		log->pending_capacity = batch_capacity;
+		log->pending_size = 0;
+		batch = data;
+		batch_capacity = capacity;
+
+		pthread_mutex_unlock(&log->lock);
+		write_batch(log, batch, size);
+		pthread_mutex_lock(&log->lock);
+	}
+
+	pthread_mutex_unlock(&log->lock);
+	freep(batch);
+
+	return NULL;
+}
+
+/*
+ * Write a batch of messages with one sync per segment they go in, and then
+ * make them visible to readers.
+ */
+static void write_batch(ChatLog *log, const uint8_t *batch, uint32_t size) {
+	// Only this thread changes the segments, so it can work on a copy of the last one.
+	ChatLogSegment segment = log->segments[log->num_segments - 1];
+	ChatRecord record = {0};
+	uint32_t record_size = 0;
+	uint64_t num_records = 0;
+
+	for (uint32_t run = 0; run < size;) {
+		uint32_t end = run;
+
+		// As many messages as fit in the segment, though an empty one takes at least one.
+		while (end < size) {
+			parse_record(batch + end, &record_size, &record);
+
+			if (segment.size + (end - run) > 0 && segment.size + (end - run) + record_size > CHAT_LOG_SEGMENT_SIZE) {
+				break;
+			}
+
+			end += record_size;
+		}
+
+		if (end == run) {
+			ChatLogSegment next;
+
+			parse_record(batch + run, &record_size, &record);
+
+			if (open_segment(log, record.id, &next) < 0) {
+				log_error(ERROR_OS, "failed to start chat log segment, dropping messages");
+
+				break;
+			}
+
+			pthread_mutex_lock(&log->lock);
+			log->segments[log->num_segments - 1] = segment;
+			log->segments = realloc(log->segments, sizeof *log->segments * (log->num_segments + 1));
+			log->segments[log->num_segments++] = next;
+			pthread_mutex_unlock(&log->lock);
+
+			segment = next;
+
+			continue;
+		}
+
+		uint32_t start = segment.size;
+
+		if (write_run(&segment, batch + run, end - run) < 0) {
+			log_errorf(ERROR_OS, "failed to write chat log segment %020" PRIu64 ", dropping messages",
+			           segment.base_id);
+		} else {
+			for (uint32_t offset = run; offset < end; offset += record_size) {
+				parse_record(batch + offset, &record_size, &record);
+				index_record(&segment, start + offset - run, &record);
+				num_records++;
+			}
+		}
+
+		run = end;
+	}
+
+	// Whatever happened to them, every message up to the last one in the batch is done with.
+	for (uint32_t offset = 0; offset < size; offset += record_size) {
+		parse_record(batch + offset, &record_size, &record);
+	}
+
+	pthread_mutex_lock(&log->lock);
+	log->segments[log->num_segments - 1] = segment;
+	log->written_id = record.id + 1;
+	log->records += num_records;
+	log->commits++;
+	pthread_mutex_unlock(&log->lock);
+}
+
+/*
+ * Append data to a segment and sync it. On failure the segment is cut back
+ * to where it was, so no partial message is left behind.
+ */
+static int write_run(ChatLogSegment *segment, const uint8_t *data, uint32_t size) {
+	for (uint32_t done = 0; done < size;) {
+		ssize_t n = pwrite(segment->fd, data + done, size - done, segment->size + done);
+
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			if (ftruncate(segment->fd, segment->size) < 0) {
+				log_error(ERROR_OS, "failed to cut back chat log segment");
+			}
+
+			return -1;
+		}
+
+		done += n;
+	}
+
+	if (fdatasync(segment->fd) < 0) {
+		if (ftruncate(segment->fd, segment->size) < 0) {
+			log_error(ERROR_OS, "failed to cut back chat log segment");
+		}
+
+		return -1;
+	}
+
+	segment->size += size;
+
+	return 0;
+}
+
+static int open_segment(const ChatLog *log, uint64_t base_id, ChatLogSegment *segment) {
+	char name[32];
+
+	snprintf(name, sizeof name, "%020" PRIu64 CHAT_LOG_SEGMENT_SUFFIX, base_id);
+
+	char *path = join_path(log->dir, name, NULL);
+	struct stat st;
+
+	*segment = (ChatLogSegment){.base_id = base_id, .fd = open(path, O_RDWR | O_CREAT, 0666)};
+	freep(path);
+
+	if (segment->fd < 0 || fstat(segment->fd, &st) < 0 || st.st_size > UINT32_MAX) {
+		log_errorf(ERROR_OS, "failed to open chat log segment %s", name);
+
+		close_segment(segment);
+
+		return -1;
+	}
+
+	segment->size = st.st_size;
+
+	snprintf(name, sizeof name, "%020" PRIu64 CHAT_LOG_INDEX_SUFFIX, base_id);
+	path = join_path(log->dir, name, NULL);
+
+	int index_fd = open(path, O_RDWR | O_CREAT, 0666);
+	void *index = MAP_FAILED;
+
+	freep(path);
+
+	if (index_fd >= 0 && ftruncate(index_fd, CHAT_LOG_INDEX_SIZE) == 0) {
+		index = mmap(NULL, CHAT_LOG_INDEX_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, index_fd, 0);
+	}
+
+	if (index_fd >= 0) {
+		close(index_fd);
+	}
+
+	if (index == MAP_FAILED) {
+		log_errorf(ERROR_OS, "failed to map chat log index %s", name);
+
+		close_segment(segment);
+
+		return -1;
+	}
+
+	segment->index = index;
+
+	// Trust the entries up to the first that does not follow on from the one before.
+	while (segment->num_entries < CHAT_LOG_INDEX_ENTRIES) {
+		const ChatLogIndexEntry *entry = &segment->index[segment->num_entries];
+		const ChatLogIndexEntry *previous = segment->num_entries > 0 ? entry - 1 : NULL;
+
+		if (previous == NULL ? entry->id != base_id || entry->offset != 0
+		                     : entry->id <= previous->id || entry->offset <= previous->offset ||
+		                           entry->timestamp < previous->timestamp) {
+			break;
+		}
+
+		if (entry->offset >= segment->size) {
+			break;
+		}
+
+		segment->num_entries++;
+	}
+
+	return 0;
+}
+
+static void close_segment(ChatLogSegment *segment) {
+	if (segment->index != NULL) {
+		munmap(segment->index, CHAT_LOG_INDEX_SIZE);
+
+		segment->index = NULL;
+	}
+
+	if (segment->fd >= 0) {
+		close(segment->fd);
+
+		segment->fd = -1;
+	}
+}
+
+/*
+ * Find the end of the last segment's messages, from its last index entry on,
+ * and carry on ids and times from there.
+ */
+static void recover_segment(ChatLog *log, ChatLogSegment *segment) {
+	uint32_t offset = segment->num_entries > 0 ? segment->index[segment->num_entries - 1].offset : 0;
+	uint64_t last_id = segment->base_id - 1;
+	uint64_t last_timestamp = 0;
+	ReadBuffer buffer = {0};
+
+	while (offset < segment->size) {
+		uint32_t size = 0;
+		ChatRecord record;
+
+		if (read_record(segment, &buffer, offset, &size, &record) < 0 || size > segment->size - offset ||
+		    record.id <= last_id || record.timestamp < last_timestamp) {
+			break;
+		}
+
+		index_record(segment, offset, &record);
+
+		last_id = record.id;
+		last_timestamp = record.timestamp;
+		offset += size;
+	}
+
+	if (offset < segment->size) {
+		log_errorf(ERROR_OS, "dropping %" PRIu32 " bytes of a torn message from chat log segment %020" PRIu64,
+		           segment->size - offset,
+		           segment->base_id);
+
+		if (ftruncate(segment->fd, offset) < 0) {
+			log_error(ERROR_OS, "failed to cut back chat log segment");
+		}
+
+		segment->size = offset;
+	}
+
+	// Entries past the ones in use could be from before the cut, so they must not be picked up next time.
+	memset(&segment->index[segment->num_entries],
+	       0,
+	       sizeof *segment->index * (CHAT_LOG_INDEX_ENTRIES - segment->num_entries));
+
+	log->next_id = last_id + 1;
+	log->last_timestamp = last_timestamp;
+}
+
+static void index_record(ChatLogSegment *segment, uint32_t offset, const ChatRecord *record) {
+	if (segment->num_entries == CHAT_LOG_INDEX_ENTRIES ||
+	    (segment->num_entries > 0 &&
+	     offset < segment->index[segment->num_entries - 1].offset + CHAT_LOG_INDEX_INTERVAL)) {
+		return;
+	}
+
+	segment->index[segment->num_entries++] =
+	    (ChatLogIndexEntry){.id = record->id, .timestamp = record->timestamp, .offset = offset};
+}
+
+/*
+ * For messages already known to be whole, such as ones waiting to be written.
+ */
+static void parse_record(const uint8_t *data, uint32_t *size, ChatRecord *record) {
+	memcpy(size, data + sizeof(PacketType), sizeof *size);
+	unserialise_chat_record(&(Serialised){.size = *size, .data = (void *)data}, record);
+}
+
+static int read_record(const ChatLogSegment *segment, ReadBuffer *buffer, uint32_t offset, uint32_t *size,
+                       ChatRecord *record) {
+	if (offset < buffer->offset || offset + CHAT_RECORD_HEADER_SIZE > buffer->offset + buffer->size) {
+		ssize_t n = pread(segment->fd, buffer->data, sizeof buffer->data, offset);
+
+		buffer->offset = offset;
+		buffer->size = n > 0 ? n : 0;
+
+		if (buffer->size < CHAT_RECORD_HEADER_SIZE) {
+			return -1;
+		}
+	}
+
+	uint8_t *header = buffer->data + offset - buffer->offset;
+	Serialised serialised = {.size = CHAT_RECORD_HEADER_SIZE, .data = header};
+
+	if (unserialise_chat_record(&serialised, record) < 0) {
+		return -1;
+	}
+
+	memcpy(size, header + sizeof(PacketType), sizeof *size);
+
+	return *size < CHAT_RECORD_HEADER_SIZE ? -1 : 0;
+}
+
+/*
+ * Offset of the first message in a segment with at least the given id and
+ * time, or the segment's size if there is none.
+ */
+static uint32_t seek(const ChatLogSegment *segment, uint64_t id, uint64_t timestamp) {
+	size_t low = 0;
+	size_t high = segment->num_entries;
+
+	// Entries are in order of both id and time, so find the last one still short of either.
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+
+		if (segment->index[mid].id < id || segment->index[mid].timestamp < timestamp) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+
+	uint32_t offset = low > 0 ? segment->index[low - 1].offset : 0;
+	ReadBuffer buffer = {0};
+
+	while (offset < segment->size) {
+		uint32_t size = 0;
+		ChatRecord record;
+
+		if (read_record(segment, &buffer, offset, &size, &record) < 0) {
+			return segment->size;
+		}
+
+		if (record.id >= id && record.timestamp >= timestamp) {
+			return offset;
+		}
+
+		offset += size;
+	}
+
+	return segment->size;
+}
+
+static int compare_segments(const void *a, const void *b) {
+	uint64_t a_id = ((const ChatLogSegment *)a)->base_id;
+	uint64_t b_id = ((const ChatLogSegment *)b)->base_id;
+
+	return (a_id > b_id) - (a_id < b_id);
+}
+
+static uint64_t now_ms() {
+	struct timespec now;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
@@ -0,0 +1,83 @@
+#pragma once
+
+#include "packets.h"
+
+#include <pthread.h>
+#include <stdint.h>
+
+/*
+ * Each room's chat is appended to segment files in a directory of its own
+ * under chat_log, so it outlives the server. A segment holds ChatRecord
+ * packets back to back and is named after the id of its first message. Once
+ * one reaches CHAT_LOG_SEGMENT_SIZE a new one is started.
+ */
+#define CHAT_LOG_DEFAULT_PATH ".local/share/" APP_NAME "/chat"
+#define CHAT_LOG_SEGMENT_SIZE (8 * 1024 * 1024)
+#define CHAT_LOG_SEGMENT_SUFFIX ".log"
+#define CHAT_LOG_INDEX_SUFFIX ".index"
+
+/*
+ * Beside every segment is a sparse index with an entry at least every
+ * CHAT_LOG_INDEX_INTERVAL bytes, so finding a message by id or time is a
+ * binary search of the index and then a scan of at most that many bytes. The
+ * index file is sized for a full segment up front and mapped into memory.
+ */
+#define CHAT_LOG_INDEX_INTERVAL 4096
+#define CHAT_LOG_INDEX_ENTRIES (CHAT_LOG_SEGMENT_SIZE / CHAT_LOG_INDEX_INTERVAL + 1)
+
+/*
+ * Messages waiting for the writer past this are not persisted, so a stalled
+ * disk cannot take the server's memory with it.
+ */
+#define CHAT_LOG_MAX_PENDING (4 * 1024 * 1024)
+
+/*
+ * Most messages sent back for one history request.
+ */
+#define CHAT_LOG_MAX_FETCH 256
+
+typedef struct {
+	uint64_t id;
+	uint64_t timestamp;
+	uint32_t offset;
+} ChatLogIndexEntry;
+
+typedef struct {
+	uint64_t base_id;
+	int fd;
+	uint32_t size;
+	uint32_t num_entries;
+	ChatLogIndexEntry *index;
+} ChatLogSegment;
+
+/*
+ * Appending only copies a message into pending. The writer thread takes
+ * everything pending in one go, writes it and syncs once, so whatever arrives
+ * while it syncs shares the next sync. Messages can be read back once
+ * written, which is every id below written_id.
+ *
+ * Without a directory nothing is persisted, but messages are still stamped.
+ */
+typedef struct {
+	char *dir;
+	pthread_mutex_t lock;
+	pthread_cond_t pending_ready;
+	pthread_t thread;
+	int running;
+	int stop;
+	ChatLogSegment *segments;
+	size_t num_segments;
+	uint8_t *pending;
+	uint32_t pending_size;
+	uint32_t pending_capacity;
+	uint64_t next_id;
+	uint64_t last_timestamp;
+	uint64_t written_id;
+	uint64_t commits;
+	uint64_t records;
+} ChatLog;
+
+int chat_log_open(ChatLog *log, const char *dir);
+void chat_log_close(ChatLog *log);
+Serialised *chat_log_append(ChatLog *log, const char *text, uint32_t size);
+int chat_log_read(ChatLog *log, uint64_t before, uint64_t since, uint32_t count, Serialised *records);
@@ -1,20 +1,32 @@
 #include "client.h"
 
+#include "compositor.h"
 #include "drawing.h"
+#include "editor.h"
+#include "jitter.h"
+#include "media.h"
 #include "packets.h"
+#include "render.h"
+#include "scheduler.h"
+#include "scrollback.h"
+#include "speaker.h"
 #include "utils.h"
 
 #include <arpa/inet.h>
-#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <netinet/in.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
 #include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <termios.h>
 #include <unistd.h>
 
@@ -27,6 +39,18 @@ typedef enum
 	ScreenChat
 } Screen;
 
+/*
+ * What the main event loop waits on, in the order it polls them.
+ */
+typedef enum
+{
+	EventSourceKeyboard,
+	EventSourceSocket,
+	EventSourceSignal,
+	EventSourceFrameTimer,
+	EventSourceCount
+} EventSource;
+
 typedef enum
 {
 	DisconnectionMethodNone,
@@ -37,36 +61,87 @@ typedef enum
 	DisconnectionMethodServerError
 } DisconnectionMethod;
 
+/*
+ * Everything but media arriving on the media channel is handled on the main
+ * thread's event loop. window_size is only read from the terminal when it
+ * changes. Handlers do not draw: they mark what changed in renderer, and the
+ * frame timer draws it.
+ */
 typedef struct {
 	int socket_fd;
 	pthread_mutex_t socket_lock;
 	Screen screen;
+	struct winsize window_size;
+	Editor chat_input;
+	char input[INPUT_BUFFER_SIZE];
+	size_t input_size;
+	Renderer renderer;
 	Config *config;
 	int16_t room_index;
+	AudioCodec audio_codec;
+	JitterBuffer jitter[MAX_PARTICIPANTS];
+	uint8_t seen_participants;
+	uint8_t active_speaker;
+	uint8_t pinned_speaker;
+	Compositor compositor;
+	int video_fd;
+	struct sockaddr_in server_addr;
+	MediaSocket media;
+	struct sockaddr_in media_addr;
+	uint32_t media_ssrc_base;
+	atomic_int media_ready;
+	atomic_int media_running;
+	pthread_t media_thread;
+	pthread_mutex_t media_lock;
+	MediaRecvStream media_streams[MAX_PARTICIPANTS][MEDIA_NUM_STREAMS];
+	Reassembly reassembly;
+	Scrollback chat_log;
 	DisconnectionMethod disconnection_method;
 } Context;
 
-/*
- * Buffer for chat message which is yet to be sent.
- */
-typedef struct {
-	unsigned int size;
-	unsigned int cursor_pos;
-	char *msg;
-} ChatBuffer;
-
 static int configure_terminal(int signum);
-static void resize_terminal_handler();
+static int update_window_size(Context *context);
+static int resize_handler(Context *context);
+static void show_screen(Context *context, Screen screen);
+static void draw_window_too_small(void);
+static int render_frame(Context *context);
 static int join_room(Context *context);
 static int setup_chat_ui(Context *context);
 static int setup_room_selection_ui(Context *context);
 static int select_room_keyboard_handler(Context *context, int ch);
-static void chat_keyboard_handler(Context *context, ChatBuffer *chat_buffer, int ch);
-static void *keyboard_handler(void *arg);
-static int set_chat_message(const char *msg);
-static int send_chat_message(Context *context, ChatMessage *msg);
+static void chat_keyboard_handler(Context *context, int ch, const char *key, size_t key_size);
+static int split_key(const char *input, size_t size, size_t *key_size);
+static int keyboard_handler(Context *context);
+static int socket_handler(Context *context);
+static int signal_handler(Context *context, int signal_fd);
+static int frame_timer_handler(Context *context, int timer_fd);
+static void draw_chat_input(Context *context, int full);
+static int send_chat_message(Context *context, const ChatMessage *msg);
+static int send_chat_search(Context *context, const char *query);
+static int chat_message_handler(Context *context);
+static int process_chat_record(Context *context, const Serialised *serialised);
+static int chat_search_results_handler(Context *context);
+static int process_chat_search_results(Context *context, const Serialised *serialised);
+static void add_chat_line(Context *context, const char *text, size_t size);
+static int chat_log_height(Context *context);
+static int draw_chat_log(Context *context);
 static int config_handler(Context *context);
+static int process_config(Context *context, const Serialised *serialised);
 static int handle_heartbeat(Context *context);
+static int send_audio_codecs(Context *context);
+static int audio_codec_handler(Context *context);
+static int media_packet_handler(Context *context);
+static int fragment_handler(Context *context);
+static int process_fragmented_packet(Context *context, const Serialised *serialised);
+static int process_media_packet(Context *context, const Serialised *serialised);
+static int audio_frame_handler(Context *context, const Serialised *serialised);
+static int comfort_noise_handler(Context *context, const Serialised *serialised);
+static int video_frame_handler(Context *context, const Serialised *serialised);
+static int media_channel_handler(Context *context);
+static void *media_handler(void *arg);
+static void media_parity_handler(Context *context, const MediaHeader *header, const Serialised *parity);
+static int active_speaker_handler(Context *context);
+static int pin_next_speaker(Context *context);
 
 static int select_room_keyboard_handler(Context *context, int ch) {
 	switch (ch) {
@@ -77,7 +152,7 @@ static int select_room_keyboard_handler(Context *context, int ch) {
 				context->room_index--;
 			}
 
-			setup_room_selection_ui(context);
+			show_screen(context, ScreenRoomSelection);
 
 			break;
 
@@ -90,7 +165,7 @@ static int select_room_keyboard_handler(Context *context, int ch) {
 				context->room_index++;
 			}
 
-			setup_room_selection_ui(context);
+			show_screen(context, ScreenRoomSelection);
 
 			break;
 
@@ -100,13 +175,11 @@ static int select_room_keyboard_handler(Context *context, int ch) {
 			} else if (context->room_index == ROOM_LIST_INDEX_CREATE_ROOM) {
 				// TODO create new room
 			} else if (context->room_index < context->config->num_rooms) {
-				join_room(context);
-
-				/*if (setup_chat_ui(context) < 0) {
-				    log_error(ERROR_TERMINAL, "failed to setup UI");
+				if (join_room(context) < 0) {
+					return -1;
+				}
 
-				    return -1;
-				}*/
+				show_screen(context, ScreenChat);
 			}
 
 			break;
@@ -118,212 +191,188 @@ static int select_room_keyboard_handler(Context *context, int ch) {
 	return 0;
 }
 
-static void chat_keyboard_handler(Context *context, ChatBuffer *chat_buffer, int ch) {
+static void chat_keyboard_handler(Context *context, int ch, const char *key, size_t key_size) {
+	Editor *editor = &context->chat_input;
+
 	switch (ch) {
-		case INPUT_NULL:
-			if (set_chat_message(chat_buffer->msg) < 0) {
-				log_error(ERROR_TERMINAL, "failed to set chat message");
+		case INPUT_TAB:
+			if (pin_next_speaker(context) < 0) {
+				log_error(ERROR_NETWORK, "failed to change speaker video");
 			}
 
-			printf("\033[%luG", chat_buffer->cursor_pos + CHAT_COL_START);
-
-			break;
-
-		case INPUT_TAB:
-			// TODO: change speaker video
 			break;
 
 		case INPUT_HOME:
 		case INPUT_HOME_2:
-			chat_buffer->cursor_pos = 0;
-			printf("\033[%luG", CHAT_COL_START);
+			editor_home(editor);
 
 			break;
 
 		case INPUT_END:
 		case INPUT_END_2:
-			chat_buffer->cursor_pos = strlen(chat_buffer->msg);
-			printf("\033[%luG", chat_buffer->cursor_pos + CHAT_COL_START);
+			editor_end(editor);
 
 			break;
 
 		case INPUT_ALT_LEFT:
-			// If we are on a space or the start of a word, go back to the previous word.
-			while (chat_buffer->cursor_pos > 0 && (isspace(chat_buffer->msg[chat_buffer->cursor_pos]) ||
-			                                       isspace(chat_buffer->msg[chat_buffer->cursor_pos - 1]))) {
-				chat_buffer->cursor_pos--;
-
-				printf("%s", ANSI_CMD_CURSOR_LEFT);
-			}
-
-			// Now go to the start of the word.
-			while (chat_buffer->cursor_pos > 0 && !isspace(chat_buffer->msg[chat_buffer->cursor_pos - 1])) {
-				chat_buffer->cursor_pos--;
-
-				printf("%s", ANSI_CMD_CURSOR_LEFT);
-			}
+			editor_word_left(editor);
 
 			break;
 
 		case INPUT_ALT_RIGHT:
-			// If we are on a space or the end of a word, go forward to the next word.
-			while (chat_buffer->cursor_pos < strlen(chat_buffer->msg) &&
-			       (isspace(chat_buffer->msg[chat_buffer->cursor_pos]) ||
-			        isspace(chat_buffer->msg[chat_buffer->cursor_pos + 1]))) {
-				chat_buffer->cursor_pos++;
-
-				printf("%s", ANSI_CMD_CURSOR_RIGHT);
-			}
-
-			// Now go to the end of the word.
-			while (chat_buffer->cursor_pos < strlen(chat_buffer->msg) &&
-			       !isspace(chat_buffer->msg[chat_buffer->cursor_pos])) {
-				chat_buffer->cursor_pos++;
-
-				printf("%s", ANSI_CMD_CURSOR_RIGHT);
-			}
+			editor_word_right(editor);
 
 			break;
 
 		case INPUT_LEFT:
-			if (chat_buffer->cursor_pos <= 0) {
-				break;
-			}
-
-			chat_buffer->cursor_pos--;
-
-			printf("%s", ANSI_CMD_CURSOR_LEFT);
+			editor_left(editor);
 
 			break;
 
 		case INPUT_RIGHT:
-			if (chat_buffer->cursor_pos >= strlen(chat_buffer->msg)) {
-				break;
-			}
-
-			chat_buffer->cursor_pos++;
-
-			printf("%s", ANSI_CMD_CURSOR_RIGHT);
+			editor_right(editor);
 
 			break;
 
 		case INPUT_LINE_FEED: {
-			if (send_chat_message(context, chat_buffer->msg) < 0) {
+			const char *msg = editor_text(editor);
+
+			if (strncmp(msg, CHAT_SEARCH_COMMAND, strlen(CHAT_SEARCH_COMMAND)) == 0) {
+				if (send_chat_search(context, msg + strlen(CHAT_SEARCH_COMMAND)) < 0) {
+					log_error(ERROR_NETWORK, "failed to send search");
+				}
+			} else if (send_chat_message(context, msg) < 0) {
 				log_error(ERROR_NETWORK, "failed to send message");
 			}
 
-			chat_buffer->msg[0] = '\0';
-			chat_buffer->cursor_pos = 0;
+			editor_clear(editor);
 
-			printf("\033[%luG%s", CHAT_COL_START, ANSI_CMD_CLEAR_LINE);
+			// Back to the newest messages, where the reply will show up.
+			scrollback_follow(&context->chat_log);
+			render_mark(&context->renderer, RenderDirtyChatLog);
 
 			break;
 		}
 
 		case INPUT_BACKSPACE:
-			if (chat_buffer->cursor_pos == 0) {
-				break;
-			}
+			editor_delete_back(editor);
 
-			chat_buffer->cursor_pos--;
-
-			memmove(chat_buffer->msg + chat_buffer->cursor_pos,
-			        chat_buffer->msg + chat_buffer->cursor_pos + 1,
-			        chat_buffer->size - chat_buffer->cursor_pos - 1);
+			break;
 
-			if (set_chat_message(chat_buffer->msg) < 0) {
-				log_error(ERROR_TERMINAL, "failed to set chat message");
-			}
+		case INPUT_PAGE_UP:
+		case INPUT_PAGE_DOWN: {
+			int height = chat_log_height(context);
+			int rows = height > 1 ? height - 1 : 1;
 
-			printf("\033[%luG", chat_buffer->cursor_pos + CHAT_COL_START);
+			scrollback_scroll(&context->chat_log, ch == INPUT_PAGE_UP ? rows : -rows, CHAT_BOX_WIDTH, height);
+			render_mark(&context->renderer, RenderDirtyChatLog);
 
 			break;
+		}
 
 		case INPUT_DELETE:
 		case INPUT_CTRL_D:
-			memmove(chat_buffer->msg + chat_buffer->cursor_pos,
-			        chat_buffer->msg + chat_buffer->cursor_pos + 1,
-			        chat_buffer->size - chat_buffer->cursor_pos - 1);
-
-			if (set_chat_message(chat_buffer->msg) < 0) {
-				log_error(ERROR_TERMINAL, "failed to set chat message");
-			}
-
-			printf("\033[%luG", chat_buffer->cursor_pos + CHAT_COL_START);
+			editor_delete_forward(editor);
 
 			break;
 
 		default:
-			if (isprint(ch) && strlen(chat_buffer->msg) + 1 < chat_buffer->size) {
-				memmove(chat_buffer->msg + chat_buffer->cursor_pos + 1,
-				        chat_buffer->msg + chat_buffer->cursor_pos,
-				        chat_buffer->size - chat_buffer->cursor_pos - 1);
-				chat_buffer->msg[chat_buffer->cursor_pos] = (char)ch;
-				chat_buffer->cursor_pos++;
-
-				if (set_chat_message(chat_buffer->msg) < 0) {
-					log_error(ERROR_TERMINAL, "failed to set chat message");
-				}
-
-				printf("\033[%luG", chat_buffer->cursor_pos + CHAT_COL_START);
+			// Anything else that is not a control character or an escape sequence is text.
+			if ((uint8_t)key[0] >= ' ' && key[0] != INPUT_BACKSPACE) {
+				editor_insert(editor, key, key_size);
 			}
 	}
+
+	// Redrawn, cursor and all, on the next frame.
+	render_mark(&context->renderer, RenderDirtyChatInput);
 }
 
-static void *keyboard_handler(void *arg) {
-	Context *context = (Context *)arg;
-	ChatBuffer chat_buffer = {0};
+/*
+ * Find how long the key pressed at the start of input is: an escape sequence,
+ * a UTF-8 character or a single byte. Returns -1 if input stops part way
+ * through one, so the rest can be read first. An escape on its own is the
+ * escape key.
+ */
+static int split_key(const char *input, size_t size, size_t *key_size) {
+	const uint8_t *bytes = (const uint8_t *)input;
+	size_t length = 1;
+
+	if (bytes[0] == INPUT_ESCAPE && size > 1) {
+		if (bytes[1] == '[') {
+			// Control sequences end with a byte from '@' to '~'.
+			for (length = 2; length < size && (bytes[length] < '@' || bytes[length] > '~'); length++)
+				;
+
+			// One that long is not a key we know, so give up on finding its end.
+			if (length < size) {
+				length++;
+			} else if (size < INPUT_MAX_KEY_SIZE) {
+				return -1;
+			}
+		} else {
+			length = bytes[1] == 'O' ? 3 : 2;
+		}
+	} else if ((bytes[0] & 0xe0) == 0xc0) {
+		length = 2;
+	} else if ((bytes[0] & 0xf0) == 0xe0) {
+		length = 3;
+	} else if ((bytes[0] & 0xf8) == 0xf0) {
+		length = 4;
+	}
 
-	while (TRUE) {
-		int ch = 0;
+	if (length > size) {
+		return -1;
+	}
 
-		if (read(STDIN_FILENO, &ch, sizeof ch) <= 0) {
-			log_error(ERROR_OS, "failed to read from STDIN");
+	*key_size = length;
 
-			if (context->disconnection_method == DisconnectionMethodNone) {
-				context->disconnection_method = DisconnectionMethodClientError;
-			}
+	return 0;
+}
 
-			break;
-		}
+/*
+ * Handle every key read from the terminal. A paste arrives as many keys in
+ * one read, and a key cut short by the end of a read is kept for the next.
+ * Returns -1 once the client should stop.
+ */
+static int keyboard_handler(Context *context) {
+	ssize_t num_read =
+	    read(STDIN_FILENO, context->input + context->input_size, sizeof context->input - context->input_size);
 
-		if (ch == INPUT_ESCAPE) {
-			if (context->disconnection_method == DisconnectionMethodNone) {
-				context->disconnection_method = DisconnectionMethodUser;
-			}
+	if (num_read <= 0) {
+		log_error(ERROR_OS, "failed to read from STDIN");
 
-			break;
+		if (context->disconnection_method == DisconnectionMethodNone) {
+			context->disconnection_method = DisconnectionMethodClientError;
 		}
 
-		struct winsize window_size;
+		return -1;
+	}
 
-		if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &window_size) < 0) {
-			log_error(ERROR_TERMINAL, "failed to get terminal size");
+	size_t size = context->input_size + num_read;
+	size_t offset = 0;
+	size_t key_size = 0;
 
-			if (context->disconnection_method == DisconnectionMethodNone) {
-				context->disconnection_method = DisconnectionMethodClientError;
-			}
+	while (offset < size && split_key(context->input + offset, size - offset, &key_size) == 0) {
+		const char *key = context->input + offset;
+		int ch = 0;
 
-			break;
+		// Keys up to four bytes long are told apart by their bytes packed into an int.
+		if (key_size <= sizeof ch) {
+			memcpy(&ch, key, key_size);
 		}
 
-		if (window_size.ws_col < MIN_WINDOW_WIDTH || window_size.ws_row < MIN_WINDOW_HEIGHT) {
-			continue;
-		} else if (chat_buffer.size != (unsigned int)window_size.ws_col - 5) {
-			chat_buffer.msg = realloc(chat_buffer.msg, window_size.ws_col - 5);
-			unsigned int new_size = window_size.ws_col - 5;
-
-			if (chat_buffer.size == 0) {
-				chat_buffer.msg[0] = '\0';
-			} else if (new_size < chat_buffer.size) {
-				chat_buffer.msg[new_size - 1] = '\0';
-			}
+		offset += key_size;
 
-			if (chat_buffer.cursor_pos >= new_size - 1) {
-				chat_buffer.cursor_pos = new_size - 2;
+		if (ch == INPUT_ESCAPE) {
+			if (context->disconnection_method == DisconnectionMethodNone) {
+				context->disconnection_method = DisconnectionMethodUser;
 			}
 
-			chat_buffer.size = new_size;
+			return -1;
+		}
+
+		if (context->window_size.ws_col < MIN_WINDOW_WIDTH || context->window_size.ws_row < MIN_WINDOW_HEIGHT) {
+			continue;
 		}
 
 		// TODO: handle return values
@@ -334,46 +383,56 @@ static void *keyboard_handler(void *arg) {
 				break;
 
 			case ScreenChat:
-				chat_keyboard_handler(context, &chat_buffer, ch);
+				chat_keyboard_handler(context, ch, key, key_size);
 
 				break;
 
 			default:
 				break;
 		}
-
-		fflush(stdout);
 	}
 
-	if (shutdown(context->socket_fd, SHUT_RDWR) < 0) {
-		if (errno != EBADF) {
-			log_error(ERROR_NETWORK, "failed to disconnect from server");
-
-			if (context->disconnection_method == DisconnectionMethodNone) {
-				context->disconnection_method = DisconnectionMethodClientError;
-			}
-		}
-	}
+	context->input_size = size - offset;
+	memmove(context->input, context->input + offset, context->input_size);
 
-	return NULL;
+	return 0;
 }
 
-static int set_chat_message(const char *msg) {
-	struct winsize window_size;
-
-	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &window_size) < 0) {
-		log_error(ERROR_TERMINAL, "failed to get terminal size");
-
-		return -1;
+/*
+ * Draw the message being typed on the bottom line, and leave the cursor where
+ * it is being typed. Unless the whole line is asked for, only the text from
+ * the first change since it was last drawn is printed again.
+ */
+static void draw_chat_input(Context *context, int full) {
+	Editor *editor = &context->chat_input;
+	uint32_t from = 0;
+	uint32_t col = 0;
+	int dirty = editor_take_dirty(editor, &from, &col);
+
+	if (full) {
+		from = 0;
+		col = 0;
+		dirty = TRUE;
+		printf("\033[%u;1H\033[K%s ", context->window_size.ws_row, CHAT_PROMPT);
 	}
 
-	printf("\033[%u;%uH\033[K%s %s", window_size.ws_row, 1, CHAT_PROMPT, msg);
-	fflush(stdout);
+	if (dirty) {
+		EditorSpans spans;
+
+		editor_spans(editor, from, &spans);
+		printf("\033[%u;%luH%.*s%.*s\033[K",
+		       context->window_size.ws_row,
+		       col + CHAT_COL_START,
+		       (int)spans.size[0],
+		       spans.text[0],
+		       (int)spans.size[1],
+		       spans.text[1]);
+	}
 
-	return 0;
+	printf("\033[%u;%luH", context->window_size.ws_row, editor->cursor_col + CHAT_COL_START);
 }
 
-static int send_chat_message(Context *context, ChatMessage *msg) {
+static int send_chat_message(Context *context, const ChatMessage *msg) {
 	log_info("sending message");
 
 	Serialised *serialised = serialise_chat_message(msg);
@@ -381,57 +440,266 @@ static int send_chat_message(Context *context, ChatMessage *msg) {
 	if (send_packet(context->socket_fd, serialised, &context->socket_lock) < 0) {
 		log_error(ERROR_NETWORK, "failed to send chat message");
 
+		free(serialised->data);
 		free(serialised);
 
 		return -1;
 	}
 
+	free(serialised->data);
 	free(serialised);
 
 	return 0;
 }
 
-// FIXME: resize terminal before closing results in no final newline
-static void resize_terminal_handler() {
-	log_info("received terminal resize signal");
+static int send_chat_search(Context *context, const char *query) {
+	ChatSearchRequest request = {.count = CHAT_SEARCH_RESULTS, .size = strlen(query), .data = (uint8_t *)query};
+	Serialised *serialised = serialise_chat_search(&request);
+	int ret = send_packet(context->socket_fd, serialised, &context->socket_lock);
 
-	struct winsize window_size;
+	free(serialised->data);
+	free(serialised);
 
-	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &window_size) < 0) {
-		log_error(ERROR_TERMINAL, "failed to get terminal size");
+	return ret < 0 ? -1 : 0;
+}
+
+/*
+ * Messages come back from the server for everyone in the room, our own
+ * included, starting with the room's history when we join.
+ */
+static int chat_message_handler(Context *context) {
+	Serialised serialised = {0};
+	int ret = recv_packet(context->socket_fd, &serialised, &context->socket_lock);
+
+	if (ret <= 0) {
+		log_error(ERROR_NETWORK, "failed to receive chat message");
+
+		return -1;
 	}
 
-	if (window_size.ws_col < MIN_WINDOW_WIDTH || window_size.ws_row < MIN_WINDOW_HEIGHT) {
-		printf("%s\033[?25h", ANSI_CMD_CLEAR_SCREEN);
-		printf("\033[HTerminal must have at least:\n"
-		       "\t* %d columns\n"
-		       "\t* %d rows\n"
-		       "Please resize to continue.\n",
-		       MIN_WINDOW_WIDTH,
-		       MIN_WINDOW_HEIGHT);
+	ret = process_chat_record(context, &serialised);
 
-		fflush(stdout);
-	} else {
-		char null = INPUT_NULL;
+	free(serialised.data);
+
+	return ret;
+}
+
+static int process_chat_record(Context *context, const Serialised *serialised) {
+	ChatRecord record;
 
-		if (ioctl(STDIN_FILENO, TIOCSTI, &null) < 0) {
-			log_error(ERROR_TERMINAL, "failed to send fake (null) input trigger");
+	if (unserialise_chat_record(serialised, &record) < 0) {
+		log_error(ERROR_NETWORK, "received malformed chat message");
+
+		return -1;
+	}
+
+	add_chat_line(context, (const char *)record.data, record.size);
+	render_mark(&context->renderer, RenderDirtyChatLog);
+
+	return 0;
+}
+
+/*
+ * Search results go in the chat box under a line saying how many there are,
+ * oldest last so the newest match sits nearest the heading.
+ */
+static int chat_search_results_handler(Context *context) {
+	Serialised serialised = {0};
+	int ret = recv_packet(context->socket_fd, &serialised, &context->socket_lock);
+
+	if (ret <= 0) {
+		log_error(ERROR_NETWORK, "failed to receive chat search results");
+
+		return -1;
+	}
+
+	ret = process_chat_search_results(context, &serialised);
+
+	free(serialised.data);
+
+	return ret;
+}
+
+static int process_chat_search_results(Context *context, const Serialised *serialised) {
+	ChatSearchResults results;
+
+	if (unserialise_chat_search_results(serialised, &results) < 0) {
+		log_error(ERROR_NETWORK, "received malformed chat search results");
+
+		return -1;
+	}
+
+	char heading[CHAT_BOX_WIDTH + 1];
+	Serialised packet;
+	ChatRecord record;
+
+	snprintf(heading, sizeof heading, "%" PRIu16 " found:", results.count);
+	add_chat_line(context, heading, strlen(heading));
+
+	for (uint32_t offset = 0; next_packet(results.data, results.size, &offset, &packet) == 0;) {
+		if (unserialise_chat_record(&packet, &record) == 0) {
+			add_chat_line(context, (const char *)record.data, record.size);
 		}
 	}
+
+	render_mark(&context->renderer, RenderDirtyChatLog);
+
+	return 0;
+}
+
+static void add_chat_line(Context *context, const char *text, size_t size) {
+	if (scrollback_append(&context->chat_log, text, size) < 0) {
+		log_error(ERROR_OS, "failed to keep chat line");
+	}
+}
+
+static int chat_log_height(Context *context) {
+	return context->window_size.ws_row - 2 - CHAT_LOG_FIRST_ROW + 1;
 }
 
 /*
- * Draw room selection UI on client terminal.
+ * Draw whatever part of the chat log is scrolled into the chat box, messages
+ * wrapped to its width. Only the rows on screen are looked at, however long
+ * the log gets.
  */
-static int setup_room_selection_ui(Context *context) {
-	struct winsize window_size;
+static int draw_chat_log(Context *context) {
+	int height = chat_log_height(context);
+
+	if (height <= 0) {
+		return 0;
+	}
+
+	ScrollbackRow rows[height];
+	int col = context->window_size.ws_col - CHAT_BOX_WIDTH + 1;
+	int num_shown = scrollback_visible(&context->chat_log, CHAT_BOX_WIDTH, height, rows);
+
+	printf("\0337");
+
+	for (int i = 0; i < height; i++) {
+		int row = CHAT_LOG_FIRST_ROW + i;
+
+		printf("\033[%d;%dH%*s", row, col, CHAT_BOX_WIDTH, "");
+
+		if (i >= height - num_shown) {
+			printf("\033[%d;%dH%.*s", row, col, (int)rows[i].size, rows[i].text);
+		}
+	}
+
+	printf("\0338");
+
+	return 0;
+}
 
-	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &window_size) < 0) {
+/*
+ * Read the terminal size into the context, and fit the chat input to its
+ * width.
+ */
+static int update_window_size(Context *context) {
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &context->window_size) < 0) {
 		log_error(ERROR_TERMINAL, "failed to get terminal size");
 
 		return -1;
 	}
 
+	// The cursor has to stay on screen after the last character.
+	if (context->window_size.ws_col >= MIN_WINDOW_WIDTH) {
+		editor_resize(&context->chat_input, context->window_size.ws_col - (CHAT_COL_START));
+	}
+
+	return 0;
+}
+
+// FIXME: resize terminal before closing results in no final newline
+static int resize_handler(Context *context) {
+	log_info("received terminal resize signal");
+
+	if (update_window_size(context) < 0) {
+		return -1;
+	}
+
+	render_mark(&context->renderer, RenderDirtyScreen);
+
+	return 0;
+}
+
+/*
+ * Switch to screen, drawn from scratch on the next frame.
+ */
+static void show_screen(Context *context, Screen screen) {
+	context->screen = screen;
+	render_mark(&context->renderer, RenderDirtyScreen);
+}
+
+static void draw_window_too_small(void) {
+	printf("%s\033[?25h", ANSI_CMD_CLEAR_SCREEN);
+	printf("\033[HTerminal must have at least:\n"
+	       "\t* %d columns\n"
+	       "\t* %d rows\n"
+	       "Please resize to continue.\n",
+	       MIN_WINDOW_WIDTH,
+	       MIN_WINDOW_HEIGHT);
+}
+
+/*
+ * Draw everything marked since the last frame, then any new video. The
+ * compositor writes straight to its descriptor and puts the cursor back
+ * afterwards, so what is printed goes out first.
+ */
+static int render_frame(Context *context) {
+	struct timespec start;
+	RenderDirty dirty = render_begin(&context->renderer, &start);
+	int drawn = dirty != 0;
+	int ret = 0;
+
+	if (context->window_size.ws_col < MIN_WINDOW_WIDTH || context->window_size.ws_row < MIN_WINDOW_HEIGHT) {
+		if (dirty & RenderDirtyScreen) {
+			draw_window_too_small();
+		}
+	} else if (context->config == NULL) {
+		// Nothing is drawn until the server sends its configuration.
+		drawn = FALSE;
+	} else if (context->screen == ScreenRoomSelection) {
+		if (dirty & RenderDirtyScreen) {
+			ret = setup_room_selection_ui(context);
+		}
+	} else {
+		if (dirty & RenderDirtyScreen) {
+			ret = setup_chat_ui(context);
+		} else if (dirty & RenderDirtyChatLog) {
+			ret = draw_chat_log(context);
+		}
+
+		if (dirty & (RenderDirtyScreen | RenderDirtyChatInput)) {
+			draw_chat_input(context, dirty & RenderDirtyScreen);
+		}
+
+		fflush(stdout);
+
+		int tiles = compositor_render(&context->compositor, context->video_fd);
+
+		if (tiles < 0) {
+			log_error(ERROR_TERMINAL, "failed to render video");
+
+			ret = -1;
+		} else if (tiles > 0) {
+			drawn = TRUE;
+		}
+	}
+
+	if (drawn) {
+		fflush(stdout);
+		render_end(&context->renderer, &start);
+	}
+
+	return ret;
+}
+
+/*
+ * Draw room selection UI on client terminal.
+ */
+static int setup_room_selection_ui(Context *context) {
+	const struct winsize window_size = context->window_size;
+
 	printf("%s%s", ANSI_CMD_CLEAR_SCREEN, ANSI_CMD_CURSOR_RESET);
 	printf("%s %s - %s\n\n", APP_NAME, APP_VERSION, APP_DESC);
 
@@ -492,10 +760,6 @@ static int setup_room_selection_ui(Context *context) {
 		printf("\033[?25l");
 	}
 
-	fflush(stdout);
-
-	context->screen = ScreenRoomSelection;
-
 	return 0;
 }
 
@@ -503,17 +767,21 @@ static int setup_room_selection_ui(Context *context) {
  * Join chat room
  */
 static int join_room(Context *context) {
-	Serialised *serialised = serialise_join_room(context->room_index);
+	uint8_t buffer[PACKET_VALUE_SIZE(RoomIndex)];
+	Serialised serialised = {.data = buffer};
 
-	if (send_packet(context->socket_fd, serialised, &context->socket_lock) < 0) {
+	serialised.size = serialise_join_room_into(context->room_index, buffer, sizeof buffer);
+
+	// The room's history replaces whatever we saw elsewhere.
+	scrollback_clear(&context->chat_log);
+
+	if (send_packet(context->socket_fd, &serialised, &context->socket_lock) < 0) {
 		log_error(ERROR_NETWORK, "failed to send room joining packet");
 
 		return -1;
 	}
 
-	// get room participants, chat history etc
-
-	free(serialised);
+	// get room participants etc; the chat history follows as ChatRecord packets
 
 	return 0;
 }
@@ -522,13 +790,7 @@ static int join_room(Context *context) {
  * Draw chat UI on client terminal.
  */
 static int setup_chat_ui(Context *context) {
-	struct winsize window_size;
-
-	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &window_size) < 0) {
-		log_error(ERROR_TERMINAL, "failed to get terminal size");
-
-		return -1;
-	}
+	const struct winsize window_size = context->window_size;
 
 	printf("%s\033[?25h", ANSI_CMD_CLEAR_SCREEN);
 
@@ -558,15 +820,9 @@ static int setup_chat_ui(Context *context) {
 
 	printf("\033[%u;%luH %s ", 10, window_size.ws_col - (CHAT_BOX_WIDTH / 2) - (strlen(CHAT_TITLE) / 2), CHAT_TITLE);
 
-	if (set_chat_message("") < 0) {
-		log_error(ERROR_TERMINAL, "failed to reset chat message");
-
-		return -1;
-	}
-
-	context->screen = ScreenChat;
+	compositor_set_area(&context->compositor, 0, 0, window_size.ws_col - CHAT_BOX_WIDTH - 1, window_size.ws_row - 2);
 
-	return 0;
+	return draw_chat_log(context);
 }
 
 /*
@@ -628,19 +884,35 @@ static int config_handler(Context *context) {
 		return ret;
 	}
 
-	free(context->config);
+	ret = process_config(context, &serialised);
 
-	context->config = unserialise_config(&serialised);
-	context->room_index = 0;
+	free(serialised.data);
 
-	return setup_room_selection_ui(context);
+	return ret;
 }
 
-int handle_heartbeat(Context *context) {
-	Serialised serialised = {0};
-	int ret = recv_packet(context->socket_fd, &serialised, &context->socket_lock);
+static int process_config(Context *context, const Serialised *serialised) {
+	free(context->config);
 
-	if (ret < 0) {
+	context->config = unserialise_config(serialised);
+	context->room_index = 0;
+
+	if (context->config == NULL) {
+		log_error(ERROR_CONFIG, "received malformed configuration");
+
+		return -1;
+	}
+
+	show_screen(context, ScreenRoomSelection);
+
+	return 0;
+}
+
+int handle_heartbeat(Context *context) {
+	Serialised serialised = {0};
+	int ret = recv_packet(context->socket_fd, &serialised, &context->socket_lock);
+
+	if (ret < 0) {
 		log_error(ERROR_NETWORK, "failed to receive heartbeat ping");
 
 		return ret;
@@ -648,28 +920,580 @@ int handle_heartbeat(Context *context) {
 		return 0;
 	}
 
-	if (unserialise_heartbeat(&serialised) != HeartbeatPing) {
+	HeartbeatProbe probe = {0};
+
+	ret = unserialise_heartbeat(&serialised, &probe);
+
+	free(serialised.data);
+
+	if (ret < 0 || probe.kind != HeartbeatPing) {
 		log_error(ERROR_NETWORK, "heartbeat from server was not a ping... this is awkward...");
 
 		return -1;
 	}
 
-	Heartbeat heartbeat = HeartbeatPong;
-	Serialised *send_serialised = serialise_heartbeat(heartbeat);
+	// The server times the round trip from the timestamp it gets back.
+	probe.kind = HeartbeatPong;
+
+	uint8_t buffer[PACKET_HEADER_SIZE + sizeof probe.kind + sizeof probe.timestamp];
+	Serialised pong = {.data = buffer};
 
-	if (send_packet(context->socket_fd, send_serialised, &context->socket_lock) < 0) {
-		free(send_serialised);
+	pong.size = serialise_heartbeat_into(&probe, buffer, sizeof buffer);
 
+	if (send_packet(context->socket_fd, &pong, &context->socket_lock) < 0) {
 		log_error(ERROR_NETWORK, "failed to send pong");
 
 		return -1;
 	}
 
-	free(send_serialised);
+	return 0;
+}
+
+/*
+ * Offer every codec we can decode; the server answers with the one to use.
+ */
+static int send_audio_codecs(Context *context) {
+	Serialised *serialised = serialise_audio_codecs(AUDIO_CODECS_SUPPORTED);
+
+	if (send_packet(context->socket_fd, serialised, &context->socket_lock) < 0) {
+		log_error(ERROR_NETWORK, "failed to send audio codec offer");
+
+		free(serialised->data);
+		free(serialised);
+
+		return -1;
+	}
+
+	free(serialised->data);
+	free(serialised);
 
 	return 0;
 }
 
+static int audio_codec_handler(Context *context) {
+	Serialised serialised = {0};
+	int ret = recv_packet(context->socket_fd, &serialised, &context->socket_lock);
+
+	if (ret <= 0) {
+		log_error(ERROR_NETWORK, "failed to receive negotiated audio codec");
+
+		return -1;
+	}
+
+	AudioCodecMask codecs = 0;
+
+	ret = unserialise_audio_codecs(&serialised, &codecs);
+
+	free(serialised.data);
+
+	if (ret < 0) {
+		log_error(ERROR_NETWORK, "received malformed audio codec answer");
+
+		return -1;
+	}
+
+	context->audio_codec = audio_codec_negotiate(codecs);
+
+	return 0;
+}
+
+/*
+ * Media sent over TCP, before the media channel is open.
+ */
+static int media_packet_handler(Context *context) {
+	Serialised serialised = {0};
+	int ret = recv_packet(context->socket_fd, &serialised, &context->socket_lock);
+
+	if (ret <= 0) {
+		log_error(ERROR_NETWORK, "failed to receive media packet");
+
+		return -1;
+	}
+
+	pthread_mutex_lock(&context->media_lock);
+	ret = process_media_packet(context, &serialised);
+	pthread_mutex_unlock(&context->media_lock);
+
+	free(serialised.data);
+
+	return ret;
+}
+
+/*
+ * The server splits large packets into fragments so it can slip more urgent
+ * packets in between. What comes out may be a batch of packets the server
+ * queued together, such as the room's chat history.
+ */
+static int fragment_handler(Context *context) {
+	Serialised packet = {0};
+	int ret = scheduler_recv_fragment(&context->reassembly, context->socket_fd, &context->socket_lock, &packet);
+
+	if (ret < 0) {
+		log_error(ERROR_NETWORK, "failed to receive packet fragment");
+
+		return -1;
+	}
+
+	if (ret == 1) {
+		Serialised serialised;
+
+		ret = 0;
+
+		for (uint32_t offset = 0; next_packet(packet.data, packet.size, &offset, &serialised) == 0;) {
+			ret |= process_fragmented_packet(context, &serialised);
+		}
+
+		free(packet.data);
+	}
+
+	return ret;
+}
+
+static int process_fragmented_packet(Context *context, const Serialised *serialised) {
+	int ret = 0;
+
+	switch (((PacketType *)serialised->data)[0]) {
+		case PacketTypeConfig:
+			return process_config(context, serialised);
+
+		case PacketTypeChatRecord:
+			return process_chat_record(context, serialised);
+
+		case PacketTypeChatSearchResults:
+			return process_chat_search_results(context, serialised);
+
+		case PacketTypeAudioFrame:
+		case PacketTypeComfortNoise:
+		case PacketTypeVideoFrame:
+			pthread_mutex_lock(&context->media_lock);
+			ret = process_media_packet(context, serialised);
+			pthread_mutex_unlock(&context->media_lock);
+
+			return ret;
+
+		default:
+			log_error(ERROR_NETWORK, "received unexpected fragmented packet");
+
+			return -1;
+	}
+}
+
+/*
+ * Call with the media lock held, media arrives on both the TCP and media
+ * channel threads.
+ */
+static int process_media_packet(Context *context, const Serialised *serialised) {
+	switch (((PacketType *)serialised->data)[0]) {
+		case PacketTypeAudioFrame:
+			return audio_frame_handler(context, serialised);
+
+		case PacketTypeComfortNoise:
+			return comfort_noise_handler(context, serialised);
+
+		case PacketTypeVideoFrame:
+			return video_frame_handler(context, serialised);
+
+		default:
+			log_error(ERROR_NETWORK, "received unexpected media packet");
+
+			return -1;
+	}
+}
+
+static int audio_frame_handler(Context *context, const Serialised *serialised) {
+	AudioFrame frame = {0};
+
+	if (unserialise_audio_frame(serialised, &frame) < 0 || frame.source >= MAX_PARTICIPANTS) {
+		log_error(ERROR_NETWORK, "received malformed audio frame");
+
+		return -1;
+	}
+
+	context->seen_participants |= 1 << frame.source;
+
+	// Playout pulls from the jitter buffer once there is a playback device.
+	if (jitter_push_frame(&context->jitter[frame.source], &frame) < 0) {
+		log_error(ERROR_NETWORK, "failed to decode audio frame");
+
+		return -1;
+	}
+
+	return 0;
+}
+
+static int comfort_noise_handler(Context *context, const Serialised *serialised) {
+	ComfortNoise noise = {0};
+
+	if (unserialise_comfort_noise(serialised, &noise) < 0 || noise.source >= MAX_PARTICIPANTS) {
+		log_error(ERROR_NETWORK, "received malformed comfort noise descriptor");
+
+		return -1;
+	}
+
+	context->seen_participants |= 1 << noise.source;
+	jitter_push_comfort_noise(&context->jitter[noise.source], &noise);
+
+	return 0;
+}
+
+static int video_frame_handler(Context *context, const Serialised *serialised) {
+	VideoFrame decoded = {0};
+
+	if (unserialise_video_frame(serialised, &decoded) < 0 || decoded.source >= MAX_PARTICIPANTS) {
+		log_error(ERROR_NETWORK, "received malformed video frame");
+
+		return -1;
+	}
+
+	// The compositor keeps the frame until it is drawn, after the packet is gone.
+	VideoFrame *frame = malloc(sizeof *frame);
+
+	*frame = decoded;
+	frame->data = malloc(decoded.size);
+	memcpy(frame->data, decoded.data, decoded.size);
+
+	context->seen_participants |= 1 << frame->source;
+
+	// Drawn on the next tick of the frame timer.
+	compositor_push_frame(&context->compositor, frame);
+
+	return 0;
+}
+
+/*
+ * The server has a media channel for us: open a datagram socket and start
+ * saying hello until it answers.
+ */
+static int media_channel_handler(Context *context) {
+	Serialised serialised = {0};
+	MediaChannel channel = {0};
+	int ret = recv_packet(context->socket_fd, &serialised, &context->socket_lock);
+
+	if (ret <= 0) {
+		log_error(ERROR_NETWORK, "failed to receive media channel");
+
+		return -1;
+	}
+
+	ret = unserialise_media_channel(&serialised, &channel);
+
+	free(serialised.data);
+
+	if (ret < 0) {
+		log_error(ERROR_NETWORK, "received malformed media channel");
+
+		return -1;
+	}
+
+	if (context->media_running) {
+		return 0;
+	}
+
+	struct timeval timeout = {.tv_usec = MEDIA_HELLO_INTERVAL_MS * 1000};
+
+	if (media_socket_open(&context->media, 0) < 0) {
+		return -1;
+	}
+
+	if (setsockopt(context->media.socket_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout) < 0) {
+		log_error(ERROR_NETWORK, "failed to set media socket timeout");
+	}
+
+	context->media_ssrc_base = channel.ssrc_base;
+	context->media_addr = context->server_addr;
+	context->media_addr.sin_port = htons(channel.port);
+
+	if (pthread_create(&context->media_thread, NULL, media_handler, context) != 0) {
+		log_error(ERROR_THREAD, "failed to start media thread, media stays on TCP");
+
+		media_socket_close(&context->media);
+
+		return -1;
+	}
+
+	context->media_running = TRUE;
+
+	return 0;
+}
+
+/*
+ * Receive media datagrams from the server. Until the server has echoed our
+ * hello, keep resending it every MEDIA_HELLO_INTERVAL_MS.
+ */
+static void *media_handler(void *arg) {
+	Context *context = (Context *)arg;
+	MediaHeader hello = {.ssrc = context->media_ssrc_base | MEDIA_STREAM_HELLO};
+
+	while (context->media_running) {
+		struct sockaddr_in addr = {0};
+		MediaHeader header = {0};
+		Serialised serialised = {0};
+
+		if (!atomic_load(&context->media_ready) &&
+		    media_send(&context->media, &context->media_addr, &hello, NULL) < 0) {
+			log_error(ERROR_NETWORK, "failed to send media channel hello");
+		}
+
+		int ret = media_recv(&context->media, &addr, &header, &serialised);
+
+		if (ret <= 0 || addr.sin_addr.s_addr != context->media_addr.sin_addr.s_addr ||
+		    addr.sin_port != context->media_addr.sin_port) {
+			free(serialised.data);
+
+			continue;
+		}
+
+		uint8_t stream = header.ssrc & MEDIA_SSRC_STREAM_MASK;
+
+		if (stream == MEDIA_STREAM_HELLO) {
+			if (header.ssrc == hello.ssrc && !atomic_load(&context->media_ready)) {
+				atomic_store(&context->media_ready, TRUE);
+
+				log_info("media channel open");
+			}
+
+			continue;
+		}
+
+		pthread_mutex_lock(&context->media_lock);
+
+		uint8_t source = ((uint8_t *)serialised.data)[PACKET_SOURCE_OFFSET];
+
+		// Audio reordering is undone by the jitter buffer, but a late video frame would step back in time.
+		if (stream == MEDIA_STREAM_FEC) {
+			media_parity_handler(context, &header, &serialised);
+		} else if (source < MAX_PARTICIPANTS && stream < MEDIA_NUM_STREAMS &&
+		           (media_recv_stream_update(&context->media_streams[source][stream], &header, &serialised) == 0 ||
+		            stream == MEDIA_STREAM_AUDIO)) {
+			process_media_packet(context, &serialised);
+		}
+
+		pthread_mutex_unlock(&context->media_lock);
+
+		free(serialised.data);
+	}
+
+	return NULL;
+}
+
+/*
+ * Rebuild whatever a parity datagram lets us and handle it as if it had
+ * arrived. Call with the media lock held.
+ */
+static void media_parity_handler(Context *context, const MediaHeader *header, const Serialised *parity) {
+	uint32_t ssrc = media_parity_ssrc(header, parity);
+	uint8_t stream = ssrc & MEDIA_SSRC_STREAM_MASK;
+	MediaHeader headers[FEC_MAX_PARITY];
+	Serialised recovered[FEC_MAX_PARITY];
+
+	if (stream >= MEDIA_NUM_STREAMS) {
+		return;
+	}
+
+	for (size_t i = 0; i < MAX_PARTICIPANTS; i++) {
+		MediaRecvStream *media_stream = &context->media_streams[i][stream];
+
+		if (!media_stream->stats.started || media_stream->stats.ssrc != ssrc) {
+			continue;
+		}
+
+		size_t count = media_recv_stream_parity(media_stream, parity, headers, recovered);
+
+		for (size_t j = 0; j < count; j++) {
+			if (media_stream_recover(&media_stream->stats, &headers[j]) == 0 || stream == MEDIA_STREAM_AUDIO) {
+				process_media_packet(context, &recovered[j]);
+			}
+
+			free(recovered[j].data);
+		}
+
+		return;
+	}
+}
+
+static int active_speaker_handler(Context *context) {
+	Serialised serialised = {0};
+	int ret = recv_packet(context->socket_fd, &serialised, &context->socket_lock);
+
+	if (ret <= 0) {
+		log_error(ERROR_NETWORK, "failed to receive active speaker");
+
+		return -1;
+	}
+
+	ret = unserialise_active_speaker(&serialised, &context->active_speaker);
+
+	free(serialised.data);
+
+	if (ret < 0) {
+		log_error(ERROR_NETWORK, "received malformed active speaker");
+
+		return -1;
+	}
+
+	compositor_set_active_speaker(&context->compositor, context->active_speaker);
+
+	return 0;
+}
+
+/*
+ * Cycle the pinned video through the participants we have heard from, then
+ * back to following the active speaker, and tell the server who we watch.
+ */
+static int pin_next_speaker(Context *context) {
+	uint8_t start = context->pinned_speaker == SPEAKER_NONE ? 0 : context->pinned_speaker + 1;
+
+	context->pinned_speaker = SPEAKER_NONE;
+
+	for (uint8_t i = start; i < MAX_PARTICIPANTS; i++) {
+		if (context->seen_participants & (1 << i)) {
+			context->pinned_speaker = i;
+
+			break;
+		}
+	}
+
+	uint8_t buffer[PACKET_VALUE_SIZE(uint8_t)];
+	Serialised serialised = {.data = buffer};
+
+	serialised.size = serialise_active_speaker_into(context->pinned_speaker, buffer, sizeof buffer);
+
+	return send_packet(context->socket_fd, &serialised, &context->socket_lock) < 0 ? -1 : 0;
+}
+
+/*
+ * Handle the packet the server has started sending. Returns -1 once the
+ * connection is gone.
+ */
+static int socket_handler(Context *context) {
+	PacketType packet_type;
+	int n = recv(context->socket_fd, &packet_type, sizeof packet_type, MSG_PEEK);
+
+	if (n == 0) {
+		if (context->disconnection_method == DisconnectionMethodNone) {
+			context->disconnection_method = DisconnectionMethodServer;
+		}
+
+		return -1;
+	} else if (n < 0) {
+		if (errno == EINTR) {
+			return 0;
+		}
+
+		if (context->disconnection_method == DisconnectionMethodNone) {
+			context->disconnection_method = DisconnectionMethodServerError;
+		}
+
+		log_error(ERROR_NETWORK, "failed to receive packet type");
+
+		return -1;
+	}
+
+	switch (packet_type) {
+		case PacketTypeHeartbeat: {
+			handle_heartbeat(context);
+
+			break;
+		}
+
+		case PacketTypeConfig: {
+			log_info("received config");
+
+			config_handler(context);
+
+			break;
+		}
+
+		case PacketTypeAudioCodec: {
+			audio_codec_handler(context);
+
+			break;
+		}
+
+		case PacketTypeAudioFrame:
+		case PacketTypeComfortNoise:
+		case PacketTypeVideoFrame: {
+			media_packet_handler(context);
+
+			break;
+		}
+
+		case PacketTypeMediaChannel: {
+			media_channel_handler(context);
+
+			break;
+		}
+
+		case PacketTypeFragment: {
+			fragment_handler(context);
+
+			break;
+		}
+
+		case PacketTypeActiveSpeaker: {
+			active_speaker_handler(context);
+
+			break;
+		}
+
+		case PacketTypeChatRecord: {
+			chat_message_handler(context);
+
+			break;
+		}
+
+		case PacketTypeChatSearchResults: {
+			chat_search_results_handler(context);
+
+			break;
+		}
+
+		default:;
+	}
+
+	return 0;
+}
+
+/*
+ * Signals arrive here rather than interrupting whatever is running: a resize
+ * redraws the screen, and anything else stops the client.
+ */
+static int signal_handler(Context *context, int signal_fd) {
+	struct signalfd_siginfo info;
+
+	if (read(signal_fd, &info, sizeof info) != sizeof info) {
+		log_error(ERROR_OS, "failed to read signal");
+
+		return 0;
+	}
+
+	if (info.ssi_signo == SIGWINCH) {
+		if (resize_handler(context) < 0) {
+			log_error(ERROR_TERMINAL, "failed to redraw resized terminal");
+		}
+
+		return 0;
+	}
+
+	if (context->disconnection_method == DisconnectionMethodNone) {
+		context->disconnection_method = DisconnectionMethodClientInterrupted;
+	}
+
+	return -1;
+}
+
+static int frame_timer_handler(Context *context, int timer_fd) {
+	uint64_t expirations = 0;
+
+	if (read(timer_fd, &expirations, sizeof expirations) != sizeof expirations) {
+		log_error(ERROR_OS, "failed to read frame timer");
+
+		return -1;
+	}
+
+	return render_frame(context);
+}
+
 int main() {
 	draw_init();
 
@@ -681,102 +1505,177 @@ int main() {
 
 	Context context = {.socket_fd = socket(AF_INET, SOCK_STREAM, 0),
 	                   .socket_lock = PTHREAD_MUTEX_INITIALIZER,
+	                   .media_lock = PTHREAD_MUTEX_INITIALIZER,
+	                   .audio_codec = AudioCodecPCM,
+	                   .active_speaker = SPEAKER_NONE,
+	                   .pinned_speaker = SPEAKER_NONE,
 	                   .disconnection_method = DisconnectionMethodNone};
 
 	if (context.socket_fd < 0) {
 		log_fatal(ERROR_NETWORK, "failed to construct socket");
 	}
 
-	if (connect(context.socket_fd, (struct sockaddr *)&server_addr, sizeof server_addr) < 0) {
-		log_fatal(ERROR_NETWORK, "failed to connect to server");
+	for (size_t i = 0; i < MAX_PARTICIPANTS; i++) {
+		jitter_init(&context.jitter[i], JITTER_DEFAULT_DELAY_FRAMES);
+	}
+
+	scrollback_init(&context.chat_log);
+
+	if (editor_init(&context.chat_input, 0) < 0) {
+		log_fatal(ERROR_OS, "failed to allocate chat input");
+	}
+
+	// Signals are read from signal_fd in the event loop, so block them before any other thread starts.
+	sigset_t signals;
+
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGWINCH);
+
+	if (pthread_sigmask(SIG_BLOCK, &signals, NULL) != 0) {
+		log_fatal(ERROR_THREAD, "failed to block signals");
 	}
 
-	// FIXME: we need to catch SIGTERM and SIGINT to avoid abort()
-	// but we don't want to do anything with it because it will interrupt send/recv
-	// anyway, which results in clean shutdown anyway.... hmmm....
-	struct sigaction reset_action = {.sa_handler = do_nothing /*(void (*)(int))configure_terminal*/};
+	int signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
 
-	if (sigaction(SIGINT, &reset_action, NULL) < 0) {
-		log_error(ERROR_TERMINAL, "failed to set SIGINT terminal reset signal");
+	if (signal_fd < 0) {
+		log_fatal(ERROR_OS, "failed to open signal descriptor");
 	}
 
-	if (sigaction(SIGTERM, &reset_action, NULL) < 0) {
-		log_error(ERROR_TERMINAL, "failed to set SIGTERM terminal reset signal");
+	// The main thread renders alongside the workers, so leave one core for it.
+	long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (compositor_init(&context.compositor, num_cpus > 1 ? num_cpus - 1 : 0) < 0) {
+		log_fatal(ERROR_THREAD, "failed to start video compositor");
+	}
+
+	context.video_fd = compositor_open_output();
+
+	if (connect(context.socket_fd, (struct sockaddr *)&server_addr, sizeof server_addr) < 0) {
+		log_fatal(ERROR_NETWORK, "failed to connect to server");
 	}
 
-	struct sigaction resize_action = {.sa_flags = SA_RESTART, .sa_handler = resize_terminal_handler};
+	// The media channel talks to the address we actually reached.
+	socklen_t server_addr_len = sizeof context.server_addr;
 
-	if (sigaction(SIGWINCH, &resize_action, NULL) < 0) {
-		log_error(ERROR_TERMINAL, "failed to set SIGWINCH terminal resize signal");
+	if (getpeername(context.socket_fd, (struct sockaddr *)&context.server_addr, &server_addr_len) < 0) {
+		context.server_addr = server_addr;
+	}
+
+	if (send_audio_codecs(&context) < 0) {
+		log_error(ERROR_NETWORK, "failed to negotiate audio codec");
 	}
 
 	if (setup_terminal() < 0) {
 		log_fatal(ERROR_TERMINAL, "failed to setup terminal");
 	}
 
-	pthread_t keyboard_thread;
-
-	if (pthread_create(&keyboard_thread, NULL, keyboard_handler, &context) != 0) {
-		log_fatal(ERROR_THREAD, "failed to start keyboard listening thread");
+	if (update_window_size(&context) < 0) {
+		log_fatal(ERROR_TERMINAL, "failed to get terminal size");
 	}
 
-	if (pthread_detach(keyboard_thread) != 0) {
-		log_fatal(ERROR_THREAD, "failed to detach client handling thread");
+	renderer_init(&context.renderer);
+
+	int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	struct itimerspec frame_interval = {.it_interval.tv_nsec = 1000000000 / context.renderer.fps,
+	                                    .it_value.tv_nsec = 1000000000 / context.renderer.fps};
+
+	if (timer_fd < 0 || timerfd_settime(timer_fd, 0, &frame_interval, NULL) < 0) {
+		log_fatal(ERROR_OS, "failed to start frame timer");
 	}
 
-	while (TRUE) {
-		PacketType packet_type;
-		int n = 0;
+	struct pollfd events[EventSourceCount] = {
+	    [EventSourceKeyboard] = {.fd = STDIN_FILENO, .events = POLLIN},
+	    [EventSourceSocket] = {.fd = context.socket_fd, .events = POLLIN},
+	    [EventSourceSignal] = {.fd = signal_fd, .events = POLLIN},
+	    [EventSourceFrameTimer] = {.fd = timer_fd, .events = POLLIN},
+	};
 
-		if ((n = recv(context.socket_fd, &packet_type, sizeof packet_type, MSG_PEEK)) == 0) {
-			if (context.disconnection_method == DisconnectionMethodNone) {
-				context.disconnection_method = DisconnectionMethodServer;
+	while (TRUE) {
+		if (poll(events, EventSourceCount, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
 			}
 
-			break;
-		} else if (n < 0) {
-			if (errno == EINTR) {
-				if (context.disconnection_method == DisconnectionMethodNone) {
-					context.disconnection_method = DisconnectionMethodClientInterrupted;
-				}
-			} else {
-				if (context.disconnection_method == DisconnectionMethodNone) {
-					context.disconnection_method = DisconnectionMethodServerError;
-				}
+			log_error(ERROR_OS, "failed to wait for events");
 
-				// If EINTR received something like SIGINT was received.
-				if (errno != EINTR) {
-					log_error(ERROR_NETWORK, "failed to receive packet type");
-				}
+			if (context.disconnection_method == DisconnectionMethodNone) {
+				context.disconnection_method = DisconnectionMethodClientError;
 			}
 
 			break;
 		}
 
-		switch (packet_type) {
-			case PacketTypeHeartbeat: {
-				handle_heartbeat(&context);
+		if (events[EventSourceSignal].revents != 0 && signal_handler(&context, signal_fd) < 0) {
+			break;
+		}
 
-				break;
-			}
+		if (events[EventSourceSocket].revents != 0 && socket_handler(&context) < 0) {
+			break;
+		}
 
-			case PacketTypeConfig: {
-				log_info("received config");
+		if (events[EventSourceKeyboard].revents != 0 && keyboard_handler(&context) < 0) {
+			break;
+		}
 
-				config_handler(&context);
+		if (events[EventSourceFrameTimer].revents != 0) {
+			frame_timer_handler(&context, timer_fd);
+		}
+	}
 
-				break;
-			}
+	// The media thread feeds the compositor and jitter buffers, and sends on the socket, so it stops first.
+	if (context.media_running) {
+		context.media_running = FALSE;
 
-			default:;
+		if (pthread_join(context.media_thread, NULL) != 0) {
+			log_error(ERROR_THREAD, "failed to join media thread");
 		}
+
+		media_socket_close(&context.media);
 	}
 
 	if (close(context.socket_fd) < 0) {
 		log_error(ERROR_NETWORK, "failed to disconnect from server");
 	}
 
+	if (close(signal_fd) < 0 || close(timer_fd) < 0) {
+		log_error(ERROR_OS, "failed to close event descriptors");
+	}
+
 	free(context.config);
+	editor_free(&context.chat_input);
+	scrollback_free(&context.chat_log);
+
+	log_infof("video frames rendered: %" PRIu64 ", dropped at terminal: %" PRIu64,
+	          compositor_stats(&context.compositor).frames_rendered,
+	          compositor_stats(&context.compositor).frames_dropped);
+
+	renderer_report(&context.renderer);
+	compositor_destroy(&context.compositor);
+
+	reassembly_free(&context.reassembly);
+
+	MediaStreamStats media_totals = {0};
+
+	for (size_t i = 0; i < MAX_PARTICIPANTS; i++) {
+		for (size_t j = 0; j < MEDIA_NUM_STREAMS; j++) {
+			media_totals.received += context.media_streams[i][j].stats.received;
+			media_totals.recovered += context.media_streams[i][j].stats.recovered;
+			media_totals.lost += context.media_streams[i][j].stats.lost;
+
+			media_recv_stream_free(&context.media_streams[i][j]);
+		}
+	}
+
+	log_infof("media datagrams received: %" PRIu64 ", recovered by FEC: %" PRIu64 ", lost: %" PRIu64,
+	          media_totals.received,
+	          media_totals.recovered,
+	          media_totals.lost);
+
+	if (context.video_fd != STDOUT_FILENO && close(context.video_fd) < 0) {
+		log_error(ERROR_TERMINAL, "failed to close video output");
+	}
 
 	if (reset_terminal() < 0) {
 		log_error(ERROR_TERMINAL, "failed to reset terminal");
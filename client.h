@@ -8,7 +8,6 @@
 /*
  * Keyboard input codes.
  */
-#define INPUT_NULL 0
 #define INPUT_ESCAPE 27
 #define INPUT_UP 4283163
 #define INPUT_DOWN 4348699
@@ -25,6 +24,15 @@
 #define INPUT_BACKSPACE 127
 #define INPUT_CTRL_D 4
 #define INPUT_DELETE 2117294875
+#define INPUT_PAGE_UP 2117425947
+#define INPUT_PAGE_DOWN 2117491483
+
+/*
+ * Bytes read from the terminal at once, and the longest escape sequence
+ * waited for when one is cut short.
+ */
+#define INPUT_BUFFER_SIZE 4096
+#define INPUT_MAX_KEY_SIZE 16
 
 /*
  * Global constants.
@@ -44,7 +52,10 @@
 #define ROOM_LIST_INDEX_ENTER_USERNAME -1
 #define ROOM_LIST_INDEX_CREATE_ROOM -2
 #define CHAT_BOX_WIDTH 20
+#define CHAT_LOG_FIRST_ROW 11
 #define CHAT_COL_START strlen(CHAT_PROMPT) + 2
+#define CHAT_SEARCH_COMMAND "/search "
+#define CHAT_SEARCH_RESULTS 10
 
 const char *PARTICIPANTS_TITLE = "Participants";
 const char *CHAT_PROMPT = "Chat:";
@@ -0,0 +1,694 @@
+#include "compositor.h"
+
+#include "speaker.h"
+#include "video.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#define UPPER_HALF_BLOCK "▀"
+
+/*
+ * Worst case bytes for one cell: truecolour foreground and background escapes
+ * plus the UTF-8 glyph.
+ */
+#define CELL_MAX_BYTES 41
+#define ROW_MAX_OVERHEAD 16
+
+static const char *ANSI_CMD_SAVE_CURSOR = "\0337";
+static const char *ANSI_CMD_RESTORE_CURSOR = "\0338";
+static const char *ANSI_CMD_RESET_ATTRIBUTES = "\033[0m";
+
+static int output_backlogged(int fd);
+static void *worker_handler(void *arg);
+static void process_jobs(Compositor *compositor);
+static void run_jobs(Compositor *compositor, unsigned int num_jobs);
+static void layout_tiles(Compositor *compositor);
+static void render_tile(Compositor *compositor, Tile *tile);
+static void scale_tile(Compositor *compositor, Tile *tile);
+static void encode_tile(Compositor *compositor, Tile *tile);
+static char *append_uint(char *pos, unsigned int value);
+static char *append_cursor(char *pos, int row, int col);
+static char *append_colour(char *pos, int background, const uint8_t *rgb);
+static int write_pending(Compositor *compositor, int fd);
+
+int compositor_init(Compositor *compositor, unsigned int num_workers) {
+	memset(compositor, 0, sizeof *compositor);
+
+	compositor->active_speaker = SPEAKER_NONE;
+	compositor->pool.num_workers = num_workers > COMPOSITOR_MAX_WORKERS ? COMPOSITOR_MAX_WORKERS : num_workers;
+
+	if (pthread_mutex_init(&compositor->lock, NULL) != 0 || pthread_mutex_init(&compositor->pool.lock, NULL) != 0 ||
+	    pthread_cond_init(&compositor->pool.work_ready, NULL) != 0 ||
+	    pthread_cond_init(&compositor->pool.work_done, NULL) != 0) {
+		log_error(ERROR_THREAD, "failed to initialise compositor locks");
+
+		return -1;
+	}
+
+	for (unsigned int i = 0; i < compositor->pool.num_workers; i++) {
+		if (pthread_create(&compositor->pool.threads[i], NULL, worker_handler, compositor) != 0) {
+			log_error(ERROR_THREAD, "failed to start compositor worker thread");
+
+			compositor->pool.num_workers = i;
+
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+void compositor_destroy(Compositor *compositor) {
+	pthread_mutex_lock(&compositor->pool.lock);
+	compositor->pool.stop = TRUE;
+	pthread_cond_broadcast(&compositor->pool.work_ready);
+	pthread_mutex_unlock(&compositor->pool.lock);
+
+	for (unsigned int i = 0; i < compositor->pool.num_workers; i++) {
+		if (pthread_join(compositor->pool.threads[i], NULL) != 0) {
+			log_error(ERROR_THREAD, "failed to join compositor worker thread");
+		}
+	}
+
+	for (size_t i = 0; i < MAX_PARTICIPANTS; i++) {
+		Tile *tile = &compositor->tiles[i];
+
+		if (compositor->frames[i] != NULL) {
+			free(compositor->frames[i]->data);
+			free(compositor->frames[i]);
+		}
+
+		if (tile->frame != NULL) {
+			free(tile->frame->data);
+			free(tile->frame);
+		}
+
+		free(tile->rgb);
+		free(tile->out);
+	}
+
+	free(compositor->cells);
+	free(compositor->out);
+
+	pthread_mutex_destroy(&compositor->lock);
+	pthread_mutex_destroy(&compositor->pool.lock);
+	pthread_cond_destroy(&compositor->pool.work_ready);
+	pthread_cond_destroy(&compositor->pool.work_done);
+}
+
+/*
+ * Set the screen area (0-based cells) available for video. Takes effect on
+ * the next render.
+ */
+void compositor_set_area(Compositor *compositor, int x, int y, int cols, int rows) {
+	pthread_mutex_lock(&compositor->lock);
+
+	compositor->area_x = x;
+	compositor->area_y = y;
+	compositor->area_cols = cols > 0 ? cols : 0;
+	compositor->area_rows = rows > 0 ? rows : 0;
+	compositor->layout_dirty = TRUE;
+
+	pthread_mutex_unlock(&compositor->lock);
+}
+
+/*
+ * The active speaker's tile is placed first in the grid.
+ */
+void compositor_set_active_speaker(Compositor *compositor, uint8_t participant) {
+	pthread_mutex_lock(&compositor->lock);
+
+	if (compositor->active_speaker != participant) {
+		compositor->active_speaker = participant;
+		compositor->layout_dirty = TRUE;
+	}
+
+	pthread_mutex_unlock(&compositor->lock);
+}
+
+/*
+ * Queue a frame for display, taking ownership of it. Only the newest frame
+ * per participant is kept; older undisplayed frames are dropped.
+ */
+void compositor_push_frame(Compositor *compositor, VideoFrame *frame) {
+	if (frame->source >= MAX_PARTICIPANTS) {
+		free(frame->data);
+		free(frame);
+
+		return;
+	}
+
+	pthread_mutex_lock(&compositor->lock);
+
+	VideoFrame *old = compositor->frames[frame->source];
+
+	if (!(compositor->seen & (1 << frame->source))) {
+		compositor->seen |= 1 << frame->source;
+		compositor->layout_dirty = TRUE;
+	}
+
+	compositor->frames[frame->source] = frame;
+
+	// The previous frame was never shown because the terminal was backlogged.
+	if (old != NULL) {
+		compositor->stats.frames_dropped++;
+	}
+
+	pthread_mutex_unlock(&compositor->lock);
+
+	if (old != NULL) {
+		free(old->data);
+		free(old);
+	}
+}
+
+/*
+ * Open a non-blocking descriptor for the terminal on stdout. It is a separate
+ * open of the tty, so stdin and stdout keep blocking. Falls back to stdout
+ * itself when that is not a terminal.
+ */
+int compositor_open_output(void) {
+	const char *tty = ttyname(STDOUT_FILENO);
+	int fd = tty != NULL ? open(tty, O_WRONLY | O_NONBLOCK | O_NOCTTY | O_CLOEXEC) : -1;
+
+	if (fd < 0) {
+		log_error(ERROR_TERMINAL, "failed to open non-blocking terminal output, video may stall");
+
+		return STDOUT_FILENO;
+	}
+
+	return fd;
+}
+
+/*
+ * Decode and convert every tile with a new frame in parallel, then write the
+ * result to fd, which should be non-blocking. Returns the number of tiles
+ * drawn.
+ *
+ * While the terminal is still working through earlier output nothing new is
+ * drawn; pending frames stay queued, to be replaced by newer ones.
+ */
+int compositor_render(Compositor *compositor, int fd) {
+	int clear = FALSE;
+	unsigned int num_jobs = 0;
+
+	if (write_pending(compositor, fd) < 0) {
+		return -1;
+	}
+
+	if (compositor->out_sent < compositor->out_size || output_backlogged(fd)) {
+		pthread_mutex_lock(&compositor->lock);
+		compositor->stats.renders_skipped++;
+		pthread_mutex_unlock(&compositor->lock);
+
+		return 0;
+	}
+
+	pthread_mutex_lock(&compositor->lock);
+
+	if (compositor->layout_dirty) {
+		layout_tiles(compositor);
+
+		compositor->layout_dirty = FALSE;
+		clear = TRUE;
+	}
+
+	for (unsigned int i = 0; i < compositor->num_tiles; i++) {
+		Tile *tile = &compositor->tiles[i];
+		VideoFrame *frame = compositor->frames[tile->participant];
+
+		if (frame != NULL) {
+			if (tile->frame != NULL) {
+				free(tile->frame->data);
+				free(tile->frame);
+			}
+
+			tile->frame = frame;
+			tile->dirty = TRUE;
+			compositor->frames[tile->participant] = NULL;
+		}
+
+		if (tile->dirty && tile->frame != NULL) {
+			compositor->jobs[num_jobs++] = tile;
+		}
+	}
+
+	pthread_mutex_unlock(&compositor->lock);
+
+	if (num_jobs == 0 && !clear) {
+		return 0;
+	}
+
+	run_jobs(compositor, num_jobs);
+
+	size_t size = strlen(ANSI_CMD_SAVE_CURSOR) + strlen(ANSI_CMD_RESET_ATTRIBUTES) + strlen(ANSI_CMD_RESTORE_CURSOR) + 1;
+
+	if (clear) {
+		size += (size_t)compositor->rows * (compositor->cols + ROW_MAX_OVERHEAD);
+	}
+
+	for (unsigned int i = 0; i < num_jobs; i++) {
+		size += compositor->jobs[i]->out_size;
+	}
+
+	if (size > compositor->out_cap) {
+		compositor->out = realloc(compositor->out, size);
+		compositor->out_cap = size;
+	}
+
+	char *pos = stpcpy(compositor->out, ANSI_CMD_SAVE_CURSOR);
+	pos = stpcpy(pos, ANSI_CMD_RESET_ATTRIBUTES);
+
+	if (clear) {
+		for (int row = 0; row < compositor->rows; row++) {
+			pos = append_cursor(pos, compositor->y + row, compositor->x);
+			memset(pos, ' ', compositor->cols);
+			pos += compositor->cols;
+		}
+	}
+
+	for (unsigned int i = 0; i < num_jobs; i++) {
+		// A frame that failed to decode leaves its tile with no output.
+		if (compositor->jobs[i]->out_size > 0) {
+			pos = mempcpy(pos, compositor->jobs[i]->out, compositor->jobs[i]->out_size);
+		}
+
+		compositor->jobs[i]->dirty = FALSE;
+	}
+
+	pos = stpcpy(pos, ANSI_CMD_RESTORE_CURSOR);
+
+	compositor->out_sent = 0;
+	compositor->out_size = pos - compositor->out;
+
+	int ret = write_pending(compositor, fd);
+
+	pthread_mutex_lock(&compositor->lock);
+	compositor->stats.frames_rendered += num_jobs;
+	pthread_mutex_unlock(&compositor->lock);
+
+	return ret < 0 ? -1 : (int)num_jobs;
+}
+
+CompositorStats compositor_stats(Compositor *compositor) {
+	pthread_mutex_lock(&compositor->lock);
+
+	CompositorStats stats = compositor->stats;
+
+	pthread_mutex_unlock(&compositor->lock);
+
+	return stats;
+}
+
+/*
+ * Check whether the terminal is still working through earlier output, so a
+ * new frame is only drawn once the previous one has mostly gone out.
+ */
+static int output_backlogged(int fd) {
+	struct pollfd pfd = {.fd = fd, .events = POLLOUT};
+	int queued = 0;
+
+	if (poll(&pfd, 1, 0) < 1 || !(pfd.revents & POLLOUT)) {
+		return TRUE;
+	}
+
+	// Not every output (pipes, files) supports TIOCOUTQ, only rely on it if it does.
+	if (ioctl(fd, TIOCOUTQ, &queued) == 0 && queued > COMPOSITOR_MAX_BACKLOG_BYTES) {
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+static void *worker_handler(void *arg) {
+	Compositor *compositor = (Compositor *)arg;
+	WorkerPool *pool = &compositor->pool;
+	unsigned int generation = 0;
+
+	while (TRUE) {
+		pthread_mutex_lock(&pool->lock);
+
+		while (!pool->stop && pool->generation == generation) {
+			pthread_cond_wait(&pool->work_ready, &pool->lock);
+		}
+
+		if (pool->stop) {
+			pthread_mutex_unlock(&pool->lock);
+
+			break;
+		}
+
+		generation = pool->generation;
+
+		pthread_mutex_unlock(&pool->lock);
+
+		process_jobs(compositor);
+	}
+
+	return NULL;
+}
+
+static void process_jobs(Compositor *compositor) {
+	WorkerPool *pool = &compositor->pool;
+
+	while (TRUE) {
+		pthread_mutex_lock(&pool->lock);
+
+		if (pool->next_job >= pool->num_jobs) {
+			pthread_mutex_unlock(&pool->lock);
+
+			break;
+		}
+
+		Tile *tile = compositor->jobs[pool->next_job++];
+
+		pthread_mutex_unlock(&pool->lock);
+
+		render_tile(compositor, tile);
+
+		pthread_mutex_lock(&pool->lock);
+
+		if (++pool->jobs_done == pool->num_jobs) {
+			pthread_cond_signal(&pool->work_done);
+		}
+
+		pthread_mutex_unlock(&pool->lock);
+	}
+}
+
+/*
+ * Hand the jobs to the pool, work on them from this thread too and wait for
+ * them all to finish.
+ */
+static void run_jobs(Compositor *compositor, unsigned int num_jobs) {
+	WorkerPool *pool = &compositor->pool;
+
+	if (num_jobs == 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+
+	pool->num_jobs = num_jobs;
+	pool->next_job = 0;
+	pool->jobs_done = 0;
+	pool->generation++;
+
+	pthread_cond_broadcast(&pool->work_ready);
+	pthread_mutex_unlock(&pool->lock);
+
+	process_jobs(compositor);
+
+	pthread_mutex_lock(&pool->lock);
+
+	while (pool->jobs_done < pool->num_jobs) {
+		pthread_cond_wait(&pool->work_done, &pool->lock);
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Arrange every participant we have video from in a grid, choosing the number
+ * of columns that gives the largest 4:3 picture. Call with the lock held.
+ */
+static void layout_tiles(Compositor *compositor) {
+	uint8_t order[MAX_PARTICIPANTS];
+	unsigned int count = 0;
+
+	compositor->x = compositor->area_x;
+	compositor->y = compositor->area_y;
+	compositor->cols = compositor->area_cols;
+	compositor->rows = compositor->area_rows;
+	compositor->cells = realloc(compositor->cells, (size_t)compositor->cols * compositor->rows * sizeof(Cell) + 1);
+
+	if (compositor->active_speaker < MAX_PARTICIPANTS && (compositor->seen & (1 << compositor->active_speaker))) {
+		order[count++] = compositor->active_speaker;
+	}
+
+	for (uint8_t i = 0; i < MAX_PARTICIPANTS; i++) {
+		if ((compositor->seen & (1 << i)) && i != compositor->active_speaker) {
+			order[count++] = i;
+		}
+	}
+
+	unsigned int grid_cols = 1;
+	long best_area = -1;
+
+	for (unsigned int candidate = 1; candidate <= count; candidate++) {
+		unsigned int candidate_rows = (count + candidate - 1) / candidate;
+		long width = (compositor->cols - (long)(candidate - 1)) / candidate;
+		long height = 2 * ((compositor->rows - (long)(candidate_rows - 1)) / candidate_rows);
+
+		if (width * 3 > height * 4) {
+			width = height * 4 / 3;
+		} else {
+			height = width * 3 / 4;
+		}
+
+		if (width * height > best_area) {
+			best_area = width * height;
+			grid_cols = candidate;
+		}
+	}
+
+	unsigned int grid_rows = count > 0 ? (count + grid_cols - 1) / grid_cols : 1;
+	int tile_cols = (compositor->cols - (int)(grid_cols - 1)) / (int)grid_cols;
+	int tile_rows = (compositor->rows - (int)(grid_rows - 1)) / (int)grid_rows;
+
+	// Keep each participant's last frame across the relayout so nothing goes blank.
+	VideoFrame *kept[MAX_PARTICIPANTS] = {0};
+
+	for (unsigned int i = 0; i < MAX_PARTICIPANTS; i++) {
+		Tile *tile = &compositor->tiles[i];
+
+		if (tile->frame != NULL) {
+			kept[tile->participant] = tile->frame;
+			tile->frame = NULL;
+		}
+	}
+
+	compositor->num_tiles = tile_cols > 0 && tile_rows > 0 ? count : 0;
+
+	for (unsigned int i = 0; i < compositor->num_tiles; i++) {
+		Tile *tile = &compositor->tiles[i];
+
+		tile->participant = order[i];
+		tile->x = compositor->x + (i % grid_cols) * (tile_cols + 1);
+		tile->y = compositor->y + (i / grid_cols) * (tile_rows + 1);
+		tile->cols = tile_cols;
+		tile->rows = tile_rows;
+		tile->frame = kept[order[i]];
+		tile->dirty = TRUE;
+
+		kept[order[i]] = NULL;
+	}
+
+	for (unsigned int i = 0; i < MAX_PARTICIPANTS; i++) {
+		if (kept[i] != NULL) {
+			free(kept[i]->data);
+			free(kept[i]);
+		}
+	}
+}
+
+static void render_tile(Compositor *compositor, Tile *tile) {
+	size_t num_pixels = (size_t)tile->frame->width * tile->frame->height;
+
+	tile->out_size = 0;
+
+	if (num_pixels * 3 > tile->rgb_cap) {
+		tile->rgb = realloc(tile->rgb, num_pixels * 3);
+		tile->rgb_cap = num_pixels * 3;
+	}
+
+	if (num_pixels == 0 || video_decode(tile->frame->data, tile->frame->size, tile->rgb, num_pixels) < 0) {
+		log_error(ERROR_NETWORK, "failed to decode video frame");
+
+		return;
+	}
+
+	scale_tile(compositor, tile);
+	encode_tile(compositor, tile);
+}
+
+/*
+ * Nearest-neighbour scale the decoded frame into the tile's cells, keeping
+ * its aspect ratio and letterboxing the rest in black.
+ */
+static void scale_tile(Compositor *compositor, Tile *tile) {
+	static const uint8_t black[3] = {0};
+	int width = tile->frame->width;
+	int height = tile->frame->height;
+	int pixel_cols = tile->cols;
+	int pixel_rows = tile->rows * 2;
+	int fit_cols = pixel_cols;
+	int fit_rows = pixel_rows;
+
+	if ((long)width * pixel_rows > (long)height * pixel_cols) {
+		fit_rows = (long)height * pixel_cols / width;
+	} else {
+		fit_cols = (long)width * pixel_rows / height;
+	}
+
+	int offset_x = (pixel_cols - fit_cols) / 2;
+	int offset_y = (pixel_rows - fit_rows) / 2;
+	int source_x[pixel_cols];
+
+	for (int x = 0; x < pixel_cols; x++) {
+		int fitted = x - offset_x;
+
+		source_x[x] = fitted >= 0 && fitted < fit_cols ? (long)fitted * width / fit_cols : -1;
+	}
+
+	for (int row = 0; row < tile->rows; row++) {
+		Cell *cells = compositor->cells + (size_t)(tile->y - compositor->y + row) * compositor->cols +
+		              (tile->x - compositor->x);
+
+		for (int half = 0; half < 2; half++) {
+			int fitted = row * 2 + half - offset_y;
+			const uint8_t *line = NULL;
+
+			if (fitted >= 0 && fitted < fit_rows) {
+				line = tile->rgb + (size_t)((long)fitted * height / fit_rows) * width * 3;
+			}
+
+			for (int x = 0; x < pixel_cols; x++) {
+				const uint8_t *pixel = line != NULL && source_x[x] >= 0 ? line + source_x[x] * 3 : black;
+
+				memcpy(half == 0 ? cells[x].top : cells[x].bottom, pixel, 3);
+			}
+		}
+	}
+}
+
+/*
+ * Turn the tile's cells into escape sequences, only emitting colours when
+ * they change from the previous cell.
+ */
+static void encode_tile(Compositor *compositor, Tile *tile) {
+	size_t cap = (size_t)tile->rows * ((size_t)tile->cols * CELL_MAX_BYTES + ROW_MAX_OVERHEAD) + ROW_MAX_OVERHEAD;
+
+	if (cap > tile->out_cap) {
+		tile->out = realloc(tile->out, cap);
+		tile->out_cap = cap;
+	}
+
+	char *pos = tile->out;
+
+	for (int row = 0; row < tile->rows; row++) {
+		const Cell *cells = compositor->cells + (size_t)(tile->y - compositor->y + row) * compositor->cols +
+		                    (tile->x - compositor->x);
+		const Cell *previous = NULL;
+
+		pos = append_cursor(pos, tile->y + row, tile->x);
+
+		for (int col = 0; col < tile->cols; col++) {
+			if (previous == NULL || memcmp(previous->top, cells[col].top, 3) != 0) {
+				pos = append_colour(pos, FALSE, cells[col].top);
+			}
+
+			if (previous == NULL || memcmp(previous->bottom, cells[col].bottom, 3) != 0) {
+				pos = append_colour(pos, TRUE, cells[col].bottom);
+			}
+
+			pos = stpcpy(pos, UPPER_HALF_BLOCK);
+			previous = &cells[col];
+		}
+	}
+
+	pos = stpcpy(pos, ANSI_CMD_RESET_ATTRIBUTES);
+
+	tile->out_size = pos - tile->out;
+}
+
+static char *append_uint(char *pos, unsigned int value) {
+	char digits[10];
+	int n = 0;
+
+	do {
+		digits[n++] = '0' + value % 10;
+		value /= 10;
+	} while (value > 0);
+
+	while (n > 0) {
+		*pos++ = digits[--n];
+	}
+
+	return pos;
+}
+
+/*
+ * Move the cursor to a 0-based row and column.
+ */
+static char *append_cursor(char *pos, int row, int col) {
+	pos = stpcpy(pos, "\033[");
+	pos = append_uint(pos, row + 1);
+	*pos++ = ';';
+	pos = append_uint(pos, col + 1);
+	*pos++ = 'H';
+
+	return pos;
+}
+
+static char *append_colour(char *pos, int background, const uint8_t *rgb) {
+	pos = stpcpy(pos, background ? "\033[48;2;" : "\033[38;2;");
+	pos = append_uint(pos, rgb[0]);
+	*pos++ = ';';
+	pos = append_uint(pos, rgb[1]);
+	*pos++ = ';';
+	pos = append_uint(pos, rgb[2]);
+	*pos++ = 'm';
+
+	return pos;
+}
+
+/*
+ * Write as much of the composed output as the terminal will take without
+ * blocking, the rest is retried on the next render. Every row starts with an
+ * absolute cursor move and full colours, so if other output gets in between
+ * the next frame repairs the picture.
+ */
+static int write_pending(Compositor *compositor, int fd) {
+	int ret = 0;
+
+	if (compositor->out_sent == compositor->out_size) {
+		return 0;
+	}
+
+	// Keep stdio users from interleaving with the frame.
+	flockfile(stdout);
+	fflush(stdout);
+
+	while (compositor->out_sent < compositor->out_size) {
+		ssize_t n = write(fd, compositor->out + compositor->out_sent, compositor->out_size - compositor->out_sent);
+
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				log_error(ERROR_TERMINAL, "failed to write video frame to terminal");
+
+				compositor->out_sent = compositor->out_size;
+				ret = -1;
+			}
+
+			break;
+		}
+
+		compositor->out_sent += n;
+	}
+
+	funlockfile(stdout);
+
+	return ret;
+}
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "packets.h"
+#include "utils.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define COMPOSITOR_MAX_WORKERS 4
+
+/*
+ * Skip rendering while the terminal still has more than this many bytes of
+ * earlier output queued, so a slow terminal or link never blocks the caller.
+ */
+#define COMPOSITOR_MAX_BACKLOG_BYTES 16384
+
+/*
+ * Each terminal cell shows two vertically stacked pixels as an upper half
+ * block, the top pixel in the foreground colour and the bottom in the background.
+ */
+typedef struct {
+	uint8_t top[3];
+	uint8_t bottom[3];
+} Cell;
+
+typedef struct {
+	uint8_t participant;
+	int x;
+	int y;
+	int cols;
+	int rows;
+	int dirty;
+	VideoFrame *frame;
+	uint8_t *rgb;
+	size_t rgb_cap;
+	char *out;
+	size_t out_size;
+	size_t out_cap;
+} Tile;
+
+typedef struct {
+	pthread_t threads[COMPOSITOR_MAX_WORKERS];
+	unsigned int num_workers;
+	pthread_mutex_t lock;
+	pthread_cond_t work_ready;
+	pthread_cond_t work_done;
+	unsigned int generation;
+	unsigned int next_job;
+	unsigned int num_jobs;
+	unsigned int jobs_done;
+	int stop;
+} WorkerPool;
+
+typedef struct {
+	uint64_t frames_rendered;
+	uint64_t frames_dropped;
+	uint64_t renders_skipped;
+} CompositorStats;
+
+/*
+ * Grid of video tiles drawn into the area left of the chat pane. Tiles are
+ * decoded and converted to cells in parallel, then written in one go.
+ */
+typedef struct {
+	pthread_mutex_t lock;
+	WorkerPool pool;
+	int area_x;
+	int area_y;
+	int area_cols;
+	int area_rows;
+	int x;
+	int y;
+	int cols;
+	int rows;
+	int layout_dirty;
+	uint8_t active_speaker;
+	uint8_t seen;
+	Cell *cells;
+	VideoFrame *frames[MAX_PARTICIPANTS];
+	Tile tiles[MAX_PARTICIPANTS];
+	unsigned int num_tiles;
+	Tile *jobs[MAX_PARTICIPANTS];
+	char *out;
+	size_t out_cap;
+	size_t out_sent;
+	size_t out_size;
+	CompositorStats stats;
+} Compositor;
+
+int compositor_init(Compositor *compositor, unsigned int num_workers);
+void compositor_destroy(Compositor *compositor);
+void compositor_set_area(Compositor *compositor, int x, int y, int cols, int rows);
+void compositor_set_active_speaker(Compositor *compositor, uint8_t participant);
+void compositor_push_frame(Compositor *compositor, VideoFrame *frame);
+int compositor_open_output(void);
+int compositor_render(Compositor *compositor, int fd);
+CompositorStats compositor_stats(Compositor *compositor);
@@ -0,0 +1,108 @@
+#include "config.h"
+
+#include "chat.h"
+#include "chatlog.h"
+#include "utils.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+/*
+ * Read a configuration file: global settings, then the rooms under a [rooms]
+ * section, one "name = description" per line. Paths that are not absolute are
+ * relative to home_dir.
+ */
+Config *config_parse(FILE *config_file, const char *home_dir) {
+	Config *config = calloc(1, sizeof *config);
+
+	if (config == NULL) {
+		return NULL;
+	}
+
+	config->chat_history = CHAT_HISTORY_DEFAULT_BYTES;
+	config->chat_log = join_path(home_dir, CHAT_LOG_DEFAULT_PATH, NULL);
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t n = 0;
+	ConfigSection section = ConfigSectionGlobal;
+
+	while ((n = getline(&line, &cap, config_file)) > 0) {
+		char *stripped = strip_whitespace(line);
+
+		if (stripped[0] == CONFIG_COMMENT || strlen(stripped) == 0) {
+			freep(stripped);
+
+			continue;
+		}
+
+		if (stripped[0] == CONFIG_SECTION_START && stripped[strlen(stripped) - 1] == CONFIG_SECTION_END) {
+			if (strncasecmp(stripped + 1, "rooms", strlen(stripped) - 2) == 0) {
+				section = ConfigSectionRooms;
+			}
+		} else {
+			char *key = stripped;
+			char *value = NULL;
+
+			for (size_t i = 0; i < strlen(stripped); i++) {
+				if (stripped[i] == '=') {
+					stripped[i] = '\0';
+					value = &stripped[i + 1];
+
+					if (section == ConfigSectionRooms) {
+						config->rooms = realloc(config->rooms, sizeof *config->rooms * (config->num_rooms + 1));
+						config->rooms[config->num_rooms].name = strip_whitespace(key);
+						config->rooms[config->num_rooms].desc = strip_whitespace(value);
+						config->num_rooms++;
+					} else {
+						char *name = strip_whitespace(key);
+
+						if (strcasecmp(name, "chat_history") == 0) {
+							config->chat_history = strtoul(value, NULL, 10);
+						} else if (strcasecmp(name, "chat_log") == 0) {
+							// An empty path turns the log off.
+							free(config->chat_log);
+							config->chat_log = strip_whitespace(value);
+
+							if (strlen(config->chat_log) == 0) {
+								freep(config->chat_log);
+							} else if (config->chat_log[0] != PATH_SEPARATOR) {
+								char *path = join_path(home_dir, config->chat_log, NULL);
+
+								free(config->chat_log);
+								config->chat_log = path;
+							}
+						} else if (strcasecmp(name, "pin_rooms") == 0) {
+							config->pin_rooms = strtoul(value, NULL, 10) != 0;
+						}
+
+						freep(name);
+					}
+
+					break;
+				}
+			}
+		}
+
+		freep(stripped);
+	}
+
+	freep(line);
+
+	return config;
+}
+
+void config_free(Config *config) {
+	if (config == NULL) {
+		return;
+	}
+
+	for (size_t i = 0; i < config->num_rooms; i++) {
+		free(config->rooms[i].name);
+		free(config->rooms[i].desc);
+	}
+
+	free(config->rooms);
+	free(config->chat_log);
+	free(config);
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include "packets.h"
+
+#include <stdio.h>
+
+#define CONFIG_COMMENT '#'
+#define CONFIG_SECTION_START '['
+#define CONFIG_SECTION_END ']'
+
+Config *config_parse(FILE *config_file, const char *home_dir);
+void config_free(Config *config);
@@ -0,0 +1,199 @@
+#include "congestion.h"
+
+#include "utils.h"
+
+#include <stdio.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/sockios.h>
+#include <linux/tcp.h>
+#include <netinet/in.h>
+#endif
+
+static uint64_t now_ms(void);
+static void sample_socket(CongestionState *state, int socket_fd, uint64_t *delivery_rate);
+
+const char *congestion_level_to_string(const CongestionLevel level) {
+	switch (level) {
+		case CongestionLevelNone:
+			return "none";
+
+		case CongestionLevelVideoReduced:
+			return "video reduced";
+
+		case CongestionLevelVideoMinimal:
+			return "video minimal";
+
+		case CongestionLevelVideoOff:
+			return "video off";
+
+		case CongestionLevelAudioReduced:
+			return "audio reduced";
+
+		case CongestionLevelAudioSpeakerOnly:
+			return "active speaker audio only";
+
+		default:
+			return "unknown";
+	}
+}
+
+/*
+ * Count media bytes handed to the receiver, over either path.
+ */
+void congestion_on_send(CongestionState *state, size_t size) {
+	state->window_bytes += size;
+}
+
+/*
+ * Whether a packet of size bytes, behind pending bytes queued ahead of the
+ * socket, would push the receiver's TCP send queue past
+ * CONGESTION_MAX_QUEUED_BYTES. A packet larger than that on its own still goes
+ * out once the queue has drained. A full queue is a sign of congestion too.
+ */
+int congestion_backlogged(CongestionState *state, int socket_fd, size_t pending, size_t size) {
+#ifdef __linux__
+	int queued = 0;
+
+	if (ioctl(socket_fd, SIOCOUTQ, &queued) < 0) {
+		return FALSE;
+	}
+
+	pending += queued;
+
+	if (pending == 0 || pending + size <= CONGESTION_MAX_QUEUED_BYTES) {
+		return FALSE;
+	}
+
+	state->overuse = TRUE;
+	state->dropped++;
+
+	return TRUE;
+#else
+	(void)state;
+	(void)socket_fd;
+	(void)pending;
+	(void)size;
+
+	return FALSE;
+#endif
+}
+
+/*
+ * Sample the receiver's connection (plus pending bytes of media waiting to be
+ * written to it) if CONGESTION_SAMPLE_MS has passed, and move its level: up on
+ * congestion, multiplicatively cutting the bandwidth estimate; down after a
+ * calm spell, growing the estimate as it probes. Returns TRUE if the level
+ * changed.
+ */
+int congestion_update(CongestionState *state, int socket_fd, size_t pending) {
+	uint64_t now = now_ms();
+	uint64_t delivery_rate = 0;
+
+	if (state->sample_ms != 0 && now - state->sample_ms < CONGESTION_SAMPLE_MS) {
+		return FALSE;
+	}
+
+	if (state->sample_ms != 0) {
+		state->send_rate = state->window_bytes * 1000 / (now - state->sample_ms);
+	} else {
+		state->level_changed_ms = now;
+		state->overuse_ms = now;
+	}
+
+	state->window_bytes = 0;
+	state->sample_ms = now;
+
+	sample_socket(state, socket_fd, &delivery_rate);
+
+	state->queued += pending;
+
+	int overuse = state->overuse || state->queued > CONGESTION_QUEUE_THRESHOLD ||
+	              (state->min_rtt_us > 0 && state->rtt_us > state->min_rtt_us + CONGESTION_DELAY_THRESHOLD_US);
+
+	state->overuse = FALSE;
+
+	if (overuse) {
+		uint64_t estimate = state->send_rate * 85 / 100;
+
+		// Only a rate measured while the connection was busy says anything about the link.
+		if (delivery_rate > 0 && (estimate == 0 || delivery_rate < estimate)) {
+			estimate = delivery_rate;
+		}
+
+		if (estimate > 0) {
+			state->bandwidth = estimate;
+		}
+
+		state->overuse_ms = now;
+
+		if (state->level < CONGESTION_LEVEL_MAX && now - state->level_changed_ms >= CONGESTION_DEGRADE_HOLD_MS) {
+			state->level++;
+			state->level_changed_ms = now;
+
+			return TRUE;
+		}
+
+		return FALSE;
+	}
+
+	if (state->bandwidth > 0) {
+		state->bandwidth += state->bandwidth / 20;
+	}
+
+	if (state->level > CongestionLevelNone && now - state->overuse_ms >= CONGESTION_RECOVER_HOLD_MS &&
+	    now - state->level_changed_ms >= CONGESTION_RECOVER_HOLD_MS &&
+	    state->bandwidth * 100 >= state->send_rate * CONGESTION_RECOVER_HEADROOM) {
+		state->level--;
+		state->level_changed_ms = now;
+
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+static uint64_t now_ms(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+ * Read the send queue depth and RTT of the receiver's TCP connection, and its
+ * delivery rate if that was not limited by us having little to send.
+ */
+static void sample_socket(CongestionState *state, int socket_fd, uint64_t *delivery_rate) {
+#ifdef __linux__
+	struct tcp_info info = {0};
+	socklen_t info_len = sizeof info;
+	int queued = 0;
+
+	state->queued = ioctl(socket_fd, SIOCOUTQ, &queued) == 0 ? queued : 0;
+
+	if (getsockopt(socket_fd, IPPROTO_TCP, TCP_INFO, &info, &info_len) < 0) {
+		log_error(ERROR_NETWORK, "failed to get client connection info");
+
+		return;
+	}
+
+	state->rtt_us = info.tcpi_rtt;
+
+	if (info.tcpi_min_rtt > 0 && (state->min_rtt_us == 0 || info.tcpi_min_rtt < state->min_rtt_us)) {
+		state->min_rtt_us = info.tcpi_min_rtt;
+	}
+
+	if (!info.tcpi_delivery_rate_app_limited) {
+		*delivery_rate = info.tcpi_delivery_rate;
+	}
+#else
+	(void)state;
+	(void)socket_fd;
+	(void)delivery_rate;
+#endif
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * How often a receiver's connection is sampled, at most.
+ */
+#define CONGESTION_SAMPLE_MS 100
+
+/*
+ * A receiver is congested when its send queues hold more than this, or its
+ * RTT has grown this far above the smallest seen (a queue building somewhere
+ * on the path, which its media datagrams share).
+ */
+#define CONGESTION_QUEUE_THRESHOLD 32768
+#define CONGESTION_DELAY_THRESHOLD_US 60000
+
+/*
+ * Media sent over TCP is dropped rather than queued past this, so a slow
+ * receiver never blocks the room it is in.
+ */
+#define CONGESTION_MAX_QUEUED_BYTES 65536
+
+/*
+ * Degrade at most one level per CONGESTION_DEGRADE_HOLD_MS. Restore one
+ * level after CONGESTION_RECOVER_HOLD_MS without congestion, once the
+ * bandwidth estimate leaves CONGESTION_RECOVER_HEADROOM percent over what is
+ * being sent.
+ */
+#define CONGESTION_DEGRADE_HOLD_MS 500
+#define CONGESTION_RECOVER_HOLD_MS 3000
+#define CONGESTION_RECOVER_HEADROOM 125
+
+/*
+ * What is held back from a congested receiver, cumulatively: video goes
+ * first, then audio is transcoded down to ADPCM, and finally only the active
+ * speaker is heard. Chat and heartbeats are never affected.
+ */
+typedef enum
+{
+	CongestionLevelNone,
+	CongestionLevelVideoReduced,
+	CongestionLevelVideoMinimal,
+	CongestionLevelVideoOff,
+	CongestionLevelAudioReduced,
+	CongestionLevelAudioSpeakerOnly
+} _CongestionLevel;
+
+typedef uint8_t CongestionLevel;
+
+#define CONGESTION_LEVEL_MAX CongestionLevelAudioSpeakerOnly
+
+/*
+ * Per receiver. Rates are in bytes per second, bandwidth is the estimate of
+ * what the receiver can take (0 until the first congestion).
+ */
+typedef struct {
+	CongestionLevel level;
+	int overuse;
+	uint64_t sample_ms;
+	uint64_t level_changed_ms;
+	uint64_t overuse_ms;
+	uint64_t window_bytes;
+	uint64_t send_rate;
+	uint64_t bandwidth;
+	uint32_t rtt_us;
+	uint32_t min_rtt_us;
+	uint32_t queued;
+	uint64_t dropped;
+} CongestionState;
+
+const char *congestion_level_to_string(const CongestionLevel level);
+void congestion_on_send(CongestionState *state, size_t size);
+int congestion_backlogged(CongestionState *state, int socket_fd, size_t pending, size_t size);
+int congestion_update(CongestionState *state, int socket_fd, size_t pending);
@@ -0,0 +1,397 @@
+#include "editor.h"
+
+#include "utils.h"
+
+#include <ctype.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+
+#define EDITOR_CLEAN UINT32_MAX
+
+static uint32_t decode(const char *text, uint32_t size, wchar_t *ch);
+static int char_width(wchar_t ch);
+static int grow(Editor *editor, uint32_t size);
+static uint32_t prev_char(const Editor *editor, int *width);
+static uint32_t next_char(const Editor *editor, int *width);
+static void mark_dirty(Editor *editor);
+
+int editor_init(Editor *editor, uint32_t max_width) {
+	memset(editor, 0, sizeof *editor);
+
+	editor->data = malloc(EDITOR_INITIAL_CAPACITY);
+
+	if (editor->data == NULL) {
+		return -1;
+	}
+
+	editor->capacity = EDITOR_INITIAL_CAPACITY;
+	editor->gap_end = EDITOR_INITIAL_CAPACITY;
+	editor->max_width = max_width;
+
+	return 0;
+}
+
+void editor_free(Editor *editor) {
+	freep(editor->data);
+
+	editor->capacity = 0;
+	editor->gap_start = 0;
+	editor->gap_end = 0;
+}
+
+/*
+ * Change how wide the text may get, dropping characters off the end until it
+ * fits.
+ */
+void editor_resize(Editor *editor, uint32_t max_width) {
+	editor->max_width = max_width;
+
+	if (editor->width > max_width) {
+		editor_end(editor);
+
+		while (editor->width > max_width) {
+			editor_delete_back(editor);
+		}
+	}
+
+	editor->dirty_from = 0;
+	editor->dirty_col = 0;
+}
+
+void editor_clear(Editor *editor) {
+	editor->gap_start = 0;
+	editor->gap_end = editor->capacity;
+	editor->width = 0;
+	editor->cursor_col = 0;
+	editor->dirty_from = 0;
+	editor->dirty_col = 0;
+}
+
+uint32_t editor_size(const Editor *editor) {
+	return editor->capacity - (editor->gap_end - editor->gap_start);
+}
+
+/*
+ * The whole text, NUL-terminated. Closing the gap leaves the cursor at the end.
+ */
+const char *editor_text(Editor *editor) {
+	editor_end(editor);
+	editor->data[editor->gap_start] = '\0';
+
+	return editor->data;
+}
+
+/*
+ * Insert the characters of text at the cursor, as many as fit. Control
+ * characters and malformed UTF-8 are skipped. Returns how many bytes of text
+ * were used.
+ */
+uint32_t editor_insert(Editor *editor, const char *text, uint32_t size) {
+	uint32_t used = 0;
+
+	mark_dirty(editor);
+
+	while (used < size) {
+		wchar_t ch;
+		uint32_t length = decode(text + used, size - used, &ch);
+		int width = length > 0 ? char_width(ch) : -1;
+
+		if (width < 0) {
+			used += length > 0 ? length : 1;
+
+			continue;
+		}
+
+		if (editor->width + width > editor->max_width) {
+			break;
+		}
+
+		// The gap never closes completely, so editor_text has room for its NUL.
+		if (editor->gap_end - editor->gap_start <= length && grow(editor, length + 1) < 0) {
+			break;
+		}
+
+		memcpy(editor->data + editor->gap_start, text + used, length);
+		editor->gap_start += length;
+		editor->width += width;
+		editor->cursor_col += width;
+		used += length;
+	}
+
+	return used;
+}
+
+/*
+ * Delete the character before the cursor, and whatever zero-width ones
+ * follow it.
+ */
+void editor_delete_back(Editor *editor) {
+	int width = 0;
+
+	if (editor->gap_start == 0) {
+		return;
+	}
+
+	while (editor->gap_start > 0 && width == 0) {
+		uint32_t length = prev_char(editor, &width);
+
+		editor->gap_start -= length;
+		editor->width -= width;
+		editor->cursor_col -= width;
+	}
+
+	mark_dirty(editor);
+}
+
+void editor_delete_forward(Editor *editor) {
+	int width = 0;
+	uint32_t length = next_char(editor, &width);
+
+	if (length == 0) {
+		return;
+	}
+
+	editor->gap_end += length;
+	editor->width -= width;
+
+	while ((length = next_char(editor, &width)) > 0 && width == 0) {
+		editor->gap_end += length;
+	}
+
+	mark_dirty(editor);
+}
+
+void editor_left(Editor *editor) {
+	int width = 0;
+
+	while (editor->gap_start > 0 && width == 0) {
+		uint32_t length = prev_char(editor, &width);
+
+		editor->gap_start -= length;
+		editor->gap_end -= length;
+		memmove(editor->data + editor->gap_end, editor->data + editor->gap_start, length);
+		editor->cursor_col -= width;
+	}
+}
+
+void editor_right(Editor *editor) {
+	int width = 0;
+	uint32_t length = next_char(editor, &width);
+
+	if (length == 0) {
+		return;
+	}
+
+	do {
+		memmove(editor->data + editor->gap_start, editor->data + editor->gap_end, length);
+		editor->gap_start += length;
+		editor->gap_end += length;
+		editor->cursor_col += width;
+	} while ((length = next_char(editor, &width)) > 0 && width == 0);
+}
+
+void editor_home(Editor *editor) {
+	uint32_t length = editor->gap_start;
+
+	editor->gap_start = 0;
+	editor->gap_end -= length;
+	memmove(editor->data + editor->gap_end, editor->data, length);
+	editor->cursor_col = 0;
+}
+
+void editor_end(Editor *editor) {
+	uint32_t length = editor->capacity - editor->gap_end;
+
+	memmove(editor->data + editor->gap_start, editor->data + editor->gap_end, length);
+	editor->gap_start += length;
+	editor->gap_end = editor->capacity;
+	editor->cursor_col = editor->width;
+}
+
+/*
+ * Move to the start of the word before the cursor, or of the one it is in.
+ */
+void editor_word_left(Editor *editor) {
+	while (editor->gap_start > 0 && isspace((unsigned char)editor->data[editor->gap_start - 1])) {
+		editor_left(editor);
+	}
+
+	while (editor->gap_start > 0 && !isspace((unsigned char)editor->data[editor->gap_start - 1])) {
+		editor_left(editor);
+	}
+}
+
+/*
+ * Move to the end of the word after the cursor, or of the one it is in.
+ */
+void editor_word_right(Editor *editor) {
+	while (editor->gap_end < editor->capacity && isspace((unsigned char)editor->data[editor->gap_end])) {
+		editor_right(editor);
+	}
+
+	while (editor->gap_end < editor->capacity && !isspace((unsigned char)editor->data[editor->gap_end])) {
+		editor_right(editor);
+	}
+}
+
+/*
+ * Where the text on screen first differs, if anywhere. It is assumed to be
+ * drawn straight after.
+ */
+int editor_take_dirty(Editor *editor, uint32_t *from, uint32_t *col) {
+	if (editor->dirty_from == EDITOR_CLEAN) {
+		return FALSE;
+	}
+
+	*from = editor->dirty_from;
+	*col = editor->dirty_col;
+	editor->dirty_from = EDITOR_CLEAN;
+
+	return TRUE;
+}
+
+/*
+ * The text from byte from to the end.
+ */
+void editor_spans(const Editor *editor, uint32_t from, EditorSpans *spans) {
+	if (from < editor->gap_start) {
+		*spans = (EditorSpans){.text = {editor->data + from, editor->data + editor->gap_end},
+		                       .size = {editor->gap_start - from, editor->capacity - editor->gap_end}};
+	} else {
+		uint32_t skip = from - editor->gap_start;
+
+		*spans = (EditorSpans){.text = {editor->data + editor->gap_end + skip, ""},
+		                       .size = {editor->capacity - editor->gap_end - skip, 0}};
+	}
+}
+
+/*
+ * Decode the UTF-8 character at the start of text. Returns its length in
+ * bytes, or 0 if it is malformed or cut short.
+ */
+static uint32_t decode(const char *text, uint32_t size, wchar_t *ch) {
+	const uint8_t *bytes = (const uint8_t *)text;
+	uint32_t length;
+
+	if (bytes[0] < 0x80) {
+		*ch = bytes[0];
+
+		return 1;
+	} else if ((bytes[0] & 0xe0) == 0xc0) {
+		length = 2;
+		*ch = bytes[0] & 0x1f;
+	} else if ((bytes[0] & 0xf0) == 0xe0) {
+		length = 3;
+		*ch = bytes[0] & 0x0f;
+	} else if ((bytes[0] & 0xf8) == 0xf0) {
+		length = 4;
+		*ch = bytes[0] & 0x07;
+	} else {
+		return 0;
+	}
+
+	if (length > size) {
+		return 0;
+	}
+
+	for (uint32_t i = 1; i < length; i++) {
+		if ((bytes[i] & 0xc0) != 0x80) {
+			return 0;
+		}
+
+		*ch = (*ch << 6) | (bytes[i] & 0x3f);
+	}
+
+	return length;
+}
+
+/*
+ * Columns a character takes, or -1 for control characters. Without a UTF-8
+ * locale every printable character is taken to be one column wide.
+ */
+static int char_width(wchar_t ch) {
+	int width = wcwidth(ch);
+
+	if (width < 0 && ch >= 0xa0) {
+		width = 1;
+	}
+
+	return width;
+}
+
+/*
+ * Make the gap at least size bytes wide.
+ */
+static int grow(Editor *editor, uint32_t size) {
+	uint32_t after = editor->capacity - editor->gap_end;
+	uint32_t capacity = editor->capacity;
+
+	while (capacity - editor_size(editor) < size) {
+		capacity *= 2;
+	}
+
+	char *data = realloc(editor->data, capacity);
+
+	if (data == NULL) {
+		return -1;
+	}
+
+	memmove(data + capacity - after, data + editor->gap_end, after);
+
+	editor->data = data;
+	editor->gap_end = capacity - after;
+	editor->capacity = capacity;
+
+	return 0;
+}
+
+/*
+ * Length and width of the character just before the cursor, or 0 at the
+ * start of the text.
+ */
+static uint32_t prev_char(const Editor *editor, int *width) {
+	uint32_t start = editor->gap_start;
+
+	if (start == 0) {
+		return 0;
+	}
+
+	do {
+		start--;
+	} while (start > 0 && ((uint8_t)editor->data[start] & 0xc0) == 0x80);
+
+	wchar_t ch;
+	uint32_t length = decode(editor->data + start, editor->gap_start - start, &ch);
+
+	*width = char_width(ch);
+
+	return length;
+}
+
+/*
+ * Length and width of the character just after the cursor, or 0 at the end
+ * of the text.
+ */
+static uint32_t next_char(const Editor *editor, int *width) {
+	if (editor->gap_end == editor->capacity) {
+		return 0;
+	}
+
+	wchar_t ch;
+	uint32_t length = decode(editor->data + editor->gap_end, editor->capacity - editor->gap_end, &ch);
+
+	*width = char_width(ch);
+
+	return length;
+}
+
+/*
+ * Everything from the cursor on is about to change.
+ */
+static void mark_dirty(Editor *editor) {
+	if (editor->gap_start < editor->dirty_from) {
+		editor->dirty_from = editor->gap_start;
+		editor->dirty_col = editor->cursor_col;
+	}
+}
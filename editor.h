@@ -0,0 +1,58 @@
+#pragma once
+
+#include <stdint.h>
+
+#define EDITOR_INITIAL_CAPACITY 256
+
+/*
+ * Text being typed, kept in a gap buffer: the text before the cursor is at
+ * the start of data and the text after it at the end, so typing and deleting
+ * at the cursor never move more than the gap. Positions are byte offsets into
+ * the text as if the gap were not there.
+ *
+ * The text is UTF-8. The cursor moves over, and deletes, a character together
+ * with any zero-width ones after it. How many columns the text takes and
+ * which column the cursor is in are kept up to date with every edit rather
+ * than counted when needed. No more is accepted once the text is max_width
+ * columns wide.
+ *
+ * What changed since the text was last drawn starts at dirty_from, dirty_col
+ * columns in; everything before it is still on screen as it is.
+ */
+typedef struct {
+	char *data;
+	uint32_t capacity;
+	uint32_t gap_start;
+	uint32_t gap_end;
+	uint32_t max_width;
+	uint32_t width;
+	uint32_t cursor_col;
+	uint32_t dirty_from;
+	uint32_t dirty_col;
+} Editor;
+
+/*
+ * Up to two runs of bytes, either side of the gap.
+ */
+typedef struct {
+	const char *text[2];
+	uint32_t size[2];
+} EditorSpans;
+
+int editor_init(Editor *editor, uint32_t max_width);
+void editor_free(Editor *editor);
+void editor_resize(Editor *editor, uint32_t max_width);
+void editor_clear(Editor *editor);
+uint32_t editor_size(const Editor *editor);
+const char *editor_text(Editor *editor);
+uint32_t editor_insert(Editor *editor, const char *text, uint32_t size);
+void editor_delete_back(Editor *editor);
+void editor_delete_forward(Editor *editor);
+void editor_left(Editor *editor);
+void editor_right(Editor *editor);
+void editor_home(Editor *editor);
+void editor_end(Editor *editor);
+void editor_word_left(Editor *editor);
+void editor_word_right(Editor *editor);
+int editor_take_dirty(Editor *editor, uint32_t *from, uint32_t *col);
+void editor_spans(const Editor *editor, uint32_t from, EditorSpans *spans);
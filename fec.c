@@ -0,0 +1,410 @@
+#include "fec.h"
+
+#include "utils.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+// x^8 + x^4 + x^3 + x^2 + 1, the usual Reed-Solomon field polynomial.
+#define GF_POLYNOMIAL 0x11D
+
+static uint8_t gf_exp[512];
+static uint8_t gf_log[256];
+static pthread_once_t gf_once = PTHREAD_ONCE_INIT;
+
+static void gf_init(void);
+static uint8_t gf_mul(uint8_t a, uint8_t b);
+static uint8_t gf_inv(uint8_t a);
+static void gf_mul_add(uint8_t *dst, const uint8_t *src, uint8_t coefficient, size_t size);
+static uint8_t coefficient(FecScheme scheme, uint8_t parity, uint8_t index);
+static void write_symbol(uint8_t *symbol, const FecSymbol *source, size_t size);
+static void clear_symbol(FecSymbol *symbol);
+
+void fec_config_from_env(FecConfig *config) {
+	const char *audio_group = getenv(FEC_AUDIO_GROUP_ENV);
+	const char *video_parity = getenv(FEC_VIDEO_PARITY_ENV);
+	unsigned long value = 0;
+
+	config->audio_group = FEC_DEFAULT_AUDIO_GROUP;
+	config->video_parity = FEC_DEFAULT_VIDEO_PARITY;
+
+	if (audio_group != NULL) {
+		value = strtoul(audio_group, NULL, 10);
+		config->audio_group = value > FEC_MAX_GROUP ? FEC_MAX_GROUP : value;
+	}
+
+	if (video_parity != NULL) {
+		value = strtoul(video_parity, NULL, 10);
+		config->video_parity = value > FEC_MAX_PARITY ? FEC_MAX_PARITY : value;
+	}
+}
+
+/*
+ * Keep a copy of a datagram sent in the current group.
+ */
+void fec_encoder_add(FecEncoder *encoder, uint16_t seq, uint32_t timestamp, const void *data, uint16_t size) {
+	if (encoder->count >= FEC_MAX_GROUP) {
+		fec_encoder_reset(encoder);
+	}
+
+	FecSymbol *symbol = &encoder->symbols[encoder->count++];
+
+	symbol->filled = TRUE;
+	symbol->seq = seq;
+	symbol->timestamp = timestamp;
+	symbol->size = size;
+	symbol->data = malloc(size > 0 ? size : 1);
+
+	memcpy(symbol->data, data, size);
+}
+
+/*
+ * Close the current group and compute header->parity_count parity symbols of
+ * the given scheme into parity[], which the caller frees. Fills in the group
+ * fields of header and returns the symbol size, or 0 if the group was empty.
+ */
+size_t fec_encoder_finish(FecEncoder *encoder, FecHeader *header, uint8_t *parity[], size_t parity_count) {
+	size_t size = 0;
+
+	pthread_once(&gf_once, gf_init);
+
+	if (encoder->count == 0) {
+		return 0;
+	}
+
+	for (uint8_t i = 0; i < encoder->count; i++) {
+		if (encoder->symbols[i].size > size) {
+			size = encoder->symbols[i].size;
+		}
+	}
+
+	size += FEC_SYMBOL_HEADER_SIZE;
+
+	header->base_seq = encoder->symbols[0].seq;
+	header->count = encoder->count;
+	header->parity_count = parity_count;
+
+	uint8_t *symbol = malloc(size);
+
+	for (size_t j = 0; j < parity_count; j++) {
+		parity[j] = calloc(1, size);
+	}
+
+	for (uint8_t i = 0; i < encoder->count; i++) {
+		write_symbol(symbol, &encoder->symbols[i], size);
+
+		for (size_t j = 0; j < parity_count; j++) {
+			gf_mul_add(parity[j], symbol, coefficient(header->scheme, j, i), size);
+		}
+	}
+
+	free(symbol);
+	fec_encoder_reset(encoder);
+
+	return size;
+}
+
+void fec_encoder_reset(FecEncoder *encoder) {
+	for (uint8_t i = 0; i < encoder->count; i++) {
+		clear_symbol(&encoder->symbols[i]);
+	}
+
+	encoder->count = 0;
+}
+
+/*
+ * Remember a received datagram in case a later parity symbol needs it.
+ */
+void fec_decoder_add(FecDecoder *decoder, uint16_t seq, uint32_t timestamp, const void *data, uint16_t size) {
+	FecSymbol *symbol = &decoder->window[seq % FEC_WINDOW];
+
+	clear_symbol(symbol);
+
+	symbol->filled = TRUE;
+	symbol->seq = seq;
+	symbol->timestamp = timestamp;
+	symbol->size = size;
+	symbol->data = malloc(size > 0 ? size : 1);
+
+	memcpy(symbol->data, data, size);
+}
+
+/*
+ * Take a parity symbol of size bytes. Once enough parity for the group has
+ * arrived to cover what is missing, rebuild the missing datagrams into
+ * recovered[] (up to FEC_MAX_PARITY, data freed by the caller) and return how
+ * many there are.
+ */
+size_t fec_decoder_parity(FecDecoder *decoder, const FecHeader *header, const uint8_t *parity, size_t size,
+                          FecSymbol recovered[]) {
+	uint8_t missing[FEC_MAX_PARITY];
+	uint8_t rows[FEC_MAX_PARITY];
+	size_t num_missing = 0;
+	size_t num_rows = 0;
+
+	pthread_once(&gf_once, gf_init);
+
+	if (header->count == 0 || header->count > FEC_MAX_GROUP || header->index >= FEC_MAX_PARITY ||
+	    header->parity_count > FEC_MAX_PARITY || size <= FEC_SYMBOL_HEADER_SIZE) {
+		return 0;
+	}
+
+	if (decoder->group.base_seq != header->base_seq || decoder->group.count != header->count ||
+	    decoder->group.scheme != header->scheme) {
+		for (size_t j = 0; j < FEC_MAX_PARITY; j++) {
+			clear_symbol(&decoder->parity[j]);
+		}
+
+		decoder->group = *header;
+		decoder->group_done = FALSE;
+	}
+
+	FecSymbol *stored = &decoder->parity[header->index];
+
+	if (decoder->group_done || stored->filled) {
+		return 0;
+	}
+
+	stored->filled = TRUE;
+	stored->size = size;
+	stored->data = malloc(size);
+
+	memcpy(stored->data, parity, size);
+
+	for (uint8_t i = 0; i < header->count; i++) {
+		uint16_t seq = header->base_seq + i;
+		const FecSymbol *symbol = &decoder->window[seq % FEC_WINDOW];
+
+		if (symbol->filled && symbol->seq == seq) {
+			if (symbol->size + FEC_SYMBOL_HEADER_SIZE > size) {
+				return 0;
+			}
+
+			continue;
+		}
+
+		if (num_missing == FEC_MAX_PARITY) {
+			return 0;
+		}
+
+		missing[num_missing++] = i;
+	}
+
+	for (uint8_t j = 0; j < FEC_MAX_PARITY && num_rows < num_missing; j++) {
+		if (decoder->parity[j].filled && decoder->parity[j].size == size) {
+			rows[num_rows++] = j;
+		}
+	}
+
+	if (num_missing == 0) {
+		decoder->group_done = TRUE;
+	}
+
+	if (num_missing == 0 || num_rows < num_missing) {
+		return 0;
+	}
+
+	// Move what was received over to the right hand side, leaving the missing symbols times their coefficients.
+	uint8_t matrix[FEC_MAX_PARITY][FEC_MAX_PARITY];
+	uint8_t *rhs[FEC_MAX_PARITY];
+	uint8_t *symbol = malloc(size);
+
+	for (size_t r = 0; r < num_rows; r++) {
+		rhs[r] = malloc(size);
+		memcpy(rhs[r], decoder->parity[rows[r]].data, size);
+
+		for (size_t c = 0; c < num_missing; c++) {
+			matrix[r][c] = coefficient(header->scheme, rows[r], missing[c]);
+		}
+	}
+
+	for (uint8_t i = 0, m = 0; i < header->count; i++) {
+		if (m < num_missing && missing[m] == i) {
+			m++;
+
+			continue;
+		}
+
+		uint16_t seq = header->base_seq + i;
+
+		write_symbol(symbol, &decoder->window[seq % FEC_WINDOW], size);
+
+		for (size_t r = 0; r < num_rows; r++) {
+			gf_mul_add(rhs[r], symbol, coefficient(header->scheme, rows[r], i), size);
+		}
+	}
+
+	// Gauss-Jordan elimination. Every square submatrix of a Cauchy matrix is invertible, so pivots are never zero.
+	for (size_t c = 0; c < num_missing; c++) {
+		size_t pivot = c;
+
+		while (matrix[pivot][c] == 0) {
+			pivot++;
+		}
+
+		if (pivot != c) {
+			uint8_t *tmp = rhs[c];
+
+			rhs[c] = rhs[pivot];
+			rhs[pivot] = tmp;
+
+			for (size_t k = 0; k < num_missing; k++) {
+				uint8_t value = matrix[c][k];
+
+				matrix[c][k] = matrix[pivot][k];
+				matrix[pivot][k] = value;
+			}
+		}
+
+		uint8_t inverse = gf_inv(matrix[c][c]);
+
+		for (size_t k = 0; k < num_missing; k++) {
+			matrix[c][k] = gf_mul(matrix[c][k], inverse);
+		}
+
+		memset(symbol, 0, size);
+		gf_mul_add(symbol, rhs[c], inverse, size);
+		memcpy(rhs[c], symbol, size);
+
+		for (size_t r = 0; r < num_missing; r++) {
+			uint8_t factor = matrix[r][c];
+
+			if (r == c || factor == 0) {
+				continue;
+			}
+
+			for (size_t k = 0; k < num_missing; k++) {
+				matrix[r][k] ^= gf_mul(factor, matrix[c][k]);
+			}
+
+			gf_mul_add(rhs[r], rhs[c], factor, size);
+		}
+	}
+
+	size_t num_recovered = 0;
+
+	for (size_t c = 0; c < num_missing; c++) {
+		FecSymbol *out = &recovered[num_recovered];
+
+		memcpy(&out->size, rhs[c], sizeof out->size);
+		memcpy(&out->timestamp, rhs[c] + sizeof out->size, sizeof out->timestamp);
+
+		// A size that does not fit means the group was not what the parity described.
+		if (out->size + FEC_SYMBOL_HEADER_SIZE > size) {
+			free(rhs[c]);
+
+			continue;
+		}
+
+		out->filled = TRUE;
+		out->seq = header->base_seq + missing[c];
+		out->data = malloc(out->size > 0 ? out->size : 1);
+
+		memcpy(out->data, rhs[c] + FEC_SYMBOL_HEADER_SIZE, out->size);
+		free(rhs[c]);
+
+		num_recovered++;
+	}
+
+	free(symbol);
+
+	decoder->group_done = TRUE;
+
+	return num_recovered;
+}
+
+void fec_decoder_free(FecDecoder *decoder) {
+	for (size_t i = 0; i < FEC_WINDOW; i++) {
+		clear_symbol(&decoder->window[i]);
+	}
+
+	for (size_t j = 0; j < FEC_MAX_PARITY; j++) {
+		clear_symbol(&decoder->parity[j]);
+	}
+}
+
+static void gf_init(void) {
+	unsigned int x = 1;
+
+	for (size_t i = 0; i < 255; i++) {
+		gf_exp[i] = x;
+		gf_log[x] = i;
+
+		x <<= 1;
+
+		if (x & 0x100) {
+			x ^= GF_POLYNOMIAL;
+		}
+	}
+
+	// Doubled so gf_mul can index log sums without a modulo.
+	for (size_t i = 255; i < sizeof gf_exp; i++) {
+		gf_exp[i] = gf_exp[i - 255];
+	}
+}
+
+static uint8_t gf_mul(uint8_t a, uint8_t b) {
+	if (a == 0 || b == 0) {
+		return 0;
+	}
+
+	return gf_exp[gf_log[a] + gf_log[b]];
+}
+
+static uint8_t gf_inv(uint8_t a) {
+	return gf_exp[255 - gf_log[a]];
+}
+
+/*
+ * dst += coefficient * src over GF(256).
+ */
+static void gf_mul_add(uint8_t *dst, const uint8_t *src, uint8_t coefficient, size_t size) {
+	if (coefficient == 0) {
+		return;
+	}
+
+	if (coefficient == 1) {
+		for (size_t i = 0; i < size; i++) {
+			dst[i] ^= src[i];
+		}
+
+		return;
+	}
+
+	unsigned int log_coefficient = gf_log[coefficient];
+
+	for (size_t i = 0; i < size; i++) {
+		if (src[i] != 0) {
+			dst[i] ^= gf_exp[log_coefficient + gf_log[src[i]]];
+		}
+	}
+}
+
+/*
+ * Parity row j, data column i. Reed-Solomon uses the Cauchy matrix
+ * 1 / (x_j + y_i) with x_j = FEC_MAX_GROUP + j and y_i = i, which never meet.
+ */
+static uint8_t coefficient(FecScheme scheme, uint8_t parity, uint8_t index) {
+	if (scheme == FecSchemeXor) {
+		return 1;
+	}
+
+	return gf_inv((FEC_MAX_GROUP + parity) ^ index);
+}
+
+static void write_symbol(uint8_t *symbol, const FecSymbol *source, size_t size) {
+	uint8_t *pos = symbol;
+
+	pos = mempcpy(pos, &source->size, sizeof source->size);
+	pos = mempcpy(pos, &source->timestamp, sizeof source->timestamp);
+	pos = mempcpy(pos, source->data, source->size);
+
+	memset(pos, 0, size - (pos - symbol));
+}
+
+static void clear_symbol(FecSymbol *symbol) {
+	free(symbol->data);
+
+	*symbol = (FecSymbol){0};
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Forward error correction over groups of consecutive datagrams of one
+ * stream. Each datagram becomes a symbol (its size, timestamp and payload,
+ * zero padded to the largest in the group) and parity symbols are linear
+ * combinations of them over GF(256). XOR is the single parity case with every
+ * coefficient 1; Reed-Solomon uses rows of a Cauchy matrix, so any count
+ * losses can be rebuilt from count parity symbols.
+ */
+#define FEC_MAX_GROUP 16
+#define FEC_MAX_PARITY 4
+#define FEC_WINDOW 32
+#define FEC_SYMBOL_HEADER_SIZE (sizeof(uint16_t) + sizeof(uint32_t))
+#define FEC_HEADER_SIZE (sizeof(uint8_t) * 5 + sizeof(uint16_t))
+
+#define FEC_DEFAULT_AUDIO_GROUP 4
+#define FEC_DEFAULT_VIDEO_GROUP 4
+#define FEC_DEFAULT_VIDEO_PARITY 2
+
+#define FEC_AUDIO_GROUP_ENV "MACLUNKEY_FEC_AUDIO_GROUP"
+#define FEC_VIDEO_PARITY_ENV "MACLUNKEY_FEC_VIDEO_PARITY"
+
+typedef enum
+{
+	FecSchemeXor,
+	FecSchemeReedSolomon
+} _FecScheme;
+
+typedef uint8_t FecScheme;
+
+/*
+ * Precedes the parity symbol in a parity datagram. The group is the count
+ * datagrams of stream from base_seq on.
+ */
+typedef struct {
+	uint8_t stream;
+	FecScheme scheme;
+	uint16_t base_seq;
+	uint8_t count;
+	uint8_t parity_count;
+	uint8_t index;
+} FecHeader;
+
+typedef struct {
+	int filled;
+	uint16_t seq;
+	uint32_t timestamp;
+	uint16_t size;
+	uint8_t *data;
+} FecSymbol;
+
+/*
+ * audio_group datagrams of audio get one XOR parity; video groups close at a
+ * keyframe (or after FEC_DEFAULT_VIDEO_GROUP datagrams without one, unprotected)
+ * and get video_parity Reed-Solomon parity. 0 turns either off.
+ */
+typedef struct {
+	uint8_t audio_group;
+	uint8_t video_parity;
+} FecConfig;
+
+typedef struct {
+	uint8_t count;
+	FecSymbol symbols[FEC_MAX_GROUP];
+} FecEncoder;
+
+/*
+ * Recently received symbols of one stream, and the parity gathered for the
+ * group being recovered.
+ */
+typedef struct {
+	FecSymbol window[FEC_WINDOW];
+	FecHeader group;
+	int group_done;
+	FecSymbol parity[FEC_MAX_PARITY];
+} FecDecoder;
+
+void fec_config_from_env(FecConfig *config);
+void fec_encoder_add(FecEncoder *encoder, uint16_t seq, uint32_t timestamp, const void *data, uint16_t size);
+size_t fec_encoder_finish(FecEncoder *encoder, FecHeader *header, uint8_t *parity[], size_t parity_count);
+void fec_encoder_reset(FecEncoder *encoder);
+void fec_decoder_add(FecDecoder *decoder, uint16_t seq, uint32_t timestamp, const void *data, uint16_t size);
+size_t fec_decoder_parity(FecDecoder *decoder, const FecHeader *header, const uint8_t *parity, size_t size,
+                          FecSymbol recovered[]);
+void fec_decoder_free(FecDecoder *decoder);
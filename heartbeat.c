@@ -0,0 +1,41 @@
+#include "heartbeat.h"
+
+#include "utils.h"
+
+/*
+ * Fold a round trip time into the averages as RFC 6298 does, giving the
+ * newest sample an eighth of the weight in srtt and a quarter in rttvar.
+ */
+void heartbeat_rtt_update(HeartbeatRtt *rtt, uint64_t sample_us) {
+	if (rtt->samples == 0) {
+		rtt->srtt = sample_us;
+		rtt->rttvar = sample_us / 2;
+	} else {
+		uint64_t deviation = sample_us > rtt->srtt ? sample_us - rtt->srtt : rtt->srtt - sample_us;
+
+		rtt->rttvar = (rtt->rttvar * 3 + deviation) / 4;
+		rtt->srtt = (rtt->srtt * 7 + sample_us) / 8;
+	}
+
+	rtt->samples++;
+	histogram_record(&rtt->rtt, sample_us);
+}
+
+/*
+ * Until a pong has been timed the client gets a whole heartbeat interval.
+ */
+uint32_t heartbeat_timeout_ms(const HeartbeatRtt *rtt) {
+	if (rtt->samples == 0) {
+		return HEARTBEAT_INTERVAL * 1000;
+	}
+
+	uint64_t timeout = (rtt->srtt + 4 * rtt->rttvar) / 1000;
+
+	if (timeout < HEARTBEAT_MIN_TIMEOUT_MS) {
+		return HEARTBEAT_MIN_TIMEOUT_MS;
+	} else if (timeout > HEARTBEAT_MAX_TIMEOUT_MS) {
+		return HEARTBEAT_MAX_TIMEOUT_MS;
+	}
+
+	return timeout;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "histogram.h"
+
+#include <stdint.h>
+
+/*
+ * A ping goes out every HEARTBEAT_INTERVAL seconds unless something else has
+ * been heard from the client since the last one, though never more than
+ * HEARTBEAT_MAX_SKIPS in a row are skipped so the round trip time stays
+ * fresh. An unanswered ping is sent again, and the client is dropped after
+ * HEARTBEAT_MAX_MISSES of them in a row.
+ */
+#define HEARTBEAT_MAX_SKIPS 5
+#define HEARTBEAT_MAX_MISSES 3
+
+/*
+ * How long to wait for a pong is worked out from the round trip times seen so
+ * far, as TCP works out its retransmission timeout, within these bounds.
+ */
+#define HEARTBEAT_MIN_TIMEOUT_MS 1000
+#define HEARTBEAT_MAX_TIMEOUT_MS 15000
+
+/*
+ * Round trip times in microseconds. srtt and rttvar are the smoothed round
+ * trip time and its mean deviation, which is the jitter.
+ */
+typedef struct {
+	uint64_t srtt;
+	uint64_t rttvar;
+	uint64_t samples;
+	Histogram rtt;
+} HeartbeatRtt;
+
+void heartbeat_rtt_update(HeartbeatRtt *rtt, uint64_t sample_us);
+uint32_t heartbeat_timeout_ms(const HeartbeatRtt *rtt);
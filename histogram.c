@@ -0,0 +1,55 @@
+#include "histogram.h"
+
+void histogram_record(Histogram *histogram, uint64_t value) {
+	histogram->counts[histogram_bucket(value)]++;
+	histogram->total++;
+}
+
+/*
+ * The upper bound of the bucket holding the given percentile (0 to 100) of
+ * what was recorded.
+ */
+uint64_t histogram_percentile(const Histogram *histogram, double percentile) {
+	uint64_t rank = (uint64_t)(histogram->total * percentile / 100 + 0.5);
+	uint64_t seen = 0;
+
+	for (unsigned int i = 0; i < HISTOGRAM_NUM_BUCKETS; i++) {
+		seen += histogram->counts[i];
+
+		if (seen >= rank && seen > 0) {
+			return histogram_bucket_limit(i);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Values below HISTOGRAM_BUCKETS_PER_OCTAVE get a bucket each. Above that,
+ * the top bit picks the octave and the two bits after it the quarter.
+ */
+unsigned int histogram_bucket(uint64_t value) {
+	if (value < HISTOGRAM_BUCKETS_PER_OCTAVE) {
+		return value;
+	}
+
+	unsigned int msb = 63 - __builtin_clzll(value);
+	unsigned int bucket = (msb - 1) * HISTOGRAM_BUCKETS_PER_OCTAVE + ((value >> (msb - 2)) & 3);
+
+	return bucket < HISTOGRAM_NUM_BUCKETS ? bucket : HISTOGRAM_NUM_BUCKETS - 1;
+}
+
+/*
+ * The largest value that goes in bucket.
+ */
+uint64_t histogram_bucket_limit(unsigned int bucket) {
+	unsigned int next = bucket + 1;
+
+	if (next < HISTOGRAM_BUCKETS_PER_OCTAVE) {
+		return bucket;
+	}
+
+	unsigned int msb = next / HISTOGRAM_BUCKETS_PER_OCTAVE + 1;
+
+	return ((uint64_t)(HISTOGRAM_BUCKETS_PER_OCTAVE + next % HISTOGRAM_BUCKETS_PER_OCTAVE) << (msb - 2)) - 1;
+}
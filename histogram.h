@@ -0,0 +1,21 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Values are counted in buckets a quarter of an octave wide, so a percentile
+ * is within a fifth of the true value. The last bucket holds everything from
+ * about 2^33 up.
+ */
+#define HISTOGRAM_BUCKETS_PER_OCTAVE 4
+#define HISTOGRAM_NUM_BUCKETS 128
+
+typedef struct {
+	uint64_t counts[HISTOGRAM_NUM_BUCKETS];
+	uint64_t total;
+} Histogram;
+
+void histogram_record(Histogram *histogram, uint64_t value);
+uint64_t histogram_percentile(const Histogram *histogram, double percentile);
+unsigned int histogram_bucket(uint64_t value);
+uint64_t histogram_bucket_limit(unsigned int bucket);
@@ -0,0 +1,154 @@
+#include "jitter.h"
+
+#include "utils.h"
+
+#include <math.h>
+#include <string.h>
+
+static void jitter_start(JitterBuffer *jitter, uint32_t timestamp);
+static JitterSlot *jitter_slot(JitterBuffer *jitter, uint32_t timestamp);
+static void generate_comfort_noise(JitterBuffer *jitter, int16_t *pcm);
+
+void jitter_init(JitterBuffer *jitter, unsigned int delay_frames) {
+	memset(jitter, 0, sizeof *jitter);
+
+	if (delay_frames >= JITTER_SLOTS) {
+		delay_frames = JITTER_SLOTS - 1;
+	}
+
+	jitter->delay_frames = delay_frames;
+	jitter->noise_seed = 0x2545f491;
+}
+
+static void jitter_start(JitterBuffer *jitter, uint32_t timestamp) {
+	for (size_t i = 0; i < JITTER_SLOTS; i++) {
+		jitter->slots[i].filled = FALSE;
+	}
+
+	jitter->playout_timestamp = timestamp - jitter->delay_frames * AUDIO_FRAME_SAMPLES;
+	jitter->started = TRUE;
+}
+
+static JitterSlot *jitter_slot(JitterBuffer *jitter, uint32_t timestamp) {
+	return &jitter->slots[(timestamp / AUDIO_FRAME_SAMPLES) % JITTER_SLOTS];
+}
+
+/*
+ * Decode a frame into its playout slot. Frames behind the playout point are
+ * counted as late and dropped; frames too far ahead resynchronise the buffer.
+ */
+int jitter_push_frame(JitterBuffer *jitter, const AudioFrame *frame) {
+	if (frame->num_samples != AUDIO_FRAME_SAMPLES) {
+		jitter->stats.malformed++;
+
+		return -1;
+	}
+
+	if (!jitter->started) {
+		jitter_start(jitter, frame->timestamp);
+	}
+
+	int32_t ahead = (int32_t)(frame->timestamp - jitter->playout_timestamp);
+
+	if (ahead < 0) {
+		jitter->stats.late++;
+
+		return 0;
+	} else if (ahead >= JITTER_SLOTS * AUDIO_FRAME_SAMPLES) {
+		jitter_start(jitter, frame->timestamp);
+	}
+
+	JitterSlot *slot = jitter_slot(jitter, frame->timestamp);
+
+	if (audio_decode(frame->codec, frame->data, frame->size, slot->pcm, AUDIO_FRAME_SAMPLES) < 0) {
+		jitter->stats.malformed++;
+		slot->filled = FALSE;
+
+		return -1;
+	}
+
+	slot->filled = TRUE;
+	slot->timestamp = frame->timestamp;
+
+	return 0;
+}
+
+/*
+ * The sender has gone silent from noise->timestamp onwards.
+ */
+void jitter_push_comfort_noise(JitterBuffer *jitter, const ComfortNoise *noise) {
+	if (!jitter->started) {
+		jitter_start(jitter, noise->timestamp);
+	}
+
+	// Periodic refreshes only update the level; the gap still starts at the first descriptor.
+	if (!jitter->comfort_noise || (int32_t)(noise->timestamp - jitter->comfort_noise_timestamp) < 0) {
+		jitter->comfort_noise_timestamp = noise->timestamp;
+	}
+
+	jitter->comfort_noise = TRUE;
+	jitter->noise_level = noise->level;
+}
+
+static void generate_comfort_noise(JitterBuffer *jitter, int16_t *pcm) {
+	// Uniform noise in [-a, a] has an RMS of a / sqrt(3).
+	float amplitude = 32768.0f * powf(10.0f, -jitter->noise_level / 20.0f) * 1.732f;
+	uint32_t seed = jitter->noise_seed;
+
+	for (size_t i = 0; i < AUDIO_FRAME_SAMPLES; i++) {
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+
+		pcm[i] = (int16_t)(amplitude * ((float)(seed >> 8) / (1 << 23) - 1.0f));
+	}
+
+	jitter->noise_seed = seed;
+}
+
+/*
+ * Produce the next AUDIO_FRAME_SAMPLES of playout: the received frame if it is
+ * there, comfort noise during a DTX gap, otherwise a fading repeat of the last
+ * frame and finally silence.
+ */
+void jitter_pull(JitterBuffer *jitter, int16_t *pcm) {
+	if (!jitter->started) {
+		memset(pcm, 0, AUDIO_FRAME_SAMPLES * sizeof *pcm);
+
+		return;
+	}
+
+	uint32_t timestamp = jitter->playout_timestamp;
+	JitterSlot *slot = jitter_slot(jitter, timestamp);
+
+	if (slot->filled && slot->timestamp == timestamp) {
+		memcpy(pcm, slot->pcm, sizeof slot->pcm);
+		memcpy(jitter->last_pcm, slot->pcm, sizeof slot->pcm);
+
+		slot->filled = FALSE;
+		jitter->concealed_run = 0;
+		jitter->stats.played++;
+
+		if (jitter->comfort_noise && (int32_t)(timestamp - jitter->comfort_noise_timestamp) > 0) {
+			jitter->comfort_noise = FALSE;
+		}
+	} else if (jitter->comfort_noise && (int32_t)(timestamp - jitter->comfort_noise_timestamp) >= 0) {
+		generate_comfort_noise(jitter, pcm);
+
+		jitter->concealed_run = 0;
+		jitter->stats.comfort_noise++;
+	} else if (jitter->concealed_run < JITTER_MAX_CONCEALED_FRAMES) {
+		for (size_t i = 0; i < AUDIO_FRAME_SAMPLES; i++) {
+			pcm[i] = jitter->last_pcm[i] >> (jitter->concealed_run + 1);
+		}
+
+		jitter->concealed_run++;
+		jitter->stats.concealed++;
+	} else {
+		memset(pcm, 0, AUDIO_FRAME_SAMPLES * sizeof *pcm);
+
+		jitter->stats.concealed++;
+	}
+
+	jitter->playout_timestamp += AUDIO_FRAME_SAMPLES;
+}
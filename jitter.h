@@ -0,0 +1,53 @@
+#pragma once
+
+#include "audio.h"
+#include "packets.h"
+
+#include <stdint.h>
+
+#define JITTER_SLOTS 16
+#define JITTER_DEFAULT_DELAY_FRAMES 3
+
+/*
+ * Number of lost frames concealed by repeating (and fading) the last frame
+ * before falling back to silence.
+ */
+#define JITTER_MAX_CONCEALED_FRAMES 3
+
+typedef struct {
+	int filled;
+	uint32_t timestamp;
+	int16_t pcm[AUDIO_FRAME_SAMPLES];
+} JitterSlot;
+
+typedef struct {
+	uint64_t played;
+	uint64_t concealed;
+	uint64_t comfort_noise;
+	uint64_t late;
+	uint64_t malformed;
+} JitterStats;
+
+/*
+ * Receive-side playout buffer for one audio stream. Frames are indexed by
+ * timestamp so DTX gaps (timestamp jumps without sequence gaps) are filled
+ * with comfort noise rather than treated as loss.
+ */
+typedef struct {
+	JitterSlot slots[JITTER_SLOTS];
+	int started;
+	unsigned int delay_frames;
+	uint32_t playout_timestamp;
+	int16_t last_pcm[AUDIO_FRAME_SAMPLES];
+	unsigned int concealed_run;
+	int comfort_noise;
+	uint32_t comfort_noise_timestamp;
+	uint8_t noise_level;
+	uint32_t noise_seed;
+	JitterStats stats;
+} JitterBuffer;
+
+void jitter_init(JitterBuffer *jitter, unsigned int delay_frames);
+int jitter_push_frame(JitterBuffer *jitter, const AudioFrame *frame);
+void jitter_push_comfort_noise(JitterBuffer *jitter, const ComfortNoise *noise);
+void jitter_pull(JitterBuffer *jitter, int16_t *pcm);
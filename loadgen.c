@@ -0,0 +1,869 @@
+#include "loadgen.h"
+
+#include "audio.h"
+#include "config.h"
+#include "histogram.h"
+#include "packets.h"
+#include "scheduler.h"
+#include "utils.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 256
+#define VIDEO_KEYFRAME_INTERVAL 30
+
+typedef enum
+{
+	ConnectionStateConnecting,
+	ConnectionStateConfiguring,
+	ConnectionStateJoining,
+	ConnectionStateJoined,
+	ConnectionStateClosed
+} ConnectionState;
+
+/*
+ * One simulated client. Whatever the socket would not take yet waits in out,
+ * and a packet still arriving waits in in, or in reassembly if it comes in
+ * fragments. Times are in microseconds on the monotonic clock.
+ */
+typedef struct {
+	int fd;
+	uint32_t id;
+	ConnectionState state;
+	uint64_t connect_start;
+	uint64_t joined_at;
+	uint8_t *in;
+	uint32_t in_size;
+	uint32_t in_capacity;
+	Reassembly reassembly;
+	uint8_t *out;
+	uint32_t out_size;
+	uint32_t out_capacity;
+	uint64_t next_chat;
+	uint64_t next_audio;
+	uint64_t next_video;
+	uint16_t audio_seq;
+	uint16_t video_seq;
+} Connection;
+
+typedef struct {
+	struct sockaddr_in addr;
+	uint32_t connections;
+	double connect_rate;
+	double chat_rate;
+	uint32_t chat_size;
+	int audio;
+	uint32_t video_fps;
+	uint32_t video_size;
+	uint32_t duration;
+} LoadOptions;
+
+typedef struct {
+	uint64_t connected;
+	uint64_t failed;
+	uint64_t joined;
+	uint64_t closed;
+	uint64_t chat_sent;
+	uint64_t chat_delivered;
+	uint64_t audio_sent;
+	uint64_t video_sent;
+	uint64_t media_skipped;
+	uint64_t media_received;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	Histogram connect_time;
+	Histogram chat_latency;
+} LoadStats;
+
+typedef struct {
+	LoadOptions options;
+	int epoll_fd;
+	Connection *connections;
+	uint32_t num_started;
+	uint64_t start;
+	uint64_t nonce;
+	int16_t pcm[AUDIO_FRAME_SAMPLES];
+	uint8_t *video;
+	LoadStats stats;
+} LoadGen;
+
+static uint64_t now_us(void);
+static const char *env_or(const char *name, const char *fallback);
+static int read_options(LoadOptions *options);
+static int start_connection(LoadGen *loadgen, Connection *connection);
+static void close_connection(LoadGen *loadgen, Connection *connection, int failed);
+static int watch_output(LoadGen *loadgen, Connection *connection, int writable);
+static int send_bytes(LoadGen *loadgen, Connection *connection, const void *data, uint32_t size);
+static int flush_output(LoadGen *loadgen, Connection *connection);
+static int connected_handler(LoadGen *loadgen, Connection *connection);
+static int input_handler(LoadGen *loadgen, Connection *connection);
+static int packet_handler(LoadGen *loadgen, Connection *connection, const Serialised *packet);
+static int fragment_handler(LoadGen *loadgen, Connection *connection, const Serialised *fragment);
+static int config_handler(LoadGen *loadgen, Connection *connection, const Serialised *packet);
+static void chat_record_handler(LoadGen *loadgen, Connection *connection, const Serialised *packet);
+static int send_chat(LoadGen *loadgen, Connection *connection, uint64_t now);
+static int send_audio(LoadGen *loadgen, Connection *connection);
+static int send_video(LoadGen *loadgen, Connection *connection, uint64_t now);
+static void tick(LoadGen *loadgen);
+static void print_status(LoadGen *loadgen, uint64_t now);
+static void print_report(LoadGen *loadgen);
+
+static uint64_t now_us(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static const char *env_or(const char *name, const char *fallback) {
+	const char *value = getenv(name);
+
+	return value != NULL && value[0] != '\0' ? value : fallback;
+}
+
+static int read_options(LoadOptions *options) {
+	const char *host = env_or(LOADGEN_HOST_ENV, LOADGEN_DEFAULT_HOST);
+	const char *port = getenv(LOADGEN_PORT_ENV);
+	const char *connections = getenv(LOADGEN_CONNECTIONS_ENV);
+	const char *connect_rate = getenv(LOADGEN_CONNECT_RATE_ENV);
+	const char *chat_rate = getenv(LOADGEN_CHAT_RATE_ENV);
+	const char *chat_size = getenv(LOADGEN_CHAT_SIZE_ENV);
+	const char *audio = getenv(LOADGEN_AUDIO_ENV);
+	const char *video_fps = getenv(LOADGEN_VIDEO_FPS_ENV);
+	const char *video_size = getenv(LOADGEN_VIDEO_SIZE_ENV);
+	const char *duration = getenv(LOADGEN_DURATION_ENV);
+
+	*options = (LoadOptions){
+	    .addr = {.sin_family = AF_INET, .sin_port = htons(port != NULL ? atoi(port) : LOADGEN_DEFAULT_PORT)},
+	    .connections = connections != NULL ? strtoul(connections, NULL, 10) : LOADGEN_DEFAULT_CONNECTIONS,
+	    .connect_rate = connect_rate != NULL ? strtod(connect_rate, NULL) : LOADGEN_DEFAULT_CONNECT_RATE,
+	    .chat_rate = chat_rate != NULL ? strtod(chat_rate, NULL) : LOADGEN_DEFAULT_CHAT_RATE,
+	    .chat_size = chat_size != NULL ? strtoul(chat_size, NULL, 10) : LOADGEN_DEFAULT_CHAT_SIZE,
+	    .audio = audio != NULL && atoi(audio) != 0,
+	    .video_fps = video_fps != NULL ? strtoul(video_fps, NULL, 10) : 0,
+	    .video_size = video_size != NULL ? strtoul(video_size, NULL, 10) : LOADGEN_DEFAULT_VIDEO_SIZE,
+	    .duration = duration != NULL ? strtoul(duration, NULL, 10) : LOADGEN_DEFAULT_DURATION,
+	};
+
+	if (inet_pton(AF_INET, host, &options->addr.sin_addr) != 1) {
+		log_error(ERROR_CONFIG, "failed to parse load generator host");
+
+		return -1;
+	}
+
+	if (options->connect_rate <= 0) {
+		options->connect_rate = LOADGEN_DEFAULT_CONNECT_RATE;
+	}
+
+	if (options->chat_size >= CHAT_MESSAGE_MAX_SIZE) {
+		options->chat_size = CHAT_MESSAGE_MAX_SIZE - 1;
+	}
+
+	if (options->video_size > PACKET_MAX_SIZE / 2) {
+		options->video_size = PACKET_MAX_SIZE / 2;
+	}
+
+	return 0;
+}
+
+static int start_connection(LoadGen *loadgen, Connection *connection) {
+	connection->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	connection->connect_start = now_us();
+
+	if (connection->fd < 0) {
+		log_error(ERROR_NETWORK, "failed to construct socket");
+
+		return -1;
+	}
+
+	if (connect(connection->fd, (struct sockaddr *)&loadgen->options.addr, sizeof loadgen->options.addr) < 0 &&
+	    errno != EINPROGRESS) {
+		return -1;
+	}
+
+	// Connected once the socket turns writable.
+	struct epoll_event event = {.events = EPOLLIN | EPOLLOUT, .data.ptr = connection};
+
+	if (epoll_ctl(loadgen->epoll_fd, EPOLL_CTL_ADD, connection->fd, &event) < 0) {
+		log_error(ERROR_OS, "failed to watch connection");
+
+		return -1;
+	}
+
+	connection->state = ConnectionStateConnecting;
+
+	return 0;
+}
+
+static void close_connection(LoadGen *loadgen, Connection *connection, int failed) {
+	if (connection->fd >= 0) {
+		close(connection->fd);
+	}
+
+	if (failed) {
+		loadgen->stats.failed++;
+	} else if (connection->state != ConnectionStateClosed) {
+		loadgen->stats.closed++;
+	}
+
+	connection->fd = -1;
+	connection->state = ConnectionStateClosed;
+	freep(connection->in);
+	freep(connection->out);
+	reassembly_free(&connection->reassembly);
+	connection->in_size = connection->in_capacity = 0;
+	connection->out_size = connection->out_capacity = 0;
+}
+
+/*
+ * Only ask to hear about the socket being writable while there is something
+ * waiting to go out, or epoll would wake for every connection all the time.
+ */
+static int watch_output(LoadGen *loadgen, Connection *connection, int writable) {
+	struct epoll_event event = {.events = EPOLLIN | (writable ? EPOLLOUT : 0), .data.ptr = connection};
+
+	if (epoll_ctl(loadgen->epoll_fd, EPOLL_CTL_MOD, connection->fd, &event) < 0) {
+		log_error(ERROR_OS, "failed to watch connection");
+
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Send straight away if nothing is waiting, and keep whatever the socket
+ * would not take.
+ */
+static int send_bytes(LoadGen *loadgen, Connection *connection, const void *data, uint32_t size) {
+	uint32_t sent = 0;
+
+	if (connection->out_size == 0) {
+		ssize_t n = send(connection->fd, data, size, MSG_NOSIGNAL);
+
+		if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+			return -1;
+		}
+
+		sent = n > 0 ? n : 0;
+		loadgen->stats.bytes_out += sent;
+
+		if (sent == size) {
+			return 0;
+		}
+
+		if (watch_output(loadgen, connection, TRUE) < 0) {
+			return -1;
+		}
+	}
+
+	if (connection->out_size + size - sent > connection->out_capacity) {
+		uint32_t capacity = connection->out_capacity > 0 ? connection->out_capacity : 4096;
+
+		while (capacity < connection->out_size + size - sent) {
+			capacity *= 2;
+		}
+
+		uint8_t *out = realloc(connection->out, capacity);
+
+		if (out == NULL) {
+			return -1;
+		}
+
+		connection->out = out;
+		connection->out_capacity = capacity;
+	}
+
+	memcpy(connection->out + connection->out_size, (const uint8_t *)data + sent, size - sent);
+	connection->out_size += size - sent;
+
+	return 0;
+}
+
+static int flush_output(LoadGen *loadgen, Connection *connection) {
+	ssize_t n = send(connection->fd, connection->out, connection->out_size, MSG_NOSIGNAL);
+
+	if (n < 0) {
+		return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+	}
+
+	loadgen->stats.bytes_out += n;
+	connection->out_size -= n;
+	memmove(connection->out, connection->out + n, connection->out_size);
+
+	return connection->out_size == 0 ? watch_output(loadgen, connection, FALSE) : 0;
+}
+
+static int connected_handler(LoadGen *loadgen, Connection *connection) {
+	int error = 0;
+	socklen_t error_size = sizeof error;
+
+	if (getsockopt(connection->fd, SOL_SOCKET, SO_ERROR, &error, &error_size) < 0 || error != 0) {
+		return -1;
+	}
+
+	connection->state = ConnectionStateConfiguring;
+	loadgen->stats.connected++;
+
+	return watch_output(loadgen, connection, FALSE);
+}
+
+/*
+ * Read whatever has arrived and handle every whole packet in it.
+ */
+static int input_handler(LoadGen *loadgen, Connection *connection) {
+	while (TRUE) {
+		uint32_t wanted = PACKET_HEADER_SIZE;
+
+		if (connection->in_size >= PACKET_HEADER_SIZE) {
+			memcpy(&wanted, connection->in + sizeof(PacketType), sizeof wanted);
+
+			if (wanted < PACKET_HEADER_SIZE || wanted > PACKET_MAX_SIZE) {
+				log_errorf(ERROR_NETWORK, "received network packet with bad size %" PRIu32, wanted);
+
+				return -1;
+			}
+		}
+
+		// Room for the rest of the packet, and some of the next.
+		if (connection->in_capacity < wanted + 4096) {
+			uint8_t *in = realloc(connection->in, wanted + 4096);
+
+			if (in == NULL) {
+				return -1;
+			}
+
+			connection->in = in;
+			connection->in_capacity = wanted + 4096;
+		}
+
+		ssize_t n = recv(connection->fd,
+		                 connection->in + connection->in_size,
+		                 connection->in_capacity - connection->in_size,
+		                 0);
+
+		if (n < 0) {
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+		} else if (n == 0) {
+			return -1;
+		}
+
+		loadgen->stats.bytes_in += n;
+		connection->in_size += n;
+
+		uint32_t offset = 0;
+		Serialised packet;
+
+		while (next_packet(connection->in, connection->in_size, &offset, &packet) == 0) {
+			if (packet_handler(loadgen, connection, &packet) < 0) {
+				return -1;
+			}
+		}
+
+		connection->in_size -= offset;
+		memmove(connection->in, connection->in + offset, connection->in_size);
+	}
+}
+
+static int packet_handler(LoadGen *loadgen, Connection *connection, const Serialised *packet) {
+	switch (((const PacketType *)packet->data)[0]) {
+		case PacketTypeConfig:
+			return config_handler(loadgen, connection, packet);
+
+		case PacketTypeHeartbeat: {
+			HeartbeatProbe probe = {0};
+
+			if (unserialise_heartbeat(packet, &probe) == 0 && probe.kind == HeartbeatPing) {
+				uint8_t buffer[PACKET_HEADER_SIZE + sizeof probe.kind + sizeof probe.timestamp];
+
+				probe.kind = HeartbeatPong;
+
+				uint32_t size = serialise_heartbeat_into(&probe, buffer, sizeof buffer);
+
+				return send_bytes(loadgen, connection, buffer, size);
+			}
+
+			break;
+		}
+
+		// Sent to everyone who gets into a room, which is the only sign they did.
+		case PacketTypeActiveSpeaker:
+			if (connection->state == ConnectionStateJoining) {
+				uint64_t now = now_us();
+
+				connection->state = ConnectionStateJoined;
+				connection->joined_at = now;
+				loadgen->stats.joined++;
+
+				// Spread the first sends over one interval so the connections do not send in step.
+				if (loadgen->options.chat_rate > 0) {
+					connection->next_chat = now + random() % (uint64_t)(1000000 / loadgen->options.chat_rate + 1);
+				}
+
+				connection->next_audio = now + random() % (AUDIO_FRAME_MS * 1000);
+
+				if (loadgen->options.video_fps > 0) {
+					connection->next_video = now + random() % (1000000 / loadgen->options.video_fps);
+				}
+			}
+
+			break;
+
+		case PacketTypeChatRecord:
+			chat_record_handler(loadgen, connection, packet);
+
+			break;
+
+		case PacketTypeAudioFrame:
+		case PacketTypeComfortNoise:
+		case PacketTypeVideoFrame:
+			loadgen->stats.media_received++;
+
+			break;
+
+		case PacketTypeFragment:
+			return fragment_handler(loadgen, connection, packet);
+
+		default:
+			break;
+	}
+
+	return 0;
+}
+
+/*
+ * The server sends anything large in fragments, and a batch of chat records
+ * queued together comes out of them as back-to-back packets.
+ */
+static int fragment_handler(LoadGen *loadgen, Connection *connection, const Serialised *fragment) {
+	Serialised packet = {0};
+	Serialised inner;
+	int ret = reassembly_add(&connection->reassembly, fragment, &packet);
+
+	if (ret <= 0) {
+		return ret;
+	}
+
+	ret = 0;
+
+	for (uint32_t offset = 0; ret == 0 && next_packet(packet.data, packet.size, &offset, &inner) == 0;) {
+		ret = packet_handler(loadgen, connection, &inner);
+	}
+
+	free(packet.data);
+
+	return ret;
+}
+
+/*
+ * The server's configuration is the first sign a connection works. Then join
+ * a room, the connections spread evenly over every room there is.
+ */
+static int config_handler(LoadGen *loadgen, Connection *connection, const Serialised *packet) {
+	if (connection->state != ConnectionStateConfiguring) {
+		return 0;
+	}
+
+	histogram_record(&loadgen->stats.connect_time, now_us() - connection->connect_start);
+
+	Config *config = unserialise_config(packet);
+
+	if (config == NULL) {
+		log_error(ERROR_NETWORK, "received malformed configuration");
+
+		return -1;
+	}
+
+	uint16_t num_rooms = config->num_rooms;
+
+	config_free(config);
+
+	if (num_rooms == 0) {
+		return 0;
+	}
+
+	uint8_t buffer[PACKET_VALUE_SIZE(RoomIndex)];
+	uint32_t size = serialise_join_room_into(connection->id % num_rooms, buffer, sizeof buffer);
+
+	connection->state = ConnectionStateJoining;
+
+	return send_bytes(loadgen, connection, buffer, size);
+}
+
+/*
+ * Time the delivery of chat this run sent after the connection joined. Older
+ * chat comes with the room's history, and would only measure how long ago it
+ * was sent.
+ */
+static void chat_record_handler(LoadGen *loadgen, Connection *connection, const Serialised *packet) {
+	ChatRecord record;
+	char text[64];
+	uint64_t nonce = 0;
+	uint64_t sent = 0;
+
+	if (unserialise_chat_record(packet, &record) < 0) {
+		return;
+	}
+
+	size_t size = record.size < sizeof text - 1 ? record.size : sizeof text - 1;
+
+	memcpy(text, record.data, size);
+	text[size] = '\0';
+
+	if (sscanf(text, LOADGEN_CHAT_PREFIX " %" SCNu64 " %" SCNu64, &nonce, &sent) != 2 || nonce != loadgen->nonce ||
+	    sent < connection->joined_at) {
+		return;
+	}
+
+	loadgen->stats.chat_delivered++;
+	histogram_record(&loadgen->stats.chat_latency, now_us() - sent);
+}
+
+static int send_chat(LoadGen *loadgen, Connection *connection, uint64_t now) {
+	char msg[CHAT_MESSAGE_MAX_SIZE];
+	uint32_t size = loadgen->options.chat_size;
+	int n = snprintf(msg, sizeof msg, LOADGEN_CHAT_PREFIX " %" PRIu64 " %" PRIu64 " ", loadgen->nonce, now);
+
+	// Padded out to the chat size, unless the stamp alone is longer.
+	if ((uint32_t)n < size) {
+		memset(msg + n, 'x', size - n);
+		msg[size] = '\0';
+	}
+
+	Serialised *serialised = serialise_chat_message(msg);
+	int ret = send_bytes(loadgen, connection, serialised->data, serialised->size);
+
+	free(serialised->data);
+	free(serialised);
+
+	loadgen->stats.chat_sent++;
+
+	return ret;
+}
+
+static int send_audio(LoadGen *loadgen, Connection *connection) {
+	if (connection->out_size > LOADGEN_MAX_BACKLOG) {
+		loadgen->stats.media_skipped++;
+
+		return 0;
+	}
+
+	AudioFrame frame = {.seq = connection->audio_seq,
+	                    .timestamp = (uint32_t)connection->audio_seq * AUDIO_FRAME_SAMPLES,
+	                    .codec = AudioCodecPCM,
+	                    .num_samples = AUDIO_FRAME_SAMPLES,
+	                    .size = sizeof loadgen->pcm,
+	                    .data = (uint8_t *)loadgen->pcm};
+	// Room for the frame's fields and then some.
+	uint8_t buffer[PACKET_HEADER_SIZE + 16 + sizeof loadgen->pcm];
+	uint32_t size = serialise_audio_frame_into(&frame, buffer, sizeof buffer);
+
+	connection->audio_seq++;
+	loadgen->stats.audio_sent++;
+
+	return send_bytes(loadgen, connection, buffer, size);
+}
+
+static int send_video(LoadGen *loadgen, Connection *connection, uint64_t now) {
+	if (connection->out_size > LOADGEN_MAX_BACKLOG) {
+		loadgen->stats.media_skipped++;
+
+		return 0;
+	}
+
+	VideoFrame frame = {.seq = connection->video_seq,
+	                    .timestamp = now / 1000,
+	                    .flags = connection->video_seq % VIDEO_KEYFRAME_INTERVAL == 0 ? VIDEO_FLAG_KEYFRAME : 0,
+	                    .width = LOADGEN_VIDEO_WIDTH,
+	                    .height = LOADGEN_VIDEO_HEIGHT,
+	                    .size = loadgen->options.video_size,
+	                    .data = loadgen->video};
+	Serialised *serialised = serialise_video_frame(&frame);
+	int ret = send_bytes(loadgen, connection, serialised->data, serialised->size);
+
+	free(serialised->data);
+	free(serialised);
+
+	connection->video_seq++;
+	loadgen->stats.video_sent++;
+
+	return ret;
+}
+
+/*
+ * Open however many connections are due by now, and have every connection in
+ * a room send whatever is due.
+ */
+static void tick(LoadGen *loadgen) {
+	const LoadOptions *options = &loadgen->options;
+	uint64_t now = now_us();
+	double due = (now - loadgen->start) / 1e6 * options->connect_rate;
+
+	while (loadgen->num_started < options->connections && loadgen->num_started < due) {
+		Connection *connection = &loadgen->connections[loadgen->num_started++];
+
+		if (start_connection(loadgen, connection) < 0) {
+			close_connection(loadgen, connection, TRUE);
+		}
+	}
+
+	for (uint32_t i = 0; i < loadgen->num_started; i++) {
+		Connection *connection = &loadgen->connections[i];
+		int ret = 0;
+
+		if (connection->state != ConnectionStateJoined) {
+			continue;
+		}
+
+		if (options->chat_rate > 0 && connection->next_chat <= now) {
+			ret |= send_chat(loadgen, connection, now);
+			connection->next_chat += 1000000 / options->chat_rate;
+		}
+
+		if (options->audio && connection->next_audio <= now) {
+			ret |= send_audio(loadgen, connection);
+			connection->next_audio += AUDIO_FRAME_MS * 1000;
+		}
+
+		if (options->video_fps > 0 && connection->next_video <= now) {
+			ret |= send_video(loadgen, connection, now);
+			connection->next_video += 1000000 / options->video_fps;
+		}
+
+		if (ret < 0) {
+			close_connection(loadgen, connection, FALSE);
+		}
+	}
+}
+
+static void print_status(LoadGen *loadgen, uint64_t now) {
+	const LoadStats *stats = &loadgen->stats;
+
+	printf("%4" PRIu64 "s  %6" PRIu64 " connected  %6" PRIu64 " joined  %6" PRIu64 " closed  %8" PRIu64
+	       " chat sent  %9" PRIu64 " delivered  p99 %" PRIu64 "us\n",
+	       (now - loadgen->start) / 1000000,
+	       stats->connected,
+	       stats->joined,
+	       stats->closed + stats->failed,
+	       stats->chat_sent,
+	       stats->chat_delivered,
+	       histogram_percentile(&stats->chat_latency, 99));
+	fflush(stdout);
+}
+
+static void print_report(LoadGen *loadgen) {
+	const LoadStats *stats = &loadgen->stats;
+
+	printf("connections     %" PRIu32 " opened, %" PRIu64 " connected, %" PRIu64 " failed, %" PRIu64
+	       " joined a room, %" PRIu64 " closed by the server\n",
+	       loadgen->num_started,
+	       stats->connected,
+	       stats->failed,
+	       stats->joined,
+	       stats->closed);
+	printf("connect time    p50 %" PRIu64 "us  p90 %" PRIu64 "us  p99 %" PRIu64 "us  p99.9 %" PRIu64 "us\n",
+	       histogram_percentile(&stats->connect_time, 50),
+	       histogram_percentile(&stats->connect_time, 90),
+	       histogram_percentile(&stats->connect_time, 99),
+	       histogram_percentile(&stats->connect_time, 99.9));
+	printf("chat            %" PRIu64 " sent, %" PRIu64 " delivered\n", stats->chat_sent, stats->chat_delivered);
+	printf("chat latency    p50 %" PRIu64 "us  p90 %" PRIu64 "us  p99 %" PRIu64 "us  p99.9 %" PRIu64 "us\n",
+	       histogram_percentile(&stats->chat_latency, 50),
+	       histogram_percentile(&stats->chat_latency, 90),
+	       histogram_percentile(&stats->chat_latency, 99),
+	       histogram_percentile(&stats->chat_latency, 99.9));
+	printf("media           %" PRIu64 " audio and %" PRIu64 " video frames sent, %" PRIu64 " skipped, %" PRIu64
+	       " packets received\n",
+	       stats->audio_sent,
+	       stats->video_sent,
+	       stats->media_skipped,
+	       stats->media_received);
+	printf("bytes           %" PRIu64 " in, %" PRIu64 " out\n", stats->bytes_in, stats->bytes_out);
+}
+
+int main() {
+	LoadGen loadgen = {0};
+
+	if (read_options(&loadgen.options) < 0) {
+		log_fatal(ERROR_CONFIG, "failed to read load generator options");
+	}
+
+	// Every connection is a descriptor, so take as many as we are allowed.
+	struct rlimit limit;
+
+	if (getrlimit(RLIMIT_NOFILE, &limit) == 0) {
+		limit.rlim_cur = limit.rlim_max;
+		setrlimit(RLIMIT_NOFILE, &limit);
+
+		if (limit.rlim_cur < loadgen.options.connections + 16) {
+			log_errorf(ERROR_OS,
+			           "only %lu descriptors allowed, some connections will fail",
+			           (unsigned long)limit.rlim_cur);
+		}
+	}
+
+	loadgen.connections = calloc(loadgen.options.connections, sizeof *loadgen.connections);
+	loadgen.video = calloc(loadgen.options.video_size, 1);
+
+	if (loadgen.connections == NULL || loadgen.video == NULL) {
+		log_fatal(ERROR_OS, "failed to allocate connections");
+	}
+
+	for (uint32_t i = 0; i < loadgen.options.connections; i++) {
+		loadgen.connections[i] = (Connection){.fd = -1, .id = i, .state = ConnectionStateClosed};
+	}
+
+	// A quiet tone, loud enough to count as speech.
+	for (size_t i = 0; i < AUDIO_FRAME_SAMPLES; i++) {
+		loadgen.pcm[i] = (int16_t)(4000 * sin(2 * M_PI * 440 * i / AUDIO_SAMPLE_RATE));
+	}
+
+	for (uint32_t i = 0; i < loadgen.options.video_size; i++) {
+		loadgen.video[i] = random();
+	}
+
+	sigset_t signals;
+
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+
+	if (sigprocmask(SIG_BLOCK, &signals, NULL) < 0) {
+		log_fatal(ERROR_OS, "failed to block signals");
+	}
+
+	int signal_fd = signalfd(-1, &signals, SFD_CLOEXEC);
+	int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	struct itimerspec interval = {.it_interval.tv_nsec = LOADGEN_TICK_MS * 1000000,
+	                              .it_value.tv_nsec = LOADGEN_TICK_MS * 1000000};
+
+	loadgen.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+
+	if (signal_fd < 0 || timer_fd < 0 || loadgen.epoll_fd < 0 || timerfd_settime(timer_fd, 0, &interval, NULL) < 0) {
+		log_fatal(ERROR_OS, "failed to set up event loop");
+	}
+
+	// The signal and timer descriptors are told apart from connections by their own addresses.
+	struct epoll_event signal_event = {.events = EPOLLIN, .data.ptr = &signal_fd};
+	struct epoll_event timer_event = {.events = EPOLLIN, .data.ptr = &timer_fd};
+
+	if (epoll_ctl(loadgen.epoll_fd, EPOLL_CTL_ADD, signal_fd, &signal_event) < 0 ||
+	    epoll_ctl(loadgen.epoll_fd, EPOLL_CTL_ADD, timer_fd, &timer_event) < 0) {
+		log_fatal(ERROR_OS, "failed to set up event loop");
+	}
+
+	loadgen.start = now_us();
+	loadgen.nonce = ((uint64_t)getpid() << 32) ^ loadgen.start;
+	srandom(loadgen.nonce);
+
+	uint64_t end = loadgen.start + (uint64_t)loadgen.options.duration * 1000000;
+	uint64_t next_status = loadgen.start + 1000000;
+	int running = TRUE;
+
+	while (running) {
+		struct epoll_event events[MAX_EVENTS];
+		int num_events = epoll_wait(loadgen.epoll_fd, events, MAX_EVENTS, -1);
+
+		if (num_events < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			log_error(ERROR_OS, "failed to wait for events");
+
+			break;
+		}
+
+		for (int i = 0; i < num_events; i++) {
+			if (events[i].data.ptr == &signal_fd) {
+				running = FALSE;
+
+				continue;
+			}
+
+			if (events[i].data.ptr == &timer_fd) {
+				uint64_t expirations;
+				uint64_t now = now_us();
+
+				if (read(timer_fd, &expirations, sizeof expirations) < 0) {
+					log_error(ERROR_OS, "failed to read tick timer");
+				}
+
+				tick(&loadgen);
+
+				if (now >= next_status) {
+					print_status(&loadgen, now);
+					next_status += 1000000;
+				}
+
+				if (now >= end) {
+					running = FALSE;
+				}
+
+				continue;
+			}
+
+			Connection *connection = events[i].data.ptr;
+			int ret = 0;
+
+			if (connection->state == ConnectionStateClosed) {
+				continue;
+			}
+
+			if (connection->state == ConnectionStateConnecting) {
+				if ((events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP)) != 0 &&
+				    connected_handler(&loadgen, connection) < 0) {
+					close_connection(&loadgen, connection, TRUE);
+				}
+
+				continue;
+			}
+
+			if ((events[i].events & EPOLLOUT) != 0) {
+				ret = flush_output(&loadgen, connection);
+			}
+
+			if (ret == 0 && (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) != 0) {
+				ret = input_handler(&loadgen, connection);
+			}
+
+			if (ret < 0) {
+				close_connection(&loadgen, connection, FALSE);
+			}
+		}
+	}
+
+	for (uint32_t i = 0; i < loadgen.num_started; i++) {
+		if (loadgen.connections[i].state != ConnectionStateClosed) {
+			// Closed by us, so not counted as closed by the server.
+			loadgen.connections[i].state = ConnectionStateClosed;
+			close_connection(&loadgen, &loadgen.connections[i], FALSE);
+		}
+	}
+
+	print_report(&loadgen);
+
+	close(loadgen.epoll_fd);
+	close(timer_fd);
+	close(signal_fd);
+	free(loadgen.connections);
+	free(loadgen.video);
+
+	return EXIT_SUCCESS;
+}
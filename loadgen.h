@@ -0,0 +1,43 @@
+#pragma once
+
+/*
+ * Everything about a run is set from the environment, falling back to these.
+ * Rates are per second, sizes in bytes and the duration in seconds. Chat and
+ * media are only sent by connections that got into a room, at the given rate
+ * each. A video rate of 0 sends no video.
+ */
+#define LOADGEN_HOST_ENV "MACLUNKEY_LOADGEN_HOST"
+#define LOADGEN_PORT_ENV "MACLUNKEY_LOADGEN_PORT"
+#define LOADGEN_CONNECTIONS_ENV "MACLUNKEY_LOADGEN_CONNECTIONS"
+#define LOADGEN_CONNECT_RATE_ENV "MACLUNKEY_LOADGEN_CONNECT_RATE"
+#define LOADGEN_CHAT_RATE_ENV "MACLUNKEY_LOADGEN_CHAT_RATE"
+#define LOADGEN_CHAT_SIZE_ENV "MACLUNKEY_LOADGEN_CHAT_SIZE"
+#define LOADGEN_AUDIO_ENV "MACLUNKEY_LOADGEN_AUDIO"
+#define LOADGEN_VIDEO_FPS_ENV "MACLUNKEY_LOADGEN_VIDEO_FPS"
+#define LOADGEN_VIDEO_SIZE_ENV "MACLUNKEY_LOADGEN_VIDEO_SIZE"
+#define LOADGEN_DURATION_ENV "MACLUNKEY_LOADGEN_DURATION"
+
+#define LOADGEN_DEFAULT_HOST "127.0.0.1"
+#define LOADGEN_DEFAULT_PORT 5000
+#define LOADGEN_DEFAULT_CONNECTIONS 1000
+#define LOADGEN_DEFAULT_CONNECT_RATE 500
+#define LOADGEN_DEFAULT_CHAT_RATE 1.0
+#define LOADGEN_DEFAULT_CHAT_SIZE 64
+#define LOADGEN_DEFAULT_VIDEO_SIZE 4096
+#define LOADGEN_DEFAULT_DURATION 30
+
+/*
+ * How often the send schedule is looked at, and how much may be waiting to go
+ * out on one connection before its media is skipped rather than queued.
+ */
+#define LOADGEN_TICK_MS 5
+#define LOADGEN_MAX_BACKLOG (1024 * 1024)
+
+/*
+ * Chat sent by a run starts with this, the run's nonce and when it was sent,
+ * so deliveries can be timed and told apart from anything else in the room.
+ */
+#define LOADGEN_CHAT_PREFIX "loadgen"
+
+#define LOADGEN_VIDEO_WIDTH 64
+#define LOADGEN_VIDEO_HEIGHT 36
@@ -0,0 +1,1292 @@
+#include "logger.h"
+
+#include "mpsc.h"
+#include "utils.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/types.h>
+#include <time.h>
+#include <wchar.h>
+
+#define LOG_RECORD_ALIGN 16
+#define LOG_OUTPUT_SIZE (16 * 1024)
+#define LOG_SPEC_SIZE 48
+#define LOG_MAX_FLAGS 8
+#define LOG_MAX_WIDTH 9999
+#define LOG_PRECISION_STAR (-2)
+
+/*
+ * How long the logger's thread lets messages gather once woken, so that a
+ * thread logging in a loop is not stopped to write out each one. A ring
+ * filling past its high-water mark cuts the wait short.
+ */
+#define LOG_BATCH_DELAY_NS 1000000
+#define LOG_RING_HIGH_WATER (LOG_RING_SIZE / 2)
+
+/*
+ * A message in a ring, followed by its arguments. The size covers both and
+ * is a multiple of LOG_RECORD_ALIGN. A record without a site only pads the
+ * ring out to its end, where a record would not have fit. sequence counts
+ * messages across every ring, so they can be written out in the order they
+ * were logged in.
+ */
+typedef struct {
+	const LogSite *site;
+	size_t size;
+	uint64_t sequence;
+} LogRecord;
+
+/*
+ * A thread's messages on their way to the logger's thread. Only the owning
+ * thread moves tail and only whoever holds drain_lock moves head, which both
+ * count bytes from the start and never wrap. The thread keeps its own copy of
+ * head to check for space against, and only reads the real one when that
+ * says the ring is full.
+ *
+ * Like metrics shards, rings outlive their threads and are taken over by the
+ * next thread that logs.
+ */
+typedef struct LogRing {
+	atomic_uint_least64_t tail;
+	uint64_t cached_head;
+	atomic_uint_least64_t dropped;
+	uint8_t tail_padding[CACHE_LINE_SIZE - 2 * sizeof(atomic_uint_least64_t) - sizeof(uint64_t)];
+	atomic_uint_least64_t head;
+	uint8_t head_padding[CACHE_LINE_SIZE - sizeof(atomic_uint_least64_t)];
+	atomic_int in_use;
+	struct LogRing *next;
+	uint8_t data[LOG_RING_SIZE];
+} LogRing;
+
+typedef enum
+{
+	ModifierNone,
+	ModifierChar,
+	ModifierShort,
+	ModifierLong,
+	ModifierLongLong,
+	ModifierMax,
+	ModifierSize,
+	ModifierPtrdiff,
+	ModifierLongDouble
+} Modifier;
+
+/*
+ * What a conversion takes from the arguments and how it is kept in a record.
+ * Integers are widened to intmax_t, strings are copied in after their length
+ * and %m keeps the errno it would have printed. A * takes an int of its own.
+ * Wide strings and %n are not supported: their argument is skipped and
+ * nothing is printed for them.
+ */
+typedef enum
+{
+	ArgUnknown,
+	ArgPercent,
+	ArgSigned,
+	ArgUnsigned,
+	ArgChar,
+	ArgDouble,
+	ArgLongDouble,
+	ArgPointer,
+	ArgString,
+	ArgError,
+	ArgSkip,
+	ArgStar
+} ArgKind;
+
+typedef enum
+{
+	SiteUndescribed,
+	SiteDescribing,
+	SiteDescribed
+} SiteDescription;
+
+typedef struct {
+	const char *start;
+	const char *end;
+	const char *flags;
+	int flags_length;
+	int width;
+	int width_star;
+	int precision;
+	int precision_star;
+	Modifier modifier;
+	char conversion;
+	ArgKind kind;
+} Spec;
+
+/*
+ * A ring being merged into the output, from head up to the tail it had when
+ * the merge started. sequence is that of the record at head.
+ */
+typedef struct {
+	LogRing *ring;
+	uint64_t head;
+	uint64_t tail;
+	uint64_t sequence;
+} LogCursor;
+
+typedef struct {
+	char data[LOG_OUTPUT_SIZE];
+	size_t size;
+} LogOutput;
+
+static void start_logger(void);
+static LogLevel default_level(void);
+static void *logger_handler(void *arg);
+static void wake_logger(int hurry);
+static int filling(LogRing *ring);
+static LogRing *local_ring(void);
+static LogRing *attach_ring(void);
+static void detach_ring(void *arg);
+static int push(LogRing *ring, LogSite *site, int error, va_list *args);
+static void drain(LogRing *ring);
+static void drain_all(void);
+static int next_record(LogCursor *cursor);
+static void sift_up(size_t index);
+static void sift_down(size_t index);
+static void write_now(LogSite *site, int error, va_list *args);
+static const char *parse_spec(const char *percent, Spec *spec);
+static int parse_number(const char **next);
+static int describe(const char *format, LogArg *args);
+static int site_args(LogSite *site, const LogArg **args, LogArg *scratch);
+static size_t encode(LogSite *site, int error, va_list *args, uint8_t *data, size_t capacity);
+static intmax_t signed_arg(Modifier modifier, va_list *args);
+static uintmax_t unsigned_arg(Modifier modifier, va_list *args);
+static int put(uint8_t *data, size_t capacity, size_t *size, const void *value, size_t length);
+static void format_record(const LogSite *site, const uint8_t *args, size_t size);
+static int format_arg(Spec *spec, const uint8_t *args, size_t size, size_t *offset);
+static int take(const uint8_t *args, size_t size, size_t *offset, void *value, size_t length);
+static void spec_string(const Spec *spec, const char *modifier, char conversion, char *buffer);
+static void output_write(const char *data, size_t length);
+static void output_printf(const char *format, ...);
+static void output_flush(void);
+
+static const char *const level_names[] = {"INFO", "WARNING", "ERROR", "FATAL"};
+
+atomic_int log_threshold = LogLevelInfo - 1;
+
+static pthread_once_t logger_once = PTHREAD_ONCE_INIT;
+static int logger_running = FALSE;
+static _Atomic(LogRing *) rings;
+static atomic_uint_least64_t next_sequence;
+static pthread_key_t ring_key;
+static _Thread_local LogRing *thread_ring;
+
+/*
+ * Whoever holds drain_lock formats records and owns output, which is mostly
+ * the logger's thread but can be any thread flushing. The rings being merged
+ * are kept in cursors as a heap ordered by sequence.
+ */
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static LogOutput output;
+static uint64_t reported_drops;
+static LogCursor *cursors;
+static size_t num_cursors;
+static size_t cursors_capacity;
+
+/*
+ * The logger's thread sleeps until pending is set, which only the first
+ * message logged after it last woke does, so while it is busy logging costs
+ * no more than an atomic load to wake it. It then waits out the batch delay
+ * unless hurried, which the first message to leave a ring past its high-water
+ * mark, or to be dropped, does.
+ */
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_cond;
+static atomic_int pending;
+static atomic_int hurried;
+
+void log_write(LogSite *site, ...) {
+	int error = errno;
+	va_list args;
+
+	pthread_once(&logger_once, start_logger);
+
+	if ((int)site->level < atomic_load_explicit(&log_threshold, memory_order_relaxed)) {
+		return;
+	}
+
+	LogRing *ring = logger_running ? local_ring() : NULL;
+
+	va_start(args, site);
+
+	if (ring == NULL) {
+		write_now(site, error, &args);
+	} else if (push(ring, site, error, &args) == 0) {
+		wake_logger(filling(ring));
+
+		if (site->level == LogLevelFatal) {
+			log_flush();
+		}
+	} else if (site->level == LogLevelFatal) {
+		// Fatal messages are the last thing the program says, so never drop them.
+		log_flush();
+		write_now(site, error, &args);
+	} else {
+		atomic_store_explicit(&ring->dropped,
+		                      atomic_load_explicit(&ring->dropped, memory_order_relaxed) + 1,
+		                      memory_order_relaxed);
+		wake_logger(TRUE);
+	}
+
+	va_end(args);
+
+	errno = error;
+}
+
+void log_set_level(LogLevel level) {
+	pthread_once(&logger_once, start_logger);
+	atomic_store(&log_threshold, level);
+}
+
+/*
+ * Write out everything logged so far, from the calling thread.
+ */
+void log_flush(void) {
+	pthread_mutex_lock(&drain_lock);
+	drain_all();
+
+	uint64_t dropped = log_dropped();
+
+	if (dropped > reported_drops) {
+		output_printf("%s: %" PRIu64 " log messages dropped\n", level_names[LogLevelWarning], dropped - reported_drops);
+		reported_drops = dropped;
+	}
+
+	output_flush();
+	pthread_mutex_unlock(&drain_lock);
+}
+
+uint64_t log_dropped(void) {
+	uint64_t dropped = 0;
+
+	for (LogRing *ring = atomic_load(&rings); ring != NULL; ring = ring->next) {
+		dropped += atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+	}
+
+	return dropped;
+}
+
+/*
+ * If the logger's thread cannot be started, messages are written out as they
+ * are logged instead.
+ */
+static void start_logger(void) {
+	int unset = LogLevelInfo - 1;
+	pthread_condattr_t wake_attr;
+	pthread_t thread;
+	sigset_t all;
+	sigset_t old;
+
+	atomic_compare_exchange_strong(&log_threshold, &unset, default_level());
+
+	// The batch delay is timed against the monotonic clock, so setting the time cannot stretch it.
+	pthread_condattr_init(&wake_attr);
+	pthread_condattr_setclock(&wake_attr, CLOCK_MONOTONIC);
+
+	int ret = pthread_cond_init(&wake_cond, &wake_attr);
+
+	pthread_condattr_destroy(&wake_attr);
+
+	if (ret != 0 || pthread_key_create(&ring_key, detach_ring) != 0) {
+		return;
+	}
+
+	// Signals are for the program's own threads to handle, not the logger's.
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	if (pthread_create(&thread, NULL, logger_handler, NULL) == 0) {
+		pthread_detach(thread);
+		logger_running = TRUE;
+		atexit(log_flush);
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+static LogLevel default_level(void) {
+	const char *level = getenv(LOG_LEVEL_ENV);
+
+	if (level != NULL) {
+		for (LogLevel i = LogLevelInfo; i <= LogLevelFatal; i++) {
+			if (strcasecmp(level, level_names[i]) == 0) {
+				return i;
+			}
+		}
+
+		fprintf(stderr, "%s: unknown log level %s\n", level_names[LogLevelWarning], level);
+	}
+
+#ifdef DEBUG
+	return LogLevelInfo;
+#else
+	return LogLevelError;
+#endif
+}
+
+static void *logger_handler(void *arg) {
+	(void)arg;
+
+	while (TRUE) {
+		struct timespec deadline;
+
+		pthread_mutex_lock(&wake_lock);
+
+		while (!atomic_load(&pending)) {
+			pthread_cond_wait(&wake_cond, &wake_lock);
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_nsec += LOG_BATCH_DELAY_NS;
+
+		if (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000;
+		}
+
+		while (!atomic_load(&hurried) && pthread_cond_timedwait(&wake_cond, &wake_lock, &deadline) != ETIMEDOUT) {
+		}
+
+		pthread_mutex_unlock(&wake_lock);
+
+		// Anything logged from here on wakes us again, so none of it is missed.
+		atomic_store(&pending, FALSE);
+		atomic_store(&hurried, FALSE);
+		log_flush();
+	}
+
+	return NULL;
+}
+
+static void wake_logger(int hurry) {
+	int wake = !atomic_load(&pending) && !atomic_exchange(&pending, TRUE);
+
+	if (hurry && !atomic_load(&hurried) && !atomic_exchange(&hurried, TRUE)) {
+		wake = TRUE;
+	}
+
+	if (wake) {
+		pthread_mutex_lock(&wake_lock);
+		pthread_cond_signal(&wake_cond);
+		pthread_mutex_unlock(&wake_lock);
+	}
+}
+
+/*
+ * Whether a ring is past its high-water mark. Only a ring that looks it by
+ * the thread's own copy of head has the real one read.
+ */
+static int filling(LogRing *ring) {
+	uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+	if (tail - ring->cached_head <= LOG_RING_HIGH_WATER) {
+		return FALSE;
+	}
+
+	ring->cached_head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+	return tail - ring->cached_head > LOG_RING_HIGH_WATER;
+}
+
+static LogRing *local_ring(void) {
+	if (thread_ring == NULL) {
+		thread_ring = attach_ring();
+	}
+
+	return thread_ring;
+}
+
+/*
+ * Take over a ring left by a thread that has finished, or add a new one.
+ * Returns NULL if there is none to be had.
+ */
+static LogRing *attach_ring(void) {
+	LogRing *ring = NULL;
+
+	for (ring = atomic_load(&rings); ring != NULL; ring = ring->next) {
+		int expected = FALSE;
+
+		if (atomic_compare_exchange_strong(&ring->in_use, &expected, TRUE)) {
+			break;
+		}
+	}
+
+	if (ring == NULL) {
+		size_t size = (sizeof *ring + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+
+		if ((ring = aligned_alloc(CACHE_LINE_SIZE, size)) == NULL) {
+			return NULL;
+		}
+
+		memset(ring, 0, offsetof(LogRing, data));
+		atomic_init(&ring->in_use, TRUE);
+		ring->next = atomic_load(&rings);
+
+		while (!atomic_compare_exchange_weak(&rings, &ring->next, ring)) {
+		}
+	}
+
+	pthread_setspecific(ring_key, ring);
+
+	return ring;
+}
+
+static void detach_ring(void *arg) {
+	LogRing *ring = arg;
+
+	atomic_store(&ring->in_use, FALSE);
+}
+
+/*
+ * Arguments are encoded straight into the ring, so room is made for the
+ * largest record there can be and only what was used is kept. A record that
+ * might not fit before the end of the ring goes at its start instead, after
+ * a padding record. Returns -1 if the ring is too full.
+ */
+static int push(LogRing *ring, LogSite *site, int error, va_list *args) {
+	uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	size_t offset = tail & (LOG_RING_SIZE - 1);
+	size_t padding = offset + LOG_RECORD_SIZE > LOG_RING_SIZE ? LOG_RING_SIZE - offset : 0;
+
+	if (tail + padding + LOG_RECORD_SIZE - ring->cached_head > LOG_RING_SIZE) {
+		ring->cached_head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+		if (tail + padding + LOG_RECORD_SIZE - ring->cached_head > LOG_RING_SIZE) {
+			return -1;
+		}
+	}
+
+	if (padding > 0) {
+		memcpy(&ring->data[offset], &(LogRecord){.site = NULL, .size = padding}, sizeof(LogRecord));
+		offset = 0;
+	}
+
+	LogRecord record = {.site = site,
+	                    .size = sizeof record,
+	                    .sequence = atomic_fetch_add_explicit(&next_sequence, 1, memory_order_relaxed)};
+
+	record.size += encode(site, error, args, &ring->data[offset + sizeof record], LOG_RECORD_SIZE - sizeof record);
+	record.size = (record.size + LOG_RECORD_ALIGN - 1) & ~(size_t)(LOG_RECORD_ALIGN - 1);
+	memcpy(&ring->data[offset], &record, sizeof record);
+
+	atomic_store_explicit(&ring->tail, tail + padding + record.size, memory_order_release);
+
+	return 0;
+}
+
+static void drain(LogRing *ring) {
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+	while (head < tail) {
+		LogRecord record;
+		size_t offset = head & (LOG_RING_SIZE - 1);
+
+		memcpy(&record, &ring->data[offset], sizeof record);
+
+		if (record.site != NULL) {
+			format_record(record.site, &ring->data[offset + sizeof record], record.size - sizeof record);
+		}
+
+		head += record.size;
+	}
+
+	atomic_store_explicit(&ring->head, head, memory_order_release);
+}
+
+/*
+ * Write out what every ring holds, merged into the order it was logged in.
+ * Rings are looked at newest first, so a message from a thread is never seen
+ * without those logged before the thread first did. Without memory for the
+ * merge, each ring is written out in turn instead. Call with drain_lock held.
+ */
+static void drain_all(void) {
+	num_cursors = 0;
+
+	for (LogRing *ring = atomic_load(&rings); ring != NULL; ring = ring->next) {
+		if (num_cursors == cursors_capacity) {
+			size_t capacity = cursors_capacity > 0 ? cursors_capacity * 2 : 16;
+			LogCursor *grown = realloc(cursors, sizeof *cursors * capacity);
+
+			if (grown == NULL) {
+				for (ring = atomic_load(&rings); ring != NULL; ring = ring->next) {
+					drain(ring);
+				}
+
+				return;
+			}
+
+			cursors = grown;
+			cursors_capacity = capacity;
+		}
+
+		LogCursor cursor = {.ring = ring,
+		                    .head = atomic_load_explicit(&ring->head, memory_order_relaxed),
+		                    .tail = atomic_load_explicit(&ring->tail, memory_order_acquire)};
+
+		if (next_record(&cursor)) {
+			cursors[num_cursors++] = cursor;
+			sift_up(num_cursors - 1);
+		}
+	}
+
+	while (num_cursors > 0) {
+		LogCursor *cursor = &cursors[0];
+		LogRecord record;
+		size_t offset = cursor->head & (LOG_RING_SIZE - 1);
+
+		memcpy(&record, &cursor->ring->data[offset], sizeof record);
+		format_record(record.site, &cursor->ring->data[offset + sizeof record], record.size - sizeof record);
+
+		cursor->head += record.size;
+
+		if (!next_record(cursor)) {
+			atomic_store_explicit(&cursor->ring->head, cursor->head, memory_order_release);
+			*cursor = cursors[--num_cursors];
+		}
+
+		sift_down(0);
+	}
+}
+
+/*
+ * Move a cursor past any padding to its next message. Returns FALSE, with
+ * the ring given back everything up to the cursor, if there is none.
+ */
+static int next_record(LogCursor *cursor) {
+	while (cursor->head < cursor->tail) {
+		LogRecord record;
+
+		memcpy(&record, &cursor->ring->data[cursor->head & (LOG_RING_SIZE - 1)], sizeof record);
+
+		if (record.site != NULL) {
+			cursor->sequence = record.sequence;
+
+			return TRUE;
+		}
+
+		cursor->head += record.size;
+	}
+
+	atomic_store_explicit(&cursor->ring->head, cursor->head, memory_order_release);
+
+	return FALSE;
+}
+
+static void sift_up(size_t index) {
+	while (index > 0 && cursors[(index - 1) / 2].sequence > cursors[index].sequence) {
+		LogCursor parent = cursors[(index - 1) / 2];
+
+		cursors[(index - 1) / 2] = cursors[index];
+		cursors[index] = parent;
+		index = (index - 1) / 2;
+	}
+}
+
+static void sift_down(size_t index) {
+	while (TRUE) {
+		size_t smallest = index;
+
+		for (size_t child = 2 * index + 1; child <= 2 * index + 2 && child < num_cursors; child++) {
+			if (cursors[child].sequence < cursors[smallest].sequence) {
+				smallest = child;
+			}
+		}
+
+		if (smallest == index) {
+			break;
+		}
+
+		LogCursor parent = cursors[index];
+
+		cursors[index] = cursors[smallest];
+		cursors[smallest] = parent;
+		index = smallest;
+	}
+}
+
+/*
+ * Write a message out from the calling thread, after anything logged before
+ * that is still in a ring.
+ */
+static void write_now(LogSite *site, int error, va_list *args) {
+	_Alignas(LogRecord) uint8_t data[LOG_RECORD_SIZE];
+	size_t size = encode(site, error, args, data, sizeof data);
+
+	pthread_mutex_lock(&drain_lock);
+	drain_all();
+	format_record(site, data, size);
+	output_flush();
+	pthread_mutex_unlock(&drain_lock);
+}
+
+/*
+ * Parse the printf conversion that starts at percent, returning where the
+ * text after it starts.
+ */
+static const char *parse_spec(const char *percent, Spec *spec) {
+	const char *next = percent + 1;
+
+	*spec = (Spec){.start = percent, .flags = next, .width = -1, .precision = -1};
+
+	while (*next != '\0' && strchr("-+ #0'", *next) != NULL) {
+		next++;
+	}
+
+	spec->flags_length = next - spec->flags < LOG_MAX_FLAGS ? next - spec->flags : LOG_MAX_FLAGS;
+
+	if (*next == '*') {
+		spec->width_star = TRUE;
+		next++;
+	} else {
+		spec->width = isdigit((unsigned char)*next) ? parse_number(&next) : -1;
+	}
+
+	if (*next == '.') {
+		spec->precision = 0;
+
+		if (*++next == '*') {
+			spec->precision_star = TRUE;
+			next++;
+		} else {
+			spec->precision = parse_number(&next);
+		}
+	}
+
+	switch (*next) {
+		case 'h':
+			spec->modifier = *++next == 'h' ? (next++, ModifierChar) : ModifierShort;
+
+			break;
+
+		case 'l':
+			spec->modifier = *++next == 'l' ? (next++, ModifierLongLong) : ModifierLong;
+
+			break;
+
+		case 'q':
+			spec->modifier = ModifierLongLong;
+			next++;
+
+			break;
+
+		case 'j':
+			spec->modifier = ModifierMax;
+			next++;
+
+			break;
+
+		case 'z':
+			spec->modifier = ModifierSize;
+			next++;
+
+			break;
+
+		case 't':
+			spec->modifier = ModifierPtrdiff;
+			next++;
+
+			break;
+
+		case 'L':
+			spec->modifier = ModifierLongDouble;
+			next++;
+
+			break;
+	}
+
+	spec->conversion = *next;
+
+	switch (spec->conversion) {
+		case '%':
+			spec->kind = ArgPercent;
+
+			break;
+
+		case 'd':
+		case 'i':
+			spec->kind = ArgSigned;
+
+			break;
+
+		case 'o':
+		case 'u':
+		case 'x':
+		case 'X':
+			spec->kind = ArgUnsigned;
+
+			break;
+
+		case 'c':
+			spec->kind = ArgChar;
+
+			break;
+
+		case 'a':
+		case 'A':
+		case 'e':
+		case 'E':
+		case 'f':
+		case 'F':
+		case 'g':
+		case 'G':
+			spec->kind = spec->modifier == ModifierLongDouble ? ArgLongDouble : ArgDouble;
+
+			break;
+
+		case 'p':
+			spec->kind = ArgPointer;
+
+			break;
+
+		case 's':
+			spec->kind = spec->modifier == ModifierLong ? ArgSkip : ArgString;
+
+			break;
+
+		case 'm':
+			spec->kind = ArgError;
+
+			break;
+
+		case 'n':
+			spec->kind = ArgSkip;
+
+			break;
+
+		default:
+			spec->kind = ArgUnknown;
+	}
+
+	if (*next != '\0') {
+		next++;
+	}
+
+	spec->end = next;
+
+	return next;
+}
+
+/*
+ * Widths and precisions past LOG_MAX_WIDTH are taken to be LOG_MAX_WIDTH.
+ */
+static int parse_number(const char **next) {
+	int number = 0;
+
+	for (; isdigit((unsigned char)**next); (*next)++) {
+		number = number < LOG_MAX_WIDTH ? number * 10 + (**next - '0') : LOG_MAX_WIDTH;
+	}
+
+	return number < LOG_MAX_WIDTH ? number : LOG_MAX_WIDTH;
+}
+
+/*
+ * List what the conversions in format take from the arguments, in order.
+ * Returns how many there are, up to LOG_MAX_ARGS.
+ */
+static int describe(const char *format, LogArg *args) {
+	int num_args = 0;
+	Spec spec;
+
+	for (const char *percent = strchr(format, '%'); percent != NULL; percent = strchr(format, '%')) {
+		format = parse_spec(percent, &spec);
+
+		if (spec.width_star && num_args < LOG_MAX_ARGS) {
+			args[num_args++] = (LogArg){.kind = ArgStar};
+		}
+
+		if (spec.precision_star && num_args < LOG_MAX_ARGS) {
+			args[num_args++] = (LogArg){.kind = ArgStar};
+		}
+
+		if (spec.kind != ArgUnknown && spec.kind != ArgPercent && num_args < LOG_MAX_ARGS) {
+			args[num_args++] = (LogArg){.kind = spec.kind,
+			                            .modifier = spec.modifier,
+			                            .precision = spec.precision_star ? LOG_PRECISION_STAR : spec.precision};
+		}
+	}
+
+	return num_args;
+}
+
+/*
+ * A site's arguments are described by the first thread to log from it, so
+ * that every message after only has to copy them. Until that is done other
+ * threads describe them for themselves, into scratch.
+ */
+static int site_args(LogSite *site, const LogArg **args, LogArg *scratch) {
+	int described = atomic_load_explicit(&site->described, memory_order_acquire);
+
+	if (described == SiteDescribed) {
+		*args = site->args;
+
+		return site->num_args;
+	}
+
+	if (described == SiteUndescribed &&
+	    atomic_compare_exchange_strong(&site->described, &described, SiteDescribing)) {
+		site->num_args = describe(site->format, site->args);
+		atomic_store_explicit(&site->described, SiteDescribed, memory_order_release);
+		*args = site->args;
+
+		return site->num_args;
+	}
+
+	*args = scratch;
+
+	return describe(site->format, scratch);
+}
+
+/*
+ * Copy a message's arguments into data, stopping at the first that does not
+ * fit. Returns how many bytes were used.
+ */
+static size_t encode(LogSite *site, int error, va_list *args, uint8_t *data, size_t capacity) {
+	LogArg scratch[LOG_MAX_ARGS];
+	const LogArg *described;
+	int num_args = site_args(site, &described, scratch);
+	int star = -1;
+	size_t size = 0;
+
+	for (int i = 0; i < num_args; i++) {
+		const LogArg *arg = &described[i];
+		int ret = 0;
+
+		switch (arg->kind) {
+			case ArgStar:
+				star = va_arg(*args, int);
+				ret = put(data, capacity, &size, &star, sizeof star);
+
+				break;
+
+			case ArgSigned:
+			case ArgChar: {
+				intmax_t value = arg->kind == ArgChar && arg->modifier == ModifierLong ? (intmax_t)va_arg(*args, wint_t)
+				                                                                      : signed_arg(arg->modifier, args);
+
+				ret = put(data, capacity, &size, &value, sizeof value);
+
+				break;
+			}
+
+			case ArgUnsigned: {
+				uintmax_t value = unsigned_arg(arg->modifier, args);
+
+				ret = put(data, capacity, &size, &value, sizeof value);
+
+				break;
+			}
+
+			case ArgDouble: {
+				double value = va_arg(*args, double);
+
+				ret = put(data, capacity, &size, &value, sizeof value);
+
+				break;
+			}
+
+			case ArgLongDouble: {
+				long double value = va_arg(*args, long double);
+
+				ret = put(data, capacity, &size, &value, sizeof value);
+
+				break;
+			}
+
+			case ArgPointer: {
+				void *value = va_arg(*args, void *);
+
+				ret = put(data, capacity, &size, &value, sizeof value);
+
+				break;
+			}
+
+			case ArgString: {
+				const char *string = va_arg(*args, const char *);
+				int precision = arg->precision == LOG_PRECISION_STAR ? star : arg->precision;
+				uint32_t length = 0;
+
+				if (size + sizeof length > capacity) {
+					return size;
+				}
+
+				string = string != NULL ? string : "(null)";
+
+				// Only as much as is printed is read, as the string may not be terminated.
+				size_t room = capacity - size - sizeof length;
+				size_t limit = precision >= 0 && (size_t)precision < room ? (size_t)precision : room;
+
+				length = strnlen(string, limit);
+				memcpy(&data[size], &length, sizeof length);
+				memcpy(&data[size + sizeof length], string, length);
+				size += sizeof length + length;
+
+				break;
+			}
+
+			case ArgError:
+				ret = put(data, capacity, &size, &error, sizeof error);
+
+				break;
+
+			case ArgSkip:
+				va_arg(*args, void *);
+
+				break;
+
+			case ArgUnknown:
+			case ArgPercent:
+				break;
+		}
+
+		if (ret < 0) {
+			break;
+		}
+	}
+
+	return size;
+}
+
+static intmax_t signed_arg(Modifier modifier, va_list *args) {
+	switch (modifier) {
+		case ModifierChar:
+			return (signed char)va_arg(*args, int);
+
+		case ModifierShort:
+			return (short)va_arg(*args, int);
+
+		case ModifierLong:
+			return va_arg(*args, long);
+
+		case ModifierLongLong:
+			return va_arg(*args, long long);
+
+		case ModifierMax:
+			return va_arg(*args, intmax_t);
+
+		case ModifierSize:
+			return va_arg(*args, ssize_t);
+
+		case ModifierPtrdiff:
+			return va_arg(*args, ptrdiff_t);
+
+		default:
+			return va_arg(*args, int);
+	}
+}
+
+static uintmax_t unsigned_arg(Modifier modifier, va_list *args) {
+	switch (modifier) {
+		case ModifierChar:
+			return (unsigned char)va_arg(*args, unsigned int);
+
+		case ModifierShort:
+			return (unsigned short)va_arg(*args, unsigned int);
+
+		case ModifierLong:
+			return va_arg(*args, unsigned long);
+
+		case ModifierLongLong:
+			return va_arg(*args, unsigned long long);
+
+		case ModifierMax:
+			return va_arg(*args, uintmax_t);
+
+		case ModifierSize:
+			return va_arg(*args, size_t);
+
+		case ModifierPtrdiff:
+			return (size_t)va_arg(*args, ptrdiff_t);
+
+		default:
+			return va_arg(*args, unsigned int);
+	}
+}
+
+static int put(uint8_t *data, size_t capacity, size_t *size, const void *value, size_t length) {
+	if (*size + length > capacity) {
+		return -1;
+	}
+
+	memcpy(&data[*size], value, length);
+	*size += length;
+
+	return 0;
+}
+
+/*
+ * Messages are laid out as they always have been, with where they were logged
+ * from and what kind of error they are about in front.
+ */
+static void format_record(const LogSite *site, const uint8_t *args, size_t size) {
+	const char *format = site->format;
+	size_t offset = 0;
+	Spec spec;
+
+	if (site->error == LOG_NO_ERROR) {
+		output_printf("%s: %s:%s:%d: ", level_names[site->level], site->file, site->func, site->line);
+	} else {
+		output_printf("%s: %s:%s:%d: %s: ",
+		              level_names[site->level],
+		              site->file,
+		              site->func,
+		              site->line,
+		              error_to_string(site->error));
+	}
+
+	for (const char *percent = strchr(format, '%'); percent != NULL; percent = strchr(format, '%')) {
+		output_write(format, percent - format);
+		format = parse_spec(percent, &spec);
+
+		// The arguments were cut short where they stopped fitting in the record.
+		if (format_arg(&spec, args, size, &offset) < 0) {
+			format = "...";
+
+			break;
+		}
+	}
+
+	output_write(format, strlen(format));
+	output_write("\n", 1);
+}
+
+static int format_arg(Spec *spec, const uint8_t *args, size_t size, size_t *offset) {
+	char buffer[LOG_SPEC_SIZE];
+
+	if (spec->width_star && take(args, size, offset, &spec->width, sizeof spec->width) < 0) {
+		return -1;
+	}
+
+	if (spec->precision_star && take(args, size, offset, &spec->precision, sizeof spec->precision) < 0) {
+		return -1;
+	}
+
+	switch (spec->kind) {
+		case ArgPercent:
+			output_write("%", 1);
+
+			break;
+
+		case ArgSigned: {
+			intmax_t value;
+
+			if (take(args, size, offset, &value, sizeof value) < 0) {
+				return -1;
+			}
+
+			spec_string(spec, "j", spec->conversion, buffer);
+			output_printf(buffer, value);
+
+			break;
+		}
+
+		case ArgChar: {
+			intmax_t value;
+
+			if (take(args, size, offset, &value, sizeof value) < 0) {
+				return -1;
+			}
+
+			if (spec->modifier == ModifierLong) {
+				spec_string(spec, "l", 'c', buffer);
+				output_printf(buffer, (wint_t)value);
+			} else {
+				spec_string(spec, "", 'c', buffer);
+				output_printf(buffer, (int)value);
+			}
+
+			break;
+		}
+
+		case ArgUnsigned: {
+			uintmax_t value;
+
+			if (take(args, size, offset, &value, sizeof value) < 0) {
+				return -1;
+			}
+
+			spec_string(spec, "j", spec->conversion, buffer);
+			output_printf(buffer, value);
+
+			break;
+		}
+
+		case ArgDouble: {
+			double value;
+
+			if (take(args, size, offset, &value, sizeof value) < 0) {
+				return -1;
+			}
+
+			spec_string(spec, "", spec->conversion, buffer);
+			output_printf(buffer, value);
+
+			break;
+		}
+
+		case ArgLongDouble: {
+			long double value;
+
+			if (take(args, size, offset, &value, sizeof value) < 0) {
+				return -1;
+			}
+
+			spec_string(spec, "L", spec->conversion, buffer);
+			output_printf(buffer, value);
+
+			break;
+		}
+
+		case ArgPointer: {
+			void *value;
+
+			if (take(args, size, offset, &value, sizeof value) < 0) {
+				return -1;
+			}
+
+			spec_string(spec, "", 'p', buffer);
+			output_printf(buffer, value);
+
+			break;
+		}
+
+		case ArgString: {
+			uint32_t length;
+
+			if (take(args, size, offset, &length, sizeof length) < 0 || *offset + length > size) {
+				return -1;
+			}
+
+			// Strings are kept without a terminator, so are printed up to their length.
+			spec->precision = length;
+			spec_string(spec, "", 's', buffer);
+			output_printf(buffer, (const char *)&args[*offset]);
+			*offset += length;
+
+			break;
+		}
+
+		case ArgError: {
+			int error;
+
+			if (take(args, size, offset, &error, sizeof error) < 0) {
+				return -1;
+			}
+
+			spec_string(spec, "", 's', buffer);
+			output_printf(buffer, strerror(error));
+
+			break;
+		}
+
+		case ArgSkip:
+		case ArgStar:
+			break;
+
+		case ArgUnknown:
+			output_write(spec->start, spec->end - spec->start);
+
+			break;
+	}
+
+	return 0;
+}
+
+static int take(const uint8_t *args, size_t size, size_t *offset, void *value, size_t length) {
+	if (*offset + length > size) {
+		return -1;
+	}
+
+	memcpy(value, &args[*offset], length);
+	*offset += length;
+
+	return 0;
+}
+
+/*
+ * Rebuild a conversion with any * filled in, and the length modifier its
+ * argument is kept with in a record.
+ */
+static void spec_string(const Spec *spec, const char *modifier, char conversion, char *buffer) {
+	int width = spec->width;
+	char *next = buffer;
+
+	*next++ = '%';
+
+	// A negative width from the arguments means the same as the - flag.
+	if (spec->width_star && width < 0) {
+		*next++ = '-';
+		width = width > -LOG_MAX_WIDTH ? -width : LOG_MAX_WIDTH;
+	}
+
+	next = mempcpy(next, spec->flags, spec->flags_length);
+
+	if (width >= 0) {
+		next += sprintf(next, "%d", width < LOG_MAX_WIDTH ? width : LOG_MAX_WIDTH);
+	}
+
+	// As is a negative precision, which means none at all.
+	if (spec->precision >= 0) {
+		next += sprintf(next, ".%d", spec->precision);
+	}
+
+	next = stpcpy(next, modifier);
+	*next++ = conversion;
+	*next = '\0';
+}
+
+static void output_write(const char *data, size_t length) {
+	if (output.size + length > LOG_OUTPUT_SIZE) {
+		output_flush();
+	}
+
+	if (length > LOG_OUTPUT_SIZE) {
+		fwrite(data, 1, length, stderr);
+	} else {
+		memcpy(&output.data[output.size], data, length);
+		output.size += length;
+	}
+}
+
+static void output_printf(const char *format, ...) {
+	size_t room = LOG_OUTPUT_SIZE - output.size;
+	va_list args;
+	va_list retry;
+
+	va_start(args, format);
+	va_copy(retry, args);
+
+	int length = vsnprintf(&output.data[output.size], room, format, args);
+
+	if (length >= 0 && (size_t)length < room) {
+		output.size += length;
+	} else if (length >= 0) {
+		output_flush();
+
+		if (length < LOG_OUTPUT_SIZE) {
+			output.size = vsnprintf(output.data, LOG_OUTPUT_SIZE, format, retry);
+		} else {
+			vfprintf(stderr, format, retry);
+		}
+	}
+
+	va_end(retry);
+	va_end(args);
+}
+
+static void output_flush(void) {
+	if (output.size > 0) {
+		fwrite(output.data, 1, output.size, stderr);
+		output.size = 0;
+	}
+}
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * The least severe level logged can be set with LOG_LEVEL_ENV to one of
+ * info, warning, error or fatal. Debug builds log everything by default and
+ * others only errors.
+ */
+#define LOG_LEVEL_ENV "MACLUNKEY_LOG_LEVEL"
+
+/*
+ * Each thread's ring, and the most one message can take up in it. String
+ * arguments are cut short to fit.
+ */
+#define LOG_RING_SIZE (64 * 1024)
+#define LOG_RECORD_SIZE 1024
+
+/*
+ * Arguments past this many are not logged.
+ */
+#define LOG_MAX_ARGS 16
+
+#define LOG_NO_ERROR (-1)
+
+typedef enum
+{
+	LogLevelInfo,
+	LogLevelWarning,
+	LogLevelError,
+	LogLevelFatal
+} LogLevel;
+
+/*
+ * What a message's format takes from its arguments, worked out by the logger
+ * the first time the message is logged.
+ */
+typedef struct {
+	uint8_t kind;
+	uint8_t modifier;
+	int16_t precision;
+} LogArg;
+
+/*
+ * Everything about a message that is known where it is logged from. Each
+ * call site has one of these, so a record only needs a pointer to it besides
+ * the arguments.
+ */
+typedef struct {
+	LogLevel level;
+	int error;
+	const char *file;
+	const char *func;
+	int line;
+	const char *format;
+	atomic_int described;
+	int num_args;
+	LogArg args[LOG_MAX_ARGS];
+} LogSite;
+
+/*
+ * Messages are copied into a ring of the calling thread's own, as the call
+ * site and the arguments the format takes, and a background thread formats
+ * and writes them out. A message is dropped, and counted, if the ring is
+ * full. Fatal messages are written out before the call returns.
+ *
+ * The format is checked as printf's would be, though printf is never called.
+ */
+#define log_at(site_level, site_error, site_format, ...)                                       \
+	do {                                                                                       \
+		static LogSite __log_site = {.level = site_level,                                      \
+		                             .error = site_error,                                      \
+		                             .file = __FILE__,                                         \
+		                             .func = __func__,                                         \
+		                             .line = __LINE__,                                         \
+		                             .format = site_format};                                   \
+                                                                                               \
+		(void)sizeof(printf(site_format, __VA_ARGS__));                                        \
+                                                                                               \
+		if ((int)(site_level) >= atomic_load_explicit(&log_threshold, memory_order_relaxed)) { \
+			log_write(&__log_site, __VA_ARGS__);                                               \
+		}                                                                                      \
+	} while (0)
+
+/*
+ * Below LogLevelInfo until the logger has started, so the first message
+ * starts it whatever its level.
+ */
+extern atomic_int log_threshold;
+
+void log_write(LogSite *site, ...);
+void log_set_level(LogLevel level);
+void log_flush(void);
+uint64_t log_dropped(void);
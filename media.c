@@ -0,0 +1,603 @@
+#include "media.h"
+
+#include "utils.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define MEDIA_SOCKET_BUFFER_SIZE (1 << 20)
+
+static void shim_configure(MediaShim *shim);
+static void *shim_handler(void *arg);
+static void shim_enqueue(MediaShim *shim, const struct sockaddr_in *addr, const struct iovec *iov, size_t iov_len);
+static int timespec_before(const struct timespec *a, const struct timespec *b);
+static int valid_media_packet(const uint8_t *data, size_t size);
+static int send_parity(MediaSocket *media, const struct sockaddr_in *addr, MediaSendStream *stream, FecHeader *fec,
+                       size_t parity_count);
+
+/*
+ * Open a datagram socket bound to port (0 for any), with the loss/delay shim
+ * set up from the environment.
+ */
+int media_socket_open(MediaSocket *media, uint16_t port) {
+	memset(media, 0, sizeof *media);
+
+	struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port), .sin_addr.s_addr = htonl(INADDR_ANY)};
+	int buffer_size = MEDIA_SOCKET_BUFFER_SIZE;
+
+	if ((media->socket_fd = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+		log_error(ERROR_NETWORK, "failed to construct media socket");
+
+		return -1;
+	}
+
+	if (bind(media->socket_fd, (struct sockaddr *)&addr, sizeof addr) < 0) {
+		log_error(ERROR_NETWORK, "failed to bind media socket");
+
+		close(media->socket_fd);
+
+		return -1;
+	}
+
+	// Video frames arrive in bursts, the default buffers only hold a few of them.
+	if (setsockopt(media->socket_fd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof buffer_size) < 0 ||
+	    setsockopt(media->socket_fd, SOL_SOCKET, SO_SNDBUF, &buffer_size, sizeof buffer_size) < 0) {
+		log_error(ERROR_NETWORK, "failed to set media socket buffer sizes");
+	}
+
+	shim_configure(&media->shim);
+	fec_config_from_env(&media->fec);
+
+	if (media->shim.delay_ms > 0 || media->shim.jitter_ms > 0) {
+		pthread_condattr_t attr;
+
+		pthread_condattr_init(&attr);
+		pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+		pthread_cond_init(&media->shim.queued, &attr);
+		pthread_condattr_destroy(&attr);
+
+		if (pthread_create(&media->shim.thread, NULL, shim_handler, media) != 0) {
+			log_error(ERROR_THREAD, "failed to start media shim thread, not delaying media");
+
+			media->shim.delay_ms = 0;
+			media->shim.jitter_ms = 0;
+		} else {
+			media->shim.running = TRUE;
+		}
+	}
+
+	return 0;
+}
+
+void media_socket_close(MediaSocket *media) {
+	MediaShim *shim = &media->shim;
+
+	if (shim->running) {
+		pthread_mutex_lock(&shim->lock);
+		shim->stop = TRUE;
+		pthread_cond_signal(&shim->queued);
+		pthread_mutex_unlock(&shim->lock);
+
+		if (pthread_join(shim->thread, NULL) != 0) {
+			log_error(ERROR_THREAD, "failed to join media shim thread");
+		}
+
+		pthread_cond_destroy(&shim->queued);
+		shim->running = FALSE;
+	}
+
+	while (shim->queue != NULL) {
+		ShimDatagram *next = shim->queue->next;
+
+		free(shim->queue);
+		shim->queue = next;
+	}
+
+	pthread_mutex_destroy(&shim->lock);
+
+	if (close(media->socket_fd) < 0) {
+		log_error(ERROR_NETWORK, "failed to close media socket");
+	}
+}
+
+/*
+ * Send one media packet (or a bare header if serialised is NULL) to addr.
+ * Datagrams the network or the shim drops are not errors.
+ */
+int media_send(MediaSocket *media, const struct sockaddr_in *addr, const MediaHeader *header,
+               const Serialised *serialised) {
+	MediaShim *shim = &media->shim;
+	uint8_t header_data[MEDIA_HEADER_SIZE];
+	uint8_t *pos = header_data;
+
+	pos = mempcpy(pos, &header->ssrc, sizeof header->ssrc);
+	pos = mempcpy(pos, &header->seq, sizeof header->seq);
+	memcpy(pos, &header->timestamp, sizeof header->timestamp);
+
+	struct iovec iov[] = {{.iov_base = header_data, .iov_len = sizeof header_data},
+	                      {.iov_base = serialised != NULL ? serialised->data : NULL,
+	                       .iov_len = serialised != NULL ? serialised->size : 0}};
+
+	if (shim->loss > 0 || shim->running) {
+		pthread_mutex_lock(&shim->lock);
+
+		if (shim->loss > 0 && rand_r(&shim->seed) < shim->loss * ((double)RAND_MAX + 1)) {
+			shim->dropped++;
+
+			pthread_mutex_unlock(&shim->lock);
+
+			return 0;
+		}
+
+		if (shim->running) {
+			shim_enqueue(shim, addr, iov, sizeof iov / sizeof *iov);
+
+			pthread_mutex_unlock(&shim->lock);
+
+			return 0;
+		}
+
+		pthread_mutex_unlock(&shim->lock);
+	}
+
+	struct msghdr msg = {.msg_name = (void *)addr,
+	                     .msg_namelen = sizeof *addr,
+	                     .msg_iov = iov,
+	                     .msg_iovlen = sizeof iov / sizeof *iov};
+
+	if (sendmsg(media->socket_fd, &msg, 0) < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS) {
+		log_error(ERROR_NETWORK, "failed to send media datagram");
+
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Receive one datagram. Returns 1 with header (and serialised, which the
+ * caller frees, unless it was a bare header) filled in, 0 if nothing usable
+ * arrived before the socket timeout, or -1 on error.
+ */
+int media_recv(MediaSocket *media, struct sockaddr_in *addr, MediaHeader *header, Serialised *serialised) {
+	uint8_t data[MEDIA_MAX_DATAGRAM_SIZE];
+	socklen_t addr_len = sizeof *addr;
+	ssize_t n = recvfrom(media->socket_fd, data, sizeof data, 0, (struct sockaddr *)addr, &addr_len);
+
+	if (n < 0) {
+		if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+			return 0;
+		}
+
+		log_error(ERROR_NETWORK, "failed to receive media datagram");
+
+		return -1;
+	}
+
+	if ((size_t)n < MEDIA_HEADER_SIZE) {
+		media->malformed++;
+
+		return 0;
+	}
+
+	uint8_t *pos = data;
+
+	memcpy(&header->ssrc, pos, sizeof header->ssrc);
+	pos += sizeof header->ssrc;
+	memcpy(&header->seq, pos, sizeof header->seq);
+	pos += sizeof header->seq;
+	memcpy(&header->timestamp, pos, sizeof header->timestamp);
+	pos += sizeof header->timestamp;
+
+	size_t size = n - MEDIA_HEADER_SIZE;
+
+	*serialised = (Serialised){0};
+
+	if ((header->ssrc & MEDIA_SSRC_STREAM_MASK) == MEDIA_STREAM_HELLO) {
+		if (size > 0) {
+			media->malformed++;
+
+			return 0;
+		}
+
+		media->received++;
+
+		return 1;
+	}
+
+	if ((header->ssrc & MEDIA_SSRC_STREAM_MASK) == MEDIA_STREAM_FEC
+	        ? size <= FEC_HEADER_SIZE + FEC_SYMBOL_HEADER_SIZE
+	        : !valid_media_packet(pos, size)) {
+		media->malformed++;
+
+		return 0;
+	}
+
+	serialised->size = size;
+	serialised->data = malloc(size);
+	memcpy(serialised->data, pos, size);
+
+	media->received++;
+
+	return 1;
+}
+
+uint32_t media_packet_timestamp(const Serialised *serialised) {
+	uint32_t timestamp = 0;
+
+	memcpy(&timestamp, (uint8_t *)serialised->data + PACKET_TIMESTAMP_OFFSET, sizeof timestamp);
+
+	return timestamp;
+}
+
+/*
+ * Account for a datagram arriving on a stream. Returns -1 if it is a
+ * duplicate or arrived after a later one, 0 otherwise. A new SSRC (someone
+ * else took the participant slot) starts the stream over.
+ */
+int media_stream_update(MediaStreamStats *stats, const MediaHeader *header) {
+	if (!stats->started || stats->ssrc != header->ssrc) {
+		*stats = (MediaStreamStats){.started = TRUE, .ssrc = header->ssrc, .highest_seq = header->seq, .received = 1};
+
+		return 0;
+	}
+
+	int16_t delta = (int16_t)(header->seq - stats->highest_seq);
+
+	stats->received++;
+
+	if (delta > 0) {
+		stats->lost += delta - 1;
+		stats->highest_seq = header->seq;
+
+		return 0;
+	}
+
+	// It was counted as lost when later datagrams overtook it.
+	if (stats->lost > 0) {
+		stats->lost--;
+	}
+
+	stats->late++;
+
+	return -1;
+}
+
+/*
+ * Account for a datagram FEC rebuilt. Returns -1 if later datagrams have
+ * already been handled, 0 otherwise.
+ */
+int media_stream_recover(MediaStreamStats *stats, const MediaHeader *header) {
+	int16_t delta = (int16_t)(header->seq - stats->highest_seq);
+
+	stats->recovered++;
+
+	if (delta > 0) {
+		stats->lost += delta - 1;
+		stats->highest_seq = header->seq;
+
+		return 0;
+	}
+
+	if (stats->lost > 0) {
+		stats->lost--;
+	}
+
+	return -1;
+}
+
+/*
+ * Send a media packet as the next datagram of stream, followed by parity once
+ * its FEC group is complete. Audio groups are every fec.audio_group datagrams
+ * with XOR parity. Video groups end at a keyframe and get fec.video_parity
+ * Reed-Solomon parity, since losing a keyframe costs the most; groups that
+ * reach FEC_DEFAULT_VIDEO_GROUP without one are sent unprotected.
+ */
+int media_send_stream(MediaSocket *media, const struct sockaddr_in *addr, MediaSendStream *stream, uint32_t ssrc,
+                      const Serialised *serialised) {
+	uint8_t type = ssrc & MEDIA_SSRC_STREAM_MASK;
+	FecHeader fec = {.stream = type};
+	size_t parity_count = 0;
+
+	// Someone else took the participant slot, the group so far belongs to the previous SSRC.
+	if (stream->ssrc != ssrc) {
+		fec_encoder_reset(&stream->fec);
+		stream->ssrc = ssrc;
+	}
+
+	MediaHeader header = {.ssrc = ssrc, .seq = stream->seq++, .timestamp = media_packet_timestamp(serialised)};
+
+	if (media_send(media, addr, &header, serialised) < 0) {
+		return -1;
+	}
+
+	if (type == MEDIA_STREAM_AUDIO) {
+		fec.scheme = FecSchemeXor;
+		parity_count = media->fec.audio_group > 0 ? 1 : 0;
+	} else {
+		fec.scheme = FecSchemeReedSolomon;
+		parity_count = media->fec.video_parity;
+	}
+
+	if (parity_count == 0) {
+		return 0;
+	}
+
+	fec_encoder_add(&stream->fec, header.seq, header.timestamp, serialised->data, serialised->size);
+
+	if (type == MEDIA_STREAM_AUDIO) {
+		if (stream->fec.count < media->fec.audio_group) {
+			return 0;
+		}
+	} else if (!(((uint8_t *)serialised->data)[PACKET_VIDEO_FLAGS_OFFSET] & VIDEO_FLAG_KEYFRAME)) {
+		if (stream->fec.count >= FEC_DEFAULT_VIDEO_GROUP) {
+			fec_encoder_reset(&stream->fec);
+		}
+
+		return 0;
+	}
+
+	return send_parity(media, addr, stream, &fec, parity_count);
+}
+
+void media_send_stream_free(MediaSendStream *stream) {
+	fec_encoder_reset(&stream->fec);
+}
+
+/*
+ * Account for a datagram arriving on stream and keep it for recovering its
+ * group. Returns as media_stream_update.
+ */
+int media_recv_stream_update(MediaRecvStream *stream, const MediaHeader *header, const Serialised *serialised) {
+	if (stream->stats.started && stream->stats.ssrc != header->ssrc) {
+		fec_decoder_free(&stream->fec);
+	}
+
+	fec_decoder_add(&stream->fec, header->seq, header->timestamp, serialised->data, serialised->size);
+
+	return media_stream_update(&stream->stats, header);
+}
+
+/*
+ * The SSRC of the stream a parity datagram protects.
+ */
+uint32_t media_parity_ssrc(const MediaHeader *header, const Serialised *parity) {
+	return (header->ssrc & ~MEDIA_SSRC_STREAM_MASK) | (((uint8_t *)parity->data)[0] & MEDIA_SSRC_STREAM_MASK);
+}
+
+/*
+ * Hand a parity datagram to the stream it protects. Returns how many
+ * datagrams it let us rebuild, with their headers and packets (freed by the
+ * caller) in headers[] and recovered[], up to FEC_MAX_PARITY. The caller
+ * accounts for them with media_stream_recover.
+ */
+size_t media_recv_stream_parity(MediaRecvStream *stream, const Serialised *parity, MediaHeader headers[],
+                                Serialised recovered[]) {
+	FecHeader fec = {0};
+	FecSymbol symbols[FEC_MAX_PARITY] = {0};
+	uint8_t *pos = parity->data;
+	size_t count = 0;
+
+	memcpy(&fec.stream, pos, sizeof fec.stream);
+	pos += sizeof fec.stream;
+	memcpy(&fec.scheme, pos, sizeof fec.scheme);
+	pos += sizeof fec.scheme;
+	memcpy(&fec.base_seq, pos, sizeof fec.base_seq);
+	pos += sizeof fec.base_seq;
+	memcpy(&fec.count, pos, sizeof fec.count);
+	pos += sizeof fec.count;
+	memcpy(&fec.parity_count, pos, sizeof fec.parity_count);
+	pos += sizeof fec.parity_count;
+	memcpy(&fec.index, pos, sizeof fec.index);
+	pos += sizeof fec.index;
+
+	if (!stream->stats.started || fec.scheme > FecSchemeReedSolomon) {
+		return 0;
+	}
+
+	size_t num_symbols = fec_decoder_parity(&stream->fec, &fec, pos, parity->size - FEC_HEADER_SIZE, symbols);
+
+	for (size_t i = 0; i < num_symbols; i++) {
+		if (!valid_media_packet(symbols[i].data, symbols[i].size)) {
+			free(symbols[i].data);
+
+			continue;
+		}
+
+		headers[count] =
+		    (MediaHeader){.ssrc = stream->stats.ssrc, .seq = symbols[i].seq, .timestamp = symbols[i].timestamp};
+		recovered[count] = (Serialised){.size = symbols[i].size, .data = symbols[i].data};
+		count++;
+	}
+
+	return count;
+}
+
+void media_recv_stream_free(MediaRecvStream *stream) {
+	fec_decoder_free(&stream->fec);
+}
+
+static void shim_configure(MediaShim *shim) {
+	const char *loss = getenv(MEDIA_SHIM_LOSS_ENV);
+	const char *delay = getenv(MEDIA_SHIM_DELAY_ENV);
+	const char *jitter = getenv(MEDIA_SHIM_JITTER_ENV);
+
+	pthread_mutex_init(&shim->lock, NULL);
+
+	shim->seed = (unsigned int)time(NULL) ^ (unsigned int)getpid();
+	shim->loss = loss != NULL ? strtod(loss, NULL) / 100 : 0;
+	shim->delay_ms = delay != NULL ? strtoul(delay, NULL, 10) : 0;
+	shim->jitter_ms = jitter != NULL ? strtoul(jitter, NULL, 10) : 0;
+
+	if (shim->loss > 0 || shim->delay_ms > 0 || shim->jitter_ms > 0) {
+		log_infof("media shim: %.1f%% loss, %ums delay, %ums jitter",
+		          shim->loss * 100,
+		          shim->delay_ms,
+		          shim->jitter_ms);
+	}
+}
+
+static void *shim_handler(void *arg) {
+	MediaSocket *media = (MediaSocket *)arg;
+	MediaShim *shim = &media->shim;
+
+	pthread_mutex_lock(&shim->lock);
+
+	while (!shim->stop) {
+		struct timespec now;
+
+		if (shim->queue == NULL) {
+			pthread_cond_wait(&shim->queued, &shim->lock);
+
+			continue;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+		if (timespec_before(&now, &shim->queue->due)) {
+			pthread_cond_timedwait(&shim->queued, &shim->lock, &shim->queue->due);
+
+			continue;
+		}
+
+		ShimDatagram *datagram = shim->queue;
+		shim->queue = datagram->next;
+
+		pthread_mutex_unlock(&shim->lock);
+
+		if (sendto(media->socket_fd,
+		           datagram->data,
+		           datagram->size,
+		           0,
+		           (struct sockaddr *)&datagram->addr,
+		           sizeof datagram->addr) < 0 &&
+		    errno != EAGAIN && errno != EWOULDBLOCK && errno != ENOBUFS) {
+			log_error(ERROR_NETWORK, "failed to send delayed media datagram");
+		}
+
+		free(datagram);
+
+		pthread_mutex_lock(&shim->lock);
+	}
+
+	pthread_mutex_unlock(&shim->lock);
+
+	return NULL;
+}
+
+/*
+ * Queue a copy of the datagram, ordered by when it is due. Call with the shim
+ * lock held.
+ */
+static void shim_enqueue(MediaShim *shim, const struct sockaddr_in *addr, const struct iovec *iov, size_t iov_len) {
+	size_t size = 0;
+
+	for (size_t i = 0; i < iov_len; i++) {
+		size += iov[i].iov_len;
+	}
+
+	ShimDatagram *datagram = malloc(sizeof *datagram + size);
+	uint8_t *pos = datagram->data;
+	unsigned int delay_ms = shim->delay_ms + (shim->jitter_ms > 0 ? rand_r(&shim->seed) % (shim->jitter_ms + 1) : 0);
+
+	for (size_t i = 0; i < iov_len; i++) {
+		if (iov[i].iov_len > 0) {
+			pos = mempcpy(pos, iov[i].iov_base, iov[i].iov_len);
+		}
+	}
+
+	datagram->addr = *addr;
+	datagram->size = size;
+
+	clock_gettime(CLOCK_MONOTONIC, &datagram->due);
+
+	datagram->due.tv_sec += delay_ms / 1000;
+	datagram->due.tv_nsec += (long)(delay_ms % 1000) * 1000000;
+
+	if (datagram->due.tv_nsec >= 1000000000) {
+		datagram->due.tv_sec++;
+		datagram->due.tv_nsec -= 1000000000;
+	}
+
+	ShimDatagram **next = &shim->queue;
+
+	while (*next != NULL && !timespec_before(&datagram->due, &(*next)->due)) {
+		next = &(*next)->next;
+	}
+
+	datagram->next = *next;
+	*next = datagram;
+
+	shim->delayed++;
+
+	pthread_cond_signal(&shim->queued);
+}
+
+static int timespec_before(const struct timespec *a, const struct timespec *b) {
+	return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+/*
+ * Exactly one whole media packet per datagram.
+ */
+static int valid_media_packet(const uint8_t *data, size_t size) {
+	uint32_t packet_size = 0;
+
+	if (size < PACKET_TIMESTAMP_OFFSET + sizeof(uint32_t)) {
+		return FALSE;
+	}
+
+	memcpy(&packet_size, data + sizeof(PacketType), sizeof packet_size);
+
+	if (packet_size != size) {
+		return FALSE;
+	}
+
+	if (data[0] == PacketTypeVideoFrame) {
+		return size > PACKET_VIDEO_FLAGS_OFFSET;
+	}
+
+	return data[0] == PacketTypeAudioFrame || data[0] == PacketTypeComfortNoise;
+}
+
+/*
+ * Close the stream's FEC group and send its parity datagrams. Parity that
+ * would not fit in a datagram is skipped.
+ */
+static int send_parity(MediaSocket *media, const struct sockaddr_in *addr, MediaSendStream *stream, FecHeader *fec,
+                       size_t parity_count) {
+	uint8_t *parity[FEC_MAX_PARITY];
+	size_t size = fec_encoder_finish(&stream->fec, fec, parity, parity_count);
+	MediaHeader header = {.ssrc = (stream->ssrc & ~MEDIA_SSRC_STREAM_MASK) | MEDIA_STREAM_FEC};
+	int ret = 0;
+
+	for (size_t i = 0; i < parity_count && size > 0; i++) {
+		if (ret == 0 && MEDIA_HEADER_SIZE + FEC_HEADER_SIZE + size <= MEDIA_MAX_DATAGRAM_SIZE) {
+			Serialised serialised = {.size = FEC_HEADER_SIZE + size, .data = malloc(FEC_HEADER_SIZE + size)};
+			uint8_t *pos = serialised.data;
+
+			fec->index = i;
+
+			pos = mempcpy(pos, &fec->stream, sizeof fec->stream);
+			pos = mempcpy(pos, &fec->scheme, sizeof fec->scheme);
+			pos = mempcpy(pos, &fec->base_seq, sizeof fec->base_seq);
+			pos = mempcpy(pos, &fec->count, sizeof fec->count);
+			pos = mempcpy(pos, &fec->parity_count, sizeof fec->parity_count);
+			pos = mempcpy(pos, &fec->index, sizeof fec->index);
+			memcpy(pos, parity[i], size);
+
+			ret = media_send(media, addr, &header, &serialised);
+
+			free(serialised.data);
+		}
+
+		free(parity[i]);
+	}
+
+	return ret;
+}
@@ -0,0 +1,147 @@
+#pragma once
+
+#include "fec.h"
+#include "packets.h"
+
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Audio and video travel as datagrams so one lost packet never holds up the
+ * ones behind it; chat, config and heartbeats stay on the TCP connection.
+ * Each datagram is a header followed by exactly one serialised media packet.
+ */
+#define MEDIA_PORT 5000
+#define MEDIA_HEADER_SIZE (sizeof(uint32_t) + sizeof(uint16_t) + sizeof(uint32_t))
+#define MEDIA_MAX_DATAGRAM_SIZE 65507
+
+/*
+ * The server hands every client an SSRC base over TCP. The low bits of an
+ * SSRC name the stream, the slot bits find the client on the server and the
+ * top bits are random so stale or stray datagrams do not match.
+ */
+#define MEDIA_SSRC_STREAM_MASK 0xF
+#define MEDIA_SSRC_SLOT_SHIFT 4
+#define MEDIA_SSRC_SLOT_MASK 0xFFF
+#define MEDIA_MAX_CLIENTS (MEDIA_SSRC_SLOT_MASK + 1)
+#define MEDIA_SSRC_SLOT(ssrc) (((ssrc) >> MEDIA_SSRC_SLOT_SHIFT) & MEDIA_SSRC_SLOT_MASK)
+
+#define MEDIA_STREAM_AUDIO 0
+#define MEDIA_STREAM_VIDEO(layer) (1 + (layer))
+#define MEDIA_NUM_STREAMS (1 + VIDEO_MAX_LAYERS)
+
+/*
+ * A header-only datagram on this stream opens the channel. The client repeats
+ * it until the server echoes it back.
+ */
+#define MEDIA_STREAM_HELLO MEDIA_SSRC_STREAM_MASK
+#define MEDIA_HELLO_INTERVAL_MS 250
+
+/*
+ * Parity datagrams for the other streams of an SSRC base. The payload is a
+ * FecHeader naming the protected stream followed by the parity symbol.
+ */
+#define MEDIA_STREAM_FEC (MEDIA_SSRC_STREAM_MASK - 1)
+
+#define MEDIA_SHIM_LOSS_ENV "MACLUNKEY_MEDIA_LOSS"
+#define MEDIA_SHIM_DELAY_ENV "MACLUNKEY_MEDIA_DELAY"
+#define MEDIA_SHIM_JITTER_ENV "MACLUNKEY_MEDIA_JITTER"
+
+/*
+ * seq counts datagrams per stream (and per receiver when forwarded by the
+ * server), timestamp is copied from the media packet.
+ */
+typedef struct {
+	uint32_t ssrc;
+	uint16_t seq;
+	uint32_t timestamp;
+} MediaHeader;
+
+typedef struct ShimDatagram {
+	struct ShimDatagram *next;
+	struct timespec due;
+	struct sockaddr_in addr;
+	size_t size;
+	uint8_t data[];
+} ShimDatagram;
+
+/*
+ * Userspace stand-in for netem so the media path can be tested on loopback.
+ * Outgoing datagrams are dropped with probability loss (from
+ * MEDIA_SHIM_LOSS_ENV, in percent) and held back for MEDIA_SHIM_DELAY_ENV
+ * plus up to MEDIA_SHIM_JITTER_ENV milliseconds, which may reorder them.
+ */
+typedef struct {
+	double loss;
+	unsigned int delay_ms;
+	unsigned int jitter_ms;
+	unsigned int seed;
+	int running;
+	int stop;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t queued;
+	ShimDatagram *queue;
+	uint64_t dropped;
+	uint64_t delayed;
+} MediaShim;
+
+typedef struct {
+	int socket_fd;
+	MediaShim shim;
+	FecConfig fec;
+	uint64_t received;
+	uint64_t malformed;
+} MediaSocket;
+
+/*
+ * Receive-side view of one incoming stream, from the datagram sequence numbers.
+ * lost only counts datagrams FEC could not rebuild.
+ */
+typedef struct {
+	int started;
+	uint32_t ssrc;
+	uint16_t highest_seq;
+	uint64_t received;
+	uint64_t lost;
+	uint64_t late;
+	uint64_t recovered;
+} MediaStreamStats;
+
+/*
+ * Sending side of one outgoing stream: its sequence numbers and the FEC group
+ * being built.
+ */
+typedef struct {
+	uint32_t ssrc;
+	uint16_t seq;
+	FecEncoder fec;
+} MediaSendStream;
+
+/*
+ * Receiving side of one incoming stream, keeping recent datagrams around for
+ * FEC recovery.
+ */
+typedef struct {
+	MediaStreamStats stats;
+	FecDecoder fec;
+} MediaRecvStream;
+
+int media_socket_open(MediaSocket *media, uint16_t port);
+void media_socket_close(MediaSocket *media);
+int media_send(MediaSocket *media, const struct sockaddr_in *addr, const MediaHeader *header,
+               const Serialised *serialised);
+int media_recv(MediaSocket *media, struct sockaddr_in *addr, MediaHeader *header, Serialised *serialised);
+uint32_t media_packet_timestamp(const Serialised *serialised);
+int media_stream_update(MediaStreamStats *stats, const MediaHeader *header);
+int media_stream_recover(MediaStreamStats *stats, const MediaHeader *header);
+int media_send_stream(MediaSocket *media, const struct sockaddr_in *addr, MediaSendStream *stream, uint32_t ssrc,
+                      const Serialised *serialised);
+void media_send_stream_free(MediaSendStream *stream);
+int media_recv_stream_update(MediaRecvStream *stream, const MediaHeader *header, const Serialised *serialised);
+uint32_t media_parity_ssrc(const MediaHeader *header, const Serialised *parity);
+size_t media_recv_stream_parity(MediaRecvStream *stream, const Serialised *parity, MediaHeader headers[],
+                                Serialised recovered[]);
+void media_recv_stream_free(MediaRecvStream *stream);
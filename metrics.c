@@ -0,0 +1,557 @@
+#include "metrics.h"
+
+#include "utils.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * A registry's counters added up over every shard.
+ */
+typedef struct {
+	uint64_t counts[HISTOGRAM_NUM_BUCKETS];
+	uint64_t sum;
+} HistogramTotal;
+
+typedef struct {
+	uint64_t counters[METRICS_NUM_COUNTERS];
+	uint64_t packets_in[PACKET_NUM_TYPES];
+	uint64_t bytes_in[PACKET_NUM_TYPES];
+	uint64_t packets_out[PACKET_NUM_TYPES];
+	uint64_t bytes_out[PACKET_NUM_TYPES];
+	HistogramTotal *histograms;
+} MetricsTotals;
+
+static MetricsShard *local_shard(void);
+static MetricsShard *attach_shard(void);
+static void detach_shard(void *arg);
+static void add(atomic_uint_least64_t *counter, uint64_t n);
+static void record(MetricsHistogram *histogram, uint64_t value);
+static MetricsHistogram *shard_histograms(MetricsShard *shard);
+static int collect(MetricsTotals *totals);
+static void write_counter(FILE *out, const char *name, const char *help, uint64_t value);
+static void write_gauge(FILE *out, const char *name, const char *help, int64_t value);
+static void write_by_type(FILE *out, const char *name, const char *help, const uint64_t *values);
+static void write_histogram(FILE *out, const char *name, const char *labels, const HistogramTotal *total, double scale);
+static char *socket_path(void);
+static void *stats_handler(void *arg);
+
+static const Config *config;
+static size_t num_histograms;
+static _Atomic(MetricsShard *) shards;
+static pthread_key_t shard_key;
+static _Thread_local MetricsShard *thread_shard;
+
+/*
+ * Shared by threads that record before they could get a shard of their own,
+ * if allocating one failed. Updates to it from several threads may be lost.
+ */
+static _Alignas(CACHE_LINE_SIZE) MetricsShard overflow_shard;
+
+static int stats_fd = -1;
+static MetricsWriter stats_writer;
+static void *stats_arg;
+
+/*
+ * Per-room histograms are labelled with the names of the rooms in
+ * server_config, which must outlive the registry.
+ */
+int metrics_init(const Config *server_config) {
+	config = server_config;
+	num_histograms = METRICS_NUM_HISTOGRAMS + (size_t)config->num_rooms * METRICS_NUM_ROOM_HISTOGRAMS;
+
+	if (pthread_key_create(&shard_key, detach_shard) != 0) {
+		log_error(ERROR_THREAD, "failed to create metrics thread key");
+
+		return -1;
+	}
+
+	atomic_store(&overflow_shard.in_use, TRUE);
+	atomic_store(&shards, &overflow_shard);
+
+	return 0;
+}
+
+void metrics_count(MetricCounter counter, uint64_t n) {
+	add(&local_shard()->counters[counter], n);
+}
+
+void metrics_packet_in(PacketType type, uint32_t size) {
+	MetricsShard *shard = local_shard();
+
+	if (type < PACKET_NUM_TYPES) {
+		add(&shard->packets_in[type], 1);
+		add(&shard->bytes_in[type], size);
+	}
+}
+
+void metrics_packet_out(PacketType type, uint32_t size) {
+	MetricsShard *shard = local_shard();
+
+	if (type < PACKET_NUM_TYPES) {
+		add(&shard->packets_out[type], 1);
+		add(&shard->bytes_out[type], size);
+	}
+}
+
+/*
+ * Count packets laid end to end, as a batch of chat goes out.
+ */
+void metrics_packets_out(const void *data, uint32_t size) {
+	Serialised packet;
+
+	for (uint32_t offset = 0; next_packet(data, size, &offset, &packet) == 0;) {
+		metrics_packet_out(((PacketType *)packet.data)[0], packet.size);
+	}
+}
+
+void metrics_observe(MetricHistogram histogram, uint64_t value) {
+	MetricsHistogram *histograms = shard_histograms(local_shard());
+
+	if (histograms != NULL) {
+		record(&histograms[histogram], value);
+	}
+}
+
+void metrics_observe_room(RoomIndex room, MetricRoomHistogram histogram, uint64_t value) {
+	MetricsHistogram *histograms = shard_histograms(local_shard());
+
+	if (histograms != NULL && room >= 0 && room < config->num_rooms) {
+		record(&histograms[METRICS_NUM_HISTOGRAMS + room * METRICS_NUM_ROOM_HISTOGRAMS + histogram], value);
+	}
+}
+
+uint64_t metrics_now_ns(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/*
+ * Everything recorded so far, in the Prometheus text format.
+ */
+void metrics_write(FILE *out) {
+	MetricsTotals totals;
+
+	if (collect(&totals) < 0) {
+		log_error(ERROR_OS, "failed to allocate metrics totals");
+
+		return;
+	}
+
+	const uint64_t *counters = totals.counters;
+
+	write_counter(out,
+	              "connections_opened_total",
+	              "Client connections accepted.",
+	              counters[MetricConnectionsOpened]);
+	write_gauge(out,
+	            "connections",
+	            "Client connections open.",
+	            counters[MetricConnectionsOpened] - counters[MetricConnectionsClosed]);
+	write_counter(out, "heartbeat_misses_total", "Pings that went unanswered.", counters[MetricHeartbeatMisses]);
+	write_counter(out,
+	              "heartbeat_skips_total",
+	              "Pings not sent because the client had just been heard from.",
+	              counters[MetricHeartbeatSkips]);
+	write_gauge(out,
+	            "room_inbox_depth",
+	            "Chat messages waiting in room inboxes.",
+	            counters[MetricInboxPushed] - counters[MetricInboxPopped]);
+	write_counter(out, "chat_messages_logged_total", "Chat messages stamped and logged.", counters[MetricChatLogged]);
+	write_counter(out,
+	              "media_dropped_total",
+	              "Media packets not sent to receivers that were too far behind.",
+	              counters[MetricMediaDropped]);
+	write_counter(out,
+	              "log_messages_dropped_total",
+	              "Log messages dropped because a thread's log ring was full.",
+	              log_dropped());
+
+	write_by_type(out, "packets_received_total", "Packets received from clients.", totals.packets_in);
+	write_by_type(out, "bytes_received_total", "Bytes of packets received from clients.", totals.bytes_in);
+	write_by_type(out, "packets_sent_total", "Packets sent to clients.", totals.packets_out);
+	write_by_type(out, "bytes_sent_total", "Bytes of packets sent to clients.", totals.bytes_out);
+
+	metrics_write_header(out, "chat_batch_size", "histogram", "Chat messages a room owner took from its inbox at once.");
+	write_histogram(out, "chat_batch_size", NULL, &totals.histograms[MetricChatBatch], 1);
+	metrics_write_header(out,
+	                     "media_backlog_bytes",
+	                     "histogram",
+	                     "Bytes already queued for a receiver when media was sent to it.");
+	write_histogram(out, "media_backlog_bytes", NULL, &totals.histograms[MetricMediaBacklog], 1);
+	metrics_write_header(out, "heartbeat_rtt_seconds", "histogram", "Round trip times of heartbeats.");
+	write_histogram(out, "heartbeat_rtt_seconds", NULL, &totals.histograms[MetricHeartbeatRtt], 1e-6);
+	metrics_write_header(out,
+	                     "room_fanout_seconds",
+	                     "histogram",
+	                     "Time taken to pass chat or media on to the rest of a room.");
+
+	for (size_t room = 0; room < config->num_rooms; room++) {
+		static const char *const kinds[METRICS_NUM_ROOM_HISTOGRAMS] = {"chat", "media"};
+
+		for (size_t kind = 0; kind < METRICS_NUM_ROOM_HISTOGRAMS; kind++) {
+			char *labels = NULL;
+			size_t labels_size = 0;
+			FILE *labels_file = open_memstream(&labels, &labels_size);
+
+			if (labels_file == NULL) {
+				continue;
+			}
+
+			fprintf(labels_file, "room=\"");
+			metrics_write_label_value(labels_file, config->rooms[room].name);
+			fprintf(labels_file, "\",kind=\"%s\"", kinds[kind]);
+			fclose(labels_file);
+
+			write_histogram(out,
+			                "room_fanout_seconds",
+			                labels,
+			                &totals.histograms[METRICS_NUM_HISTOGRAMS + room * METRICS_NUM_ROOM_HISTOGRAMS + kind],
+			                1e-9);
+			freep(labels);
+		}
+	}
+
+	freep(totals.histograms);
+}
+
+void metrics_write_header(FILE *out, const char *name, const char *type, const char *help) {
+	fprintf(out, "# HELP " METRICS_PREFIX "%s %s\n# TYPE " METRICS_PREFIX "%s %s\n", name, help, name, type);
+}
+
+/*
+ * Listen for connections on the stats socket and answer each with the stats,
+ * followed by whatever writer adds, then hang up. Returns 0 without listening
+ * if the socket is turned off.
+ */
+int metrics_serve(MetricsWriter writer, void *arg) {
+	char *path = socket_path();
+	struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+	if (path == NULL) {
+		return 0;
+	}
+
+	if (strlen(path) >= sizeof addr.sun_path) {
+		log_error(ERROR_NETWORK, "stats socket path is too long");
+		freep(path);
+
+		return -1;
+	}
+
+	strcpy(addr.sun_path, path);
+
+	// A socket left behind by a server that did not shut down cleanly would stop the bind.
+	if (unlink(path) < 0 && errno != ENOENT) {
+		log_error(ERROR_OS, "failed to remove old stats socket");
+	}
+
+	if ((stats_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+	    bind(stats_fd, (struct sockaddr *)&addr, sizeof addr) < 0 || chmod(path, 0600) < 0 ||
+	    listen(stats_fd, SOMAXCONN) < 0) {
+		log_error(ERROR_NETWORK, "failed to listen on stats socket");
+		freep(path);
+
+		if (stats_fd >= 0) {
+			close(stats_fd);
+			stats_fd = -1;
+		}
+
+		return -1;
+	}
+
+	log_infof("serving stats on %s", path);
+	freep(path);
+
+	stats_writer = writer;
+	stats_arg = arg;
+
+	pthread_t thread;
+
+	if (pthread_create(&thread, NULL, stats_handler, NULL) != 0 || pthread_detach(thread) != 0) {
+		log_error(ERROR_THREAD, "failed to start stats thread");
+
+		return -1;
+	}
+
+	return 0;
+}
+
+static MetricsShard *local_shard(void) {
+	if (thread_shard == NULL) {
+		thread_shard = attach_shard();
+	}
+
+	return thread_shard;
+}
+
+/*
+ * Take over a shard left by a thread that has finished, or add a new one.
+ */
+static MetricsShard *attach_shard(void) {
+	MetricsShard *shard = NULL;
+
+	for (shard = atomic_load(&shards); shard != NULL; shard = shard->next) {
+		int expected = FALSE;
+
+		if (atomic_compare_exchange_strong(&shard->in_use, &expected, TRUE)) {
+			break;
+		}
+	}
+
+	if (shard == NULL) {
+		size_t size = (sizeof *shard + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+
+		if ((shard = aligned_alloc(CACHE_LINE_SIZE, size)) == NULL) {
+			return &overflow_shard;
+		}
+
+		memset(shard, 0, size);
+		atomic_init(&shard->in_use, TRUE);
+		shard->next = atomic_load(&shards);
+
+		while (!atomic_compare_exchange_weak(&shards, &shard->next, shard)) {
+		}
+	}
+
+	pthread_setspecific(shard_key, shard);
+
+	return shard;
+}
+
+static void detach_shard(void *arg) {
+	MetricsShard *shard = arg;
+
+	atomic_store(&shard->in_use, FALSE);
+}
+
+/*
+ * Only the shard's own thread writes to it, so a plain load and store does
+ * what a locked add would, for a fraction of the cost.
+ */
+static void add(atomic_uint_least64_t *counter, uint64_t n) {
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+static void record(MetricsHistogram *histogram, uint64_t value) {
+	add(&histogram->counts[histogram_bucket(value)], 1);
+	add(&histogram->sum, value);
+}
+
+static MetricsHistogram *shard_histograms(MetricsShard *shard) {
+	MetricsHistogram *histograms = atomic_load_explicit(&shard->histograms, memory_order_acquire);
+
+	if (histograms == NULL) {
+		MetricsHistogram *allocated = calloc(num_histograms, sizeof *allocated);
+
+		// Only the overflow shard can be raced for, and the loser uses the winner's.
+		if (allocated != NULL && !atomic_compare_exchange_strong(&shard->histograms, &histograms, allocated)) {
+			free(allocated);
+		} else {
+			histograms = allocated;
+		}
+	}
+
+	return histograms;
+}
+
+static int collect(MetricsTotals *totals) {
+	memset(totals, 0, sizeof *totals);
+
+	if ((totals->histograms = calloc(num_histograms, sizeof *totals->histograms)) == NULL) {
+		return -1;
+	}
+
+	for (MetricsShard *shard = atomic_load(&shards); shard != NULL; shard = shard->next) {
+		for (size_t i = 0; i < METRICS_NUM_COUNTERS; i++) {
+			totals->counters[i] += atomic_load_explicit(&shard->counters[i], memory_order_relaxed);
+		}
+
+		for (size_t i = 0; i < PACKET_NUM_TYPES; i++) {
+			totals->packets_in[i] += atomic_load_explicit(&shard->packets_in[i], memory_order_relaxed);
+			totals->bytes_in[i] += atomic_load_explicit(&shard->bytes_in[i], memory_order_relaxed);
+			totals->packets_out[i] += atomic_load_explicit(&shard->packets_out[i], memory_order_relaxed);
+			totals->bytes_out[i] += atomic_load_explicit(&shard->bytes_out[i], memory_order_relaxed);
+		}
+
+		MetricsHistogram *histograms = atomic_load_explicit(&shard->histograms, memory_order_acquire);
+
+		for (size_t i = 0; histograms != NULL && i < num_histograms; i++) {
+			for (size_t j = 0; j < HISTOGRAM_NUM_BUCKETS; j++) {
+				totals->histograms[i].counts[j] += atomic_load_explicit(&histograms[i].counts[j], memory_order_relaxed);
+			}
+
+			totals->histograms[i].sum += atomic_load_explicit(&histograms[i].sum, memory_order_relaxed);
+		}
+	}
+
+	return 0;
+}
+
+static void write_counter(FILE *out, const char *name, const char *help, uint64_t value) {
+	metrics_write_header(out, name, "counter", help);
+	fprintf(out, METRICS_PREFIX "%s %" PRIu64 "\n", name, value);
+}
+
+/*
+ * Gauges made from two counters read at slightly different times can come
+ * out a little off, or even negative, while they are changing.
+ */
+static void write_gauge(FILE *out, const char *name, const char *help, int64_t value) {
+	metrics_write_header(out, name, "gauge", help);
+	fprintf(out, METRICS_PREFIX "%s %" PRId64 "\n", name, value);
+}
+
+static void write_by_type(FILE *out, const char *name, const char *help, const uint64_t *values) {
+	metrics_write_header(out, name, "counter", help);
+
+	for (PacketType type = 0; type < PACKET_NUM_TYPES; type++) {
+		fprintf(out, METRICS_PREFIX "%s{type=\"%s\"} %" PRIu64 "\n", name, packet_type_to_string(type), values[type]);
+	}
+}
+
+/*
+ * Only buckets from the lowest to the highest one anything is in are written,
+ * with bounds multiplied by scale to give them in the metric's unit.
+ */
+static void write_histogram(FILE *out, const char *name, const char *labels, const HistogramTotal *total,
+                            double scale) {
+	unsigned int first = HISTOGRAM_NUM_BUCKETS;
+	unsigned int last = 0;
+	uint64_t count = 0;
+
+	for (unsigned int i = 0; i < HISTOGRAM_NUM_BUCKETS; i++) {
+		if (total->counts[i] > 0) {
+			first = i < first ? i : first;
+			last = i;
+		}
+	}
+
+	const char *separator = labels != NULL ? "," : "";
+	const char *open_brace = labels != NULL ? "{" : "";
+	const char *close_brace = labels != NULL ? "}" : "";
+
+	labels = labels != NULL ? labels : "";
+
+	for (unsigned int i = first; i <= last; i++) {
+		count += total->counts[i];
+		fprintf(out,
+		        METRICS_PREFIX "%s_bucket{%s%sle=\"%.9g\"} %" PRIu64 "\n",
+		        name,
+		        labels,
+		        separator,
+		        histogram_bucket_limit(i) * scale,
+		        count);
+	}
+
+	for (unsigned int i = last + 1; i < HISTOGRAM_NUM_BUCKETS; i++) {
+		count += total->counts[i];
+	}
+
+	fprintf(out, METRICS_PREFIX "%s_bucket{%s%sle=\"+Inf\"} %" PRIu64 "\n", name, labels, separator, count);
+	fprintf(out, METRICS_PREFIX "%s_sum%s%s%s %.9g\n", name, open_brace, labels, close_brace, total->sum * scale);
+	fprintf(out, METRICS_PREFIX "%s_count%s%s%s %" PRIu64 "\n", name, open_brace, labels, close_brace, count);
+}
+
+/*
+ * Escape value for use between the quotes of a label.
+ */
+void metrics_write_label_value(FILE *out, const char *value) {
+	for (const char *pos = value; *pos != '\0'; pos++) {
+		if (*pos == '\\' || *pos == '"') {
+			fprintf(out, "\\%c", *pos);
+		} else if (*pos == '\n') {
+			fprintf(out, "\\n");
+		} else {
+			fputc(*pos, out);
+		}
+	}
+}
+
+/*
+ * The path from the environment, or the default one under the home
+ * directory, or NULL if the socket is turned off.
+ */
+static char *socket_path(void) {
+	const char *path = getenv(METRICS_SOCKET_ENV);
+
+	if (path != NULL) {
+		return strlen(path) > 0 ? strdup(path) : NULL;
+	}
+
+	char *home_dir = get_home_dir();
+
+	if (home_dir == NULL) {
+		log_error(ERROR_OS, "failed to get home directory");
+
+		return NULL;
+	}
+
+	return join_path(home_dir, METRICS_SOCKET_PATH, NULL);
+}
+
+/*
+ * Stats are written out in full before sending, so a slow reader holds up
+ * only the next one.
+ */
+static void *stats_handler(void *arg) {
+	(void)arg;
+
+	while (TRUE) {
+		int client_fd = accept4(stats_fd, NULL, NULL, SOCK_CLOEXEC);
+
+		if (client_fd < 0) {
+			if (errno != EINTR && errno != ECONNABORTED) {
+				log_error(ERROR_NETWORK, "failed to accept stats connection");
+				sleep(1);
+			}
+
+			continue;
+		}
+
+		char *text = NULL;
+		size_t size = 0;
+		FILE *out = open_memstream(&text, &size);
+
+		if (out == NULL) {
+			log_error(ERROR_OS, "failed to allocate stats");
+		} else {
+			metrics_write(out);
+
+			if (stats_writer != NULL) {
+				stats_writer(out, stats_arg);
+			}
+
+			fclose(out);
+
+			for (size_t sent = 0; sent < size;) {
+				ssize_t n = send(client_fd, text + sent, size - sent, MSG_NOSIGNAL);
+
+				if (n < 0 && errno == EINTR) {
+					continue;
+				} else if (n <= 0) {
+					break;
+				}
+
+				sent += n;
+			}
+
+			freep(text);
+		}
+
+		close(client_fd);
+	}
+
+	return NULL;
+}
@@ -0,0 +1,109 @@
+#pragma once
+
+#include "histogram.h"
+#include "mpsc.h"
+#include "packets.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Where the stats socket is made, relative to the home directory unless
+ * METRICS_SOCKET_ENV gives a path of its own. An empty path turns it off.
+ */
+#define METRICS_SOCKET_ENV "MACLUNKEY_STATS_SOCKET"
+#define METRICS_SOCKET_PATH ".config/" APP_NAME "/stats.sock"
+
+#define METRICS_PREFIX APP_NAME "_"
+
+typedef enum
+{
+	MetricConnectionsOpened,
+	MetricConnectionsClosed,
+	MetricHeartbeatMisses,
+	MetricHeartbeatSkips,
+	MetricInboxPushed,
+	MetricInboxPopped,
+	MetricChatLogged,
+	MetricMediaDropped
+} _MetricCounter;
+
+typedef uint8_t MetricCounter;
+
+#define METRICS_NUM_COUNTERS (MetricMediaDropped + 1)
+
+/*
+ * How many chat messages a room's owner took from its inbox at once, how many
+ * bytes were already queued for a receiver when media was sent to it, and
+ * heartbeat round trip times in microseconds.
+ */
+typedef enum
+{
+	MetricChatBatch,
+	MetricMediaBacklog,
+	MetricHeartbeatRtt
+} _MetricHistogram;
+
+typedef uint8_t MetricHistogram;
+
+#define METRICS_NUM_HISTOGRAMS (MetricHeartbeatRtt + 1)
+
+/*
+ * Nanoseconds spent passing one chat batch or media packet on to the rest of
+ * a room.
+ */
+typedef enum
+{
+	MetricRoomChatFanout,
+	MetricRoomMediaFanout
+} _MetricRoomHistogram;
+
+typedef uint8_t MetricRoomHistogram;
+
+#define METRICS_NUM_ROOM_HISTOGRAMS (MetricRoomMediaFanout + 1)
+
+typedef struct {
+	atomic_uint_least64_t counts[HISTOGRAM_NUM_BUCKETS];
+	atomic_uint_least64_t sum;
+} MetricsHistogram;
+
+/*
+ * Everything one thread has recorded. Only that thread writes to it, with
+ * plain loads and stores rather than locked instructions, and it starts on a
+ * cache line of its own so no two threads write to the same line. Readers add
+ * the shards up when asked for stats.
+ *
+ * Histograms are only allocated by threads that record one. A shard outlives
+ * its thread and is handed to the next thread that starts, whose counts then
+ * carry on from where it left off.
+ */
+typedef struct MetricsShard {
+	atomic_uint_least64_t counters[METRICS_NUM_COUNTERS];
+	atomic_uint_least64_t packets_in[PACKET_NUM_TYPES];
+	atomic_uint_least64_t bytes_in[PACKET_NUM_TYPES];
+	atomic_uint_least64_t packets_out[PACKET_NUM_TYPES];
+	atomic_uint_least64_t bytes_out[PACKET_NUM_TYPES];
+	_Atomic(MetricsHistogram *) histograms;
+	atomic_int in_use;
+	struct MetricsShard *next;
+} MetricsShard;
+
+/*
+ * Writes stats of the caller's own, such as gauges read from its state, after
+ * the registry's.
+ */
+typedef void (*MetricsWriter)(FILE *out, void *arg);
+
+int metrics_init(const Config *config);
+void metrics_count(MetricCounter counter, uint64_t n);
+void metrics_packet_in(PacketType type, uint32_t size);
+void metrics_packet_out(PacketType type, uint32_t size);
+void metrics_packets_out(const void *data, uint32_t size);
+void metrics_observe(MetricHistogram histogram, uint64_t value);
+void metrics_observe_room(RoomIndex room, MetricRoomHistogram histogram, uint64_t value);
+uint64_t metrics_now_ns(void);
+void metrics_write(FILE *out);
+void metrics_write_header(FILE *out, const char *name, const char *type, const char *help);
+void metrics_write_label_value(FILE *out, const char *value);
+int metrics_serve(MetricsWriter writer, void *arg);
@@ -0,0 +1,100 @@
+#include "mpsc.h"
+
+#include "utils.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * capacity is rounded up to a power of two, so positions map to slots by
+ * masking.
+ */
+int mpsc_queue_init(MpscQueue *queue, size_t capacity) {
+	memset(queue, 0, sizeof *queue);
+
+	size_t size = 1;
+
+	while (size < capacity) {
+		size <<= 1;
+	}
+
+	if ((queue->slots = aligned_alloc(CACHE_LINE_SIZE, size * sizeof *queue->slots)) == NULL) {
+		return -1;
+	}
+
+	for (size_t i = 0; i < size; i++) {
+		atomic_init(&queue->slots[i].sequence, i);
+		queue->slots[i].item = NULL;
+	}
+
+	queue->mask = size - 1;
+	atomic_init(&queue->tail, 0);
+
+	return 0;
+}
+
+/*
+ * Items still queued are not freed.
+ */
+void mpsc_queue_free(MpscQueue *queue) {
+	free(queue->slots);
+	memset(queue, 0, sizeof *queue);
+}
+
+/*
+ * A slot is free for the producer at pos when its sequence is pos, and holds
+ * an item for the consumer when it is pos + 1. A sequence behind pos means
+ * the consumer has not got round to the slot since the last lap, so the queue
+ * is full. Returns -1 then.
+ */
+int mpsc_queue_push(MpscQueue *queue, void *item) {
+	size_t pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+	MpscSlot *slot;
+
+	while (TRUE) {
+		slot = &queue->slots[pos & queue->mask];
+
+		size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+		intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak_explicit(&queue->tail,
+			                                          &pos,
+			                                          pos + 1,
+			                                          memory_order_relaxed,
+			                                          memory_order_relaxed)) {
+				break;
+			}
+		} else if (diff < 0) {
+			return -1;
+		} else {
+			pos = atomic_load_explicit(&queue->tail, memory_order_relaxed);
+		}
+	}
+
+	slot->item = item;
+	atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+
+	return 0;
+}
+
+/*
+ * Returns NULL when nothing is queued, which includes a slot a producer has
+ * claimed but not yet filled, even if later ones are. Only ever call from the
+ * one consuming thread.
+ */
+void *mpsc_queue_pop(MpscQueue *queue) {
+	MpscSlot *slot = &queue->slots[queue->head & queue->mask];
+
+	if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != queue->head + 1) {
+		return NULL;
+	}
+
+	void *item = slot->item;
+
+	// Hand the slot back for the producers' next lap.
+	atomic_store_explicit(&slot->sequence, queue->head + queue->mask + 1, memory_order_release);
+	queue->head++;
+
+	return item;
+}
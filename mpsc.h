@@ -0,0 +1,37 @@
+#pragma once
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CACHE_LINE_SIZE 64
+
+/*
+ * A bounded queue of pointers that any number of threads may push to and one
+ * thread pops from, without locks. Each slot carries a sequence number saying
+ * whose turn it is: a producer claims the next slot by advancing tail, stores
+ * its item and then publishes it by bumping the sequence, which is what the
+ * consumer waits on. Slots, and the producer and consumer ends, each take a
+ * cache line of their own so threads working on neighbouring ones do not keep
+ * taking the line from each other.
+ */
+typedef struct {
+	atomic_size_t sequence;
+	void *item;
+	uint8_t padding[CACHE_LINE_SIZE - sizeof(atomic_size_t) - sizeof(void *)];
+} MpscSlot;
+
+typedef struct {
+	MpscSlot *slots;
+	size_t mask;
+	uint8_t padding[CACHE_LINE_SIZE - sizeof(MpscSlot *) - sizeof(size_t)];
+	atomic_size_t tail;
+	uint8_t tail_padding[CACHE_LINE_SIZE - sizeof(atomic_size_t)];
+	size_t head;
+	uint8_t head_padding[CACHE_LINE_SIZE - sizeof(size_t)];
+} MpscQueue;
+
+int mpsc_queue_init(MpscQueue *queue, size_t capacity);
+void mpsc_queue_free(MpscQueue *queue);
+int mpsc_queue_push(MpscQueue *queue, void *item);
+void *mpsc_queue_pop(MpscQueue *queue);
@@ -1,4 +1,5 @@
 #include <errno.h>
+#include <inttypes.h>
 #include <packets.h>
 #include <pthread.h>
 #include <stdint.h>
@@ -8,9 +9,64 @@
 #include <sys/socket.h>
 #include <utils.h>
 
+const char *packet_type_to_string(const PacketType type) {
+	switch (type) {
+		case PacketTypeConfig:
+			return "config";
+
+		case PacketTypeJoinRoom:
+			return "join_room";
+
+		case PacketTypeLeaveRoom:
+			return "leave_room";
+
+		case PacketTypeHeartbeat:
+			return "heartbeat";
+
+		case PacketTypeChatMessage:
+			return "chat_message";
+
+		case PacketTypeAudioFrame:
+			return "audio_frame";
+
+		case PacketTypeVideoFrame:
+			return "video_frame";
+
+		case PacketTypeAudioCodec:
+			return "audio_codec";
+
+		case PacketTypeComfortNoise:
+			return "comfort_noise";
+
+		case PacketTypeActiveSpeaker:
+			return "active_speaker";
+
+		case PacketTypeMediaChannel:
+			return "media_channel";
+
+		case PacketTypeFragment:
+			return "fragment";
+
+		case PacketTypeChatRecord:
+			return "chat_record";
+
+		case PacketTypeChatHistory:
+			return "chat_history";
+
+		case PacketTypeChatSearch:
+			return "chat_search";
+
+		case PacketTypeChatSearchResults:
+			return "chat_search_results";
+
+		default:
+			return "unknown";
+	}
+}
+
 int send_packet(const int socket_fd, const Serialised *serialised, pthread_mutex_t *mutex) {
-	int total_bytes = 0;
-	int num_bytes = 0;
+	size_t total_bytes = 0;
+	ssize_t num_bytes = 0;
 	int ret = 0;
 
 	if (mutex != NULL) {
@@ -20,9 +76,9 @@ int send_packet(const int socket_fd, const Serialised *serialised, pthread_mutex
 	while (total_bytes < serialised->size) {
 		if ((num_bytes = send(socket_fd, (char *)serialised->data + total_bytes, serialised->size - total_bytes, 0)) <
 		    0) {
-			log_errorf(ERROR_NETWORK, "failed to send network packet of size %d", serialised->size);
+			log_errorf(ERROR_NETWORK, "failed to send network packet of size %" PRIu32, serialised->size);
 
-			ret = num_bytes;
+			ret = -1;
 
 			break;
 		} else if (num_bytes == 0) {
@@ -42,167 +98,334 @@ int send_packet(const int socket_fd, const Serialised *serialised, pthread_mutex
 	return ret;
 }
 
+/*
+ * Receive exactly size bytes. Returns 1 once they are in, 0 if the peer
+ * disconnected first, or -1 on error.
+ */
+int recv_all(const int socket_fd, void *data, size_t size) {
+	size_t total_bytes = 0;
+
+	while (total_bytes < size) {
+		ssize_t num_bytes = recv(socket_fd, (char *)data + total_bytes, size - total_bytes, 0);
+
+		if (num_bytes < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return -1;
+		} else if (num_bytes == 0) {
+			return 0;
+		}
+
+		total_bytes += num_bytes;
+	}
+
+	return 1;
+}
+
+/*
+ * Receive one packet into serialised, whose data the caller frees. The size
+ * header is checked against PACKET_MAX_SIZE before anything is allocated.
+ * Returns the packet size, 0 if the peer disconnected, or -1 on error.
+ */
 int recv_packet(const int socket_fd, Serialised *serialised, pthread_mutex_t *mutex) {
-	char data[sizeof(PacketType) + sizeof serialised->size];
-	int num_bytes = 0;
+	uint8_t header[PACKET_HEADER_SIZE];
+	int ret = 0;
+
+	*serialised = (Serialised){0};
 
 	if (mutex != NULL) {
 		pthread_mutex_lock(mutex);
 	}
 
-	if ((num_bytes = recv(socket_fd, data, sizeof(PacketType) + sizeof serialised->size, MSG_PEEK)) < 0) {
-		log_errorf(ERROR_NETWORK, "failed to receive network packet of size %d", serialised->size);
-		perror("HERE");
-
-		free(serialised);
+	if ((ret = recv_all(socket_fd, header, sizeof header)) <= 0) {
+		if (ret < 0) {
+			log_error(ERROR_NETWORK, "failed to receive network packet header");
+		}
 
 		if (mutex != NULL) {
 			pthread_mutex_unlock(mutex);
 		}
 
-		return num_bytes;
-	} else if (num_bytes == 0) {
-		free(serialised);
+		return ret;
+	}
+
+	memcpy(&serialised->size, header + sizeof(PacketType), sizeof serialised->size);
+
+	if (serialised->size < PACKET_HEADER_SIZE || serialised->size > PACKET_MAX_SIZE) {
+		log_errorf(ERROR_NETWORK, "received network packet with bad size %" PRIu32, serialised->size);
+
+		serialised->size = 0;
 
 		if (mutex != NULL) {
 			pthread_mutex_unlock(mutex);
 		}
 
-		return 0;
+		return -1;
 	}
 
-	memcpy(&serialised->size, data + sizeof(PacketType), sizeof serialised->size);
 	serialised->data = malloc(serialised->size);
-	int total_bytes = 0;
-	num_bytes = 0;
+	memcpy(serialised->data, header, sizeof header);
 
-	while (total_bytes < serialised->size) {
-		if ((num_bytes = recv(socket_fd, (char *)serialised->data + total_bytes, serialised->size - total_bytes, 0)) <
-		    0) {
-			free(serialised->data);
-			free(serialised);
+	ret = recv_all(socket_fd, (uint8_t *)serialised->data + sizeof header, serialised->size - sizeof header);
 
-			log_errorf(ERROR_NETWORK, "failed to receive network packet of size %d", serialised->size);
+	if (mutex != NULL) {
+		pthread_mutex_unlock(mutex);
+	}
 
-			if (mutex != NULL) {
-				pthread_mutex_unlock(mutex);
-			}
+	if (ret <= 0) {
+		if (ret < 0) {
+			log_errorf(ERROR_NETWORK, "failed to receive network packet of size %" PRIu32, serialised->size);
+		}
 
-			return num_bytes;
-		} else if (num_bytes == 0) {
-			free(serialised->data);
-			free(serialised);
+		freep(serialised->data);
+		serialised->size = 0;
 
-			if (mutex != NULL) {
-				pthread_mutex_unlock(mutex);
-			}
+		return ret;
+	}
 
-			return 0;
-		} else {
-			total_bytes += num_bytes;
-		}
+	return serialised->size;
+}
+
+/*
+ * Step through packets stored back to back, such as chat history. Returns 0
+ * with the one at offset in packet and offset moved past it, or -1 at the end
+ * or if the rest is malformed. packet points into data.
+ */
+int next_packet(const void *data, uint32_t size, uint32_t *offset, Serialised *packet) {
+	uint32_t packet_size = 0;
+
+	if (*offset >= size || size - *offset < PACKET_HEADER_SIZE) {
+		return -1;
 	}
 
-	if (mutex != NULL) {
-		pthread_mutex_unlock(mutex);
+	memcpy(&packet_size, (const uint8_t *)data + *offset + sizeof(PacketType), sizeof packet_size);
+
+	if (packet_size < PACKET_HEADER_SIZE || packet_size > size - *offset) {
+		return -1;
 	}
 
-	return total_bytes;
+	*packet = (Serialised){.size = packet_size, .data = (uint8_t *)data + *offset};
+	*offset += packet_size;
+
+	return 0;
 }
 
-Serialised *serialise_config(const Config *config) {
-	PacketType packet_type = PacketTypeConfig;
+/*
+ * Write the header of a packet of size bytes, returning where its body goes.
+ */
+static char *put_header(void *buffer, const PacketType type, const uint32_t size) {
+	char *pos = mempcpy(buffer, &type, sizeof type);
+
+	return mempcpy(pos, &size, sizeof size);
+}
+
+static Serialised *allocate_packet(const uint32_t size) {
 	Serialised *serialised = malloc(sizeof *serialised);
-	serialised->size = sizeof packet_type + sizeof serialised->size;
 
-	for (size_t i = 0; i < config->num_rooms; i++) {
-		serialised->size += strlen(config->rooms[i].name) + 1;
-		serialised->size += strlen(config->rooms[i].desc) + 1;
-	}
+	serialised->size = size;
+	serialised->data = malloc(size);
 
-	serialised->data = malloc(serialised->size);
-	char *pos = mempcpy(serialised->data, &packet_type, sizeof packet_type);
-	pos = mempcpy(pos, &serialised->size, sizeof serialised->size);
+	return serialised;
+}
 
-	for (size_t i = 0; i < config->num_rooms; i++) {
-		pos = mempcpy(pos, config->rooms[i].name, strlen(config->rooms[i].name) + 1);
-		pos = mempcpy(pos, config->rooms[i].desc, strlen(config->rooms[i].desc) + 1);
+/*
+ * The body of a packet of type with at least body_size bytes in it, or NULL
+ * if serialised is not one.
+ */
+static const char *get_body(const Serialised *serialised, const PacketType type, const size_t body_size) {
+	if (serialised->size < PACKET_HEADER_SIZE + body_size || ((PacketType *)serialised->data)[0] != type) {
+		return NULL;
 	}
 
-	return serialised;
+	return (const char *)serialised->data + PACKET_HEADER_SIZE;
 }
 
-Serialised *serialise_heartbeat(const Heartbeat heartbeat) {
-	PacketType packet_type = PacketTypeHeartbeat;
-	Serialised *serialised = malloc(sizeof *serialised);
-	serialised->size = sizeof packet_type + sizeof serialised->size + sizeof heartbeat;
-	serialised->data = malloc(serialised->size);
+#define PACKET_VALUE_CODEC(name, type, value_type)                                             \
+	uint32_t serialise_##name##_into(const value_type value, void *buffer, size_t capacity) {  \
+		if (capacity < PACKET_VALUE_SIZE(value_type)) {                                        \
+			return 0;                                                                          \
+		}                                                                                      \
+                                                                                               \
+		memcpy(put_header(buffer, type, PACKET_VALUE_SIZE(value_type)), &value, sizeof value); \
+                                                                                               \
+		return PACKET_VALUE_SIZE(value_type);                                                  \
+	}                                                                                          \
+                                                                                               \
+	Serialised *serialise_##name(const value_type value) {                                     \
+		Serialised *serialised = allocate_packet(PACKET_VALUE_SIZE(value_type));               \
+                                                                                               \
+		serialise_##name##_into(value, serialised->data, serialised->size);                    \
+                                                                                               \
+		return serialised;                                                                     \
+	}                                                                                          \
+                                                                                               \
+	int unserialise_##name(const Serialised *serialised, value_type *value) {                  \
+		const char *pos = get_body(serialised, type, sizeof *value);                           \
+                                                                                               \
+		if (pos == NULL) {                                                                     \
+			return -1;                                                                         \
+		}                                                                                      \
+                                                                                               \
+		memcpy(value, pos, sizeof *value);                                                     \
+                                                                                               \
+		return 0;                                                                              \
+	}
+PACKET_VALUE_TABLE(PACKET_VALUE_CODEC)
+#undef PACKET_VALUE_CODEC
+
+#define FIELD_SIZE(member) +sizeof packet->member
+#define FIELD_ENCODE(member) pos = mempcpy(pos, &packet->member, sizeof packet->member);
+#define FIELD_DECODE(member)                             \
+	memcpy(&packet->member, pos, sizeof packet->member); \
+	pos += sizeof packet->member;
+
+#define TAIL_SIZE_NONE(packet) 0
+#define TAIL_SIZE_BYTES(packet) (packet)->size
+#define TAIL_ENCODE_NONE(pos, packet)
+#define TAIL_ENCODE_BYTES(pos, packet)               \
+	if ((packet)->size > 0) {                        \
+		memcpy(pos, (packet)->data, (packet)->size); \
+	}
+#define TAIL_DECODE_NONE(pos, end, packet)
+#define TAIL_DECODE_BYTES(pos, end, packet)                  \
+	(packet)->data = (uint8_t *)(pos);                       \
+	(packet)->size = (end) - (pos);                          \
+                                                             \
+	if ((size_t)(packet)->size != (size_t)((end) - (pos))) { \
+		return -1;                                           \
+	}
 
-	char *pos = mempcpy(serialised->data, &packet_type, sizeof packet_type);
-	pos = mempcpy(pos, &serialised->size, sizeof serialised->size);
-	memcpy(pos, &heartbeat, sizeof heartbeat);
+#define PACKET_STRUCT_CODEC(name, type, struct_type, fields, tail)                               \
+	uint32_t name##_packet_size(const struct_type *packet) {                                     \
+		return PACKET_HEADER_SIZE fields(FIELD_SIZE) + TAIL_SIZE_##tail(packet);                 \
+	}                                                                                            \
+                                                                                                 \
+	uint32_t serialise_##name##_into(const struct_type *packet, void *buffer, size_t capacity) { \
+		uint32_t size = name##_packet_size(packet);                                              \
+                                                                                                 \
+		if (capacity < size) {                                                                   \
+			return 0;                                                                            \
+		}                                                                                        \
+                                                                                                 \
+		char *pos = put_header(buffer, type, size);                                              \
+                                                                                                 \
+		fields(FIELD_ENCODE) TAIL_ENCODE_##tail(pos, packet);                                    \
+                                                                                                 \
+		return size;                                                                             \
+	}                                                                                            \
+                                                                                                 \
+	Serialised *serialise_##name(const struct_type *packet) {                                    \
+		Serialised *serialised = allocate_packet(name##_packet_size(packet));                    \
+                                                                                                 \
+		serialise_##name##_into(packet, serialised->data, serialised->size);                     \
+                                                                                                 \
+		return serialised;                                                                       \
+	}                                                                                            \
+                                                                                                 \
+	int unserialise_##name(const Serialised *serialised, struct_type *packet) {                  \
+		const char *pos = get_body(serialised, type, 0 fields(FIELD_SIZE));                      \
+		const char *end = (const char *)serialised->data + serialised->size;                     \
+                                                                                                 \
+		if (pos == NULL) {                                                                       \
+			return -1;                                                                           \
+		}                                                                                        \
+                                                                                                 \
+		fields(FIELD_DECODE) TAIL_DECODE_##tail(pos, end, packet)                                \
+                                                                                                 \
+		(void)end;                                                                               \
+                                                                                                 \
+		return 0;                                                                                \
+	}
+PACKET_STRUCT_TABLE(PACKET_STRUCT_CODEC)
+#undef PACKET_STRUCT_CODEC
+
+Serialised *serialise_config(const Config *config) {
+	uint32_t size = PACKET_HEADER_SIZE;
+
+	for (size_t i = 0; i < config->num_rooms; i++) {
+		size += strlen(config->rooms[i].name) + 1 + strlen(config->rooms[i].desc) + 1;
+	}
+
+	Serialised *serialised = allocate_packet(size);
+	char *pos = put_header(serialised->data, PacketTypeConfig, size);
+
+	for (size_t i = 0; i < config->num_rooms; i++) {
+		pos = stpcpy(pos, config->rooms[i].name) + 1;
+		pos = stpcpy(pos, config->rooms[i].desc) + 1;
+	}
 
 	return serialised;
 }
 
-Serialised *serialise_join_room(RoomIndex index) {
-	PacketType packet_type = PacketTypeJoinRoom;
-	Serialised *serialised = malloc(sizeof *serialised);
-	serialised->size = sizeof packet_type + sizeof index;
-	serialised->data = malloc(serialised->size);
+Serialised *serialise_leave_room() {
+	Serialised *serialised = allocate_packet(PACKET_HEADER_SIZE);
 
-	char *pos = mempcpy(serialised->data, &packet_type, sizeof packet_type);
-	pos = mempcpy(pos, &serialised->size, sizeof serialised->size);
-	memcpy(pos, &index, sizeof index);
+	put_header(serialised->data, PacketTypeLeaveRoom, PACKET_HEADER_SIZE);
 
 	return serialised;
 }
 
 Serialised *serialise_chat_message(const ChatMessage *msg) {
-	PacketType packet_type = PacketTypeChatMessage;
-	Serialised *serialised = malloc(sizeof *serialised);
-	serialised->size = sizeof packet_type + sizeof serialised->size + strlen(msg) + 1;
-	serialised->data = malloc(serialised->size);
+	size_t length = strlen(msg) + 1;
+	Serialised *serialised = allocate_packet(PACKET_HEADER_SIZE + length);
 
-	char *pos = mempcpy(serialised->data, &packet_type, sizeof packet_type);
-	pos = mempcpy(pos, &serialised->size, sizeof serialised->size);
-	memcpy(pos, msg, strlen(msg) + 1);
+	memcpy(put_header(serialised->data, PacketTypeChatMessage, serialised->size), msg, length);
 
 	return serialised;
 }
 
+/*
+ * Returns NULL if the packet is malformed. Unlike the other packets, config
+ * outlives the packet so its strings are copied.
+ */
 Config *unserialise_config(const Serialised *serialised) {
+	const char *pos = get_body(serialised, PacketTypeConfig, 0);
+	const char *end = (const char *)serialised->data + serialised->size;
+
+	if (pos == NULL) {
+		return NULL;
+	}
+
 	Config *config = calloc(1, sizeof *config);
-	char *pos = (char *)serialised->data + sizeof(PacketType) + sizeof serialised->size;
 
-	for (int i = 0; pos - (char *)serialised->data < serialised->size; i++) {
-		Room *room = malloc(sizeof *room);
+	while (pos < end) {
+		const char *name_end = memchr(pos, '\0', end - pos);
+		const char *desc_end = name_end != NULL ? memchr(name_end + 1, '\0', end - name_end - 1) : NULL;
+
+		if (desc_end == NULL) {
+			for (size_t i = 0; i < config->num_rooms; i++) {
+				free(config->rooms[i].name);
+				free(config->rooms[i].desc);
+			}
+
+			free(config->rooms);
+			free(config);
 
-		room->name = strdup(pos);
-		pos += strlen(room->name) + 1;
-		room->desc = strdup(pos);
-		pos += strlen(room->desc) + 1;
+			return NULL;
+		}
+
+		Room room = {.name = strndup(pos, name_end - pos), .desc = strndup(name_end + 1, desc_end - name_end - 1)};
 
 		config->num_rooms++;
-		config->rooms = realloc(config->rooms, sizeof *room * config->num_rooms);
-		config->rooms[config->num_rooms - 1] = *room;
+		config->rooms = realloc(config->rooms, sizeof room * config->num_rooms);
+		config->rooms[config->num_rooms - 1] = room;
+
+		pos = desc_end + 1;
 	}
 
 	return config;
 }
 
-Heartbeat unserialise_heartbeat(const Serialised *serialised) {
-	return ((char *)serialised->data)[sizeof(PacketType) + sizeof serialised->size];
-}
+int unserialise_chat_message(const Serialised *serialised, const ChatMessage **msg) {
+	const char *pos = get_body(serialised, PacketTypeChatMessage, 1);
 
-RoomIndex unserialise_join_room(const Serialised *serialised) {
-	return ((char *)serialised->data)[sizeof(PacketType) + sizeof serialised->size];
-}
+	if (pos == NULL || ((const char *)serialised->data)[serialised->size - 1] != '\0') {
+		return -1;
+	}
 
-ChatMessage *unserialise_chat_message(const Serialised *serialised) {
-	size_t offset = sizeof(PacketType) + sizeof serialised->size;
-	ChatMessage *msg = malloc(serialised->size - offset);
-	char *pos = (char *)serialised->data + offset;
+	*msg = pos;
 
-	return memcpy(msg, pos, serialised->size - offset);
+	return 0;
 }
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "audio.h"
+
 #include <stdint.h>
 #include <sys/types.h>
 
@@ -11,11 +13,22 @@ typedef enum
 	PacketTypeHeartbeat,
 	PacketTypeChatMessage,
 	PacketTypeAudioFrame,
-	PacketTypeVideoFrame
+	PacketTypeVideoFrame,
+	PacketTypeAudioCodec,
+	PacketTypeComfortNoise,
+	PacketTypeActiveSpeaker,
+	PacketTypeMediaChannel,
+	PacketTypeFragment,
+	PacketTypeChatRecord,
+	PacketTypeChatHistory,
+	PacketTypeChatSearch,
+	PacketTypeChatSearchResults
 } _PacketType;
 
 typedef uint8_t PacketType;
 
+#define PACKET_NUM_TYPES (PacketTypeChatSearchResults + 1)
+
 typedef enum
 {
 	HeartbeatPing,
@@ -24,34 +37,242 @@ typedef enum
 
 typedef uint8_t Heartbeat;
 
+/*
+ * A ping carries the sender's monotonic clock in nanoseconds and the pong
+ * answering it the same timestamp back, so the sender can time the round
+ * trip without the two clocks having to agree.
+ */
+typedef struct {
+	Heartbeat kind;
+	uint64_t timestamp;
+} HeartbeatProbe;
+
+#define HEARTBEAT_PROBE_FIELDS(FIELD) FIELD(kind) FIELD(timestamp)
+
 typedef struct {
 	char *name;
 	char *desc;
 } Room;
 
+/*
+ * chat_history is the server's per-room chat history budget in bytes and
+ * chat_log the directory its chat is persisted under, or NULL for none.
+ * pin_rooms gives each room a CPU of its own, and is off unless set. None of
+ * them are sent to clients.
+ */
 typedef struct {
 	uint16_t num_rooms;
 	Room *rooms;
+	uint32_t chat_history;
+	char *chat_log;
+	int pin_rooms;
 } Config;
 
 typedef int16_t RoomIndex;
 typedef char ChatMessage;
 
+/*
+ * Longer chat messages are refused, which keeps history reads bounded.
+ */
+#define CHAT_MESSAGE_MAX_SIZE 4096
+
+/*
+ * Encoded audio frame. timestamp is in samples at AUDIO_SAMPLE_RATE.
+ */
 typedef struct {
+	uint8_t source;
+	uint16_t seq;
+	uint32_t timestamp;
+	AudioCodec codec;
+	uint16_t num_samples;
 	uint16_t size;
+	uint8_t *data;
+} AudioFrame;
+
+#define AUDIO_FRAME_FIELDS(FIELD) FIELD(source) FIELD(seq) FIELD(timestamp) FIELD(codec) FIELD(num_samples)
+
+/*
+ * Sent in place of audio frames while the sender is silent. level is the
+ * background noise level in -dBov, as in RFC 3389.
+ */
+typedef struct {
+	uint8_t source;
+	uint16_t seq;
+	uint32_t timestamp;
+	uint8_t level;
+} ComfortNoise;
+
+#define COMFORT_NOISE_FIELDS(FIELD) FIELD(source) FIELD(seq) FIELD(timestamp) FIELD(level)
+
+#define VIDEO_FLAG_KEYFRAME 0x01
+
+/*
+ * Senders may publish up to VIDEO_MAX_LAYERS copies of their video, layer 0
+ * at full resolution and higher layers progressively smaller.
+ */
+#define VIDEO_MAX_LAYERS 2
+
+/*
+ * Encoded video frame. timestamp is in milliseconds.
+ */
+typedef struct {
+	uint8_t source;
+	uint16_t seq;
+	uint32_t timestamp;
+	uint8_t flags;
+	uint8_t layer;
+	uint16_t width;
+	uint16_t height;
+	uint32_t size;
+	uint8_t *data;
+} VideoFrame;
+
+#define VIDEO_FRAME_FIELDS(FIELD) \
+	FIELD(source) FIELD(seq) FIELD(timestamp) FIELD(flags) FIELD(layer) FIELD(width) FIELD(height)
+
+/*
+ * Tells a client where to send its media datagrams and the SSRC base its
+ * streams use.
+ */
+typedef struct {
+	uint16_t port;
+	uint32_t ssrc_base;
+} MediaChannel;
+
+#define MEDIA_CHANNEL_FIELDS(FIELD) FIELD(port) FIELD(ssrc_base)
+
+/*
+ * A chat message as the server keeps and forwards it, stamped with its id,
+ * which counts up from 1 within a room, and the time it arrived in
+ * milliseconds since the epoch. The text is not NUL-terminated.
+ */
+typedef struct {
+	uint64_t id;
+	uint64_t timestamp;
+	uint32_t size;
+	uint8_t *data;
+} ChatRecord;
+
+#define CHAT_RECORD_FIELDS(FIELD) FIELD(id) FIELD(timestamp)
+
+/*
+ * Asks for up to count messages of the current room from before id before (0
+ * for the newest) that arrived no earlier than since (0 for any time). They
+ * come back as ChatRecord packets, oldest first.
+ */
+typedef struct {
+	uint64_t before;
+	uint64_t since;
+	uint16_t count;
+} ChatHistoryRequest;
+
+#define CHAT_HISTORY_REQUEST_FIELDS(FIELD) FIELD(before) FIELD(since) FIELD(count)
+
+/*
+ * Asks for up to count of the newest messages of the current room from
+ * before id before (0 for any) that contain the query, ignoring ASCII case.
+ */
+typedef struct {
+	uint64_t before;
+	uint16_t count;
+	uint32_t size;
+	uint8_t *data;
+} ChatSearchRequest;
+
+#define CHAT_SEARCH_REQUEST_FIELDS(FIELD) FIELD(before) FIELD(count)
+
+/*
+ * The answer to a search: count ChatRecord packets back to back, newest
+ * first.
+ */
+typedef struct {
+	uint16_t count;
+	uint32_t size;
+	uint8_t *data;
+} ChatSearchResults;
+
+#define CHAT_SEARCH_RESULTS_FIELDS(FIELD) FIELD(count)
+
+/*
+ * Every packet starts with its type and its total size, header included.
+ */
+typedef struct {
+	uint32_t size;
 	void *data;
 } Serialised;
 
+#define PACKET_HEADER_SIZE (sizeof(PacketType) + sizeof(uint32_t))
+
+/*
+ * Larger sizes are treated as corrupt rather than allocated.
+ */
+#define PACKET_MAX_SIZE (16 * 1024 * 1024)
+
+/*
+ * Media packets carry the sending participant straight after the header so
+ * the server can stamp it when forwarding without re-serialising.
+ */
+#define PACKET_SOURCE_OFFSET PACKET_HEADER_SIZE
+#define PACKET_TIMESTAMP_OFFSET (PACKET_SOURCE_OFFSET + sizeof(uint8_t) + sizeof(uint16_t))
+#define PACKET_VIDEO_FLAGS_OFFSET (PACKET_TIMESTAMP_OFFSET + sizeof(uint32_t))
+
+/*
+ * Packets whose body is a single value.
+ */
+#define PACKET_VALUE_TABLE(VALUE)                             \
+	VALUE(join_room, PacketTypeJoinRoom, RoomIndex)           \
+	VALUE(audio_codecs, PacketTypeAudioCodec, AudioCodecMask) \
+	VALUE(active_speaker, PacketTypeActiveSpeaker, uint8_t)
+
+/*
+ * Packets whose body is the fields of a struct, in the order listed by its
+ * *_FIELDS macro, followed by either nothing (NONE) or the struct's data, of
+ * the remaining size of the packet (BYTES).
+ */
+#define PACKET_STRUCT_TABLE(PACKET)                                                                    \
+	PACKET(heartbeat, PacketTypeHeartbeat, HeartbeatProbe, HEARTBEAT_PROBE_FIELDS, NONE)               \
+	PACKET(audio_frame, PacketTypeAudioFrame, AudioFrame, AUDIO_FRAME_FIELDS, BYTES)                   \
+	PACKET(comfort_noise, PacketTypeComfortNoise, ComfortNoise, COMFORT_NOISE_FIELDS, NONE)            \
+	PACKET(video_frame, PacketTypeVideoFrame, VideoFrame, VIDEO_FRAME_FIELDS, BYTES)                   \
+	PACKET(media_channel, PacketTypeMediaChannel, MediaChannel, MEDIA_CHANNEL_FIELDS, NONE)            \
+	PACKET(chat_record, PacketTypeChatRecord, ChatRecord, CHAT_RECORD_FIELDS, BYTES)                   \
+	PACKET(chat_history, PacketTypeChatHistory, ChatHistoryRequest, CHAT_HISTORY_REQUEST_FIELDS, NONE) \
+	PACKET(chat_search, PacketTypeChatSearch, ChatSearchRequest, CHAT_SEARCH_REQUEST_FIELDS, BYTES)    \
+	PACKET(chat_search_results, PacketTypeChatSearchResults, ChatSearchResults, CHAT_SEARCH_RESULTS_FIELDS, BYTES)
+
+#define PACKET_VALUE_SIZE(type) (PACKET_HEADER_SIZE + sizeof(type))
+#define CHAT_RECORD_HEADER_SIZE (PACKET_HEADER_SIZE + sizeof(uint64_t) * 2)
+
+const char *packet_type_to_string(const PacketType type);
 int send_packet(const int socket_fd, const Serialised *serialised, pthread_mutex_t *mutex);
+int recv_all(const int socket_fd, void *data, size_t size);
 int recv_packet(const int socket_fd, Serialised *serialised, pthread_mutex_t *mutex);
+int next_packet(const void *data, uint32_t size, uint32_t *offset, Serialised *packet);
+
+/*
+ * serialise_*_into writes a packet into buffer and returns its size, or 0 if
+ * it does not fit in capacity bytes. serialise_* allocates one of the right
+ * size instead. unserialise_* returns -1 if the packet is too short; any data
+ * or string it returns points into the packet rather than being copied.
+ */
+#define PACKET_VALUE_PROTOTYPES(name, type, value_type)                                      \
+	uint32_t serialise_##name##_into(const value_type value, void *buffer, size_t capacity); \
+	Serialised *serialise_##name(const value_type value);                                    \
+	int unserialise_##name(const Serialised *serialised, value_type *value);
+PACKET_VALUE_TABLE(PACKET_VALUE_PROTOTYPES)
+#undef PACKET_VALUE_PROTOTYPES
+
+#define PACKET_STRUCT_PROTOTYPES(name, type, struct_type, fields, tail)                         \
+	uint32_t name##_packet_size(const struct_type *packet);                                     \
+	uint32_t serialise_##name##_into(const struct_type *packet, void *buffer, size_t capacity); \
+	Serialised *serialise_##name(const struct_type *packet);                                    \
+	int unserialise_##name(const Serialised *serialised, struct_type *packet);
+PACKET_STRUCT_TABLE(PACKET_STRUCT_PROTOTYPES)
+#undef PACKET_STRUCT_PROTOTYPES
 
 Serialised *serialise_config(const Config *config);
-Serialised *serialise_join_room(RoomIndex room_number);
 Serialised *serialise_leave_room();
-Serialised *serialise_heartbeat(const Heartbeat heartbeat);
 Serialised *serialise_chat_message(const ChatMessage *msg);
 
 Config *unserialise_config(const Serialised *serialised);
-RoomIndex unserialise_join_room(const Serialised *serialised);
-Heartbeat unserialise_heartbeat(const Serialised *serialised);
-ChatMessage *unserialise_chat_message(const Serialised *serialised);
+int unserialise_chat_message(const Serialised *serialised, const ChatMessage **msg);
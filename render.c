@@ -0,0 +1,80 @@
+#include "render.h"
+
+#include "utils.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static uint64_t elapsed_us(const struct timespec *start, const struct timespec *end);
+
+void renderer_init(Renderer *renderer) {
+	memset(renderer, 0, sizeof *renderer);
+
+	const char *fps = getenv(RENDER_FPS_ENV);
+
+	renderer->fps = fps != NULL ? strtoul(fps, NULL, 10) : RENDER_DEFAULT_FPS;
+
+	if (renderer->fps == 0 || renderer->fps > RENDER_MAX_FPS) {
+		renderer->fps = RENDER_DEFAULT_FPS;
+	}
+}
+
+void render_mark(Renderer *renderer, RenderDirty dirty) {
+	renderer->dirty |= dirty;
+	renderer->updates++;
+}
+
+/*
+ * Take what needs drawing this frame, noting when drawing started.
+ */
+RenderDirty render_begin(Renderer *renderer, struct timespec *start) {
+	RenderDirty dirty = renderer->dirty;
+
+	renderer->dirty = 0;
+	clock_gettime(CLOCK_MONOTONIC, start);
+
+	return dirty;
+}
+
+/*
+ * Only call once something was actually drawn, so idle frames do not count.
+ */
+void render_end(Renderer *renderer, const struct timespec *start) {
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	histogram_record(&renderer->render_time, elapsed_us(start, &end));
+
+	if (renderer->frames > 0) {
+		histogram_record(&renderer->frame_time, elapsed_us(&renderer->last_frame, start));
+	}
+
+	renderer->last_frame = *start;
+	renderer->frames++;
+}
+
+void renderer_report(const Renderer *renderer) {
+	// Percentiles of no frames at all say nothing.
+	if (renderer->frames == 0) {
+		return;
+	}
+
+	log_infof("renderer drew %" PRIu64 " frames for %" PRIu64 " updates at up to %u fps",
+	          renderer->frames,
+	          renderer->updates,
+	          renderer->fps);
+	log_infof("render time p50 %" PRIu64 "us, p90 %" PRIu64 "us, p99 %" PRIu64 "us",
+	          histogram_percentile(&renderer->render_time, 50),
+	          histogram_percentile(&renderer->render_time, 90),
+	          histogram_percentile(&renderer->render_time, 99));
+	log_infof("frame time p50 %" PRIu64 "us, p90 %" PRIu64 "us, p99 %" PRIu64 "us",
+	          histogram_percentile(&renderer->frame_time, 50),
+	          histogram_percentile(&renderer->frame_time, 90),
+	          histogram_percentile(&renderer->frame_time, 99));
+}
+
+static uint64_t elapsed_us(const struct timespec *start, const struct timespec *end) {
+	return (end->tv_sec - start->tv_sec) * 1000000 + (end->tv_nsec - start->tv_nsec) / 1000;
+}
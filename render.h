@@ -0,0 +1,48 @@
+#pragma once
+
+#include "histogram.h"
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Frames drawn per second, overridden by RENDER_FPS_ENV.
+ */
+#define RENDER_DEFAULT_FPS 30
+#define RENDER_MAX_FPS 1000
+#define RENDER_FPS_ENV "MACLUNKEY_FPS"
+
+/*
+ * Parts of the screen that need drawing again. RenderDirtyScreen redraws
+ * everything, the layout included.
+ */
+typedef enum
+{
+	RenderDirtyScreen = 0x01,
+	RenderDirtyChatLog = 0x02,
+	RenderDirtyChatInput = 0x04
+} _RenderDirty;
+
+typedef uint8_t RenderDirty;
+
+/*
+ * Changes to what is on screen only mark it dirty. Once a frame interval
+ * everything marked since the last frame is drawn in one go, however many
+ * times it changed. render_time is how long drawing a frame took, and
+ * frame_time the gap between one drawn frame and the next, in microseconds.
+ */
+typedef struct {
+	unsigned int fps;
+	RenderDirty dirty;
+	uint64_t updates;
+	uint64_t frames;
+	struct timespec last_frame;
+	Histogram render_time;
+	Histogram frame_time;
+} Renderer;
+
+void renderer_init(Renderer *renderer);
+void render_mark(Renderer *renderer, RenderDirty dirty);
+RenderDirty render_begin(Renderer *renderer, struct timespec *start);
+void render_end(Renderer *renderer, const struct timespec *start);
+void renderer_report(const Renderer *renderer);
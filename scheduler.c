@@ -0,0 +1,647 @@
+#include "scheduler.h"
+
+#include "utils.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <time.h>
+
+/*
+ * Bytes each class may send per round. Control gets enough for a large
+ * configuration in a round or two; video gets about one fragment.
+ */
+static const size_t QUANTUM[SCHEDULER_NUM_CLASSES] = {65536, 16384, 4096, 1536};
+
+/*
+ * A packet, or one fragment of it, picked to be written next. header is only
+ * used for fragments.
+ */
+typedef struct {
+	SchedulerClass class;
+	ScheduledPacket *packet;
+	uint8_t header[SCHEDULER_FIRST_FRAGMENT_HEADER_SIZE];
+	size_t header_size;
+	const uint8_t *data;
+	size_t data_size;
+} Chunk;
+
+static uint8_t *reassembly_next(Reassembly *reassembly,
+                                SchedulerClass class,
+                                uint8_t flags,
+                                uint32_t total_size,
+                                uint32_t data_size);
+static int reassembly_finish(Reassembly *reassembly,
+                             SchedulerClass class,
+                             uint8_t flags,
+                             uint32_t data_size,
+                             Serialised *packet);
+static void *writer_handler(void *arg);
+static int next_chunk(Scheduler *scheduler, Chunk *chunk);
+static void finish_chunk(Scheduler *scheduler, const Chunk *chunk);
+static size_t chunk_size(const ScheduledPacket *packet);
+static int fragmented(const ScheduledPacket *packet);
+static int write_chunk(Scheduler *scheduler, const Chunk *chunk);
+
+const char *scheduler_class_to_string(const SchedulerClass class) {
+	switch (class) {
+		case SchedulerClassControl:
+			return "control";
+
+		case SchedulerClassChat:
+			return "chat";
+
+		case SchedulerClassAudio:
+			return "audio";
+
+		case SchedulerClassVideo:
+			return "video";
+
+		default:
+			return "unknown";
+	}
+}
+
+SchedulerClass scheduler_class_of(const Serialised *serialised) {
+	switch (((PacketType *)serialised->data)[0]) {
+		case PacketTypeChatMessage:
+		case PacketTypeChatRecord:
+		case PacketTypeChatHistory:
+		case PacketTypeChatSearch:
+		case PacketTypeChatSearchResults:
+			return SchedulerClassChat;
+
+		case PacketTypeAudioFrame:
+		case PacketTypeComfortNoise:
+			return SchedulerClassAudio;
+
+		case PacketTypeVideoFrame:
+			return SchedulerClassVideo;
+
+		default:
+			return SchedulerClassControl;
+	}
+}
+
+/*
+ * Start the writer thread for a connection. From here on everything sent on
+ * socket_fd should go through scheduler_send. sent, if not NULL, is told
+ * about everything written.
+ */
+int scheduler_start(Scheduler *scheduler, int socket_fd, SchedulerSent sent) {
+	memset(scheduler, 0, sizeof *scheduler);
+
+	scheduler->socket_fd = socket_fd;
+	scheduler->sent = sent;
+
+	pthread_mutex_init(&scheduler->lock, NULL);
+	pthread_cond_init(&scheduler->ready, NULL);
+
+	if (pthread_create(&scheduler->thread, NULL, writer_handler, scheduler) != 0) {
+		log_error(ERROR_THREAD, "failed to start connection writer thread");
+
+		pthread_cond_destroy(&scheduler->ready);
+		pthread_mutex_destroy(&scheduler->lock);
+
+		return -1;
+	}
+
+	scheduler->running = TRUE;
+
+	return 0;
+}
+
+/*
+ * Stop the writer thread, discarding anything still queued.
+ */
+void scheduler_stop(Scheduler *scheduler) {
+	if (!scheduler->running) {
+		return;
+	}
+
+	pthread_mutex_lock(&scheduler->lock);
+	atomic_store(&scheduler->stop, TRUE);
+	scheduler->running = FALSE;
+	pthread_cond_signal(&scheduler->ready);
+	pthread_mutex_unlock(&scheduler->lock);
+
+	if (pthread_join(scheduler->thread, NULL) != 0) {
+		log_error(ERROR_THREAD, "failed to join connection writer thread");
+	}
+
+	for (size_t i = 0; i < SCHEDULER_NUM_CLASSES; i++) {
+		while (scheduler->queues[i].head != NULL) {
+			ScheduledPacket *next = scheduler->queues[i].head->next;
+
+			free(scheduler->queues[i].head);
+			scheduler->queues[i].head = next;
+		}
+	}
+
+	pthread_cond_destroy(&scheduler->ready);
+	pthread_mutex_destroy(&scheduler->lock);
+}
+
+/*
+ * Queue a copy of a packet. Returns -1 if the connection has failed. Media
+ * that does not fit in its queue is dropped, which is not an error.
+ */
+int scheduler_send(Scheduler *scheduler, const Serialised *serialised) {
+	struct iovec span = {.iov_base = serialised->data, .iov_len = serialised->size};
+
+	return scheduler_sendv(scheduler, &span, 1);
+}
+
+/*
+ * Queue a copy of packets of the same class, given as num_spans spans laid
+ * end to end, to go out together as if they were one packet.
+ */
+int scheduler_sendv(Scheduler *scheduler, const struct iovec *spans, int num_spans) {
+	Serialised serialised = {.data = spans[0].iov_base};
+
+	for (int i = 0; i < num_spans; i++) {
+		serialised.size += spans[i].iov_len;
+	}
+
+	SchedulerClass class = scheduler_class_of(&serialised);
+	SchedulerQueue *queue = &scheduler->queues[class];
+
+	// Copy before taking the lock so the writer is not held up by a large batch.
+	ScheduledPacket *packet = malloc(sizeof *packet + serialised.size);
+	uint8_t *pos = packet->data;
+
+	packet->next = NULL;
+	packet->size = serialised.size;
+	packet->sent = 0;
+
+	for (int i = 0; i < num_spans; i++) {
+		pos = mempcpy(pos, spans[i].iov_base, spans[i].iov_len);
+	}
+
+	pthread_mutex_lock(&scheduler->lock);
+
+	if (!scheduler->running || scheduler->failed) {
+		pthread_mutex_unlock(&scheduler->lock);
+		free(packet);
+
+		return -1;
+	}
+
+	if (class >= SchedulerClassAudio && queue->queued > 0 &&
+	    queue->queued + serialised.size > SCHEDULER_MAX_QUEUED_BYTES) {
+		queue->dropped++;
+
+		pthread_mutex_unlock(&scheduler->lock);
+		free(packet);
+
+		return 0;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &packet->queued);
+
+	if (queue->tail != NULL) {
+		queue->tail->next = packet;
+	} else {
+		queue->head = packet;
+	}
+
+	queue->tail = packet;
+	queue->queued += packet->size;
+
+	pthread_cond_signal(&scheduler->ready);
+	pthread_mutex_unlock(&scheduler->lock);
+
+	return 0;
+}
+
+size_t scheduler_queued(Scheduler *scheduler, SchedulerClass class) {
+	pthread_mutex_lock(&scheduler->lock);
+
+	size_t queued = scheduler->queues[class].queued;
+
+	pthread_mutex_unlock(&scheduler->lock);
+
+	return queued;
+}
+
+/*
+ * Where the data of a fragment of data_size bytes goes, starting the packet
+ * for its class over if it is the first. Returns NULL, having dropped whatever
+ * the class had so far, if the fragment does not fit what came before.
+ */
+static uint8_t *reassembly_next(Reassembly *reassembly,
+                                SchedulerClass class,
+                                uint8_t flags,
+                                uint32_t total_size,
+                                uint32_t data_size) {
+	ReassemblyBuffer *buffer = class < SCHEDULER_NUM_CLASSES ? &reassembly->classes[class] : NULL;
+
+	if (buffer != NULL && (flags & FRAGMENT_FIRST)) {
+		freep(buffer->data);
+
+		buffer->size = 0;
+		buffer->capacity = 0;
+
+		if (total_size >= PACKET_HEADER_SIZE && total_size <= PACKET_MAX_SIZE) {
+			buffer->data = malloc(total_size);
+			buffer->capacity = total_size;
+		}
+	}
+
+	if (buffer == NULL || buffer->data == NULL || buffer->size + data_size > buffer->capacity) {
+		if (buffer != NULL) {
+			freep(buffer->data);
+		}
+
+		log_error(ERROR_NETWORK, "received malformed packet fragment");
+
+		return NULL;
+	}
+
+	return buffer->data + buffer->size;
+}
+
+/*
+ * Count in the fragment just received into the class's buffer. Returns 1 with
+ * packet filled in if it was the last, which is checked to be whole: a batch
+ * of packets queued together is rebuilt as the same back-to-back packets.
+ */
+static int reassembly_finish(Reassembly *reassembly,
+                             SchedulerClass class,
+                             uint8_t flags,
+                             uint32_t data_size,
+                             Serialised *packet) {
+	ReassemblyBuffer *buffer = &reassembly->classes[class];
+	Serialised inner;
+	uint32_t offset = 0;
+
+	buffer->size += data_size;
+
+	if (!(flags & FRAGMENT_LAST)) {
+		return 0;
+	}
+
+	while (next_packet(buffer->data, buffer->size, &offset, &inner) == 0) {
+	}
+
+	if (buffer->size == buffer->capacity && offset == buffer->size) {
+		*packet = (Serialised){.size = buffer->size, .data = buffer->data};
+		*buffer = (ReassemblyBuffer){0};
+
+		return 1;
+	}
+
+	log_error(ERROR_NETWORK, "received incomplete fragmented packet");
+
+	freep(buffer->data);
+	*buffer = (ReassemblyBuffer){0};
+
+	return 0;
+}
+
+/*
+ * Receive one fragment from socket_fd straight into the packet being rebuilt
+ * for its class. Returns 1 with packet filled in (data freed by the caller)
+ * once the last fragment is in, 0 if more are to come or the fragment was
+ * skipped as not fitting what came before, or -1 if the connection is no
+ * longer usable. What is returned may be several packets back to back.
+ */
+int scheduler_recv_fragment(Reassembly *reassembly, int socket_fd, pthread_mutex_t *mutex, Serialised *packet) {
+	uint8_t header[SCHEDULER_FIRST_FRAGMENT_HEADER_SIZE];
+	uint32_t fragment_size = 0;
+	uint32_t total_size = 0;
+	int ret = 0;
+
+	if (mutex != NULL) {
+		pthread_mutex_lock(mutex);
+	}
+
+	if ((ret = recv_all(socket_fd, header, SCHEDULER_FRAGMENT_HEADER_SIZE)) <= 0) {
+		goto unlock;
+	}
+
+	memcpy(&fragment_size, header + sizeof(PacketType), sizeof fragment_size);
+
+	SchedulerClass class = header[PACKET_HEADER_SIZE];
+	uint8_t flags = header[PACKET_HEADER_SIZE + sizeof class];
+	size_t header_size = flags & FRAGMENT_FIRST ? SCHEDULER_FIRST_FRAGMENT_HEADER_SIZE : SCHEDULER_FRAGMENT_HEADER_SIZE;
+
+	// The stream cannot be resynchronised after a size we do not believe.
+	if (fragment_size < header_size || fragment_size - header_size > SCHEDULER_FRAGMENT_SIZE) {
+		log_errorf(ERROR_NETWORK, "received fragment with bad size %" PRIu32, fragment_size);
+
+		ret = -1;
+
+		goto unlock;
+	}
+
+	if ((flags & FRAGMENT_FIRST) &&
+	    (ret = recv_all(socket_fd, header + SCHEDULER_FRAGMENT_HEADER_SIZE, sizeof total_size)) <= 0) {
+		goto unlock;
+	}
+
+	memcpy(&total_size, header + SCHEDULER_FRAGMENT_HEADER_SIZE, sizeof total_size);
+
+	uint32_t data_size = fragment_size - header_size;
+	uint8_t *data = reassembly_next(reassembly, class, flags, total_size, data_size);
+
+	if (data == NULL) {
+		uint8_t discard[SCHEDULER_FRAGMENT_SIZE];
+
+		ret = recv_all(socket_fd, discard, data_size) <= 0 ? -1 : 0;
+
+		goto unlock;
+	}
+
+	if ((ret = recv_all(socket_fd, data, data_size)) <= 0) {
+		goto unlock;
+	}
+
+	ret = reassembly_finish(reassembly, class, flags, data_size, packet);
+
+unlock:
+	if (mutex != NULL) {
+		pthread_mutex_unlock(mutex);
+	}
+
+	return ret;
+}
+
+/*
+ * As scheduler_recv_fragment, for a fragment already received whole into
+ * memory. Returns 1 with packet filled in once the last fragment is in, 0 if
+ * more are to come or the fragment was skipped, or -1 if it is malformed.
+ */
+int reassembly_add(Reassembly *reassembly, const Serialised *fragment, Serialised *packet) {
+	uint32_t total_size = 0;
+
+	if (fragment->size < SCHEDULER_FRAGMENT_HEADER_SIZE) {
+		return -1;
+	}
+
+	const uint8_t *header = fragment->data;
+	SchedulerClass class = header[PACKET_HEADER_SIZE];
+	uint8_t flags = header[PACKET_HEADER_SIZE + sizeof class];
+	size_t header_size = flags & FRAGMENT_FIRST ? SCHEDULER_FIRST_FRAGMENT_HEADER_SIZE : SCHEDULER_FRAGMENT_HEADER_SIZE;
+
+	if (fragment->size < header_size || fragment->size - header_size > SCHEDULER_FRAGMENT_SIZE) {
+		log_errorf(ERROR_NETWORK, "received fragment with bad size %" PRIu32, fragment->size);
+
+		return -1;
+	}
+
+	if (flags & FRAGMENT_FIRST) {
+		memcpy(&total_size, header + SCHEDULER_FRAGMENT_HEADER_SIZE, sizeof total_size);
+	}
+
+	uint32_t data_size = fragment->size - header_size;
+	uint8_t *data = reassembly_next(reassembly, class, flags, total_size, data_size);
+
+	if (data == NULL) {
+		return 0;
+	}
+
+	memcpy(data, header + header_size, data_size);
+
+	return reassembly_finish(reassembly, class, flags, data_size, packet);
+}
+
+void reassembly_free(Reassembly *reassembly) {
+	for (size_t i = 0; i < SCHEDULER_NUM_CLASSES; i++) {
+		freep(reassembly->classes[i].data);
+	}
+}
+
+static void *writer_handler(void *arg) {
+	Scheduler *scheduler = (Scheduler *)arg;
+
+	pthread_mutex_lock(&scheduler->lock);
+
+	while (!atomic_load(&scheduler->stop)) {
+		Chunk chunk = {0};
+
+		if (!next_chunk(scheduler, &chunk)) {
+			pthread_cond_wait(&scheduler->ready, &scheduler->lock);
+
+			continue;
+		}
+
+		// Only this thread removes packets, so the chunk's data stays put while we write it.
+		pthread_mutex_unlock(&scheduler->lock);
+
+		int ret = write_chunk(scheduler, &chunk);
+
+		pthread_mutex_lock(&scheduler->lock);
+
+		if (ret < 0) {
+			scheduler->failed = TRUE;
+
+			break;
+		}
+
+		finish_chunk(scheduler, &chunk);
+	}
+
+	pthread_mutex_unlock(&scheduler->lock);
+
+	return NULL;
+}
+
+/*
+ * Pick the next packet or fragment by deficit round-robin. Returns FALSE if
+ * nothing is queued. Call with the lock held.
+ */
+static int next_chunk(Scheduler *scheduler, Chunk *chunk) {
+	int empty = TRUE;
+
+	for (size_t i = 0; i < SCHEDULER_NUM_CLASSES; i++) {
+		empty = empty && scheduler->queues[i].head == NULL;
+	}
+
+	if (empty) {
+		return FALSE;
+	}
+
+	while (TRUE) {
+		SchedulerClass class = scheduler->current;
+		SchedulerQueue *queue = &scheduler->queues[class];
+		ScheduledPacket *packet = queue->head;
+
+		if (packet != NULL && !scheduler->turn_started) {
+			queue->deficit += QUANTUM[class];
+			scheduler->turn_started = TRUE;
+		}
+
+		if (packet == NULL || chunk_size(packet) > queue->deficit) {
+			// An idle class does not bank credit for later.
+			if (packet == NULL) {
+				queue->deficit = 0;
+			}
+
+			scheduler->current = (class + 1) % SCHEDULER_NUM_CLASSES;
+			scheduler->turn_started = FALSE;
+
+			continue;
+		}
+
+		size_t size = chunk_size(packet);
+
+		queue->deficit -= size;
+
+		chunk->class = class;
+		chunk->packet = packet;
+		chunk->data = packet->data + packet->sent;
+
+		if (!fragmented(packet)) {
+			chunk->data_size = size;
+
+			return TRUE;
+		}
+
+		PacketType packet_type = PacketTypeFragment;
+		uint32_t fragment_size = size;
+		uint8_t flags = packet->sent == 0 ? FRAGMENT_FIRST : 0;
+		uint8_t *pos = chunk->header;
+
+		chunk->header_size = flags & FRAGMENT_FIRST ? SCHEDULER_FIRST_FRAGMENT_HEADER_SIZE : SCHEDULER_FRAGMENT_HEADER_SIZE;
+		chunk->data_size = size - chunk->header_size;
+
+		if (packet->sent + chunk->data_size == packet->size) {
+			flags |= FRAGMENT_LAST;
+		}
+
+		pos = mempcpy(pos, &packet_type, sizeof packet_type);
+		pos = mempcpy(pos, &fragment_size, sizeof fragment_size);
+		pos = mempcpy(pos, &class, sizeof class);
+		pos = mempcpy(pos, &flags, sizeof flags);
+
+		if (flags & FRAGMENT_FIRST) {
+			memcpy(pos, &packet->size, sizeof packet->size);
+		}
+
+		scheduler->fragments++;
+
+		return TRUE;
+	}
+}
+
+/*
+ * Account for a written chunk, removing its packet once all of it is out.
+ * Call with the lock held.
+ */
+static void finish_chunk(Scheduler *scheduler, const Chunk *chunk) {
+	SchedulerQueue *queue = &scheduler->queues[chunk->class];
+	ScheduledPacket *packet = chunk->packet;
+
+	packet->sent += chunk->data_size;
+
+	if (packet->sent < packet->size) {
+		return;
+	}
+
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	uint32_t wait_us =
+	    (now.tv_sec - packet->queued.tv_sec) * 1000000 + (now.tv_nsec - packet->queued.tv_nsec) / 1000;
+
+	if (wait_us > queue->max_wait_us) {
+		queue->max_wait_us = wait_us;
+	}
+
+	queue->head = packet->next;
+
+	if (queue->head == NULL) {
+		queue->tail = NULL;
+	}
+
+	queue->queued -= packet->size;
+	queue->packets++;
+
+	if (scheduler->sent != NULL) {
+		scheduler->sent(packet->data, packet->size);
+	}
+
+	free(packet);
+}
+
+/*
+ * Size on the wire of the next piece of packet: the rest of it, or a fragment
+ * if it is too large to go out in one piece.
+ */
+static size_t chunk_size(const ScheduledPacket *packet) {
+	size_t remaining = packet->size - packet->sent;
+
+	if (!fragmented(packet)) {
+		return remaining;
+	}
+
+	return (packet->sent == 0 ? SCHEDULER_FIRST_FRAGMENT_HEADER_SIZE : SCHEDULER_FRAGMENT_HEADER_SIZE) +
+	       (remaining < SCHEDULER_FRAGMENT_SIZE ? remaining : SCHEDULER_FRAGMENT_SIZE);
+}
+
+/*
+ * Whether packet goes out as fragments, which is decided once for the whole
+ * packet: once it has started, every piece of it needs a fragment header,
+ * including a last one that happens to be the same size as what is left.
+ * Any class is fragmented, so a large configuration or batch of chat history
+ * holds up a heartbeat no longer than a video frame does.
+ */
+static int fragmented(const ScheduledPacket *packet) {
+	return packet->size > SCHEDULER_FRAGMENT_SIZE;
+}
+
+/*
+ * Write the chunk's header and data in one go, without blocking indefinitely
+ * so scheduler_stop can always get the writer to finish even if the peer
+ * stopped reading.
+ */
+static int write_chunk(Scheduler *scheduler, const Chunk *chunk) {
+	struct iovec iov[] = {{.iov_base = (void *)chunk->header, .iov_len = chunk->header_size},
+	                      {.iov_base = (void *)chunk->data, .iov_len = chunk->data_size}};
+	struct msghdr msg = {.msg_iov = iov, .msg_iovlen = sizeof iov / sizeof *iov};
+
+	while (iov[0].iov_len + iov[1].iov_len > 0) {
+		ssize_t n = sendmsg(scheduler->socket_fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+		if (n > 0) {
+			for (size_t i = 0; i < sizeof iov / sizeof *iov; i++) {
+				size_t done = (size_t)n < iov[i].iov_len ? (size_t)n : iov[i].iov_len;
+
+				iov[i].iov_base = (uint8_t *)iov[i].iov_base + done;
+				iov[i].iov_len -= done;
+				n -= done;
+			}
+
+			continue;
+		}
+
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			struct pollfd poll_fd = {.fd = scheduler->socket_fd, .events = POLLOUT};
+
+			if (poll(&poll_fd, 1, SCHEDULER_POLL_MS) < 0 && errno != EINTR) {
+				return -1;
+			}
+
+			if (atomic_load(&scheduler->stop)) {
+				return -1;
+			}
+
+			continue;
+		}
+
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+
+		return -1;
+	}
+
+	return 0;
+}
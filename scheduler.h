@@ -0,0 +1,114 @@
+#pragma once
+
+#include "packets.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/uio.h>
+
+/*
+ * Every packet for a connection goes through one writer thread, which serves
+ * per-class queues by deficit round-robin in priority order. Each class's
+ * quantum (bytes per round) reflects its priority, and packets of any class
+ * larger than SCHEDULER_FRAGMENT_SIZE go out as fragments so a heartbeat or
+ * chat message waits for at most one fragment of a video frame or history.
+ */
+typedef enum
+{
+	SchedulerClassControl,
+	SchedulerClassChat,
+	SchedulerClassAudio,
+	SchedulerClassVideo
+} _SchedulerClass;
+
+typedef uint8_t SchedulerClass;
+
+#define SCHEDULER_NUM_CLASSES 4
+#define SCHEDULER_FRAGMENT_SIZE 1024
+#define SCHEDULER_FRAGMENT_HEADER_SIZE (PACKET_HEADER_SIZE + sizeof(uint8_t) * 2)
+
+/*
+ * The first fragment of a packet also carries the packet's total size, so the
+ * receiver can allocate it once and receive every fragment straight into it.
+ */
+#define SCHEDULER_FIRST_FRAGMENT_HEADER_SIZE (SCHEDULER_FRAGMENT_HEADER_SIZE + sizeof(uint32_t))
+
+/*
+ * Media queued past this is dropped, though a larger packet is still taken
+ * into an empty queue. Control and chat are never dropped.
+ */
+#define SCHEDULER_MAX_QUEUED_BYTES 65536
+
+/*
+ * How long the writer waits on a full socket before checking whether it has
+ * been told to stop.
+ */
+#define SCHEDULER_POLL_MS 100
+
+#define FRAGMENT_FIRST 0x01
+#define FRAGMENT_LAST 0x02
+
+typedef struct ScheduledPacket {
+	struct ScheduledPacket *next;
+	struct timespec queued;
+	uint32_t size;
+	uint32_t sent;
+	uint8_t data[];
+} ScheduledPacket;
+
+typedef struct {
+	ScheduledPacket *head;
+	ScheduledPacket *tail;
+	size_t queued;
+	size_t deficit;
+	uint64_t packets;
+	uint64_t dropped;
+	uint32_t max_wait_us;
+} SchedulerQueue;
+
+/*
+ * Called from the writer thread once each queued packet, or batch of them
+ * queued together, is all written.
+ */
+typedef void (*SchedulerSent)(const void *data, uint32_t size);
+
+typedef struct {
+	int socket_fd;
+	SchedulerSent sent;
+	int running;
+	atomic_int stop;
+	int failed;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	SchedulerClass current;
+	int turn_started;
+	SchedulerQueue queues[SCHEDULER_NUM_CLASSES];
+	uint64_t fragments;
+} Scheduler;
+
+/*
+ * Receive side: fragments of one class arrive in order, so one destination
+ * buffer per class is enough.
+ */
+typedef struct {
+	uint8_t *data;
+	uint32_t size;
+	uint32_t capacity;
+} ReassemblyBuffer;
+
+typedef struct {
+	ReassemblyBuffer classes[SCHEDULER_NUM_CLASSES];
+} Reassembly;
+
+const char *scheduler_class_to_string(const SchedulerClass class);
+SchedulerClass scheduler_class_of(const Serialised *serialised);
+int scheduler_start(Scheduler *scheduler, int socket_fd, SchedulerSent sent);
+void scheduler_stop(Scheduler *scheduler);
+int scheduler_send(Scheduler *scheduler, const Serialised *serialised);
+int scheduler_sendv(Scheduler *scheduler, const struct iovec *spans, int num_spans);
+size_t scheduler_queued(Scheduler *scheduler, SchedulerClass class);
+int scheduler_recv_fragment(Reassembly *reassembly, int socket_fd, pthread_mutex_t *mutex, Serialised *packet);
+int reassembly_add(Reassembly *reassembly, const Serialised *fragment, Serialised *packet);
+void reassembly_free(Reassembly *reassembly);
@@ -0,0 +1,302 @@
+#include "scrollback.h"
+
+#include "utils.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static ScrollbackLine *line_at(Scrollback *scrollback, uint64_t number);
+static uint32_t line_rows(Scrollback *scrollback, uint64_t number, uint16_t width);
+static uint32_t wrap_row(const char *text, uint32_t size, uint32_t start, uint16_t width, uint32_t *next);
+static uint32_t rows_above(Scrollback *scrollback, uint16_t width, uint32_t limit);
+
+/*
+ * The arena and line entries are only allocated with the first line.
+ */
+void scrollback_init(Scrollback *scrollback) {
+	memset(scrollback, 0, sizeof *scrollback);
+
+	scrollback->following = TRUE;
+}
+
+void scrollback_free(Scrollback *scrollback) {
+	freep(scrollback->arena);
+	freep(scrollback->lines);
+
+	scrollback_init(scrollback);
+}
+
+/*
+ * Forget every line but keep the memory for the next ones.
+ */
+void scrollback_clear(Scrollback *scrollback) {
+	scrollback->tail = 0;
+	scrollback->first = 0;
+	scrollback->next = 0;
+	scrollback->following = TRUE;
+	scrollback->anchor_line = 0;
+	scrollback->anchor_row = 0;
+}
+
+/*
+ * Add a line, evicting as many of the oldest as it takes to make room.
+ * Returns -1 if it is larger than the whole arena.
+ */
+int scrollback_append(Scrollback *scrollback, const char *text, uint32_t size) {
+	if (size > SCROLLBACK_ARENA_SIZE) {
+		return -1;
+	}
+
+	if (scrollback->arena == NULL) {
+		scrollback->arena = malloc(SCROLLBACK_ARENA_SIZE);
+		scrollback->lines = malloc(SCROLLBACK_MAX_LINES * sizeof *scrollback->lines);
+
+		if (scrollback->arena == NULL || scrollback->lines == NULL) {
+			scrollback_free(scrollback);
+
+			return -1;
+		}
+	}
+
+	while (scrollback->first < scrollback->next) {
+		const ScrollbackLine *oldest = line_at(scrollback, scrollback->first);
+
+		if (scrollback->next - scrollback->first < SCROLLBACK_MAX_LINES) {
+			if (oldest->offset >= scrollback->tail) {
+				// Kept text runs from oldest to the end of the arena, then from its start to tail.
+				if (scrollback->tail + size <= oldest->offset) {
+					break;
+				}
+			} else if (scrollback->tail + size <= SCROLLBACK_ARENA_SIZE) {
+				break;
+			} else if (size <= oldest->offset) {
+				scrollback->tail = 0;
+
+				break;
+			}
+		}
+
+		scrollback->first++;
+	}
+
+	if (scrollback->first == scrollback->next) {
+		scrollback->tail = 0;
+	}
+
+	ScrollbackLine *line = line_at(scrollback, scrollback->next);
+
+	*line = (ScrollbackLine){.offset = scrollback->tail, .size = size};
+
+	if (size > 0) {
+		memcpy(scrollback->arena + scrollback->tail, text, size);
+	}
+
+	scrollback->tail += size;
+	scrollback->next++;
+
+	if (scrollback->anchor_line < scrollback->first) {
+		scrollback->anchor_line = scrollback->first;
+		scrollback->anchor_row = 0;
+	}
+
+	return 0;
+}
+
+/*
+ * Fill rows with what shows in a view width columns wide and height rows
+ * high, bottom up from rows[height - 1]. Returns how many rows were filled;
+ * any above them are blank.
+ */
+int scrollback_visible(Scrollback *scrollback, uint16_t width, int height, ScrollbackRow *rows) {
+	if (scrollback->first == scrollback->next || width == 0) {
+		return 0;
+	}
+
+	uint64_t number = scrollback->following ? scrollback->next - 1 : scrollback->anchor_line;
+	uint32_t skip = scrollback->following ? 0 : scrollback->anchor_row;
+	int filled = 0;
+
+	while (filled < height) {
+		ScrollbackLine *line = line_at(scrollback, number);
+		const char *text = scrollback->arena + line->offset;
+		uint32_t num_rows = line_rows(scrollback, number, width);
+
+		// After the width changes the anchor may be past the end of its line.
+		if (skip >= num_rows) {
+			skip = num_rows - 1;
+			scrollback->anchor_row = skip;
+		}
+
+		uint32_t shown = num_rows - skip;
+		uint32_t take = shown < (uint32_t)(height - filled) ? shown : (uint32_t)(height - filled);
+		uint32_t start = 0;
+		uint32_t next = 0;
+
+		for (uint32_t row = 0; row < shown; row++) {
+			uint32_t end = wrap_row(text, line->size, start, width, &next);
+
+			if (row >= shown - take) {
+				rows[height - filled - shown + row] = (ScrollbackRow){.text = text + start, .size = end - start};
+			}
+
+			start = next;
+		}
+
+		filled += take;
+		skip = 0;
+
+		if (number == scrollback->first) {
+			break;
+		}
+
+		number--;
+	}
+
+	return filled;
+}
+
+/*
+ * Move the view back through the history by rows, or forward for a negative
+ * count, stopping once the oldest line reaches the top of the view or the
+ * newest the bottom. At the bottom the view follows new lines again.
+ */
+void scrollback_scroll(Scrollback *scrollback, int rows, uint16_t width, int height) {
+	if (scrollback->first == scrollback->next || width == 0 || height <= 0) {
+		return;
+	}
+
+	if (scrollback->following) {
+		scrollback->following = FALSE;
+		scrollback->anchor_line = scrollback->next - 1;
+		scrollback->anchor_row = 0;
+	}
+
+	uint32_t num_rows = line_rows(scrollback, scrollback->anchor_line, width);
+
+	if (scrollback->anchor_row >= num_rows) {
+		scrollback->anchor_row = num_rows - 1;
+	}
+
+	if (rows > 0) {
+		uint32_t above = rows_above(scrollback, width, height + rows);
+		uint32_t move = above > (uint32_t)height ? above - height : 0;
+
+		scrollback->anchor_row += move < (uint32_t)rows ? move : (uint32_t)rows;
+
+		while (scrollback->anchor_row >= (num_rows = line_rows(scrollback, scrollback->anchor_line, width))) {
+			scrollback->anchor_row -= num_rows;
+			scrollback->anchor_line--;
+		}
+	} else {
+		uint32_t move = -rows;
+
+		while (move > 0) {
+			if (move <= scrollback->anchor_row) {
+				scrollback->anchor_row -= move;
+
+				break;
+			}
+
+			move -= scrollback->anchor_row + 1;
+
+			if (scrollback->anchor_line + 1 >= scrollback->next) {
+				scrollback->anchor_row = 0;
+
+				break;
+			}
+
+			scrollback->anchor_line++;
+			scrollback->anchor_row = line_rows(scrollback, scrollback->anchor_line, width) - 1;
+		}
+	}
+
+	if (scrollback->anchor_line == scrollback->next - 1 && scrollback->anchor_row == 0) {
+		scrollback->following = TRUE;
+	}
+}
+
+void scrollback_follow(Scrollback *scrollback) {
+	scrollback->following = TRUE;
+}
+
+static ScrollbackLine *line_at(Scrollback *scrollback, uint64_t number) {
+	return &scrollback->lines[number % SCROLLBACK_MAX_LINES];
+}
+
+static uint32_t line_rows(Scrollback *scrollback, uint64_t number, uint16_t width) {
+	ScrollbackLine *line = line_at(scrollback, number);
+
+	if (line->wrap_width != width) {
+		const char *text = scrollback->arena + line->offset;
+		uint32_t start = 0;
+		uint32_t next = 0;
+
+		line->wrap_rows = 0;
+
+		do {
+			wrap_row(text, line->size, start, width, &next);
+			start = next;
+			line->wrap_rows++;
+		} while (start < line->size);
+
+		line->wrap_width = width;
+	}
+
+	return line->wrap_rows;
+}
+
+/*
+ * Find the row of text starting at start that fits in width columns, breaking
+ * after the last space that lets it fit, or mid-word if there is none. Every
+ * UTF-8 character takes one column. Returns where the row ends, and sets next
+ * to where the following one starts, past the space broken at.
+ */
+static uint32_t wrap_row(const char *text, uint32_t size, uint32_t start, uint16_t width, uint32_t *next) {
+	uint32_t end = start;
+	uint32_t space = start;
+	uint16_t cols = 0;
+
+	while (end < size) {
+		// Continuation bytes belong to the character before them.
+		if (((uint8_t)text[end] & 0xc0) != 0x80) {
+			if (cols == width) {
+				break;
+			}
+
+			cols++;
+		}
+
+		if (text[end] == ' ') {
+			space = end;
+		}
+
+		end++;
+	}
+
+	if (end < size && text[end] == ' ') {
+		*next = end + 1;
+	} else if (end < size && space > start) {
+		end = space;
+		*next = space + 1;
+	} else {
+		*next = end;
+	}
+
+	return end;
+}
+
+/*
+ * Rows from the bottom of the view upwards, as far as the oldest line or
+ * limit, whichever comes first.
+ */
+static uint32_t rows_above(Scrollback *scrollback, uint16_t width, uint32_t limit) {
+	uint64_t number = scrollback->anchor_line;
+	uint32_t rows = line_rows(scrollback, number, width) - scrollback->anchor_row;
+
+	while (rows < limit && number > scrollback->first) {
+		number--;
+		rows += line_rows(scrollback, number, width);
+	}
+
+	return rows;
+}
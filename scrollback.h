@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdint.h>
+
+/*
+ * Most lines kept, and the arena their text shares. Once either is full the
+ * oldest lines make way for new ones.
+ */
+#define SCROLLBACK_MAX_LINES 131072
+#define SCROLLBACK_ARENA_SIZE (8 * 1024 * 1024)
+
+/*
+ * How many rows a line wraps to is worked out for one width at a time, when
+ * the line is first shown at it, and kept until the width changes.
+ */
+typedef struct {
+	uint32_t offset;
+	uint32_t size;
+	uint32_t wrap_width;
+	uint32_t wrap_rows;
+} ScrollbackLine;
+
+typedef struct {
+	const char *text;
+	uint32_t size;
+} ScrollbackRow;
+
+/*
+ * Lines are numbered from when the scrollback was last cleared, and the ones
+ * from first to next - 1 are kept, in a ring of entries. Their text goes in
+ * the arena back to back; text that does not fit before the end of the arena
+ * goes at its start. Only visible lines are ever wrapped, so drawing and
+ * scrolling cost as much as what is on screen, however long the history.
+ *
+ * The view is anchored by its bottom row: anchor_row rows of anchor_line are
+ * below it. While following, the view sticks to the newest line instead.
+ */
+typedef struct {
+	char *arena;
+	uint32_t tail;
+	ScrollbackLine *lines;
+	uint64_t first;
+	uint64_t next;
+	int following;
+	uint64_t anchor_line;
+	uint32_t anchor_row;
+} Scrollback;
+
+void scrollback_init(Scrollback *scrollback);
+void scrollback_free(Scrollback *scrollback);
+void scrollback_clear(Scrollback *scrollback);
+int scrollback_append(Scrollback *scrollback, const char *text, uint32_t size);
+int scrollback_visible(Scrollback *scrollback, uint16_t width, int height, ScrollbackRow *rows);
+void scrollback_scroll(Scrollback *scrollback, int rows, uint16_t width, int height);
+void scrollback_follow(Scrollback *scrollback);
@@ -0,0 +1,522 @@
+#include "search.h"
+
+#include "utils.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SEARCH_MIN_CAPACITY 1024
+#define VARINT_MAX_SIZE 10
+
+/*
+ * A posting list being probed for ids, which keeps the block it decoded last
+ * as probes usually land in the same one.
+ */
+typedef struct {
+	const SearchPosting *posting;
+	uint32_t block;
+	uint32_t count;
+	uint64_t ids[SEARCH_BLOCK_SIZE];
+} SearchCursor;
+
+static uint32_t trigram_at(const uint8_t *data);
+static uint8_t fold(uint8_t c);
+static SearchPosting *find_posting(SearchIndex *index, uint32_t trigram, int create);
+static void grow_table(SearchIndex *index);
+static void posting_append(SearchIndex *index, SearchPosting *posting, uint64_t id);
+static uint32_t decode_block(const SearchPosting *posting, uint32_t block, uint64_t ids[SEARCH_BLOCK_SIZE]);
+static int cursor_contains(SearchCursor *cursor, uint64_t id);
+static uint32_t find_candidates(SearchIndex *index, const uint8_t *query, uint32_t size, uint64_t before,
+                                uint64_t candidates[SEARCH_CANDIDATES]);
+static void keep_recent(SearchIndex *index, const ChatRecord *record, const Serialised *serialised);
+static int copy_recent(SearchIndex *index, uint64_t id, Serialised *serialised);
+static void scan_recent(SearchIndex *index, const uint8_t *query, uint32_t size, uint64_t before, uint32_t count,
+                        ChatSearchResults *results);
+static void add_result(ChatSearchResults *results, const Serialised *serialised);
+static int message_matches(const ChatRecord *record, const uint8_t *query, uint32_t size);
+
+void search_index_init(SearchIndex *index) {
+	memset(index, 0, sizeof *index);
+
+	pthread_mutex_init(&index->lock, NULL);
+}
+
+void search_index_free(SearchIndex *index) {
+	for (uint32_t i = 0; i < index->capacity; i++) {
+		free(index->postings[i].data);
+		free(index->postings[i].skips);
+	}
+
+	for (uint32_t i = 0; index->recent != NULL && i < SEARCH_RECENT_MESSAGES; i++) {
+		free(index->recent[i].record.data);
+	}
+
+	freep(index->postings);
+	freep(index->recent);
+	pthread_mutex_destroy(&index->lock);
+}
+
+/*
+ * Index everything already in a log, a batch at a time.
+ */
+int search_index_build(SearchIndex *index, ChatLog *log) {
+	pthread_mutex_lock(&log->lock);
+
+	uint64_t end_id = log->written_id;
+
+	pthread_mutex_unlock(&log->lock);
+
+	for (uint64_t first_id = 1; first_id < end_id; first_id += SEARCH_BUILD_BATCH) {
+		uint64_t before = end_id - first_id > SEARCH_BUILD_BATCH ? first_id + SEARCH_BUILD_BATCH : end_id;
+		Serialised records = {0};
+		Serialised serialised;
+
+		if (chat_log_read(log, before, 0, before - first_id, &records) < 0) {
+			return -1;
+		}
+
+		for (uint32_t offset = 0; next_packet(records.data, records.size, &offset, &serialised) == 0;) {
+			search_index_add(index, &serialised);
+		}
+
+		freep(records.data);
+	}
+
+	return 0;
+}
+
+/*
+ * Add a ChatRecord packet. Messages must be added in order of id.
+ */
+void search_index_add(SearchIndex *index, const Serialised *serialised) {
+	ChatRecord record;
+
+	if (unserialise_chat_record(serialised, &record) < 0) {
+		return;
+	}
+
+	pthread_mutex_lock(&index->lock);
+
+	for (uint32_t i = 0; i + SEARCH_TRIGRAM_SIZE <= record.size; i++) {
+		SearchPosting *posting = find_posting(index, trigram_at(record.data + i), TRUE);
+
+		// A trigram that repeats within the message is only listed once.
+		if (posting->count == 0 || posting->last_id < record.id) {
+			posting_append(index, posting, record.id);
+		}
+	}
+
+	keep_recent(index, &record, serialised);
+	index->num_messages++;
+
+	pthread_mutex_unlock(&index->lock);
+}
+
+/*
+ * Run a search, returning the ChatSearchResults packet to send back.
+ */
+Serialised *search_index_query(SearchIndex *index, ChatLog *log, const ChatSearchRequest *request) {
+	ChatSearchResults results = {0};
+	uint32_t count = request->count < SEARCH_MAX_RESULTS ? request->count : SEARCH_MAX_RESULTS;
+	uint64_t before = request->before != 0 ? request->before : UINT64_MAX;
+	uint8_t *query = malloc(request->size > 0 ? request->size : 1);
+
+	for (uint32_t i = 0; i < request->size; i++) {
+		query[i] = fold(request->data[i]);
+	}
+
+	if (request->size > 0 && request->size < SEARCH_TRIGRAM_SIZE) {
+		scan_recent(index, query, request->size, before, count, &results);
+	}
+
+	for (size_t pass = 0; request->size >= SEARCH_TRIGRAM_SIZE && results.count < count && pass < SEARCH_MAX_PASSES;
+	     pass++) {
+		uint64_t candidates[SEARCH_CANDIDATES];
+		uint32_t num_candidates = find_candidates(index, query, request->size, before, candidates);
+
+		// The index only says a message has every trigram of the query, not that they are in order.
+		for (uint32_t i = 0; i < num_candidates && results.count < count; i++) {
+			Serialised serialised = {0};
+			ChatRecord record;
+
+			if ((copy_recent(index, candidates[i], &serialised) == 0 ||
+			     chat_log_read(log, candidates[i] + 1, 0, 1, &serialised) > 0) &&
+			    unserialise_chat_record(&serialised, &record) == 0 && record.id == candidates[i] &&
+			    message_matches(&record, query, request->size)) {
+				add_result(&results, &serialised);
+			}
+
+			freep(serialised.data);
+		}
+
+		if (num_candidates < SEARCH_CANDIDATES) {
+			break;
+		}
+
+		before = candidates[num_candidates - 1];
+	}
+
+	Serialised *serialised = serialise_chat_search_results(&results);
+
+	freep(results.data);
+	freep(query);
+
+	return serialised;
+}
+
+static uint32_t trigram_at(const uint8_t *data) {
+	return 1u << 24 | (uint32_t)fold(data[0]) << 16 | (uint32_t)fold(data[1]) << 8 | fold(data[2]);
+}
+
+static uint8_t fold(uint8_t c) {
+	return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+static SearchPosting *find_posting(SearchIndex *index, uint32_t trigram, int create) {
+	if (create && (index->num_postings + 1) * 2 > index->capacity) {
+		grow_table(index);
+	}
+
+	if (index->capacity == 0) {
+		return NULL;
+	}
+
+	uint32_t mask = index->capacity - 1;
+
+	for (uint32_t slot = (trigram * 2654435761u) & mask;; slot = (slot + 1) & mask) {
+		SearchPosting *posting = &index->postings[slot];
+
+		if (posting->trigram == trigram) {
+			return posting;
+		}
+
+		if (posting->trigram == 0) {
+			if (!create) {
+				return NULL;
+			}
+
+			posting->trigram = trigram;
+			index->num_postings++;
+
+			return posting;
+		}
+	}
+}
+
+static void grow_table(SearchIndex *index) {
+	SearchPosting *postings = index->postings;
+	uint32_t capacity = index->capacity;
+
+	index->capacity = capacity > 0 ? capacity * 2 : SEARCH_MIN_CAPACITY;
+	index->postings = calloc(index->capacity, sizeof *index->postings);
+	index->num_postings = 0;
+	index->memory += (index->capacity - capacity) * sizeof *index->postings;
+
+	for (uint32_t i = 0; i < capacity; i++) {
+		if (postings[i].trigram != 0) {
+			*find_posting(index, postings[i].trigram, TRUE) = postings[i];
+		}
+	}
+
+	freep(postings);
+}
+
+static void posting_append(SearchIndex *index, SearchPosting *posting, uint64_t id) {
+	if (posting->count % SEARCH_BLOCK_SIZE == 0) {
+		if (posting->num_skips == posting->skips_capacity) {
+			uint32_t capacity = posting->skips_capacity > 0 ? posting->skips_capacity * 2 : 1;
+
+			posting->skips = realloc(posting->skips, sizeof *posting->skips * capacity);
+			index->memory += sizeof *posting->skips * (capacity - posting->skips_capacity);
+			posting->skips_capacity = capacity;
+		}
+
+		posting->skips[posting->num_skips++] = (SearchSkip){.id = id, .offset = posting->size};
+	}
+
+	if (posting->size + VARINT_MAX_SIZE > posting->capacity) {
+		uint32_t capacity = posting->capacity > 0 ? posting->capacity * 2 : 16;
+
+		posting->data = realloc(posting->data, capacity);
+		index->memory += capacity - posting->capacity;
+		posting->capacity = capacity;
+	}
+
+	uint64_t delta = id - posting->last_id;
+	uint8_t *pos = posting->data + posting->size;
+
+	for (; delta >= 0x80; delta >>= 7) {
+		*pos++ = (uint8_t)delta | 0x80;
+	}
+
+	*pos++ = (uint8_t)delta;
+
+	posting->size = pos - posting->data;
+	posting->last_id = id;
+	posting->count++;
+}
+
+/*
+ * The first difference in a block is skipped over, as its skip entry already
+ * has the id.
+ */
+static uint32_t decode_block(const SearchPosting *posting, uint32_t block, uint64_t ids[SEARCH_BLOCK_SIZE]) {
+	const uint8_t *pos = posting->data + posting->skips[block].offset;
+	uint32_t end_offset = block + 1 < posting->num_skips ? posting->skips[block + 1].offset : posting->size;
+	const uint8_t *end = posting->data + end_offset;
+	uint64_t id = posting->skips[block].id;
+	uint32_t count = 0;
+
+	while (pos < end) {
+		uint64_t delta = 0;
+
+		for (int shift = 0;; shift += 7) {
+			delta |= (uint64_t)(*pos & 0x7f) << shift;
+
+			if ((*pos++ & 0x80) == 0) {
+				break;
+			}
+		}
+
+		if (count > 0) {
+			id += delta;
+		}
+
+		ids[count++] = id;
+	}
+
+	return count;
+}
+
+static int cursor_contains(SearchCursor *cursor, uint64_t id) {
+	const SearchPosting *posting = cursor->posting;
+	uint32_t low = 0;
+	uint32_t high = posting->num_skips;
+
+	// The block is the last one starting at or before id.
+	while (low < high) {
+		uint32_t mid = low + (high - low) / 2;
+
+		if (posting->skips[mid].id <= id) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+
+	if (low == 0) {
+		return FALSE;
+	}
+
+	if (cursor->count == 0 || cursor->block != low - 1) {
+		cursor->block = low - 1;
+		cursor->count = decode_block(posting, cursor->block, cursor->ids);
+	}
+
+	for (low = 0, high = cursor->count; low < high;) {
+		uint32_t mid = low + (high - low) / 2;
+
+		if (cursor->ids[mid] < id) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+
+	return low < cursor->count && cursor->ids[low] == id;
+}
+
+/*
+ * Find up to SEARCH_CANDIDATES of the newest messages before id before that
+ * have every trigram of query, newest first. The shortest posting list is
+ * walked backwards and the others are only probed.
+ */
+static uint32_t find_candidates(SearchIndex *index, const uint8_t *query, uint32_t size, uint64_t before,
+                                uint64_t candidates[SEARCH_CANDIDATES]) {
+	uint32_t num_trigrams = size - SEARCH_TRIGRAM_SIZE + 1;
+	const SearchPosting **postings = malloc(sizeof *postings * num_trigrams);
+	uint32_t num_postings = 0;
+	uint32_t num_candidates = 0;
+	SearchCursor *cursors = NULL;
+
+	pthread_mutex_lock(&index->lock);
+
+	for (uint32_t i = 0; i < num_trigrams; i++) {
+		const SearchPosting *posting = find_posting(index, trigram_at(query + i), FALSE);
+		uint32_t j = 0;
+
+		if (posting == NULL) {
+			num_postings = 0;
+
+			break;
+		}
+
+		for (; j < num_postings && postings[j] != posting; j++) {
+		}
+
+		if (j == num_postings) {
+			postings[num_postings++] = posting;
+		}
+
+		// Keep the shortest first.
+		if (j == num_postings - 1 && posting->count < postings[0]->count) {
+			postings[j] = postings[0];
+			postings[0] = posting;
+		}
+	}
+
+	if (num_postings > 1) {
+		cursors = malloc(sizeof *cursors * (num_postings - 1));
+
+		for (uint32_t i = 1; i < num_postings; i++) {
+			cursors[i - 1] = (SearchCursor){.posting = postings[i]};
+		}
+	}
+
+	for (uint32_t block = num_postings > 0 ? postings[0]->num_skips : 0; block-- > 0;) {
+		uint64_t ids[SEARCH_BLOCK_SIZE];
+		uint32_t count = 0;
+
+		if (postings[0]->skips[block].id >= before) {
+			continue;
+		}
+
+		count = decode_block(postings[0], block, ids);
+
+		while (count-- > 0 && num_candidates < SEARCH_CANDIDATES) {
+			uint32_t i = 1;
+
+			for (; ids[count] < before && i < num_postings && cursor_contains(&cursors[i - 1], ids[count]); i++) {
+			}
+
+			if (ids[count] < before && i == num_postings) {
+				candidates[num_candidates++] = ids[count];
+			}
+		}
+
+		if (num_candidates == SEARCH_CANDIDATES) {
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&index->lock);
+
+	freep(cursors);
+	freep(postings);
+
+	return num_candidates;
+}
+
+/*
+ * Called with the index locked. The slot is taken over from whatever message
+ * SEARCH_RECENT_MESSAGES before it had it.
+ */
+static void keep_recent(SearchIndex *index, const ChatRecord *record, const Serialised *serialised) {
+	if (index->recent == NULL) {
+		index->recent = calloc(SEARCH_RECENT_MESSAGES, sizeof *index->recent);
+		index->memory += SEARCH_RECENT_MESSAGES * sizeof *index->recent;
+	}
+
+	SearchRecent *recent = &index->recent[record->id % SEARCH_RECENT_MESSAGES];
+
+	index->memory -= recent->record.size;
+	recent->id = record->id;
+	recent->record.size = serialised->size;
+	recent->record.data = realloc(recent->record.data, serialised->size);
+	index->memory += serialised->size;
+	index->newest_id = record->id;
+
+	memcpy(recent->record.data, serialised->data, serialised->size);
+}
+
+/*
+ * Copy out a recent message, or return -1 if it is too old to be kept.
+ */
+static int copy_recent(SearchIndex *index, uint64_t id, Serialised *serialised) {
+	int ret = -1;
+
+	pthread_mutex_lock(&index->lock);
+
+	const SearchRecent *recent = index->recent != NULL ? &index->recent[id % SEARCH_RECENT_MESSAGES] : NULL;
+
+	if (recent != NULL && recent->id == id) {
+		serialised->size = recent->record.size;
+		serialised->data = malloc(recent->record.size);
+
+		memcpy(serialised->data, recent->record.data, recent->record.size);
+
+		ret = 0;
+	}
+
+	pthread_mutex_unlock(&index->lock);
+
+	return ret;
+}
+
+/*
+ * Look through the recent messages before id before, newest first, for a
+ * query the index cannot answer.
+ */
+static void scan_recent(SearchIndex *index, const uint8_t *query, uint32_t size, uint64_t before, uint32_t count,
+                        ChatSearchResults *results) {
+	pthread_mutex_lock(&index->lock);
+
+	uint64_t id = before <= index->newest_id ? before - 1 : index->newest_id;
+	uint64_t oldest_id = index->newest_id > SEARCH_RECENT_MESSAGES ? index->newest_id - SEARCH_RECENT_MESSAGES : 0;
+
+	for (; index->recent != NULL && id > oldest_id && results->count < count; id--) {
+		const SearchRecent *recent = &index->recent[id % SEARCH_RECENT_MESSAGES];
+		ChatRecord record;
+
+		if (recent->id == id && unserialise_chat_record(&recent->record, &record) == 0 &&
+		    message_matches(&record, query, size)) {
+			add_result(results, &recent->record);
+		}
+	}
+
+	pthread_mutex_unlock(&index->lock);
+}
+
+static void add_result(ChatSearchResults *results, const Serialised *serialised) {
+	results->data = realloc(results->data, results->size + serialised->size);
+
+	memcpy(results->data + results->size, serialised->data, serialised->size);
+
+	results->size += serialised->size;
+	results->count++;
+}
+
+/*
+ * The query is already folded, and the message is folded as it is compared,
+ * once its first byte is found in either case.
+ */
+static int message_matches(const ChatRecord *record, const uint8_t *query, uint32_t size) {
+	if (record->size < size) {
+		return FALSE;
+	}
+
+	uint8_t first = query[0];
+	uint8_t upper = first >= 'a' && first <= 'z' ? first - 'a' + 'A' : first;
+	const uint8_t *end = record->data + record->size - size + 1;
+
+	for (const uint8_t *pos = record->data; pos < end; pos++) {
+		const uint8_t *lower_pos = memchr(pos, first, end - pos);
+		const uint8_t *upper_pos = upper != first ? memchr(pos, upper, (lower_pos != NULL ? lower_pos : end) - pos) : NULL;
+		uint32_t i = 1;
+
+		pos = upper_pos != NULL ? upper_pos : lower_pos;
+
+		if (pos == NULL) {
+			return FALSE;
+		}
+
+		for (; i < size && fold(pos[i]) == query[i]; i++) {
+		}
+
+		if (i == size) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
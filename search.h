@@ -0,0 +1,96 @@
+#pragma once
+
+#include "chatlog.h"
+#include "packets.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Each room's chat is indexed by the trigrams (runs of three bytes, ASCII
+ * folded to lower case) its messages contain. A query is looked up by its
+ * own trigrams, and the messages that have all of them are then checked
+ * against their text. Queries shorter than a trigram can only be answered
+ * from the recent messages, which are scanned instead.
+ */
+#define SEARCH_TRIGRAM_SIZE 3
+
+/*
+ * Posting lists store ids as varint differences, with a skip entry at the
+ * start of every SEARCH_BLOCK_SIZE ids so a list can be entered anywhere
+ * without decoding what comes before.
+ */
+#define SEARCH_BLOCK_SIZE 128
+
+/*
+ * Most results sent back for one query. Candidates are taken from the index
+ * SEARCH_CANDIDATES at a time and checked against the log, for at most
+ * SEARCH_MAX_PASSES rounds.
+ */
+#define SEARCH_MAX_RESULTS 50
+#define SEARCH_CANDIDATES 64
+#define SEARCH_MAX_PASSES 16
+
+/*
+ * The newest SEARCH_RECENT_MESSAGES messages are kept by the index, so they
+ * are checked without reading the log, and can be found without one. Older
+ * messages are read back from the log.
+ */
+#define SEARCH_RECENT_MESSAGES 8192
+
+/*
+ * How many messages are read from the log at a time when building an index.
+ */
+#define SEARCH_BUILD_BATCH 4096
+
+typedef struct {
+	uint64_t id;
+	uint32_t offset;
+} SearchSkip;
+
+/*
+ * The messages containing one trigram, oldest first. trigram 0 marks an
+ * empty slot of the table.
+ */
+typedef struct {
+	uint32_t trigram;
+	uint32_t count;
+	uint64_t last_id;
+	uint8_t *data;
+	uint32_t size;
+	uint32_t capacity;
+	SearchSkip *skips;
+	uint32_t num_skips;
+	uint32_t skips_capacity;
+} SearchPosting;
+
+/*
+ * A recent message as its ChatRecord packet. id 0 marks an empty slot.
+ */
+typedef struct {
+	uint64_t id;
+	Serialised record;
+} SearchRecent;
+
+/*
+ * Posting lists live in an open-addressed table kept at most half full.
+ * Recent messages are a ring, each in the slot its id picks, allocated with
+ * the first message. memory is everything the index has allocated.
+ */
+typedef struct {
+	pthread_mutex_t lock;
+	SearchPosting *postings;
+	uint32_t capacity;
+	uint32_t num_postings;
+	SearchRecent *recent;
+	uint64_t newest_id;
+	uint64_t num_messages;
+	size_t memory;
+} SearchIndex;
+
+void search_index_init(SearchIndex *index);
+void search_index_free(SearchIndex *index);
+int search_index_build(SearchIndex *index, ChatLog *log);
+void search_index_add(SearchIndex *index, const Serialised *serialised);
+Serialised *search_index_query(SearchIndex *index, ChatLog *log, const ChatSearchRequest *request);
@@ -1,248 +1,1368 @@
 #include "server.h"
 
+#include "config.h"
+#include "metrics.h"
 #include "packets.h"
 #include "utils.h"
 
 #include <errno.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 static void *heartbeat_handler(void *arg);
+static int ping_client(Client *client);
+static int wait_ms(uint32_t ms);
+static void pong_handler(Client *client, const HeartbeatProbe *probe);
+static void heard_from(Client *client);
+static int recv_client_packet(Client *client, Serialised *serialised);
 static void *client_handler(void *arg);
 static Config *read_config();
-static int send_config(const Client *client, const Config *config);
+static int send_config(Client *client, const Config *config);
+static int audio_codec_handler(Client *client);
+static void *media_handler(void *arg);
+static int register_media(Client *client);
+static void unregister_media(Client *client);
+static int media_packet_handler(Client *client);
+static int fragment_handler(Client *client);
+static void process_media_packet(Client *client, Serialised *serialised);
+static void audio_frame_handler(Client *client, Serialised *serialised);
+static void comfort_noise_handler(Client *client, Serialised *serialised);
+static void video_frame_handler(Client *client, Serialised *serialised);
+static int active_speaker_handler(Client *client);
+static int chat_message_handler(Client *client);
+static int chat_history_handler(Client *client);
+static int chat_search_handler(Client *client);
+static int join_room_handler(Client *client);
+static void leave_room(Client *client);
+static ServerRoom *lock_client_room(Client *client);
+static void broadcast(ServerRoom *room, Client *sender, Serialised *serialised);
+static int forward_audio(ServerRoom *room, Client *receiver, Client *sender, Serialised *serialised,
+                         Serialised **reduced);
+static Serialised *transcode_audio_frame(Client *sender, const Serialised *serialised, AudioCodec codec);
+static int send_media(Client *receiver, const Client *sender, uint8_t stream, const Serialised *serialised);
+static void update_speaker(ServerRoom *room, Client *client, float level_db);
+static int should_forward_video(const ServerRoom *room, const Client *receiver, const Client *sender, uint8_t layer);
+static char *room_chat_log_dir(const Config *config, const Room *room);
+static void reload_chat_history(ServerRoom *room);
+static void *room_owner(void *arg);
+static int start_room_owner(ServerRoom *room);
+static void stop_room_owner(ServerRoom *room);
+static void assign_room_cpus(Server *server);
+static void migrate_client(Client *client, int cpu);
+static void write_server_stats(FILE *out, void *arg);
+
+/*
+ * Ping the client whenever it has gone a heartbeat interval without being
+ * heard from, or has not been pinged for too long.
+ */
+static void *heartbeat_handler(void *arg) {
+	Client *client = (Client *)arg;
+	struct sigaction disconnect_action = {.sa_handler = do_nothing};
+
+	if (sigaction(SIGUSR1, &disconnect_action, NULL) < 0) {
+		log_error(ERROR_TERMINAL, "failed to set SIGUSR1 client disconnection signal");
+	}
+
+	// The first ping goes out straight away, so the round trip is known early.
+	int ping = TRUE;
+	int skipped = 0;
+
+	while (!atomic_load(&client->disconnecting)) {
+		if (ping) {
+			if (ping_client(client) <= 0) {
+				break;
+			}
+
+			skipped = 0;
+		}
+
+		uint64_t checked = metrics_now_ns();
+
+		// May be interrupted if told to finish up.
+		if (wait_ms(HEARTBEAT_INTERVAL * 1000) < 0) {
+			break;
+		}
+
+		ping = atomic_load(&client->heard) < checked || skipped == HEARTBEAT_MAX_SKIPS;
+
+		if (!ping) {
+			skipped++;
+			metrics_count(MetricHeartbeatSkips, 1);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Ping the client until anything is heard back from it, giving up after
+ * HEARTBEAT_MAX_MISSES tries. Returns 1 once it is heard from, 0 if it was
+ * disconnected for not answering, or -1 if the heartbeat should stop.
+ */
+static int ping_client(Client *client) {
+	for (int misses = 0; misses < HEARTBEAT_MAX_MISSES; misses++) {
+		HeartbeatProbe probe = {.kind = HeartbeatPing, .timestamp = metrics_now_ns()};
+		uint8_t buffer[PACKET_HEADER_SIZE + sizeof probe.kind + sizeof probe.timestamp];
+		Serialised ping = {.size = serialise_heartbeat_into(&probe, buffer, sizeof buffer), .data = buffer};
+
+		atomic_store(&client->ping_sent, probe.timestamp);
+
+		if (scheduler_send(&client->scheduler, &ping) < 0) {
+			log_error(ERROR_HEARTBEAT, "failed to send ping");
+
+			return -1;
+		}
+
+		if (wait_ms(atomic_load(&client->ping_timeout_ms)) < 0 || atomic_load(&client->disconnecting)) {
+			return -1;
+		}
+
+		if (atomic_load(&client->heard) >= probe.timestamp) {
+			return 1;
+		}
+
+		metrics_count(MetricHeartbeatMisses, 1);
+	}
+
+	log_error(ERROR_HEARTBEAT, "client has not answered its last pings");
+
+	// The client's own thread sees the connection end and cleans up after it.
+	if (shutdown(client->socket_fd, SHUT_RDWR) < 0 && errno != ENOTCONN) {
+		log_error(ERROR_NETWORK, "failed to disconnect from client");
+	}
+
+	return 0;
+}
+
+/*
+ * Sleep for ms milliseconds. Returns -1 if a signal cut it short.
+ */
+static int wait_ms(uint32_t ms) {
+	struct timespec duration = {.tv_sec = ms / 1000, .tv_nsec = (ms % 1000) * 1000000L};
+
+	return nanosleep(&duration, NULL);
+}
+
+/*
+ * A pong answering the last ping times the round trip. Any other is stale or
+ * made up, and only counts as hearing from the client.
+ */
+static void pong_handler(Client *client, const HeartbeatProbe *probe) {
+	uint64_t now = metrics_now_ns();
+
+	if (probe->kind != HeartbeatPong || probe->timestamp != atomic_load(&client->ping_sent) || probe->timestamp > now) {
+		return;
+	}
+
+	uint64_t rtt_us = (now - probe->timestamp) / 1000;
+
+	heartbeat_rtt_update(&client->rtt, rtt_us);
+	atomic_store(&client->ping_timeout_ms, heartbeat_timeout_ms(&client->rtt));
+	metrics_observe(MetricHeartbeatRtt, rtt_us);
+}
+
+static void heard_from(Client *client) {
+	atomic_store_explicit(&client->heard, metrics_now_ns(), memory_order_relaxed);
+}
+
+/*
+ * Receive a packet from client's connection, counting it.
+ */
+static int recv_client_packet(Client *client, Serialised *serialised) {
+	int ret = recv_packet(client->socket_fd, serialised, &client->socket_lock);
+
+	if (ret > 0) {
+		heard_from(client);
+		metrics_packet_in(((PacketType *)serialised->data)[0], serialised->size);
+	}
+
+	return ret;
+}
+
+static Config *read_config() {
+	char *home_dir = get_home_dir();
+
+	if (home_dir == NULL) {
+		log_error(ERROR_OS, "failed to get home directory");
+
+		return NULL;
+	}
+
+	char *config_path = join_path(home_dir, CONFIG_PATH, NULL);
+	char *dir = strndup(config_path, strrchr(config_path, PATH_SEPARATOR) - config_path);
+
+	if (make_dirs(dir) < 0) {
+		log_error(ERROR_CONFIG, "failed to create config directory");
+
+		freep(dir);
+
+		return NULL;
+	}
+
+	freep(dir);
+
+#ifdef __APPLE__
+	int config_fd = open(config_path, O_RDONLY | O_CREAT | O_SYMLINK, 0666);
+#else
+	int config_fd = open(config_path, O_RDONLY | O_CREAT, 0666);
+#endif
+
+	if (config_fd < 0) {
+		log_error(ERROR_CONFIG, "failed to create/open configuration file");
+
+		return NULL;
+	}
+
+	freep(config_path);
+
+	FILE *config_file = fdopen(config_fd, "r");
+
+	if (config_file == NULL) {
+		log_error(ERROR_CONFIG, "failed to open configuration file stream");
+
+		return NULL;
+	}
+
+	Config *config = config_parse(config_file, home_dir);
+
+	if (ferror(config_file) != 0) {
+		log_error(ERROR_CONFIG, "failed to read lines from configuration file");
+
+		config_free(config);
+
+		if (fclose(config_file) != 0) {
+			log_error(ERROR_CONFIG, "failed to close configuration file stream");
+		}
+
+		return NULL;
+	}
+
+	if (fclose(config_file) != 0) {
+		log_error(ERROR_CONFIG, "failed to close configuration file stream");
+	}
+
+	return config;
+}
+
+static int send_config(Client *client, const Config *config) {
+	Serialised *serialised = serialise_config(config);
+
+	int n = scheduler_send(&client->scheduler, serialised);
+
+	free(serialised->data);
+	free(serialised);
+
+	if (n < 0) {
+		log_error(ERROR_NETWORK, "failed to send packet type");
+
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Answer a client's codec offer with the single codec this connection will use.
+ */
+static int audio_codec_handler(Client *client) {
+	Serialised serialised = {0};
+	int ret = recv_client_packet(client, &serialised);
+
+	if (ret <= 0) {
+		log_error(ERROR_NETWORK, "failed to receive audio codec offer");
+
+		return -1;
+	}
+
+	ret = unserialise_audio_codecs(&serialised, &client->audio_codecs);
+	freep(serialised.data);
+
+	if (ret < 0) {
+		log_error(ERROR_NETWORK, "received malformed audio codec offer");
+
+		return -1;
+	}
+
+	client->audio_codec = audio_codec_negotiate(client->audio_codecs);
+
+	uint8_t buffer[PACKET_VALUE_SIZE(AudioCodecMask)];
+	Serialised reply = {.data = buffer};
+
+	reply.size = serialise_audio_codecs_into(AUDIO_CODEC_MASK(client->audio_codec), buffer, sizeof buffer);
+
+	if (scheduler_send(&client->scheduler, &reply) < 0) {
+		log_error(ERROR_NETWORK, "failed to send negotiated audio codec");
+
+		return -1;
+	}
+
+	return 0;
+}
+
+/*
+ * Receive datagrams from every client's media channel and handle them as if
+ * they had arrived on that client's TCP connection.
+ */
+static void *media_handler(void *arg) {
+	Server *server = (Server *)arg;
+
+	while (TRUE) {
+		struct sockaddr_in addr = {0};
+		MediaHeader header = {0};
+		Serialised serialised = {0};
+		int ret = media_recv(&server->media, &addr, &header, &serialised);
+
+		if (ret <= 0) {
+			continue;
+		}
+
+		pthread_mutex_lock(&server->media_lock);
+
+		Client *client = server->media_clients[MEDIA_SSRC_SLOT(header.ssrc)];
+
+		if (client == NULL || (header.ssrc & ~MEDIA_SSRC_STREAM_MASK) != client->media_ssrc_base) {
+			log_error(ERROR_NETWORK, "received media datagram with unknown SSRC");
+		} else if ((header.ssrc & MEDIA_SSRC_STREAM_MASK) == MEDIA_STREAM_HELLO) {
+			// The first hello fixes the client's address, the echo tells it the channel works.
+			if (!atomic_load(&client->media_ready)) {
+				client->media_addr = addr;
+				atomic_store(&client->media_ready, TRUE);
+
+				log_info("client media channel open");
+			}
+
+			if (addr.sin_addr.s_addr == client->media_addr.sin_addr.s_addr &&
+			    addr.sin_port == client->media_addr.sin_port &&
+			    media_send(&server->media, &client->media_addr, &header, NULL) < 0) {
+				log_error(ERROR_NETWORK, "failed to answer media channel hello");
+			}
+		} else if (atomic_load(&client->media_ready) && addr.sin_addr.s_addr == client->media_addr.sin_addr.s_addr &&
+		           addr.sin_port == client->media_addr.sin_port) {
+			heard_from(client);
+			metrics_packet_in(((PacketType *)serialised.data)[0], serialised.size);
+			process_media_packet(client, &serialised);
+		}
+
+		pthread_mutex_unlock(&server->media_lock);
+
+		free(serialised.data);
+	}
+
+	return NULL;
+}
+
+/*
+ * Give a newly connected client an SSRC base and tell it where to send media.
+ * If every slot is taken the client keeps sending media over TCP.
+ */
+static int register_media(Client *client) {
+	Server *server = client->server;
+	int ret = 0;
+
+	pthread_mutex_lock(&server->media_lock);
+
+	for (uint32_t slot = 0; slot < MEDIA_MAX_CLIENTS; slot++) {
+		if (server->media_clients[slot] == NULL) {
+			server->media_clients[slot] = client;
+			// Never zero, which marks a client without a slot.
+			client->media_ssrc_base = ((uint32_t)(random() % 0xFFFF) + 1) << 16 | slot << MEDIA_SSRC_SLOT_SHIFT;
+
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&server->media_lock);
+
+	if (client->media_ssrc_base == 0) {
+		log_error(ERROR_NETWORK, "no media channel slots left, client media stays on TCP");
+
+		return 0;
+	}
+
+	MediaChannel channel = {.port = MEDIA_PORT, .ssrc_base = client->media_ssrc_base};
+	uint8_t buffer[PACKET_HEADER_SIZE + sizeof channel.port + sizeof channel.ssrc_base];
+	Serialised serialised = {.size = serialise_media_channel_into(&channel, buffer, sizeof buffer), .data = buffer};
+
+	if (scheduler_send(&client->scheduler, &serialised) < 0) {
+		log_error(ERROR_NETWORK, "failed to send media channel");
+
+		ret = -1;
+	}
+
+	return ret;
+}
+
+/*
+ * Once this returns the media thread no longer touches client.
+ */
+static void unregister_media(Client *client) {
+	Server *server = client->server;
+
+	pthread_mutex_lock(&server->media_lock);
+
+	if (client->media_ssrc_base != 0 &&
+	    server->media_clients[MEDIA_SSRC_SLOT(client->media_ssrc_base)] == client) {
+		server->media_clients[MEDIA_SSRC_SLOT(client->media_ssrc_base)] = NULL;
+	}
+
+	pthread_mutex_unlock(&server->media_lock);
+}
+
+/*
+ * Media sent over TCP, from clients without a working media channel.
+ */
+static int media_packet_handler(Client *client) {
+	Serialised serialised = {0};
+	int ret = recv_client_packet(client, &serialised);
+
+	if (ret <= 0) {
+		log_error(ERROR_NETWORK, "failed to receive media packet");
+
+		return -1;
+	}
+
+	process_media_packet(client, &serialised);
+
+	freep(serialised.data);
+
+	return ret;
+}
+
+/*
+ * Large media packets may arrive in fragments, interleaved with other packets.
+ */
+static int fragment_handler(Client *client) {
+	Serialised packet = {0};
+	int ret = scheduler_recv_fragment(&client->reassembly, client->socket_fd, &client->socket_lock, &packet);
+
+	if (ret < 0) {
+		log_error(ERROR_NETWORK, "failed to receive packet fragment");
+
+		return -1;
+	}
+
+	heard_from(client);
+
+	if (ret == 1) {
+		metrics_packet_in(((PacketType *)packet.data)[0], packet.size);
+		process_media_packet(client, &packet);
+		freep(packet.data);
+	}
+
+	return 0;
+}
+
+static void process_media_packet(Client *client, Serialised *serialised) {
+	switch (((PacketType *)serialised->data)[0]) {
+		case PacketTypeAudioFrame:
+			audio_frame_handler(client, serialised);
+
+			break;
+
+		case PacketTypeComfortNoise:
+			comfort_noise_handler(client, serialised);
+
+			break;
+
+		case PacketTypeVideoFrame:
+			video_frame_handler(client, serialised);
+
+			break;
+
+		default:
+			log_error(ERROR_NETWORK, "received unexpected media packet");
+	}
+}
+
+static void audio_frame_handler(Client *client, Serialised *serialised) {
+	AudioFrame frame = {0};
+	ServerRoom *room = NULL;
+
+	if (unserialise_audio_frame(serialised, &frame) < 0 || frame.codec != client->audio_codec ||
+	    frame.num_samples > AUDIO_FRAME_SAMPLES || frame.size < audio_encoded_size(frame.codec, frame.num_samples)) {
+		log_error(ERROR_NETWORK, "received malformed audio frame");
+	} else if ((room = lock_client_room(client)) != NULL) {
+		int16_t pcm[AUDIO_FRAME_SAMPLES];
+
+		audio_decode(frame.codec, frame.data, frame.size, pcm, frame.num_samples);
+
+		update_speaker(room, client, audio_energy_db(pcm, frame.num_samples));
+		broadcast(room, client, serialised);
+		pthread_mutex_unlock(&room->lock);
+	}
+}
+
+static void comfort_noise_handler(Client *client, Serialised *serialised) {
+	ComfortNoise noise = {0};
+	ServerRoom *room = NULL;
+
+	if (unserialise_comfort_noise(serialised, &noise) < 0) {
+		log_error(ERROR_NETWORK, "received malformed comfort noise descriptor");
+	} else if ((room = lock_client_room(client)) != NULL) {
+		update_speaker(room, client, AUDIO_FULL_SCALE_DB - noise.level);
+		broadcast(room, client, serialised);
+		pthread_mutex_unlock(&room->lock);
+	}
+}
+
+static void video_frame_handler(Client *client, Serialised *serialised) {
+	VideoFrame frame = {0};
+	ServerRoom *room = NULL;
+
+	if (unserialise_video_frame(serialised, &frame) < 0 || frame.layer >= VIDEO_MAX_LAYERS) {
+		log_error(ERROR_NETWORK, "received malformed video frame");
+	} else if ((room = lock_client_room(client)) != NULL) {
+		client->video_layers |= 1 << frame.layer;
+		client->video_frames[frame.layer]++;
+		((uint8_t *)serialised->data)[PACKET_SOURCE_OFFSET] = client->participant;
+
+		uint64_t start = metrics_now_ns();
+
+		for (size_t i = 0; i < MAX_PARTICIPANTS; i++) {
+			Client *member = room->members[i];
+
+			if (member == NULL || member == client || !should_forward_video(room, member, client, frame.layer)) {
+				continue;
+			}
+
+			if (send_media(member, client, MEDIA_STREAM_VIDEO(frame.layer), serialised) < 0) {
+				log_error(ERROR_NETWORK, "failed to forward video frame");
+			}
+		}
+
+		metrics_observe_room(room->index, MetricRoomMediaFanout, metrics_now_ns() - start);
+		pthread_mutex_unlock(&room->lock);
+	}
+}
+
+/*
+ * The client pinned a participant with TAB, or SPEAKER_NONE to follow the
+ * active speaker again.
+ */
+static int active_speaker_handler(Client *client) {
+	Serialised serialised = {0};
+	int ret = recv_client_packet(client, &serialised);
+
+	if (ret <= 0) {
+		log_error(ERROR_NETWORK, "failed to receive speaker selection");
+
+		return -1;
+	}
+
+	uint8_t focus = SPEAKER_NONE;
+
+	if (unserialise_active_speaker(&serialised, &focus) < 0) {
+		log_error(ERROR_NETWORK, "received malformed speaker selection");
+	}
+
+	client->focus = focus < MAX_PARTICIPANTS ? focus : SPEAKER_NONE;
+
+	freep(serialised.data);
+
+	return ret;
+}
+
+/*
+ * Hand a chat message to the owner of the sender's room, which passes it on
+ * to everyone in the room, including its sender, whose client only shows what
+ * comes back.
+ */
+static int chat_message_handler(Client *client) {
+	Serialised serialised = {0};
+	int ret = recv_client_packet(client, &serialised);
+
+	if (ret <= 0) {
+		log_error(ERROR_NETWORK, "failed to receive chat message");
+
+		return -1;
+	}
+
+	const ChatMessage *msg = NULL;
+
+	if (unserialise_chat_message(&serialised, &msg) < 0) {
+		log_error(ERROR_NETWORK, "received malformed chat message");
+	} else if (strlen(msg) + 1 > CHAT_MESSAGE_MAX_SIZE) {
+		log_error(ERROR_NETWORK, "received chat message that is too long");
+	} else if (client->room_index != ROOM_INDEX_NONE) {
+		ServerRoom *room = &client->server->rooms[client->room_index];
+		Serialised *message = malloc(sizeof *message);
+
+		*message = serialised;
+		serialised.data = NULL;
+
+		int waited;
+
+		// A full inbox holds the sender up until the owner catches up, as waiting on the room lock used to.
+		do {
+			waited = sem_wait(&room->inbox_space);
+		} while (waited < 0 && errno == EINTR);
+
+		if (waited < 0 || mpsc_queue_push(&room->inbox, message) < 0) {
+			log_error(ERROR_THREAD, "failed to queue chat message for room");
+			free(message->data);
+			free(message);
+
+			if (waited == 0) {
+				sem_post(&room->inbox_space);
+			}
+		} else {
+			metrics_count(MetricInboxPushed, 1);
+			sem_post(&room->inbox_ready);
+		}
+	}
+
+	freep(serialised.data);
+
+	return ret;
+}
+
+/*
+ * Older messages than a client was sent on joining come from the room's log,
+ * which does not need the room locked.
+ */
+static int chat_history_handler(Client *client) {
+	Serialised serialised = {0};
+	int ret = recv_client_packet(client, &serialised);
+
+	if (ret <= 0) {
+		log_error(ERROR_NETWORK, "failed to receive chat history request");
+
+		return -1;
+	}
+
+	ChatHistoryRequest request;
+	Serialised records = {0};
+
+	if (unserialise_chat_history(&serialised, &request) < 0) {
+		log_error(ERROR_NETWORK, "received malformed chat history request");
+	} else if (client->room_index != ROOM_INDEX_NONE) {
+		ChatLog *log = &client->server->rooms[client->room_index].chat_log;
+		uint32_t count = request.count < CHAT_LOG_MAX_FETCH ? request.count : CHAT_LOG_MAX_FETCH;
+
+		if (chat_log_read(log, request.before, request.since, count, &records) > 0 &&
+		    scheduler_send(&client->scheduler, &records) < 0) {
+			log_error(ERROR_NETWORK, "failed to send chat history");
+		}
+	}
+
+	freep(records.data);
+	freep(serialised.data);
+
+	return ret;
+}
+
+static int chat_search_handler(Client *client) {
+	Serialised serialised = {0};
+	int ret = recv_client_packet(client, &serialised);
+
+	if (ret <= 0) {
+		log_error(ERROR_NETWORK, "failed to receive chat search");
+
+		return -1;
+	}
+
+	ChatSearchRequest request;
+
+	if (unserialise_chat_search(&serialised, &request) < 0) {
+		log_error(ERROR_NETWORK, "received malformed chat search");
+	} else if (client->room_index != ROOM_INDEX_NONE) {
+		ServerRoom *room = &client->server->rooms[client->room_index];
+		Serialised *results = search_index_query(&room->search, &room->chat_log, &request);
+
+		if (scheduler_send(&client->scheduler, results) < 0) {
+			log_error(ERROR_NETWORK, "failed to send chat search results");
+		}
+
+		free(results->data);
+		free(results);
+	}
+
+	freep(serialised.data);
+
+	return ret;
+}
+
+static int join_room_handler(Client *client) {
+	Serialised serialised = {0};
+	int ret = recv_client_packet(client, &serialised);
+
+	if (ret <= 0) {
+		log_error(ERROR_NETWORK, "failed to receive room joining packet");
+
+		return -1;
+	}
+
+	RoomIndex index = -1;
+
+	unserialise_join_room(&serialised, &index);
+	freep(serialised.data);
+
+	if (index < 0 || index >= client->server->config->num_rooms) {
+		log_error(ERROR_NETWORK, "client asked to join a room that does not exist");
+
+		return ret;
+	}
+
+	leave_room(client);
+
+	ServerRoom *room = &client->server->rooms[index];
+
+	pthread_mutex_lock(&room->lock);
+
+	for (uint8_t i = 0; i < MAX_PARTICIPANTS; i++) {
+		if (room->members[i] == NULL) {
+			room->members[i] = client;
+			client->room_index = index;
+			client->participant = i;
+			client->focus = SPEAKER_NONE;
+			client->speaker = (SpeakerLevel){0};
+			client->video_layers = 0;
+
+			break;
+		}
+	}
+
+	if (client->room_index == index) {
+		uint8_t buffer[PACKET_VALUE_SIZE(uint8_t)];
+		Serialised speaker = {.data = buffer};
+
+		speaker.size = serialise_active_speaker_into(room->active_speaker, buffer, sizeof buffer);
+
+		if (scheduler_send(&client->scheduler, &speaker) < 0) {
+			log_error(ERROR_NETWORK, "failed to send active speaker");
+		}
+
+		// Queued all at once for the new member's writer thread, so the room is only held for the copy.
+		struct iovec spans[2];
+		int num_spans = chat_history_spans(&room->chat_history, spans);
+
+		if (num_spans > 0 && scheduler_sendv(&client->scheduler, spans, num_spans) < 0) {
+			log_error(ERROR_NETWORK, "failed to send chat history");
+		}
+	} else {
+		log_error(ERROR_NETWORK, "client asked to join a room that is full");
+	}
+
+	pthread_mutex_unlock(&room->lock);
+
+	if (client->room_index == index) {
+		migrate_client(client, room->cpu);
+	}
+
+	return ret;
+}
+
+static void leave_room(Client *client) {
+	if (client->room_index == ROOM_INDEX_NONE) {
+		return;
+	}
+
+	ServerRoom *room = &client->server->rooms[client->room_index];
+
+	pthread_mutex_lock(&room->lock);
+
+	room->members[client->participant] = NULL;
+
+	if (room->active_speaker == client->participant) {
+		uint8_t buffer[PACKET_VALUE_SIZE(uint8_t)];
+		Serialised speaker = {.size = serialise_active_speaker_into(SPEAKER_NONE, buffer, sizeof buffer),
+		                      .data = buffer};
+
+		room->active_speaker = SPEAKER_NONE;
+		broadcast(room, client, &speaker);
+	}
+
+	pthread_mutex_unlock(&room->lock);
+
+	client->room_index = ROOM_INDEX_NONE;
+	migrate_client(client, ROOM_CPU_NONE);
+}
+
+/*
+ * Lock and return the room client is in, or NULL if it is not in one. Media
+ * arrives on another thread, so check the client is still a member once the
+ * lock is held.
+ */
+static ServerRoom *lock_client_room(Client *client) {
+	RoomIndex index = client->room_index;
+
+	if (index == ROOM_INDEX_NONE) {
+		return NULL;
+	}
+
+	ServerRoom *room = &client->server->rooms[index];
+
+	pthread_mutex_lock(&room->lock);
+
+	if (client->room_index != index || room->members[client->participant] != client) {
+		pthread_mutex_unlock(&room->lock);
+
+		return NULL;
+	}
+
+	return room;
+}
+
+/*
+ * Send a packet to every member of room except sender, stamping media packets
+ * with the sender's participant number. Call with the room lock held.
+ */
+static void broadcast(ServerRoom *room, Client *sender, Serialised *serialised) {
+	PacketType packet_type = ((PacketType *)serialised->data)[0];
+	int media = packet_type == PacketTypeAudioFrame || packet_type == PacketTypeComfortNoise;
+	Serialised *reduced = NULL;
+	uint64_t start = 0;
+
+	if (media) {
+		((uint8_t *)serialised->data)[PACKET_SOURCE_OFFSET] = sender->participant;
+		start = metrics_now_ns();
+	}
+
+	for (size_t i = 0; i < MAX_PARTICIPANTS; i++) {
+		Client *member = room->members[i];
+		int ret = 0;
+
+		if (member == NULL || member == sender) {
+			continue;
+		}
 
-static void *heartbeat_handler(void *arg) {
-	Client *client = (Client *)arg;
-	struct sigaction disconnect_action = {.sa_handler = do_nothing};
+		if (media) {
+			ret = forward_audio(room, member, sender, serialised, &reduced);
+		} else {
+			ret = scheduler_send(&member->scheduler, serialised);
+		}
 
-	if (sigaction(SIGUSR1, &disconnect_action, NULL) < 0) {
-		log_error(ERROR_TERMINAL, "failed to set SIGUSR1 client disconnection signal");
+		if (ret < 0) {
+			log_error(ERROR_NETWORK, "failed to broadcast packet to room member");
+		}
 	}
 
-	while (TRUE) {
-		client->heartbeat = HeartbeatPing;
-		Serialised *serialised = serialise_heartbeat(client->heartbeat);
+	if (reduced != NULL) {
+		free(reduced->data);
+		free(reduced);
+	}
+
+	if (media) {
+		metrics_observe_room(room->index, MetricRoomMediaFanout, metrics_now_ns() - start);
+	}
+}
 
-		if (send_packet(client->socket_fd, serialised, &client->socket_lock) < 0) {
-			log_error(ERROR_HEARTBEAT, "failed to send packet type");
+/*
+ * Forward audio to a receiver according to its congestion level. reduced
+ * caches the ADPCM copy of the frame across the receivers that need it. Call
+ * with the room lock held.
+ */
+static int forward_audio(ServerRoom *room, Client *receiver, Client *sender, Serialised *serialised,
+                         Serialised **reduced) {
+	CongestionLevel level = receiver->congestion.level;
+
+	if (level >= CongestionLevelAudioSpeakerOnly && sender->participant != room->active_speaker) {
+		return 0;
+	}
 
-			break;
+	if (level >= CongestionLevelAudioReduced && ((PacketType *)serialised->data)[0] == PacketTypeAudioFrame &&
+	    (receiver->audio_codecs & AUDIO_CODEC_MASK(AudioCodecADPCM))) {
+		if (*reduced == NULL) {
+			*reduced = transcode_audio_frame(sender, serialised, AudioCodecADPCM);
 		}
 
-		// Wait for client_handler to receive pong. May be interrupted if told to finish up.
-		if (sleep(HEARTBEAT_INTERVAL) != 0) {
-			break;
+		if (*reduced != NULL) {
+			return send_media(receiver, sender, MEDIA_STREAM_AUDIO, *reduced);
 		}
+	}
 
-		if (client->heartbeat != HeartbeatPong) {
-			pthread_mutex_lock(&client->socket_lock);
+	return send_media(receiver, sender, MEDIA_STREAM_AUDIO, serialised);
+}
 
-			// Check if client has already disconnected.
-			if (send(client->socket_fd, NULL, 0, 0) < 0) {
-				if (errno == EBADF) {
-					pthread_mutex_unlock(&client->socket_lock);
+/*
+ * Re-encode an audio frame with codec, or return NULL if it already uses it.
+ */
+static Serialised *transcode_audio_frame(Client *sender, const Serialised *serialised, AudioCodec codec) {
+	AudioFrame frame = {0};
 
-					break;
-				} else {
-					log_error(ERROR_HEARTBEAT, "failed to check status of client");
-				}
-			}
+	if (unserialise_audio_frame(serialised, &frame) < 0 || frame.codec == codec) {
+		return NULL;
+	}
 
-			pthread_mutex_unlock(&client->socket_lock);
+	int16_t pcm[AUDIO_FRAME_SAMPLES] = {0};
+	uint8_t data[AUDIO_FRAME_SAMPLES * sizeof(int16_t)];
 
-			log_error(ERROR_HEARTBEAT, "client has not responded to last ping with a pong");
+	audio_decode(frame.codec, frame.data, frame.size, pcm, frame.num_samples);
 
-			if (shutdown(client->socket_fd, SHUT_RDWR) < 0) {
-				log_error(ERROR_NETWORK, "failed to disconnect from client");
-			}
+	AudioFrame reduced = frame;
 
-			break;
-		}
-	}
+	reduced.codec = codec;
+	reduced.size = audio_encode(codec, &sender->transcode_state, pcm, frame.num_samples, data);
+	reduced.data = data;
 
-	return NULL;
+	return serialise_audio_frame(&reduced);
 }
 
-static Config *read_config() {
-	char *home_dir = get_home_dir();
+/*
+ * Forward a media packet over the receiver's media channel, or its TCP
+ * connection if it has none or the packet does not fit in a datagram. Sequence
+ * numbers and FEC groups are per receiver so throttled video does not look
+ * like loss. Call with the receiver's room lock held.
+ */
+static int send_media(Client *receiver, const Client *sender, uint8_t stream, const Serialised *serialised) {
+	CongestionState *congestion = &receiver->congestion;
+
+	size_t pending = scheduler_queued(&receiver->scheduler, SchedulerClassAudio) +
+	                 scheduler_queued(&receiver->scheduler, SchedulerClassVideo);
+
+	if (congestion_update(congestion, receiver->socket_fd, pending)) {
+		log_infof("participant %u congestion level now %s, %" PRIu64 " kB/s sent, %" PRIu64 " kB/s estimated",
+		          receiver->participant,
+		          congestion_level_to_string(congestion->level),
+		          congestion->send_rate / 1000,
+		          congestion->bandwidth / 1000);
+	}
 
-	if (home_dir == NULL) {
-		log_error(ERROR_OS, "failed to get home directory");
+	congestion_on_send(congestion, serialised->size);
+	metrics_observe(MetricMediaBacklog, pending);
 
-		return NULL;
+	if (!atomic_load(&receiver->media_ready) || MEDIA_HEADER_SIZE + serialised->size > MEDIA_MAX_DATAGRAM_SIZE) {
+		// Better to lose media than to hold up the whole room behind a slow receiver.
+		if (congestion_backlogged(congestion, receiver->socket_fd, pending, serialised->size)) {
+			metrics_count(MetricMediaDropped, 1);
+
+			return 0;
+		}
+
+		return scheduler_send(&receiver->scheduler, serialised);
 	}
 
-	char *config_path = join_path(home_dir, CONFIG_PATH, NULL);
-	char *dir = NULL;
+	int ret = media_send_stream(&receiver->server->media,
+	                            &receiver->media_addr,
+	                            &receiver->media_out[sender->participant][stream],
+	                            sender->media_ssrc_base | stream,
+	                            serialised);
 
-	for (size_t i = 1; i < strlen(config_path); i++) {
-		if (config_path[i] == PATH_SEPARATOR) {
-			if (dir != NULL) {
-				free(dir);
-			}
+	if (ret >= 0) {
+		metrics_packet_out(((PacketType *)serialised->data)[0], serialised->size);
+	}
+
+	return ret;
+}
 
-			dir = strndup(config_path, i);
+/*
+ * Feed one frame's level into the room's speaker detection and announce a
+ * change of active speaker. Call with the room lock held.
+ */
+static void update_speaker(ServerRoom *room, Client *client, float level_db) {
+	speaker_level_update(&client->speaker, level_db);
 
-			if (mkdir(dir, 0777) < 0 && errno != EEXIST) {
-				log_error(ERROR_CONFIG, "failed to create config directory");
+	if (room->active_speaker == client->participant) {
+		return;
+	}
 
-				freep(dir);
+	Client *active = room->active_speaker != SPEAKER_NONE ? room->members[room->active_speaker] : NULL;
 
-				return NULL;
-			}
+	if (!speaker_should_switch(&client->speaker, active != NULL ? &active->speaker : NULL)) {
+		return;
+	}
+
+	room->active_speaker = client->participant;
+
+	uint8_t buffer[PACKET_VALUE_SIZE(uint8_t)];
+	Serialised speaker = {.size = serialise_active_speaker_into(client->participant, buffer, sizeof buffer),
+	                      .data = buffer};
+
+	for (size_t i = 0; i < MAX_PARTICIPANTS; i++) {
+		if (room->members[i] != NULL && scheduler_send(&room->members[i]->scheduler, &speaker) < 0) {
+			log_error(ERROR_NETWORK, "failed to send active speaker");
 		}
 	}
+}
+
+/*
+ * The participant a receiver is watching (pinned, or else the active speaker)
+ * gets the sender's full resolution layer at full rate. Everyone else gets the
+ * smallest published layer at a reduced frame rate. A congested receiver gets
+ * less: the watched participant's smallest layer and everyone else at half
+ * the usual rate, then only the watched participant at the reduced rate, then
+ * nothing.
+ */
+static int should_forward_video(const ServerRoom *room, const Client *receiver, const Client *sender, uint8_t layer) {
+	uint8_t watching = receiver->focus != SPEAKER_NONE ? receiver->focus : room->active_speaker;
+	uint8_t smallest = 31 - __builtin_clz(sender->video_layers);
+	CongestionLevel level = receiver->congestion.level;
+
+	if (level >= CongestionLevelVideoOff) {
+		return FALSE;
+	}
 
-	freep(dir);
+	if (sender->participant == watching) {
+		if (level >= CongestionLevelVideoMinimal) {
+			return layer == smallest && sender->video_frames[layer] % VIDEO_THROTTLE_DIVISOR == 0;
+		}
 
-#ifdef __APPLE__
-	int config_fd = open(config_path, O_RDONLY | O_CREAT | O_SYMLINK, 0666);
-#else
-	int config_fd = open(config_path, O_RDONLY | O_CREAT, 0666);
-#endif
+		return layer == (level >= CongestionLevelVideoReduced ? smallest : __builtin_ctz(sender->video_layers));
+	}
 
-	if (config_fd < 0) {
-		log_error(ERROR_CONFIG, "failed to create/open configuration file");
+	if (level >= CongestionLevelVideoMinimal) {
+		return FALSE;
+	}
+
+	return layer == smallest &&
+	       sender->video_frames[layer] % (VIDEO_THROTTLE_DIVISOR * (level >= CongestionLevelVideoReduced ? 2 : 1)) == 0;
+}
 
+/*
+ * Rooms are logged under their names, made safe to use as one path component.
+ */
+static char *room_chat_log_dir(const Config *config, const Room *room) {
+	if (config->chat_log == NULL) {
 		return NULL;
 	}
 
-	freep(config_path);
+	char *name = strdup(room->name);
 
-	FILE *config_file = fdopen(config_fd, "r");
+	for (char *pos = name; *pos != '\0'; pos++) {
+		if (*pos == PATH_SEPARATOR || (pos == name && *pos == '.')) {
+			*pos = '_';
+		}
+	}
 
-	if (config_file == NULL) {
-		log_error(ERROR_CONFIG, "failed to open configuration file stream");
+	char *dir = join_path(config->chat_log, name, NULL);
 
-		return NULL;
+	freep(name);
+
+	return dir;
+}
+
+/*
+ * Refill a room's history from its log after a restart. Every message takes
+ * at least CHAT_RECORD_HEADER_SIZE bytes, which bounds how many could fit.
+ */
+static void reload_chat_history(ServerRoom *room) {
+	ChatHistory *history = &room->chat_history;
+	Serialised records = {0};
+
+	if (history->capacity == 0 ||
+	    chat_log_read(&room->chat_log, 0, 0, history->capacity / CHAT_RECORD_HEADER_SIZE, &records) <= 0) {
+		return;
+	}
+
+	Serialised record;
+
+	for (uint32_t offset = 0; next_packet(records.data, records.size, &offset, &record) == 0;) {
+		chat_history_append(history, &record);
 	}
 
-	Config *config = calloc(1, sizeof *config);
-	char *line = NULL;
-	size_t cap = 0;
-	ssize_t n = 0;
-	ConfigSection section = ConfigSectionGlobal;
+	log_infof("reloaded %" PRIu32 " chat messages", history->count);
+
+	freep(records.data);
+}
+
+/*
+ * The owner of a room's chat. Each wake takes what is in the inbox, up to a
+ * batch: the log stamps every message, and the whole batch is then queued for
+ * every member at once under one hold of the room lock. Only the log waits on
+ * the disk.
+ */
+static void *room_owner(void *arg) {
+	ServerRoom *room = arg;
+
+	while (TRUE) {
+		if (sem_wait(&room->inbox_ready) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			log_error(ERROR_THREAD, "failed to wait on room inbox");
+
+			break;
+		}
+
+		Serialised *records[ROOM_INBOX_BATCH];
+		struct iovec spans[ROOM_INBOX_BATCH];
+		Serialised *message = NULL;
+		int count = 0;
+
+		while (count < ROOM_INBOX_BATCH && (message = mpsc_queue_pop(&room->inbox)) != NULL) {
+			// Checked by the connection thread that received it.
+			const ChatMessage *msg = NULL;
 
-	while ((n = getline(&line, &cap, config_file)) > 0) {
-		char *stripped = strip_whitespace(line);
+			unserialise_chat_message(message, &msg);
+			records[count] = chat_log_append(&room->chat_log, msg, strlen(msg));
+			search_index_add(&room->search, records[count]);
+			spans[count] = (struct iovec){.iov_base = records[count]->data, .iov_len = records[count]->size};
+			count++;
+
+			free(message->data);
+			free(message);
+			sem_post(&room->inbox_space);
+		}
+
+		metrics_count(MetricInboxPopped, count);
+
+		if (count == 0) {
+			// Every message posts once, so the extra post from stop_room_owner is taken once the inbox is empty.
+			if (atomic_load(&room->stop)) {
+				break;
+			}
 
-		if (stripped[0] == CONFIG_COMMENT || strlen(stripped) == 0) {
 			continue;
 		}
 
-		if (stripped[0] == CONFIG_SECTION_START && stripped[strlen(stripped) - 1] == CONFIG_SECTION_END) {
-			if (strncasecmp(stripped + 1, "rooms", strlen(stripped) - 2) == 0) {
-				section = ConfigSectionRooms;
+		metrics_count(MetricChatLogged, count);
+		metrics_observe(MetricChatBatch, count);
+
+		uint64_t start = metrics_now_ns();
+
+		pthread_mutex_lock(&room->lock);
+
+		for (int i = 0; i < count && room->chat_history.capacity > 0; i++) {
+			if (chat_history_append(&room->chat_history, records[i]) < 0) {
+				log_error(ERROR_NETWORK, "chat message too large to keep in room history");
 			}
-		} else {
-			char *key = stripped;
-			char *value = NULL;
-
-			for (size_t i = 0; i < strlen(stripped); i++) {
-				if (stripped[i] == '=') {
-					stripped[i] = '\0';
-					value = &stripped[i + 1];
-
-					if (section == ConfigSectionRooms) {
-						config->rooms = realloc(config->rooms, sizeof *config->rooms * (config->num_rooms + 1));
-						config->rooms[config->num_rooms].name = strip_whitespace(key);
-						config->rooms[config->num_rooms].desc = strip_whitespace(value);
-						config->num_rooms++;
-					}
-
-					break;
-				}
+		}
+
+		for (size_t i = 0; i < MAX_PARTICIPANTS; i++) {
+			if (room->members[i] != NULL && scheduler_sendv(&room->members[i]->scheduler, spans, count) < 0) {
+				log_error(ERROR_NETWORK, "failed to send chat message");
 			}
 		}
 
-		freep(stripped);
+		pthread_mutex_unlock(&room->lock);
+		metrics_observe_room(room->index, MetricRoomChatFanout, metrics_now_ns() - start);
+
+		for (int i = 0; i < count; i++) {
+			free(records[i]->data);
+			free(records[i]);
+		}
 	}
 
-	freep(line);
+	return NULL;
+}
+
+static int start_room_owner(ServerRoom *room) {
+	if (mpsc_queue_init(&room->inbox, ROOM_INBOX_SIZE) < 0) {
+		log_error(ERROR_OS, "failed to allocate room inbox");
 
-	if (ferror(config_file) != 0) {
-		log_error(ERROR_CONFIG, "failed to read lines from configuration file");
+		return -1;
+	}
 
-		if (fclose(config_file) != 0) {
-			log_error(ERROR_CONFIG, "failed to close configuration file stream");
+	if (sem_init(&room->inbox_ready, 0, 0) < 0) {
+		log_error(ERROR_OS, "failed to create room inbox semaphore");
+		mpsc_queue_free(&room->inbox);
+
+		return -1;
+	}
+
+	if (sem_init(&room->inbox_space, 0, ROOM_INBOX_SIZE) < 0) {
+		log_error(ERROR_OS, "failed to create room inbox semaphore");
+		sem_destroy(&room->inbox_ready);
+		mpsc_queue_free(&room->inbox);
+
+		return -1;
+	}
+
+	atomic_init(&room->stop, FALSE);
+
+	if (pthread_create(&room->owner, NULL, room_owner, room) != 0) {
+		log_error(ERROR_THREAD, "failed to start room owner thread");
+		sem_destroy(&room->inbox_space);
+		sem_destroy(&room->inbox_ready);
+		mpsc_queue_free(&room->inbox);
+
+		return -1;
+	}
+
+	if (room->cpu != ROOM_CPU_NONE) {
+		cpu_set_t cpus;
+
+		CPU_ZERO(&cpus);
+		CPU_SET(room->cpu, &cpus);
+
+		if (pthread_setaffinity_np(room->owner, sizeof cpus, &cpus) != 0) {
+			log_error(ERROR_THREAD, "failed to pin room owner thread");
 		}
+	}
 
-		return NULL;
+	return 0;
+}
+
+/*
+ * The owner sends what is already in the inbox before it stops.
+ */
+static void stop_room_owner(ServerRoom *room) {
+	atomic_store(&room->stop, TRUE);
+	sem_post(&room->inbox_ready);
+
+	if (pthread_join(room->owner, NULL) != 0) {
+		log_error(ERROR_THREAD, "failed to join room owner thread");
 	}
 
-	if (fclose(config_file) != 0) {
-		log_error(ERROR_CONFIG, "failed to close configuration file stream");
+	Serialised *message = NULL;
+
+	while ((message = mpsc_queue_pop(&room->inbox)) != NULL) {
+		free(message->data);
+		free(message);
 	}
 
-	return config;
+	sem_destroy(&room->inbox_space);
+	sem_destroy(&room->inbox_ready);
+	mpsc_queue_free(&room->inbox);
 }
 
-static int send_config(const Client *client, const Config *config) {
-	Serialised *serialised = serialise_config(config);
+/*
+ * Deal the CPUs the server may run on out to the rooms in turn, if pin_rooms
+ * is set. With only one there is nothing to gain, and rooms are left unpinned.
+ */
+static void assign_room_cpus(Server *server) {
+	CPU_ZERO(&server->cpus);
 
-	int n = send_packet(client->socket_fd, serialised, (pthread_mutex_t *)&client->socket_lock);
+	if (sched_getaffinity(0, sizeof server->cpus, &server->cpus) < 0) {
+		log_error(ERROR_OS, "failed to get server CPUs");
+	}
 
-	if (n < 0) {
-		log_error(ERROR_NETWORK, "failed to send packet type");
+	int num_cpus = CPU_COUNT(&server->cpus);
+	int cpu = 0;
 
-		return -1;
+	for (size_t i = 0; i < server->config->num_rooms; i++) {
+		server->rooms[i].cpu = ROOM_CPU_NONE;
+
+		if (!server->config->pin_rooms || num_cpus < 2) {
+			continue;
+		}
+
+		while (!CPU_ISSET(cpu, &server->cpus)) {
+			cpu = (cpu + 1) % CPU_SETSIZE;
+		}
+
+		server->rooms[i].cpu = cpu;
+		log_infof("room %s runs on CPU %d", server->config->rooms[i].name, cpu);
+		cpu = (cpu + 1) % CPU_SETSIZE;
+	}
+}
+
+/*
+ * Move the reader and writer threads of a client, along with the state they
+ * keep warm, onto cpu, or let them run anywhere the server may with
+ * ROOM_CPU_NONE. Call from the client's own thread.
+ */
+static void migrate_client(Client *client, int cpu) {
+	cpu_set_t cpus = client->server->cpus;
+
+	if (!client->server->config->pin_rooms) {
+		return;
 	}
 
-	return 0;
+	if (cpu != ROOM_CPU_NONE) {
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+	}
+
+	if (pthread_setaffinity_np(pthread_self(), sizeof cpus, &cpus) != 0 ||
+	    pthread_setaffinity_np(client->scheduler.thread, sizeof cpus, &cpus) != 0) {
+		log_error(ERROR_THREAD, "failed to move client threads");
+	}
+}
+
+/*
+ * Room gauges, read from the rooms themselves when stats are asked for. A
+ * server without rooms has none to write.
+ */
+static void write_server_stats(FILE *out, void *arg) {
+	Server *server = arg;
+
+	// Nor can it size the arrays below, as a variable length array may not be empty.
+	if (server->config->num_rooms == 0) {
+		return;
+	}
+
+	uint64_t members[server->config->num_rooms];
+	uint64_t history[server->config->num_rooms];
+	uint64_t index_bytes[server->config->num_rooms];
+
+	for (size_t i = 0; i < server->config->num_rooms; i++) {
+		ServerRoom *room = &server->rooms[i];
+
+		members[i] = 0;
+		pthread_mutex_lock(&room->lock);
+
+		for (size_t j = 0; j < MAX_PARTICIPANTS; j++) {
+			members[i] += room->members[j] != NULL;
+		}
+
+		history[i] = room->chat_history.count;
+		pthread_mutex_unlock(&room->lock);
+
+		pthread_mutex_lock(&room->search.lock);
+		index_bytes[i] = room->search.memory;
+		pthread_mutex_unlock(&room->search.lock);
+	}
+
+	static const struct {
+		const char *name;
+		const char *help;
+	} gauges[] = {
+	    {"room_members", "Clients in the room."},
+	    {"room_history_messages", "Chat messages kept in the room's history for joining clients."},
+	    {"room_search_index_bytes", "Memory taken by the room's chat search index."},
+	};
+	const uint64_t *values[] = {members, history, index_bytes};
+
+	for (size_t i = 0; i < sizeof gauges / sizeof *gauges; i++) {
+		metrics_write_header(out, gauges[i].name, "gauge", gauges[i].help);
+
+		for (size_t j = 0; j < server->config->num_rooms; j++) {
+			fprintf(out, METRICS_PREFIX "%s{room=\"", gauges[i].name);
+			metrics_write_label_value(out, server->config->rooms[j].name);
+			fprintf(out, "\"} %" PRIu64 "\n", values[i][j]);
+		}
+	}
 }
 
 static void *client_handler(void *arg) {
-	Client client = {.socket_fd = *(int *)arg, .socket_lock = PTHREAD_MUTEX_INITIALIZER};
+	Client *client = (Client *)arg;
 
 	log_info("connected to client");
 
-	if (pthread_create(&client.heartbeat_thread, NULL, heartbeat_handler, &client) != 0) {
+	if (pthread_create(&client->heartbeat_thread, NULL, heartbeat_handler, client) != 0) {
 		log_fatal(ERROR_THREAD, "failed to create client heartbeat thread");
 	}
 
-	Config *config = read_config();
+	Config *config = client->server->config;
 
-	if (config == NULL) {
-		log_error(ERROR_CONFIG, "failed to read configuration file");
+	if (send_config(client, config) < 0) {
+		log_error(ERROR_CONFIG, "failed to send configuration to client");
 	}
 
-	if (send_config(&client, config) < 0) {
-		log_error(ERROR_CONFIG, "failed to send configuration to client");
+	if (register_media(client) < 0) {
+		log_error(ERROR_NETWORK, "failed to set up client media channel");
 	}
 
 	while (TRUE) {
 		PacketType packet_type;
-		int n = recv(client.socket_fd, &packet_type, sizeof packet_type, MSG_PEEK);
+		int n = recv(client->socket_fd, &packet_type, sizeof packet_type, MSG_PEEK);
 
 		if (n < 0) {
 			log_error(ERROR_NETWORK, "failed to receive packet type");
 
 			break;
 		} else if (n == 0) {
-			// Instruct the heartbeat handler to finish up.
-			if (pthread_kill(client.heartbeat_thread, SIGUSR1) != 0) {
-				log_error(ERROR_THREAD, "failed to signal client heartbeat thread to finish");
-			}
-
-			if (close(client.socket_fd) < 0) {
-				log_error(ERROR_NETWORK, "failed to disconnect from client");
-			}
+			log_info("client disconnected");
 
 			break;
 		}
 
 		if (packet_type == PacketTypeHeartbeat) {
 			Serialised serialised = {0};
-			int ret = recv_packet(client.socket_fd, &serialised, &client.socket_lock);
+			int ret = recv_client_packet(client, &serialised);
 
 			if (ret < 0) {
 				log_error(ERROR_NETWORK, "failed to receive heartbeat");
@@ -252,67 +1372,197 @@ static void *client_handler(void *arg) {
 				break;
 			}
 
-			client.heartbeat = unserialise_heartbeat(&serialised);
+			HeartbeatProbe probe;
+
+			if (unserialise_heartbeat(&serialised, &probe) < 0) {
+				log_error(ERROR_NETWORK, "received malformed heartbeat");
+			} else {
+				pong_handler(client, &probe);
+			}
+
+			freep(serialised.data);
 		} else if (packet_type == PacketTypeJoinRoom) {
-			printf("received room join request\n");
+			if (join_room_handler(client) < 0) {
+				break;
+			}
+		} else if (packet_type == PacketTypeLeaveRoom) {
+			printf("received room leave request\n");
 
 			Serialised serialised = {0};
-			int ret = recv_packet(client.socket_fd, &serialised, &client.socket_lock);
 
-			if (ret < 0) {
-				log_error(ERROR_NETWORK, "failed to receive room joining packet");
+			if (recv_client_packet(client, &serialised) <= 0) {
+				log_error(ERROR_NETWORK, "failed to receive room leave request");
 
-				break;
-			} else if (ret == 0) {
 				break;
 			}
 
-			RoomIndex index = unserialise_join_room(&serialised);
-
-		} else if (packet_type == PacketTypeLeaveRoom) {
-			printf("received room leave request\n");
+			freep(serialised.data);
+			leave_room(client);
 
-			if (send_config(&client, config) < 0) {
+			if (send_config(client, config) < 0) {
 				log_error(ERROR_CONFIG, "failed to send configuration to client");
 			}
 		} else if (packet_type == PacketTypeChatMessage) {
-			printf("received chat message\n");
-
-			Serialised serialised = {0};
-			int ret = recv_packet(client.socket_fd, &serialised, &client.socket_lock);
-
-			if (ret < 0) {
-				log_error(ERROR_NETWORK, "failed to receive chat message");
-
+			if (chat_message_handler(client) < 0) {
 				break;
-			} else if (ret == 0) {
+			}
+		} else if (packet_type == PacketTypeChatHistory) {
+			if (chat_history_handler(client) < 0) {
+				break;
+			}
+		} else if (packet_type == PacketTypeChatSearch) {
+			if (chat_search_handler(client) < 0) {
+				break;
+			}
+		} else if (packet_type == PacketTypeAudioCodec) {
+			if (audio_codec_handler(client) < 0) {
+				break;
+			}
+		} else if (packet_type == PacketTypeAudioFrame || packet_type == PacketTypeComfortNoise ||
+		           packet_type == PacketTypeVideoFrame) {
+			if (media_packet_handler(client) < 0) {
+				break;
+			}
+		} else if (packet_type == PacketTypeFragment) {
+			if (fragment_handler(client) < 0) {
+				break;
+			}
+		} else if (packet_type == PacketTypeActiveSpeaker) {
+			if (active_speaker_handler(client) < 0) {
 				break;
 			}
+		}
+	}
+
+	leave_room(client);
+	unregister_media(client);
 
-			ChatMessage *msg = unserialise_chat_message(&serialised);
+	/*
+	 * The socket's number may be given to the next client as soon as it is
+	 * closed, so everything else that writes to it is stopped first. Shutting
+	 * it down makes any write still under way fail rather than block.
+	 */
+	if (shutdown(client->socket_fd, SHUT_RDWR) < 0 && errno != ENOTCONN) {
+		log_error(ERROR_NETWORK, "failed to shut down client connection");
+	}
 
-			fprintf(stderr, "msg: %s\n", msg);
+	// Instruct the heartbeat handler to finish up.
+	atomic_store(&client->disconnecting, TRUE);
 
-			freep(msg);
-		}
+	if (pthread_kill(client->heartbeat_thread, SIGUSR1) != 0) {
+		log_error(ERROR_THREAD, "failed to signal client heartbeat thread to finish");
 	}
 
-	if (pthread_join(client.heartbeat_thread, NULL) != 0) {
+	if (pthread_join(client->heartbeat_thread, NULL) != 0) {
 		log_fatal(ERROR_THREAD, "failed to join client heartbeat thread");
 	}
 
-	if (close(client.socket_fd) < 0) {
-		if (errno == EBADF) {
-			log_info("client disconnected");
-		} else {
-			log_errorf(ERROR_NETWORK, "failed to disconnect from client: %d", errno);
+	// Only once the heartbeat has stopped sending through it.
+	scheduler_stop(&client->scheduler);
+
+	if (close(client->socket_fd) < 0) {
+		log_errorf(ERROR_NETWORK, "failed to disconnect from client: %d", errno);
+	}
+
+	for (size_t i = 0; i < SCHEDULER_NUM_CLASSES; i++) {
+		const SchedulerQueue *queue = &client->scheduler.queues[i];
+
+		// Classes the client never used have nothing to report.
+		if (queue->packets == 0 && queue->dropped == 0) {
+			continue;
+		}
+
+		log_infof("%s packets sent: %" PRIu64 ", dropped: %" PRIu64 ", longest wait: %" PRIu32 "us",
+		          scheduler_class_to_string(i),
+		          queue->packets,
+		          queue->dropped,
+		          queue->max_wait_us);
+	}
+
+	if (client->rtt.samples > 0) {
+		log_infof("round trip %" PRIu64 "us, jitter %" PRIu64 "us, 99th percentile %" PRIu64 "us over %" PRIu64 " pings",
+		          client->rtt.srtt,
+		          client->rtt.rttvar,
+		          histogram_percentile(&client->rtt.rtt, 99),
+		          client->rtt.samples);
+	}
+
+	reassembly_free(&client->reassembly);
+	metrics_count(MetricConnectionsClosed, 1);
+
+	for (size_t i = 0; i < MAX_PARTICIPANTS; i++) {
+		for (size_t j = 0; j < MEDIA_NUM_STREAMS; j++) {
+			media_send_stream_free(&client->media_out[i][j]);
 		}
 	}
 
+	free(client);
+
 	return NULL;
 }
 
 int main() {
+	Server server = {.config = read_config()};
+
+	if (server.config == NULL) {
+		log_fatal(ERROR_CONFIG, "failed to read configuration file");
+	}
+
+	if (metrics_init(server.config) < 0) {
+		log_fatal(ERROR_THREAD, "failed to set up metrics");
+	}
+
+	server.rooms = calloc(server.config->num_rooms, sizeof *server.rooms);
+	assign_room_cpus(&server);
+
+	for (size_t i = 0; i < server.config->num_rooms; i++) {
+		server.rooms[i].index = i;
+		pthread_mutex_init(&server.rooms[i].lock, NULL);
+		server.rooms[i].active_speaker = SPEAKER_NONE;
+		chat_history_init(&server.rooms[i].chat_history, server.config->chat_history);
+
+		char *dir = room_chat_log_dir(server.config, &server.config->rooms[i]);
+
+		if (chat_log_open(&server.rooms[i].chat_log, dir) < 0) {
+			log_fatal(ERROR_OS, "failed to open chat log");
+		}
+
+		freep(dir);
+		reload_chat_history(&server.rooms[i]);
+		search_index_init(&server.rooms[i].search);
+
+		if (search_index_build(&server.rooms[i].search, &server.rooms[i].chat_log) < 0) {
+			log_fatal(ERROR_OS, "failed to index chat log");
+		}
+
+		log_infof("chat search index for %s is %zu bytes",
+		          server.config->rooms[i].name,
+		          server.rooms[i].search.memory);
+
+		if (start_room_owner(&server.rooms[i]) < 0) {
+			log_fatal(ERROR_THREAD, "failed to start room owner");
+		}
+	}
+
+	if (metrics_serve(write_server_stats, &server) < 0) {
+		log_error(ERROR_NETWORK, "failed to start serving stats");
+	}
+
+	srandom(time(NULL));
+	pthread_mutex_init(&server.media_lock, NULL);
+
+	if (media_socket_open(&server.media, MEDIA_PORT) < 0) {
+		log_fatal(ERROR_NETWORK, "failed to open media socket");
+	}
+
+	if (pthread_create(&server.media_thread, NULL, media_handler, &server) != 0) {
+		log_fatal(ERROR_THREAD, "failed to start media thread");
+	}
+
+	if (pthread_detach(server.media_thread) != 0) {
+		log_fatal(ERROR_THREAD, "failed to detach media thread");
+	}
+
 	int server_fd = socket(AF_INET, SOCK_STREAM, 0);
 
 	if (server_fd < 0) {
@@ -345,13 +1595,28 @@ int main() {
 			log_fatal(ERROR_NETWORK, "failed to accept client connection");
 		}
 
-		pthread_t thread;
+		Client *client = calloc(1, sizeof *client);
+		client->socket_fd = client_fd;
+		client->audio_codec = AudioCodecPCM;
+		client->server = &server;
+		client->room_index = ROOM_INDEX_NONE;
+		client->focus = SPEAKER_NONE;
+		atomic_init(&client->heard, metrics_now_ns());
+		atomic_init(&client->ping_timeout_ms, heartbeat_timeout_ms(&client->rtt));
+		atomic_init(&client->disconnecting, FALSE);
+		pthread_mutex_init(&client->socket_lock, NULL);
+
+		metrics_count(MetricConnectionsOpened, 1);
+
+		if (scheduler_start(&client->scheduler, client_fd, metrics_packets_out) < 0) {
+			log_fatal(ERROR_THREAD, "failed to start client writer");
+		}
 
-		if (pthread_create(&thread, NULL, client_handler, &client_fd) != 0) {
+		if (pthread_create(&client->thread, NULL, client_handler, client) != 0) {
 			log_fatal(ERROR_THREAD, "failed to start client handling thread");
 		}
 
-		if (pthread_detach(thread) != 0) {
+		if (pthread_detach(client->thread) != 0) {
 			log_fatal(ERROR_THREAD, "failed to detach client handling thread");
 		}
 	}
@@ -360,5 +1625,12 @@ int main() {
 		log_error(ERROR_NETWORK, "failed to shutdown server socket");
 	}
 
+	for (size_t i = 0; i < server.config->num_rooms; i++) {
+		stop_room_owner(&server.rooms[i]);
+		chat_log_close(&server.rooms[i].chat_log);
+		search_index_free(&server.rooms[i].search);
+		chat_history_free(&server.rooms[i].chat_history);
+	}
+
 	return EXIT_SUCCESS;
 }
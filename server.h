@@ -1,17 +1,119 @@
 #pragma once
 
+#include "chat.h"
+#include "chatlog.h"
+#include "congestion.h"
+#include "heartbeat.h"
+#include "media.h"
+#include "mpsc.h"
 #include "packets.h"
+#include "scheduler.h"
+#include "search.h"
+#include "speaker.h"
+#include "utils.h"
 
+#include <netinet/in.h>
 #include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdatomic.h>
 
-#define CONFIG_COMMENT '#'
-#define CONFIG_SECTION_START '['
-#define CONFIG_SECTION_END ']'
+/*
+ * Participants other than the one a receiver is watching get every Nth frame.
+ */
+#define VIDEO_THROTTLE_DIVISOR 3
 
+#define ROOM_INDEX_NONE -1
+#define ROOM_CPU_NONE -1
+
+/*
+ * Chat messages a room's owner thread can have waiting. Its connection
+ * threads stop reading, blocked on inbox_space, while the inbox is full. The
+ * owner takes up to ROOM_INBOX_BATCH at a time and queues the whole batch for
+ * each member at once.
+ */
+#define ROOM_INBOX_SIZE 1024
+#define ROOM_INBOX_BATCH 64
+
+typedef struct Server Server;
+
+/*
+ * heard is when anything last arrived from the client and ping_sent when the
+ * last ping went out, both in metrics_now_ns time. rtt is only touched by the
+ * client's own thread, which publishes how long the next ping may wait for
+ * an answer in ping_timeout_ms.
+ */
 typedef struct {
 	int socket_fd;
-	Heartbeat heartbeat;
+	atomic_uint_least64_t heard;
+	atomic_uint_least64_t ping_sent;
+	atomic_uint ping_timeout_ms;
+	HeartbeatRtt rtt;
+	AudioCodec audio_codec;
+	AudioCodecMask audio_codecs;
+	AdpcmState transcode_state;
+	Server *server;
+	RoomIndex room_index;
+	uint8_t participant;
+	uint8_t focus;
+	SpeakerLevel speaker;
+	uint8_t video_layers;
+	uint32_t video_frames[VIDEO_MAX_LAYERS];
+	uint32_t media_ssrc_base;
+	struct sockaddr_in media_addr;
+	atomic_int media_ready;
+	MediaSendStream media_out[MAX_PARTICIPANTS][MEDIA_NUM_STREAMS];
+	CongestionState congestion;
+	Scheduler scheduler;
+	Reassembly reassembly;
 	pthread_t thread;
 	pthread_t heartbeat_thread;
+	atomic_int disconnecting;
 	pthread_mutex_t socket_lock;
 } Client;
+
+/*
+ * Live state of a configured room. members is indexed by participant number,
+ * which is what media packets carry as their source.
+ *
+ * Connection threads do not broadcast chat themselves: they take a slot from
+ * inbox_space, push received messages to inbox and post inbox_ready, and the
+ * room's owner thread stamps, indexes and fans them out, so only the owner
+ * takes the room lock for chat. The owner gives each slot back as it takes
+ * the message out.
+ *
+ * With pin_rooms set, each room is given one of the server's CPUs. The owner
+ * runs there, and so do the reader and writer threads of every member while
+ * they are in the room, so a room's chat fan-out stays on one core. Heartbeats
+ * and media are not moved, so it is off by default; bench/rooms.c measures it.
+ */
+typedef struct {
+	RoomIndex index;
+	pthread_mutex_t lock;
+	Client *members[MAX_PARTICIPANTS];
+	uint8_t active_speaker;
+	ChatHistory chat_history;
+	ChatLog chat_log;
+	SearchIndex search;
+	MpscQueue inbox;
+	sem_t inbox_ready;
+	sem_t inbox_space;
+	atomic_int stop;
+	pthread_t owner;
+	int cpu;
+} ServerRoom;
+
+/*
+ * media_clients is indexed by the slot bits of a client's SSRC base, so the
+ * media thread can find who sent a datagram. cpus is what the server was
+ * started allowed to run on, which clients outside a room go back to.
+ */
+struct Server {
+	Config *config;
+	ServerRoom *rooms;
+	cpu_set_t cpus;
+	MediaSocket media;
+	pthread_t media_thread;
+	pthread_mutex_t media_lock;
+	Client *media_clients[MEDIA_MAX_CLIENTS];
+};
@@ -0,0 +1,46 @@
+#include "speaker.h"
+
+#include "utils.h"
+
+#include <stddef.h>
+
+/*
+ * Smooth a participant's level with a fast attack and a slow release, so the
+ * gaps between words do not make the level collapse.
+ */
+void speaker_level_update(SpeakerLevel *level, float frame_db) {
+	float alpha = frame_db > level->level_db ? 0.5f : 0.1f;
+
+	level->level_db += (frame_db - level->level_db) * alpha;
+}
+
+/*
+ * Decide whether candidate should take over from active (NULL if there is no
+ * active speaker). A silent active speaker is replaced after a third of the
+ * usual hold time and without the loudness margin.
+ */
+int speaker_should_switch(SpeakerLevel *candidate, const SpeakerLevel *active) {
+	if (candidate->level_db < SPEAKER_SILENCE_DB) {
+		candidate->louder_frames = 0;
+
+		return FALSE;
+	}
+
+	int active_silent = active == NULL || active->level_db < SPEAKER_SILENCE_DB;
+	float threshold = active_silent ? SPEAKER_SILENCE_DB : active->level_db + SPEAKER_SWITCH_MARGIN_DB;
+	unsigned int hold = active_silent ? SPEAKER_SWITCH_FRAMES / 3 : SPEAKER_SWITCH_FRAMES;
+
+	if (candidate->level_db <= threshold) {
+		candidate->louder_frames = 0;
+
+		return FALSE;
+	}
+
+	if (++candidate->louder_frames < hold) {
+		return FALSE;
+	}
+
+	candidate->louder_frames = 0;
+
+	return TRUE;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SPEAKER_NONE 0xFF
+
+/*
+ * Levels below this are treated as silence when choosing a speaker.
+ */
+#define SPEAKER_SILENCE_DB 45.0f
+
+/*
+ * A challenger must be this much louder than the active speaker for
+ * SPEAKER_SWITCH_FRAMES consecutive frames before the speaker changes.
+ */
+#define SPEAKER_SWITCH_MARGIN_DB 6.0f
+#define SPEAKER_SWITCH_FRAMES 15
+
+typedef struct {
+	float level_db;
+	unsigned int louder_frames;
+} SpeakerLevel;
+
+void speaker_level_update(SpeakerLevel *level, float frame_db);
+int speaker_should_switch(SpeakerLevel *candidate, const SpeakerLevel *active);
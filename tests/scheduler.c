@@ -0,0 +1,308 @@
+#include "packets.h"
+#include "scheduler.h"
+#include "utils.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Media packets sent through a scheduler come out the other end of the socket
+ * whole and in order, whatever their size: in one piece, or as fragments that
+ * reassemble into them. Sizes around multiples of a fragment, with and without
+ * room for a fragment header, are where the two have gone out of step.
+ *
+ * A batch of chat records queued together, as a room's history is, is larger
+ * than a fragment and has to come back as the same records back to back.
+ *
+ * With as much video queued as the scheduler takes and a peer that reads
+ * slowly, a chat message has to get onto the socket within a few
+ * milliseconds rather than wait for the video ahead of it.
+ */
+
+static const uint32_t sizes[] = {
+	PACKET_HEADER_SIZE + 1,
+	SCHEDULER_FRAGMENT_SIZE - 1,
+	SCHEDULER_FRAGMENT_SIZE,
+	SCHEDULER_FRAGMENT_SIZE + 1,
+	SCHEDULER_FRAGMENT_SIZE + SCHEDULER_FIRST_FRAGMENT_HEADER_SIZE,
+	SCHEDULER_FRAGMENT_SIZE + SCHEDULER_FRAGMENT_HEADER_SIZE,
+	2047,
+	2048,
+	2049,
+	2054,
+	2055,
+	2056,
+	3078,
+	3079,
+	3080,
+	4102,
+	4103,
+	4104,
+	65536,
+	200000,
+};
+
+#define NUM_SIZES (sizeof sizes / sizeof *sizes)
+#define BATCH_RECORDS 5
+#define BATCH_TEXT_SIZE 700
+
+#define SLOW_SEND_BUFFER 4096
+#define SLOW_READ_BYTES 4096
+#define SLOW_READ_US 1000
+#define VIDEO_PACKETS 8
+#define VIDEO_PACKET_SIZE 8000
+#define CHAT_MAX_WAIT_US 5000
+
+/*
+ * The far end of a slow link: four kilobytes a millisecond, until the socket
+ * is closed.
+ */
+typedef struct {
+	int socket_fd;
+	atomic_int stop;
+} SlowReader;
+
+/*
+ * A video packet of size bytes, filled with a pattern that differs from one
+ * packet to the next.
+ */
+static void make_packet(Serialised *packet, uint32_t size, size_t seed) {
+	PacketType type = PacketTypeVideoFrame;
+
+	packet->size = size;
+	packet->data = malloc(size);
+
+	memcpy(packet->data, &type, sizeof type);
+	memcpy((uint8_t *)packet->data + sizeof type, &size, sizeof size);
+
+	for (uint32_t i = PACKET_HEADER_SIZE; i < size; i++) {
+		((uint8_t *)packet->data)[i] = (uint8_t)(i * 31 + seed);
+	}
+}
+
+/*
+ * Read the next whole packet as the client does: straight off the socket, or
+ * rebuilt from fragments.
+ */
+static int recv_whole(int socket_fd, Reassembly *reassembly, Serialised *packet) {
+	while (TRUE) {
+		PacketType type;
+
+		if (recv(socket_fd, &type, sizeof type, MSG_PEEK) != sizeof type) {
+			return -1;
+		}
+
+		if (type != PacketTypeFragment) {
+			return recv_packet(socket_fd, packet, NULL) > 0 ? 0 : -1;
+		}
+
+		int ret = scheduler_recv_fragment(reassembly, socket_fd, NULL, packet);
+
+		if (ret < 0) {
+			return -1;
+		} else if (ret > 0) {
+			return 0;
+		}
+	}
+}
+
+/*
+ * Returns -1 if the batch did not come back as it was sent.
+ */
+static int check_batch(Scheduler *scheduler, int socket_fd, Reassembly *reassembly) {
+	Serialised *records[BATCH_RECORDS];
+	struct iovec spans[BATCH_RECORDS];
+	uint8_t text[BATCH_TEXT_SIZE];
+	uint8_t expected[BATCH_RECORDS * (BATCH_TEXT_SIZE + 64)];
+	uint32_t expected_size = 0;
+	Serialised received = {0};
+	int ret = 0;
+
+	for (size_t i = 0; i < BATCH_RECORDS; i++) {
+		memset(text, 'a' + i, sizeof text);
+
+		ChatRecord record = {.id = i + 1, .timestamp = i, .size = sizeof text, .data = text};
+
+		records[i] = serialise_chat_record(&record);
+		spans[i] = (struct iovec){.iov_base = records[i]->data, .iov_len = records[i]->size};
+		memcpy(expected + expected_size, records[i]->data, records[i]->size);
+		expected_size += records[i]->size;
+	}
+
+	scheduler_sendv(scheduler, spans, BATCH_RECORDS);
+
+	if (recv_whole(socket_fd, reassembly, &received) < 0) {
+		fprintf(stderr, "stream broke before batch of %u bytes\n", expected_size);
+		ret = -1;
+	} else if (received.size != expected_size || memcmp(received.data, expected, expected_size) != 0) {
+		fprintf(stderr, "batch of %u bytes came back as %u bytes\n", expected_size, received.size);
+		ret = -1;
+	}
+
+	free(received.data);
+
+	for (size_t i = 0; i < BATCH_RECORDS; i++) {
+		free(records[i]->data);
+		free(records[i]);
+	}
+
+	return ret;
+}
+
+static void *read_slowly(void *arg) {
+	SlowReader *reader = arg;
+	uint8_t buffer[SLOW_READ_BYTES];
+
+	while (!atomic_load(&reader->stop) && recv(reader->socket_fd, buffer, sizeof buffer, 0) > 0) {
+		nanosleep(&(struct timespec){.tv_nsec = SLOW_READ_US * 1000}, NULL);
+	}
+
+	return NULL;
+}
+
+/*
+ * Returns -1 if the chat message waited longer than CHAT_MAX_WAIT_US, or the
+ * video had all gone before it so nothing was shown.
+ */
+static int check_chat_latency(void) {
+	int fds[2];
+	int send_buffer = SLOW_SEND_BUFFER;
+	struct timeval timeout = {.tv_sec = 5};
+	Scheduler scheduler;
+	SlowReader reader = {0};
+	pthread_t thread;
+	Serialised video = {0};
+	uint8_t text[] = "still there?";
+	ChatRecord record = {.id = 1, .size = sizeof text - 1, .data = text};
+	int ret = 0;
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0 ||
+	    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &send_buffer, sizeof send_buffer) < 0 ||
+	    setsockopt(fds[1], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout) < 0 ||
+	    scheduler_start(&scheduler, fds[0], NULL) < 0) {
+		perror("failed to set up slow scheduler");
+
+		return -1;
+	}
+
+	reader.socket_fd = fds[1];
+
+	if (pthread_create(&thread, NULL, read_slowly, &reader) != 0) {
+		perror("failed to start slow reader");
+
+		return -1;
+	}
+
+	for (size_t i = 0; i < VIDEO_PACKETS; i++) {
+		make_packet(&video, VIDEO_PACKET_SIZE, i);
+		scheduler_send(&scheduler, &video);
+		free(video.data);
+	}
+
+	// Let the video fill the socket, so the writer is blocked on it when chat arrives.
+	nanosleep(&(struct timespec){.tv_nsec = 10 * SLOW_READ_US * 1000}, NULL);
+
+	Serialised *chat = serialise_chat_record(&record);
+
+	scheduler_send(&scheduler, chat);
+
+	for (size_t i = 0; i < 5000 && scheduler_queued(&scheduler, SchedulerClassChat) > 0; i++) {
+		nanosleep(&(struct timespec){.tv_nsec = 1000000}, NULL);
+	}
+
+	size_t video_left = scheduler_queued(&scheduler, SchedulerClassVideo);
+
+	pthread_mutex_lock(&scheduler.lock);
+
+	uint64_t chat_sent = scheduler.queues[SchedulerClassChat].packets;
+	uint32_t max_wait_us = scheduler.queues[SchedulerClassChat].max_wait_us;
+
+	pthread_mutex_unlock(&scheduler.lock);
+
+	if (chat_sent != 1 || video_left == 0) {
+		fprintf(stderr, "chat sent %" PRIu64 " times with %zu bytes of video left\n", chat_sent, video_left);
+		ret = -1;
+	} else if (max_wait_us > CHAT_MAX_WAIT_US) {
+		fprintf(stderr, "chat waited %" PRIu32 "us behind video, over %dus\n", max_wait_us, CHAT_MAX_WAIT_US);
+		ret = -1;
+	}
+
+	atomic_store(&reader.stop, TRUE);
+	scheduler_stop(&scheduler);
+	close(fds[0]);
+	pthread_join(thread, NULL);
+	close(fds[1]);
+
+	free(chat->data);
+	free(chat);
+
+	return ret;
+}
+
+int main() {
+	int fds[2];
+	Scheduler scheduler;
+	Reassembly reassembly = {0};
+	Serialised sent[NUM_SIZES] = {0};
+	int failed = FALSE;
+
+	// A stream that has gone out of step fails the test rather than hanging it.
+	struct timeval timeout = {.tv_sec = 5};
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0 ||
+	    setsockopt(fds[1], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof timeout) < 0 ||
+	    scheduler_start(&scheduler, fds[0], NULL) < 0) {
+		perror("failed to set up scheduler");
+
+		return EXIT_FAILURE;
+	}
+
+	// One at a time, as media queued behind more than the scheduler holds is dropped.
+	for (size_t i = 0; i < NUM_SIZES; i++) {
+		Serialised received = {0};
+
+		make_packet(&sent[i], sizes[i], i);
+		scheduler_send(&scheduler, &sent[i]);
+
+		if (recv_whole(fds[1], &reassembly, &received) < 0) {
+			fprintf(stderr, "stream broke before packet of %u bytes\n", sizes[i]);
+			failed = TRUE;
+
+			break;
+		}
+
+		if (received.size != sent[i].size || memcmp(received.data, sent[i].data, sent[i].size) != 0) {
+			fprintf(stderr, "packet of %u bytes came back as %u bytes\n", sizes[i], received.size);
+			failed = TRUE;
+		}
+
+		free(received.data);
+	}
+
+	if (!failed && check_batch(&scheduler, fds[1], &reassembly) < 0) {
+		failed = TRUE;
+	}
+
+	if (check_chat_latency() < 0) {
+		failed = TRUE;
+	}
+
+	scheduler_stop(&scheduler);
+	reassembly_free(&reassembly);
+	close(fds[0]);
+	close(fds[1]);
+
+	for (size_t i = 0; i < NUM_SIZES; i++) {
+		free(sent[i].data);
+	}
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
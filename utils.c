@@ -3,12 +3,14 @@
 #include "packets.h"
 
 #include <ctype.h>
+#include <errno.h>
 #include <pwd.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #define ERR_STRING(id, string) string,
@@ -82,6 +84,32 @@ char *join_path(const char *path, ...) {
 	return joined;
 }
 
+/*
+ * Create a directory and any of its parents that are missing.
+ */
+int make_dirs(const char *path) {
+	char *dir = strdup(path);
+	int ret = 0;
+
+	for (size_t i = 1; ret == 0 && dir[i - 1] != '\0'; i++) {
+		if (dir[i] == PATH_SEPARATOR || dir[i] == '\0') {
+			char separator = dir[i];
+
+			dir[i] = '\0';
+
+			if (mkdir(dir, 0777) < 0 && errno != EEXIST) {
+				ret = -1;
+			}
+
+			dir[i] = separator;
+		}
+	}
+
+	freep(dir);
+
+	return ret;
+}
+
 char *strip_whitespace(const char *string) {
 	int start_pos = 0;
 	int end_pos = strlen(string);
@@ -1,5 +1,7 @@
 #pragma once
 
+#include "logger.h"
+
 #include <stddef.h>
 
 #define FALSE 0
@@ -10,11 +12,6 @@
 #define ENV_HOME "HOME"
 #define CONFIG_PATH ".config/" APP_NAME "/" APP_NAME ".config"
 
-#define LOG_LEVEL_INFO "INFO"
-#define LOG_LEVEL_WARNING "WARNING"
-#define LOG_LEVEL_ERROR "ERROR"
-#define LOG_LEVEL_FATAL "FATAL"
-
 #define ERR_TABLE(ERR)                       \
 	ERR(ERROR_NETWORK, "Network error")      \
 	ERR(ERROR_TERMINAL, "Terminal error")    \
@@ -33,47 +30,25 @@ enum ErrId
 
 const char *error_to_string(const enum ErrId id);
 
-#define log_error_x(type, id, err) \
-	fprintf(stderr, "%s: %s:%s:%d: %s: %s\n", type, __FILE__, __func__, __LINE__, error_to_string(id), err)
-
-#define log_error_xf(type, id, fmt, ...)       \
-	char *__log_string = NULL;                 \
-	asprintf(&__log_string, fmt, __VA_ARGS__); \
-	log_error_x(type, id, __log_string);       \
-	free(__log_string);                        \
-	__log_string = NULL
-
-#define log_x(type, msg) fprintf(stderr, "%s: %s:%s:%d: %s\n", type, __FILE__, __func__, __LINE__, msg)
+#define log_error_x(level, id, err) log_at(level, id, "%s", err)
+#define log_error_xf(level, id, fmt, ...) log_at(level, id, fmt, __VA_ARGS__)
+#define log_x(level, msg) log_at(level, LOG_NO_ERROR, "%s", msg)
+#define log_xf(level, fmt, ...) log_at(level, LOG_NO_ERROR, fmt, __VA_ARGS__)
 
-#define log_xf(type, fmt, ...)                 \
-	char *__log_string = NULL;                 \
-	asprintf(&__log_string, fmt, __VA_ARGS__); \
-	log_x(type, fmt, __log_string);            \
-	free(__log_string);                        \
-	__log_string = NULL
-
-#define log_fatal(id, err)                 \
-	log_error_x(LOG_LEVEL_FATAL, id, err); \
+#define log_fatal(id, err)               \
+	log_error_x(LogLevelFatal, id, err); \
 	exit(id)
 
-#define log_fatalf(id, fmt, ...)                         \
-	log_error_xf(LOG_LEVEL_FATAL, id, fmt, __VA_ARGS__); \
+#define log_fatalf(id, fmt, ...)                       \
+	log_error_xf(LogLevelFatal, id, fmt, __VA_ARGS__); \
 	exit(id)
 
-#define log_error(id, err) log_error_x(LOG_LEVEL_ERROR, id, err)
-#define log_errorf(id, fmt, ...) log_error_xf(LOG_LEVEL_ERROR, id, fmt, __VA_ARGS__)
-
-#ifdef DEBUG
-	#define log_warning(msg) log_x(LOG_LEVEL_WARNING, msg)
-	#define log_warningf(fmt, ...) log_xf(LOG_LEVEL_WARNING, fmt, __VA_ARGS__)
-	#define log_info(msg) log_x(LOG_LEVEL_INFO, msg)
-	#define log_infof(fmt, ...) log_xf(LOG_LEVEL_INFO, fmt, __VA_ARGS__)
-#else
-	#define log_warning(msg)
-	#define log_warningf(fmt, ...)
-	#define log_info(msg)
-	#define log_infof(fmt, ...)
-#endif
+#define log_error(id, err) log_error_x(LogLevelError, id, err)
+#define log_errorf(id, fmt, ...) log_error_xf(LogLevelError, id, fmt, __VA_ARGS__)
+#define log_warning(msg) log_x(LogLevelWarning, msg)
+#define log_warningf(fmt, ...) log_xf(LogLevelWarning, fmt, __VA_ARGS__)
+#define log_info(msg) log_x(LogLevelInfo, msg)
+#define log_infof(fmt, ...) log_xf(LogLevelInfo, fmt, __VA_ARGS__)
 
 #define freep(ptr) \
 	free(ptr);     \
@@ -93,6 +68,7 @@ void do_nothing();
 
 char *get_home_dir();
 char *join_path(const char *path, ...);
+int make_dirs(const char *path);
 char *strip_whitespace(const char *string);
 
 #ifdef __APPLE__
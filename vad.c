@@ -0,0 +1,160 @@
+#include "vad.h"
+
+#include "utils.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_NOISE_LEVEL 127
+
+void vad_init(Vad *vad) {
+	vad->noise_floor_db = VAD_INITIAL_NOISE_DB;
+	vad->energy_db = 0.0f;
+	vad->hangover = 0;
+}
+
+/*
+ * Classify a frame as speech (TRUE) or silence (FALSE). Voiced speech is caught
+ * by energy well above the noise floor; quieter unvoiced sounds are caught by a
+ * high zero-crossing rate at a smaller margin. A hangover keeps word endings.
+ */
+int vad_process(Vad *vad, const int16_t *pcm, size_t num_samples) {
+	if (num_samples == 0) {
+		return vad->hangover > 0;
+	}
+
+	unsigned int crossings = 0;
+
+	for (size_t i = 1; i < num_samples; i++) {
+		crossings += (pcm[i - 1] < 0) != (pcm[i] < 0);
+	}
+
+	float energy_db = audio_energy_db(pcm, num_samples);
+	float zcr = (float)crossings / num_samples;
+	float margin = energy_db - vad->noise_floor_db;
+	int speech = energy_db > VAD_MIN_SPEECH_DB && (margin > VAD_ENERGY_MARGIN_DB ||
+	                                               (margin > VAD_ENERGY_MARGIN_DB / 2 && zcr > VAD_UNVOICED_ZCR));
+
+	// Track the floor quickly downwards and during silence, barely at all during speech.
+	if (energy_db < vad->noise_floor_db) {
+		vad->noise_floor_db += (energy_db - vad->noise_floor_db) * 0.5f;
+	} else if (!speech) {
+		vad->noise_floor_db += (energy_db - vad->noise_floor_db) * 0.05f;
+	} else {
+		vad->noise_floor_db += (energy_db - vad->noise_floor_db) * 0.001f;
+	}
+
+	vad->energy_db = energy_db;
+
+	if (speech) {
+		vad->hangover = VAD_HANGOVER_FRAMES;
+	} else if (vad->hangover > 0) {
+		vad->hangover--;
+
+		return TRUE;
+	}
+
+	return speech;
+}
+
+/*
+ * Convert a frame energy in dB to a comfort noise level in -dBov (0 is loudest).
+ */
+uint8_t vad_noise_level(float energy_db) {
+	float level = AUDIO_FULL_SCALE_DB - energy_db;
+
+	if (level < 0.0f) {
+		return 0;
+	} else if (level > MAX_NOISE_LEVEL) {
+		return MAX_NOISE_LEVEL;
+	}
+
+	return (uint8_t)level;
+}
+
+void dtx_init(Dtx *dtx) {
+	memset(dtx, 0, sizeof *dtx);
+	vad_init(&dtx->vad);
+	dtx->noise_level = MAX_NOISE_LEVEL;
+}
+
+/*
+ * Decide what to transmit for this frame. The first silent frame after speech
+ * always carries a descriptor so the receiver can start comfort noise at once.
+ */
+DtxFrame dtx_process(Dtx *dtx, const int16_t *pcm, size_t num_samples) {
+	dtx->frames_total++;
+
+	if (vad_process(&dtx->vad, pcm, num_samples)) {
+		dtx->silent = FALSE;
+		dtx->frames_sent++;
+
+		return DtxFrameSpeech;
+	}
+
+	// Smooth the noise level so descriptors do not jump around between updates.
+	uint8_t level = vad_noise_level(dtx->vad.energy_db);
+	dtx->noise_level = dtx->silent ? (dtx->noise_level * 3 + level) / 4 : level;
+
+	if (!dtx->silent || ++dtx->frames_since_sid >= DTX_SID_INTERVAL_FRAMES) {
+		dtx->silent = TRUE;
+		dtx->frames_since_sid = 0;
+		dtx->descriptors_sent++;
+
+		return DtxFrameComfortNoise;
+	}
+
+	return DtxFrameSuppressed;
+}
+
+void audio_sender_init(AudioSender *sender, AudioCodec codec) {
+	memset(sender, 0, sizeof *sender);
+	sender->codec = codec;
+	sender->seq = rand();
+	sender->timestamp = rand();
+
+	dtx_init(&sender->dtx);
+}
+
+/*
+ * Run one frame of at most AUDIO_FRAME_SAMPLES of PCM through DTX and the
+ * codec. Returns the size of the packet to send, which is left in
+ * sender->packet until the next frame, or 0 when the frame is suppressed.
+ * Sequence numbers only advance for sent packets while the timestamp advances
+ * for every frame, so receivers can tell DTX gaps from loss.
+ */
+uint32_t audio_sender_process(AudioSender *sender, const int16_t *pcm, size_t num_samples) {
+	uint32_t size = 0;
+
+	switch (dtx_process(&sender->dtx, pcm, num_samples)) {
+		case DtxFrameSpeech: {
+			AudioFrame frame = {.seq = sender->seq++,
+			                    .timestamp = sender->timestamp,
+			                    .codec = sender->codec,
+			                    .num_samples = num_samples,
+			                    .data = sender->data};
+
+			frame.size = audio_encode(sender->codec, &sender->adpcm, pcm, num_samples, sender->data);
+			size = serialise_audio_frame_into(&frame, sender->packet, sizeof sender->packet);
+
+			break;
+		}
+
+		case DtxFrameComfortNoise: {
+			ComfortNoise noise = {
+			    .seq = sender->seq++, .timestamp = sender->timestamp, .level = sender->dtx.noise_level};
+
+			size = serialise_comfort_noise_into(&noise, sender->packet, sizeof sender->packet);
+
+			break;
+		}
+
+		case DtxFrameSuppressed:
+		default:
+			break;
+	}
+
+	sender->timestamp += num_samples;
+
+	return size;
+}
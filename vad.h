@@ -0,0 +1,72 @@
+#pragma once
+
+#include "audio.h"
+#include "packets.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define VAD_INITIAL_NOISE_DB 30.0f
+#define VAD_MIN_SPEECH_DB 36.0f
+#define VAD_ENERGY_MARGIN_DB 12.0f
+#define VAD_UNVOICED_ZCR 0.25f
+#define VAD_HANGOVER_FRAMES 10
+
+/*
+ * A comfort noise descriptor is resent this often while the sender is silent.
+ */
+#define DTX_SID_INTERVAL_FRAMES 20
+
+/*
+ * Energy and zero-crossing voice activity detector with an adaptive noise floor.
+ */
+typedef struct {
+	float noise_floor_db;
+	float energy_db;
+	unsigned int hangover;
+} Vad;
+
+typedef enum
+{
+	DtxFrameSpeech,
+	DtxFrameComfortNoise,
+	DtxFrameSuppressed
+} DtxFrame;
+
+/*
+ * Discontinuous transmission state. Silent frames are suppressed and replaced
+ * by a comfort noise descriptor every DTX_SID_INTERVAL_FRAMES.
+ */
+typedef struct {
+	Vad vad;
+	int silent;
+	unsigned int frames_since_sid;
+	uint8_t noise_level;
+	uint64_t frames_total;
+	uint64_t frames_sent;
+	uint64_t descriptors_sent;
+} Dtx;
+
+/*
+ * Sending side of an audio stream: DTX, encoding and packetisation. Frames
+ * are encoded and packetised into buffers kept here rather than allocated.
+ */
+typedef struct {
+	AudioCodec codec;
+	AdpcmState adpcm;
+	Dtx dtx;
+	uint16_t seq;
+	uint32_t timestamp;
+	uint8_t data[AUDIO_FRAME_SAMPLES * sizeof(int16_t)];
+	uint8_t packet[PACKET_HEADER_SIZE + sizeof(AudioFrame) + AUDIO_FRAME_SAMPLES * sizeof(int16_t)];
+} AudioSender;
+
+void vad_init(Vad *vad);
+int vad_process(Vad *vad, const int16_t *pcm, size_t num_samples);
+uint8_t vad_noise_level(float energy_db);
+
+void dtx_init(Dtx *dtx);
+DtxFrame dtx_process(Dtx *dtx, const int16_t *pcm, size_t num_samples);
+
+void audio_sender_init(AudioSender *sender, AudioCodec codec);
+uint32_t audio_sender_process(AudioSender *sender, const int16_t *pcm, size_t num_samples);
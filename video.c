@@ -0,0 +1,55 @@
+#include "video.h"
+
+#include <string.h>
+
+size_t video_max_encoded_size(const size_t num_pixels) {
+	return num_pixels * VIDEO_RUN_SIZE;
+}
+
+/*
+ * Encode num_pixels of RGB24 into out, which must hold video_max_encoded_size()
+ * bytes. Returns the number of bytes written.
+ */
+size_t video_encode(const uint8_t *rgb, size_t num_pixels, uint8_t *out) {
+	uint8_t *pos = out;
+
+	for (size_t i = 0; i < num_pixels;) {
+		const uint8_t *pixel = rgb + i * 3;
+		size_t run = 1;
+
+		while (i + run < num_pixels && run < VIDEO_MAX_RUN && memcmp(pixel, rgb + (i + run) * 3, 3) == 0) {
+			run++;
+		}
+
+		*pos++ = run - 1;
+		pos = mempcpy(pos, pixel, 3);
+		i += run;
+	}
+
+	return pos - out;
+}
+
+/*
+ * Decode exactly num_pixels of RGB24. Returns -1 if the runs do not add up.
+ */
+int video_decode(const uint8_t *data, size_t size, uint8_t *rgb, size_t num_pixels) {
+	size_t pixel = 0;
+
+	for (size_t i = 0; i + VIDEO_RUN_SIZE <= size; i += VIDEO_RUN_SIZE) {
+		size_t run = (size_t)data[i] + 1;
+
+		if (pixel + run > num_pixels) {
+			return -1;
+		}
+
+		uint8_t *pos = rgb + pixel * 3;
+
+		for (size_t j = 0; j < run; j++) {
+			pos = mempcpy(pos, data + i + 1, 3);
+		}
+
+		pixel += run;
+	}
+
+	return pixel == num_pixels && size % VIDEO_RUN_SIZE == 0 ? 0 : -1;
+}
@@ -0,0 +1,16 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Video payloads are intra-coded run-length RGB: a sequence of runs, each a
+ * length byte (run length minus one) followed by one RGB24 pixel. Every frame
+ * decodes on its own, so any frame may be dropped in transit.
+ */
+#define VIDEO_RUN_SIZE 4
+#define VIDEO_MAX_RUN 256
+
+size_t video_max_encoded_size(const size_t num_pixels);
+size_t video_encode(const uint8_t *rgb, size_t num_pixels, uint8_t *out);
+int video_decode(const uint8_t *data, size_t size, uint8_t *rgb, size_t num_pixels);